@@ -0,0 +1,381 @@
+#include "array.h"
+#include "errors.h"
+#include "gc.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KERNELS_AVX2
+#include <immintrin.h>
+#endif
+
+///////////////////////////////////////
+////////////// Section Arrays
+
+// Numbers start on a cache line, so the kernels' 32 byte loads never split
+// one
+#define ARRAY_ALIGN 64
+
+array *array_create(linmem *mem, size_t len) {
+  array *ret = linmem_malloc(mem, sizeof *ret);
+  *ret = (array){
+      .nums = linmem_malloc_aligned(mem, len * sizeof(double), ARRAY_ALIGN),
+      .len = len,
+      .section = mem->section,
+  };
+  memset(ret->nums, 0, len * sizeof(double));
+  return ret;
+}
+
+// linmem can't free, the double buffer is left behind
+static void array_box(linmem *mem, array *a) {
+  value *vals = linmem_malloc(mem, a->len * sizeof *vals);
+  for (size_t k = 0; k < a->len; ++k)
+    vals[k] = (value){.type = V_NUMBER, .dval = a->nums[k]};
+  a->vals = vals;
+  a->nums = NULL;
+}
+
+void array_store(linmem *mem, array *a, size_t k, value v) {
+  ASSERT(k < a->len);
+
+  if (a->nums != NULL && v.type == V_NUMBER) {
+    a->nums[k] = v.dval;
+    return;
+  }
+  if (a->nums != NULL)
+    array_box(mem, a);
+  gc_store(mem, &a->vals[k], v);
+}
+
+static int array_index(array *a, value *index, size_t *dest) {
+  if (index->type != V_NUMBER) {
+    runtime_error("Array indices must be numbers\n");
+    return -1;
+  }
+  double d = index->dval;
+  if (!(d >= 0 && d < (double)a->len) || d != (double)(size_t)d) {
+    runtime_error("Index %g is out of bounds for an array of %zu\n", d,
+                  a->len);
+    return -1;
+  }
+  *dest = (size_t)d;
+  return 0;
+}
+
+int array_get(array *a, value *index, value *dest) {
+  size_t k;
+  if (array_index(a, index, &k))
+    return -1;
+  *dest = array_at(a, k);
+  return 0;
+}
+
+int array_set(linmem *mem, array *a, value *index, value v) {
+  size_t k;
+  if (array_index(a, index, &k))
+    return -1;
+  array_store(mem, a, k, v);
+  return 0;
+}
+
+double *array_numbers(linmem *mem, array *a) {
+  if (a->nums != NULL)
+    return a->nums;
+
+  for (size_t k = 0; k < a->len; ++k)
+    if (a->vals[k].type != V_NUMBER)
+      return NULL;
+
+  double *nums = linmem_malloc_aligned(mem, a->len * sizeof *nums, ARRAY_ALIGN);
+  for (size_t k = 0; k < a->len; ++k)
+    nums[k] = a->vals[k].dval;
+  // The heap is detached while other threads run, and they may be reading
+  // a too. So they get the copy, and a stays boxed
+  if (mem->gc == NULL)
+    return nums;
+  a->nums = nums;
+  a->vals = NULL;
+  return nums;
+}
+
+///////////////////////////////////////
+////////////// Section Kernels
+
+/**
+ * Both versions of sum and dot keep sixteen partial sums: four vectors of
+ * four lanes for AVX2. Lane l of vector v is partial sum 4 * v + l, and
+ * they are combined in the same order, so either version gives the same
+ * result
+ */
+#define PARTIALS 16
+
+static double combine_partials(const double *s) {
+  double lane[4];
+  for (int l = 0; l < 4; ++l)
+    lane[l] = (s[l] + s[4 + l]) + (s[8 + l] + s[12 + l]);
+  return (lane[0] + lane[1]) + (lane[2] + lane[3]);
+}
+
+static double sum_scalar(const double *x, size_t n) {
+  double s[PARTIALS] = {0};
+  size_t i = 0;
+  for (; i + PARTIALS <= n; i += PARTIALS)
+    for (int p = 0; p < PARTIALS; ++p)
+      s[p] += x[i + p];
+
+  double ret = combine_partials(s);
+  for (; i < n; ++i)
+    ret += x[i];
+  return ret;
+}
+
+static double dot_scalar(const double *x, const double *y, size_t n) {
+  double s[PARTIALS] = {0};
+  size_t i = 0;
+  for (; i + PARTIALS <= n; i += PARTIALS)
+    for (int p = 0; p < PARTIALS; ++p)
+      s[p] += x[i + p] * y[i + p];
+
+  double ret = combine_partials(s);
+  for (; i < n; ++i)
+    ret += x[i] * y[i];
+  return ret;
+}
+
+static void scale_scalar(double *dest, const double *x, double k, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dest[i] = x[i] * k;
+}
+
+static void add_scalar(double *dest, const double *x, const double *y,
+                       size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dest[i] = x[i] + y[i];
+}
+
+static void mul_scalar(double *dest, const double *x, const double *y,
+                       size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dest[i] = x[i] * y[i];
+}
+
+// Like minpd and maxpd: b when either one is NaN
+static inline double min2(double a, double b) { return a < b ? a : b; }
+static inline double max2(double a, double b) { return a > b ? a : b; }
+
+// Four lanes, then the rest, in the order the AVX2 version takes them
+static double min_scalar(const double *x, size_t n) {
+  if (n < 4) {
+    double ret = x[0];
+    for (size_t i = 1; i < n; ++i)
+      ret = min2(ret, x[i]);
+    return ret;
+  }
+
+  double lane[4] = {x[0], x[1], x[2], x[3]};
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4)
+    for (int l = 0; l < 4; ++l)
+      lane[l] = min2(lane[l], x[i + l]);
+
+  double ret = min2(min2(lane[0], lane[1]), min2(lane[2], lane[3]));
+  for (; i < n; ++i)
+    ret = min2(ret, x[i]);
+  return ret;
+}
+
+static double max_scalar(const double *x, size_t n) {
+  if (n < 4) {
+    double ret = x[0];
+    for (size_t i = 1; i < n; ++i)
+      ret = max2(ret, x[i]);
+    return ret;
+  }
+
+  double lane[4] = {x[0], x[1], x[2], x[3]};
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4)
+    for (int l = 0; l < 4; ++l)
+      lane[l] = max2(lane[l], x[i + l]);
+
+  double ret = max2(max2(lane[0], lane[1]), max2(lane[2], lane[3]));
+  for (; i < n; ++i)
+    ret = max2(ret, x[i]);
+  return ret;
+}
+
+#ifdef KERNELS_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double sum_avx2(const double *x, size_t n) {
+  __m256d acc[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(),
+                    _mm256_setzero_pd(), _mm256_setzero_pd()};
+  size_t i = 0;
+  for (; i + PARTIALS <= n; i += PARTIALS)
+    for (int v = 0; v < 4; ++v)
+      acc[v] = _mm256_add_pd(acc[v], _mm256_loadu_pd(x + i + 4 * v));
+
+  double s[PARTIALS];
+  for (int v = 0; v < 4; ++v)
+    _mm256_storeu_pd(s + 4 * v, acc[v]);
+  double ret = combine_partials(s);
+  for (; i < n; ++i)
+    ret += x[i];
+  return ret;
+}
+
+AVX2 static double dot_avx2(const double *x, const double *y, size_t n) {
+  __m256d acc[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(),
+                    _mm256_setzero_pd(), _mm256_setzero_pd()};
+  size_t i = 0;
+  for (; i + PARTIALS <= n; i += PARTIALS)
+    for (int v = 0; v < 4; ++v)
+      acc[v] = _mm256_add_pd(acc[v],
+                             _mm256_mul_pd(_mm256_loadu_pd(x + i + 4 * v),
+                                           _mm256_loadu_pd(y + i + 4 * v)));
+
+  double s[PARTIALS];
+  for (int v = 0; v < 4; ++v)
+    _mm256_storeu_pd(s + 4 * v, acc[v]);
+  double ret = combine_partials(s);
+  for (; i < n; ++i)
+    ret += x[i] * y[i];
+  return ret;
+}
+
+AVX2 static void scale_avx2(double *dest, const double *x, double k,
+                            size_t n) {
+  __m256d vk = _mm256_set1_pd(k);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), vk));
+  for (; i < n; ++i)
+    dest[i] = x[i] * k;
+}
+
+AVX2 static void add_avx2(double *dest, const double *x, const double *y,
+                          size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(dest + i, _mm256_add_pd(_mm256_loadu_pd(x + i),
+                                             _mm256_loadu_pd(y + i)));
+  for (; i < n; ++i)
+    dest[i] = x[i] + y[i];
+}
+
+AVX2 static void mul_avx2(double *dest, const double *x, const double *y,
+                          size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(x + i),
+                                             _mm256_loadu_pd(y + i)));
+  for (; i < n; ++i)
+    dest[i] = x[i] * y[i];
+}
+
+AVX2 static double min_avx2(const double *x, size_t n) {
+  if (n < 4)
+    return min_scalar(x, n);
+
+  __m256d acc = _mm256_loadu_pd(x);
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4)
+    acc = _mm256_min_pd(acc, _mm256_loadu_pd(x + i));
+
+  double lane[4];
+  _mm256_storeu_pd(lane, acc);
+  double ret = min2(min2(lane[0], lane[1]), min2(lane[2], lane[3]));
+  for (; i < n; ++i)
+    ret = min2(ret, x[i]);
+  return ret;
+}
+
+AVX2 static double max_avx2(const double *x, size_t n) {
+  if (n < 4)
+    return max_scalar(x, n);
+
+  __m256d acc = _mm256_loadu_pd(x);
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4)
+    acc = _mm256_max_pd(acc, _mm256_loadu_pd(x + i));
+
+  double lane[4];
+  _mm256_storeu_pd(lane, acc);
+  double ret = max2(max2(lane[0], lane[1]), max2(lane[2], lane[3]));
+  for (; i < n; ++i)
+    ret = max2(ret, x[i]);
+  return ret;
+}
+
+#endif
+
+typedef struct {
+  double (*sum)(const double *x, size_t n);
+  double (*dot)(const double *x, const double *y, size_t n);
+  void (*scale)(double *dest, const double *x, double k, size_t n);
+  void (*add)(double *dest, const double *x, const double *y, size_t n);
+  void (*mul)(double *dest, const double *x, const double *y, size_t n);
+  double (*min)(const double *x, size_t n);
+  double (*max)(const double *x, size_t n);
+} kernels;
+
+static const kernels scalar_kernels = {
+    sum_scalar, dot_scalar, scale_scalar, add_scalar,
+    mul_scalar, min_scalar, max_scalar,
+};
+
+#ifdef KERNELS_AVX2
+static const kernels avx2_kernels = {
+    sum_avx2, dot_avx2, scale_avx2, add_avx2, mul_avx2, min_avx2, max_avx2,
+};
+#endif
+
+static const kernels *active = &scalar_kernels;
+
+void kernels_select(int simd) {
+  active = &scalar_kernels;
+#ifdef KERNELS_AVX2
+  __builtin_cpu_init();
+  if (simd && __builtin_cpu_supports("avx2"))
+    active = &avx2_kernels;
+#endif
+}
+
+#ifdef KERNELS_AVX2
+// Before main, so no thread ever races to choose
+__attribute__((constructor)) static void kernels_init(void) {
+  kernels_select(1);
+}
+#endif
+
+static inline const kernels *kernels_get() { return active; }
+
+double kernel_sum(const double *x, size_t n) { return kernels_get()->sum(x, n); }
+
+double kernel_dot(const double *x, const double *y, size_t n) {
+  return kernels_get()->dot(x, y, n);
+}
+
+void kernel_scale(double *dest, const double *x, double k, size_t n) {
+  kernels_get()->scale(dest, x, k, n);
+}
+
+void kernel_add(double *dest, const double *x, const double *y, size_t n) {
+  kernels_get()->add(dest, x, y, n);
+}
+
+void kernel_mul(double *dest, const double *x, const double *y, size_t n) {
+  kernels_get()->mul(dest, x, y, n);
+}
+
+double kernel_min(const double *x, size_t n) {
+  ASSERT(n > 0);
+  return kernels_get()->min(x, n);
+}
+
+double kernel_max(const double *x, size_t n) {
+  ASSERT(n > 0);
+  return kernels_get()->max(x, n);
+}
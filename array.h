@@ -0,0 +1,74 @@
+#pragma once
+
+#include "memory.h"
+#include "value.h"
+
+///////////////////////////////////////
+////////////// Section Arrays
+
+/**
+ * Arrays
+ * - Start out numeric: the elements are one contiguous double buffer, so
+ *   reading or writing an element never builds a value and the kernels
+ *   run straight over it
+ * - Storing anything but a number boxes every element into a value
+ *   buffer. A boxed array that holds only numbers again is unboxed the
+ *   next time a kernel needs it. In parallel code the kernel gets a copy
+ *   instead, as other threads may be reading the array
+ */
+struct array_s {
+  double *nums; // NULL once boxed
+  value *vals;  // NULL while numeric
+  size_t len;
+  size_t section; // See linmem
+};
+
+// len zeros
+array *array_create(linmem *mem, size_t len);
+
+// Element k, which must be in bounds
+void array_store(linmem *mem, array *a, size_t k, value v);
+
+// The value of element k, in bounds
+static inline value array_at(array *a, size_t k) {
+  if (a->nums != NULL)
+    return (value){.type = V_NUMBER, .dval = a->nums[k]};
+  return a->vals[k];
+}
+
+// a[index], -1 after an error if index isn't a whole number in bounds
+int array_get(array *a, value *index, value *dest);
+
+int array_set(linmem *mem, array *a, value *index, value v);
+
+// The elements as doubles, NULL if one of them isn't a number
+double *array_numbers(linmem *mem, array *a);
+
+///////////////////////////////////////
+////////////// Section Kernels
+
+/**
+ * Kernels over double buffers
+ * - AVX2 when the CPU has it, chosen when the program starts. Scalar
+ *   otherwise
+ * - Sums keep four partial sums, one per lane, in both versions. So a sum
+ *   comes out the same on every CPU, though it may round differently from
+ *   a left to right loop
+ */
+double kernel_sum(const double *x, size_t n);
+
+double kernel_dot(const double *x, const double *y, size_t n);
+
+void kernel_scale(double *dest, const double *x, double k, size_t n);
+
+void kernel_add(double *dest, const double *x, const double *y, size_t n);
+
+void kernel_mul(double *dest, const double *x, const double *y, size_t n);
+
+// n > 0
+double kernel_min(const double *x, size_t n);
+
+double kernel_max(const double *x, size_t n);
+
+// 0 forces the scalar kernels, for benchmarks. Otherwise AVX2 if possible
+void kernels_select(int simd);
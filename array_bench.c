@@ -0,0 +1,103 @@
+#include "array.h"
+#include "interpreter.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Fills two arrays, then takes their dot product one way or the other
+static const char *program =
+    "var x = array(%d);\n"
+    "var y = array(%d);\n"
+    "for (var i = 0; i < len(x); i = i + 1) {\n"
+    "  x[i] = i * 0.5;\n"
+    "  y[i] = 1 - i * 0.25;\n"
+    "}\n"
+    "%s";
+
+static const char *loop =
+    "var r = 0;\n"
+    "for (var i = 0; i < len(x); i = i + 1) r = r + x[i] * y[i];\n";
+
+static const char *builtin = "var r = dot(x, y);\n";
+
+#define N (1 << 16)
+#define ROUNDS 2000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_lox(const char *name, const char *product, int n) {
+  char src[1024];
+  snprintf(src, sizeof src, program, n, n, product);
+
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  var_env env = var_env_create();
+
+  double start = now();
+  int failed = interpret_stmts(&arr.mem, &stmts, &env);
+  double elapsed = now() - start;
+
+  value *r = var_env_find(&env, "r");
+  if (failed || r == NULL || r->type != V_NUMBER) {
+    fprintf(stdout, "%s: failed\n", name);
+    exit(1);
+  }
+  fprintf(stdout, "%-8s r = %.6g  %.3fs with the fill\n", name, r->dval,
+          elapsed);
+  var_env_free(&env);
+}
+
+// Every kernel ROUNDS times over N elements
+static void bench_kernels(const char *name, int simd, double *x, double *y,
+                          double *out) {
+  kernels_select(simd);
+
+  double start = now();
+  double acc = 0;
+  for (int r = 0; r < ROUNDS; ++r) {
+    acc += kernel_sum(x, N);
+    acc += kernel_dot(x, y, N);
+    acc += kernel_min(x, N) + kernel_max(y, N);
+    kernel_add(out, x, y, N);
+    kernel_mul(out, out, y, N);
+    kernel_scale(out, out, 0.5, N);
+    acc += out[r % N];
+  }
+  double elapsed = now() - start;
+
+  double elements = 7.0 * ROUNDS * N;
+  fprintf(stdout, "%-8s acc = %.17g  %.3fs  %.0fM elements/s\n", name, acc,
+          elapsed, elements / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  bench_lox("loop", loop, n);
+  bench_lox("dot", builtin, n);
+
+  double *x = malloc(N * sizeof *x);
+  double *y = malloc(N * sizeof *y);
+  double *out = malloc(N * sizeof *out);
+  for (int i = 0; i < N; ++i) {
+    x[i] = (i % 1000) * 0.001;
+    y[i] = 1.0 / (1 + i % 7);
+  }
+
+  // acc matches: both versions add in the same order
+  bench_kernels("scalar", 0, x, y, out);
+  bench_kernels("simd", 1, x, y, out);
+
+  free(x);
+  free(y);
+  free(out);
+  return 0;
+}
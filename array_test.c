@@ -0,0 +1,81 @@
+#include "array.h"
+
+#include <stdio.h>
+
+// Lengths around the kernels' strides: four lanes, and sixteen partial sums
+static const size_t lens[] = {0, 1, 3, 4, 5, 8, 9, 15, 16, 17, 33};
+
+#define LEN_MAX 33
+#define SENTINEL 12345.0
+
+static int failures = 0;
+
+// Small whole numbers, so every order of adding them up is exact
+static double x_at(size_t i) { return (double)((i * 7) % 11) - 5; }
+
+static double y_at(size_t i) { return (double)((i * 3) % 5) - 2; }
+
+static void expect(const char *kernel, int simd, size_t n, size_t offset,
+                   double got, double want) {
+  if (got == want)
+    return;
+  fprintf(stdout, "FAIL: %s of %zu at offset %zu (%s): got %g, want %g\n",
+          kernel, n, offset, simd ? "simd" : "scalar", got, want);
+  failures++;
+}
+
+// What dest holds must be want at every element, and nothing past n
+static void expect_all(const char *kernel, int simd, size_t n, size_t offset,
+                       const double *dest, const double *want) {
+  for (size_t i = 0; i < n; ++i)
+    expect(kernel, simd, n, offset, dest[i], want[i]);
+  expect(kernel, simd, n, offset, dest[n], SENTINEL);
+}
+
+// offset moves x and y off the kernels' 32 byte alignment
+static void check(int simd, size_t n, size_t offset) {
+  double xs[LEN_MAX + 1], ys[LEN_MAX + 1];
+  double *x = xs + offset, *y = ys + offset;
+  double sum = 0, dot = 0, min = 0, max = 0;
+  double scaled[LEN_MAX], added[LEN_MAX], multiplied[LEN_MAX];
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = x_at(i);
+    y[i] = y_at(i);
+    sum += x[i];
+    dot += x[i] * y[i];
+    min = i == 0 || x[i] < min ? x[i] : min;
+    max = i == 0 || x[i] > max ? x[i] : max;
+    scaled[i] = x[i] * 2.5;
+    added[i] = x[i] + y[i];
+    multiplied[i] = x[i] * y[i];
+  }
+
+  expect("sum", simd, n, offset, kernel_sum(x, n), sum);
+  expect("dot", simd, n, offset, kernel_dot(x, y, n), dot);
+  if (n > 0) {
+    expect("min", simd, n, offset, kernel_min(x, n), min);
+    expect("max", simd, n, offset, kernel_max(x, n), max);
+  }
+
+  double dest[LEN_MAX + 1];
+  dest[n] = SENTINEL;
+  kernel_scale(dest, x, 2.5, n);
+  expect_all("scale", simd, n, offset, dest, scaled);
+  kernel_add(dest, x, y, n);
+  expect_all("add", simd, n, offset, dest, added);
+  kernel_mul(dest, x, y, n);
+  expect_all("mul", simd, n, offset, dest, multiplied);
+}
+
+int main() {
+  size_t n = 0;
+  for (int simd = 0; simd <= 1; ++simd) {
+    kernels_select(simd);
+    for (size_t i = 0; i < sizeof lens / sizeof *lens; ++i)
+      for (size_t offset = 0; offset <= 1; ++offset, ++n)
+        check(simd, lens[i], offset);
+  }
+
+  fprintf(stdout, "%zu cases, %d failures\n", n, failures);
+  return failures != 0;
+}
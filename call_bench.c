@@ -0,0 +1,68 @@
+#include "interpreter.h"
+#include "jit.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Recursive fib: every call is a frame push, argument passing and a return
+static const char *program = "fun fib(n) {\n"
+                             "  if (n < 2) return n;\n"
+                             "  return fib(n - 1) + fib(n - 2);\n"
+                             "}\n"
+                             "var r = fib(%d);\n";
+
+// fib(n) makes 2 * fib(n + 1) - 1 calls
+static double fib_calls(int n) {
+  double a = 0, b = 1;
+  for (int i = 0; i < n + 1; ++i) {
+    double t = a + b;
+    a = b;
+    b = t;
+  }
+  return 2 * a - 1;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, int n) {
+  char src[256];
+  snprintf(src, sizeof src, program, n);
+
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  var_env env = var_env_create();
+
+  double start = now();
+  int failed = interpret_stmts(&arr.mem, &stmts, &env);
+  double elapsed = now() - start;
+
+  value *r = var_env_find(&env, "r");
+  if (failed || r == NULL || r->type != V_NUMBER) {
+    fprintf(stdout, "%s: fib(%d) failed\n", name, n);
+    exit(1);
+  }
+
+  double calls = fib_calls(n);
+  fprintf(stdout, "%-6s fib(%d) = %.0f  %.3fs  %.2fM calls/s\n", name, n,
+          r->dval, elapsed, calls / elapsed / 1e6);
+  var_env_free(&env);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 30;
+
+  bench("walk", n);
+  if (jit_supported()) {
+    jit_enable(JIT_HOT_THRESHOLD);
+    bench("jit", n);
+  }
+  return 0;
+}
@@ -0,0 +1,316 @@
+#include "emit_c.h"
+#include "errors.h"
+#include "expression.h"
+#include "statements.h"
+#include "token.h"
+
+// What the statement being translated has that can't be, for the error
+static const char *refused;
+
+static int refuse(const char *what) {
+  refused = what;
+  return -1;
+}
+
+static int refuse_expr(expr *e) {
+  switch (e->type) {
+  case ET_VARIABLE:
+    return refuse("a local variable");
+  case ET_CALL:
+    return refuse("a call");
+  case ET_ASSIGN:
+    return refuse("an assignment");
+  case ET_GET:
+    return refuse("a property");
+  case ET_SET:
+    return refuse("a property assignment");
+  case ET_ARRAY:
+    return refuse("an array");
+  case ET_INDEX:
+    return refuse("an index");
+  case ET_INDEX_SET:
+    return refuse("an indexed assignment");
+  default:
+    unreachable();
+  }
+}
+
+static int refuse_stmt(stmt *s) {
+  switch (s->type) {
+  case ST_BLOCK:
+    // A for loop is a block around its initializer and a while loop
+    if (s->body.len > 0 && s->body.stmts[s->body.len - 1].type == ST_WHILE)
+      return refuse("a loop");
+    return refuse("a block");
+  case ST_FUN:
+    return refuse("a function declaration");
+  case ST_IF:
+    return refuse("an if statement");
+  case ST_RETURN:
+    return refuse("a return statement");
+  case ST_CLASS:
+    return refuse("a class declaration");
+  case ST_WHILE:
+    return refuse("a loop");
+  default:
+    unreachable();
+  }
+}
+
+// Temporaries are named after their depth in the tree: v0, v1, ...
+static int expr_depth(expr *e) {
+  ASSERT(e);
+
+  switch (e->type) {
+  case ET_LITERAL:
+  case ET_VARIABLE:
+    return 1;
+  case ET_UNARY:
+    return expr_depth(e->u.e);
+  case ET_BINARY: {
+    int l = expr_depth(e->b.left);
+    int r = expr_depth(e->b.right) + 1;
+    return l > r ? l : r;
+  }
+  case ET_GROUPING:
+    return expr_depth(e->g);
+  case ET_CONCAT:
+    return expr_depth(e->cat.chain);
+  default:
+    return refuse_expr(e);
+  }
+}
+
+static void emit_c_string(FILE *ofp, const char *s) {
+  fputc('"', ofp);
+  for (; *s; ++s) {
+    switch (*s) {
+    case '"':
+      fputs("\\\"", ofp);
+      break;
+    case '\\':
+      fputs("\\\\", ofp);
+      break;
+    case '\n':
+      fputs("\\n", ofp);
+      break;
+    case '\t':
+      fputs("\\t", ofp);
+      break;
+    default:
+      if (*s < ' ' || *s == 0x7f)
+        fprintf(ofp, "\\%03o", (unsigned char)*s);
+      else
+        fputc(*s, ofp);
+    }
+  }
+  fputc('"', ofp);
+}
+
+static void emit_literal(FILE *ofp, literal l, int slot) {
+  switch (l.type) {
+  case LT_NUMBER:
+    fprintf(ofp, "  v%d = (value){.type = V_NUMBER, .dval = %.17g};\n", slot,
+            l.dval);
+    return;
+  case LT_STRING:
+    // Made the first time the site runs, like the scanner does
+    fprintf(ofp, "  {\n    static lox_string *k;\n    if (k == NULL)\n"
+                 "      k = lox_string_create(mem, ");
+    emit_c_string(ofp, l.str->chars);
+    fprintf(ofp, ", %zu);\n    v%d = value_from_string(k);\n  }\n", l.str->len,
+            slot);
+    return;
+  case LT_TRUE:
+    fprintf(ofp, "  v%d = (value){.type = V_BOOL, .bool_val = 1};\n", slot);
+    return;
+  case LT_FALSE:
+    fprintf(ofp, "  v%d = (value){.type = V_BOOL, .bool_val = 0};\n", slot);
+    return;
+  case LT_NIL:
+    fprintf(ofp, "  v%d = (value){.type = V_NIL};\n", slot);
+    return;
+  default:
+    unreachable();
+  }
+}
+
+static int emit_expr(FILE *ofp, expr *e, int slot);
+
+static int emit_unary(FILE *ofp, unary u, int slot) {
+  if (emit_expr(ofp, u.e, slot))
+    return -1;
+
+  switch (u.op) {
+  case MINUS:
+    fprintf(ofp, "  if (number_cast(&v%d))\n    return -1;\n", slot);
+    fprintf(ofp, "  minus_number(&v%d);\n", slot);
+    return 0;
+  case BANG:
+    fprintf(ofp, "  bool_cast(&v%d);\n  bang_bool(&v%d);\n", slot, slot);
+    return 0;
+  default:
+    unreachable();
+  }
+}
+
+// Comparisons go through the runtime and may fail on mismatched types
+static void emit_compare(FILE *ofp, const char *fn, int negate, int l, int r) {
+  fprintf(ofp, "  if ((t = %s(&v%d, &v%d)) < 0)\n    return -1;\n", fn, l, r);
+  fprintf(ofp, "  v%d = (value){.type = V_BOOL, .bool_val = %st};\n", l,
+          negate ? "!" : "");
+}
+
+// Arithmetic inlines the number case and calls the runtime otherwise
+static void emit_arith(FILE *ofp, const char *fn, char op, int with_mem,
+                       int l, int r) {
+  fprintf(ofp, "  if (v%d.type == V_NUMBER && v%d.type == V_NUMBER)\n", l, r);
+  fprintf(ofp, "    v%d.dval %c= v%d.dval;\n", l, op, r);
+  fprintf(ofp, "  else if (%s(%s&v%d, &v%d))\n    return -1;\n", fn,
+          with_mem ? "mem, " : "", l, r);
+}
+
+static int emit_binary(FILE *ofp, binary b, int slot) {
+  if (emit_expr(ofp, b.left, slot))
+    return -1;
+  if (emit_expr(ofp, b.right, slot + 1))
+    return -1;
+
+  int l = slot;
+  int r = slot + 1;
+
+  switch (b.op) {
+  case EQUAL_EQUAL:
+  case BANG_EQUAL:
+    fprintf(ofp, "  t = equal_equal(&v%d, &v%d);\n", l, r);
+    fprintf(ofp, "  v%d = (value){.type = V_BOOL, .bool_val = %st};\n", l,
+            b.op == BANG_EQUAL ? "!" : "");
+    return 0;
+  case LESS:
+    emit_compare(ofp, "less", 0, l, r);
+    return 0;
+  case LESS_EQUAL:
+    emit_compare(ofp, "greater", 1, l, r);
+    return 0;
+  case GREATER:
+    emit_compare(ofp, "greater", 0, l, r);
+    return 0;
+  case GREATER_EQUAL:
+    emit_compare(ofp, "less", 1, l, r);
+    return 0;
+  case PLUS:
+    emit_arith(ofp, "plus", '+', 1, l, r);
+    return 0;
+  case MINUS:
+    emit_arith(ofp, "minus", '-', 0, l, r);
+    return 0;
+  case STAR:
+    emit_arith(ofp, "star", '*', 0, l, r);
+    return 0;
+  case SLASH:
+    emit_arith(ofp, "slash", '/', 0, l, r);
+    return 0;
+  default:
+    unreachable();
+  }
+}
+
+static int emit_expr(FILE *ofp, expr *e, int slot) {
+  ASSERT(e);
+
+  switch (e->type) {
+  case ET_LITERAL:
+    emit_literal(ofp, e->l, slot);
+    return 0;
+  case ET_UNARY:
+    return emit_unary(ofp, e->u, slot);
+  case ET_BINARY:
+    return emit_binary(ofp, e->b, slot);
+  case ET_GROUPING:
+    return emit_expr(ofp, e->g, slot);
+  case ET_CONCAT:
+    return emit_expr(ofp, e->cat.chain, slot);
+  case ET_VARIABLE:
+    if (!variable_is_global(&e->v))
+      return refuse_expr(e);
+    // Every site gets its own inline cache
+    fprintf(ofp, "  {\n    static slot_cache c;\n"
+                 "    if ((p = var_env_get_cached(env, &c, ");
+    emit_c_string(ofp, e->v.name);
+    fprintf(ofp, ")) == NULL)\n      return -1;\n  }\n  v%d = *p;\n", slot);
+    return 0;
+  default:
+    return refuse_expr(e);
+  }
+}
+
+// One C function per statement so a failing statement returns early
+static int emit_stmt(FILE *ofp, stmt *s, size_t n) {
+  ASSERT(s);
+
+  if (s->type != ST_EXPR && s->type != ST_PRNT && s->type != ST_DECL)
+    return refuse_stmt(s);
+
+  int depth = s->e ? expr_depth(s->e) : 1;
+  if (depth < 0)
+    return -1;
+
+  fprintf(ofp, "\nstatic int stmt_%zu(linmem *mem, var_env *env) {\n", n);
+  fprintf(ofp, "  value v0");
+  for (int i = 1; i < depth; ++i)
+    fprintf(ofp, ", v%d", i);
+  fprintf(ofp, ";\n  value *p;\n  int t;\n");
+
+  if (s->e != NULL) {
+    if (emit_expr(ofp, s->e, 0))
+      return -1;
+  } else {
+    fprintf(ofp, "  v0 = (value){.type = V_NIL};\n");
+  }
+
+  switch (s->type) {
+  case ST_EXPR:
+    break;
+  case ST_PRNT:
+    fprintf(ofp, "  value_println(stdout, v0);\n");
+    break;
+  case ST_DECL:
+    fprintf(ofp, "  static slot_cache c;\n  var_env_define_cached(env, &c, ");
+    emit_c_string(ofp, s->ident_name);
+    fprintf(ofp, ", v0);\n");
+    break;
+  default:
+    unreachable();
+  }
+
+  fprintf(ofp, "  (void)p;\n  (void)t;\n  return 0;\n}\n");
+  return 0;
+}
+
+int emit_c(FILE *ofp, stmt_arr *s, const char *source_name) {
+  ASSERT(ofp);
+  stmt_arr_ASSERT(s);
+
+  fprintf(ofp, "// Generated by clox --emit-c from %s\n",
+          source_name ? source_name : "<stdin>");
+  fprintf(ofp, "#include \"memory.h\"\n#include \"value.h\"\n"
+               "#include \"var_env.h\"\n#include <stdio.h>\n");
+
+  for (size_t i = 0; i < s->len; ++i) {
+    if (emit_stmt(ofp, &s->stmts[i], i)) {
+      compile_error(s->stmts[i].pos.line,
+                    "--emit-c can't translate %s, in statement %zu\n",
+                    refused, i);
+      return -1;
+    }
+  }
+
+  fprintf(ofp, "\nint main() {\n");
+  fprintf(ofp, "  linmem mem = linmem_create();\n");
+  fprintf(ofp, "  var_env env = var_env_create();\n");
+  for (size_t i = 0; i < s->len; ++i)
+    fprintf(ofp, "  stmt_%zu(&mem, &env);\n", i);
+  fprintf(ofp, "  return 0;\n}\n");
+
+  return 0;
+}
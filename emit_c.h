@@ -0,0 +1,16 @@
+#pragma once
+
+#include "statements.h"
+#include <stdio.h>
+
+/**
+ * Ahead of time Lox to C translation
+ * - Emits one standalone C file per script
+ * - The output links against the runtime: see RUNTIME in the Makefile
+ * - Takes top level expression, print and var statements over literals,
+ *   globals and operators. Blocks, ifs, loops, locals, assignment, calls
+ *   and classes are for the interpreter
+ * - Returns -1 (and emits nothing useful) on constructs it can't translate,
+ *   after a compile error naming the statement and the construct
+ */
+int emit_c(FILE *ofp, stmt_arr *s, const char *source_name);
@@ -0,0 +1,67 @@
+#include "emit_c.h"
+#include "errors.h"
+#include "parser.h"
+#include "scanner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// What --emit-c takes: top level expressions, prints and global
+// declarations. Anything else must be refused, not mistranslated
+typedef struct {
+  const char *src;
+  const char *refusal; // What the error must contain, NULL if it translates
+} emit_case;
+
+static const emit_case cases[] = {
+    {"var a = 1 + 2; print a * -a; \"s\" + a;", NULL},
+    {"var s = \"a\\tb\"; print !(s < \"c\") == false;", NULL},
+    {"print missing;", NULL},
+    {"{ var a = 1; }", "[line 1] Error: --emit-c can't translate a block, in "
+                       "statement 0"},
+    {"if (true) print 1;", "an if statement, in statement 0"},
+    {"print 1;\nwhile (false) print 1;",
+     "[line 2] Error: --emit-c can't translate a loop, in statement 1"},
+    {"for (var i = 0; i < 1; i = i + 1) i;", "a loop, in statement 0"},
+    {"var a = 1; a = 2;", "an assignment, in statement 1"},
+    {"fun f() { return 1; } print f();", "a function declaration"},
+    {"class A {} print A;", "a class declaration"},
+    {"var a = [1]; print a[0];", "an array, in statement 0"},
+    {"print 1 + len(2);", "a call, in statement 0"},
+};
+
+static int failures = 0;
+
+static void check_emit(const emit_case *c) {
+  token_arr arr = scanner_parse_tokens(c->src);
+  stmt_arr stmts = parse_tokens(arr);
+
+  char *out = NULL, *errors = NULL;
+  size_t len = 0, errlen = 0;
+  FILE *ofp = open_memstream(&out, &len);
+  FILE *efp = open_memstream(&errors, &errlen);
+  FILE *old = errors_redirect(efp);
+  int ret = emit_c(ofp, &stmts, NULL);
+  errors_redirect(old);
+  fclose(efp);
+  fclose(ofp);
+
+  if (c->refusal == NULL ? ret != 0
+                         : ret == 0 || strstr(errors, c->refusal) == NULL) {
+    fprintf(stdout, "FAIL: %s\nexpected: %s\ngot: %s\n", c->src,
+            c->refusal ? c->refusal : "a translation", errors);
+    failures++;
+  }
+  free(errors);
+  free(out);
+}
+
+int main() {
+  size_t n = sizeof cases / sizeof *cases;
+  for (size_t i = 0; i < n; ++i)
+    check_emit(&cases[i]);
+
+  fprintf(stdout, "%zu cases, %d failures\n", n, failures);
+  return failures != 0;
+}
@@ -4,6 +4,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// Per thread destination of reported errors, stderr when NULL
+static _Thread_local FILE *error_stream = NULL;
+
+FILE *errors_redirect(FILE *fp) {
+  FILE *ret = error_stream;
+  error_stream = fp;
+  return ret;
+}
+
+static inline FILE *errors_out() {
+  return error_stream ? error_stream : stderr;
+}
+
+void errors_replay(const char *text, size_t len) {
+  fwrite(text, 1, len, errors_out());
+}
+
 void fatal_error(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -15,15 +32,15 @@ void fatal_error(const char *format, ...) {
 void compile_error(const int line, const char *format, ...) {
   va_list args;
   va_start(args, format);
-  fprintf(stderr, "[line %d] Error: ", line);
-  vfprintf(stderr, format, args);
+  fprintf(errors_out(), "[line %d] Error: ", line);
+  vfprintf(errors_out(), format, args);
   va_end(args);
 }
 
 void runtime_error(const char *format, ...) {
   va_list args;
   va_start(args, format);
-  fprintf(stderr, "Error: ");
-  vfprintf(stderr, format, args);
+  fprintf(errors_out(), "Error: ");
+  vfprintf(errors_out(), format, args);
   va_end(args);
 }
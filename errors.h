@@ -1,11 +1,19 @@
 #pragma once
 
 #include <errno.h>
+#include <stdio.h>
 
 void fatal_error(const char *format, ...) __attribute__((noreturn));
 void compile_error(const int line, const char *format, ...);
 void runtime_error(const char *format, ...);
 
+// Compile and runtime errors of the calling thread go to fp (NULL: stderr).
+// Returns where they went before
+FILE *errors_redirect(FILE *fp);
+
+// Reports errors another thread captured, as they were
+void errors_replay(const char *text, size_t len);
+
 #define abort_if(expr, context)                                                \
   do {                                                                         \
     if (expr) {                                                                \
@@ -17,10 +17,10 @@ int fprintln_expr_r(FILE *ofp, expr *e) {
     case LT_NUMBER:
       return fprintf(ofp, "%f", e->l.dval);
     case LT_STRING:
-      return fprintf(ofp, "%s", e->l.sval);
+      return fprintf(ofp, "%s", e->l.str->chars);
     }
   case ET_VARIABLE:
-    return fprintf(ofp, "%s", e->v);
+    return fprintf(ofp, "%s", e->v.name);
 
   case ET_UNARY: {
     int ret = 0;
@@ -80,6 +80,53 @@ int fprintln_expr_r(FILE *ofp, expr *e) {
     ret += fprintln_expr_r(ofp, e->g);
     return fprintf(ofp, ")");
   }
+  case ET_ASSIGN: {
+    int ret = fprintf(ofp, "%s = ", e->a.target.name);
+    return ret + fprintln_expr_r(ofp, e->a.value);
+  }
+  case ET_CONCAT:
+    return fprintln_expr_r(ofp, e->cat.chain);
+  case ET_GET: {
+    int ret = fprintln_expr_r(ofp, e->get.obj);
+    return ret + fprintf(ofp, ".%s", e->get.name);
+  }
+  case ET_SET: {
+    int ret = fprintln_expr_r(ofp, e->set.obj);
+    ret += fprintf(ofp, ".%s = ", e->set.name);
+    return ret + fprintln_expr_r(ofp, e->set.value);
+  }
+  case ET_ARRAY: {
+    int ret = fprintf(ofp, "[");
+    for (int i = 0; i < e->arr.nelems; ++i) {
+      if (i > 0)
+        ret += fprintf(ofp, ", ");
+      ret += fprintln_expr_r(ofp, e->arr.elems[i]);
+    }
+    return ret + fprintf(ofp, "]");
+  }
+  case ET_INDEX: {
+    int ret = fprintln_expr_r(ofp, e->idx.obj);
+    ret += fprintf(ofp, "[");
+    ret += fprintln_expr_r(ofp, e->idx.index);
+    return ret + fprintf(ofp, "]");
+  }
+  case ET_INDEX_SET: {
+    int ret = fprintln_expr_r(ofp, e->iset.obj);
+    ret += fprintf(ofp, "[");
+    ret += fprintln_expr_r(ofp, e->iset.index);
+    ret += fprintf(ofp, "] = ");
+    return ret + fprintln_expr_r(ofp, e->iset.value);
+  }
+  case ET_CALL: {
+    int ret = fprintln_expr_r(ofp, e->c.callee);
+    ret += fprintf(ofp, "(");
+    for (int i = 0; i < e->c.nargs; ++i) {
+      if (i > 0)
+        ret += fprintf(ofp, ", ");
+      ret += fprintln_expr_r(ofp, e->c.args[i]);
+    }
+    return ret + fprintf(ofp, ")");
+  }
   }
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "object.h"
 #include "token.h"
+#include "var_env.h"
 #include <stdio.h>
 
 typedef struct expr_s expr;
@@ -12,7 +14,7 @@ typedef enum { LT_NUMBER, LT_STRING, LT_TRUE, LT_FALSE, LT_NIL } literal_t;
 typedef struct {
   union {
     double dval;
-    char *sval;
+    lox_string *str;
   };
   literal_t type;
 } literal;
@@ -21,8 +23,8 @@ static inline literal lt_number(double v) {
   return (literal){.type = LT_NUMBER, .dval = v};
 }
 
-static inline literal lt_string(char *v) {
-  return (literal){.type = LT_STRING, .sval = v};
+static inline literal lt_string(lox_string *v) {
+  return (literal){.type = LT_STRING, .str = v};
 }
 
 static inline literal lt_true() {
@@ -67,6 +69,11 @@ typedef struct {
   expr *left;
   token_t op;
   expr *right;
+  srcpos pos;
+
+  // Type feedback: bit (1 << value_t) of every operand type seen
+  unsigned int seen_left;
+  unsigned int seen_right;
 } binary;
 
 #define binary_operator_ASSERT(op)                                             \
@@ -74,16 +81,114 @@ typedef struct {
          op == LESS_EQUAL || op == GREATER || op == GREATER_EQUAL ||           \
          op == PLUS || op == MINUS || op == STAR || op == SLASH);
 
-static inline binary binary_c(expr *left, token_t op, expr *right) {
+static inline binary binary_c(expr *left, token_t op, expr *right,
+                              srcpos pos) {
   binary_operator_ASSERT(op);
 
   return (binary){
       .left = left,
       .op = op,
       .right = right,
+      .pos = pos,
+  };
+}
+
+///////////////////////////////////////
+////////////// Section Variable
+typedef enum {
+  VAR_GLOBAL,
+  VAR_LOCAL,   // In a scope of the running function
+  VAR_CAPTURE, // Captured from an enclosing function by a closure
+} var_kind;
+
+typedef struct {
+  char *name;
+  var_kind kind;
+  int depth;        // VAR_LOCAL: scopes out from the use
+  int idx;          // VAR_LOCAL: index in that scope. VAR_CAPTURE: capture
+  slot_cache cache; // VAR_GLOBAL
+} variable;
+
+#define variable_is_global(v) ((v)->kind == VAR_GLOBAL)
+
+///////////////////////////////////////
+////////////// Section Call
+typedef struct {
+  expr *callee;
+  expr **args;
+  int nargs;
+  srcpos pos; // Of the opening paren
+} call;
+
+static inline call call_c(expr *callee, expr **args, int nargs, srcpos pos) {
+  return (call){
+      .callee = callee,
+      .args = args,
+      .nargs = nargs,
+      .pos = pos,
   };
 }
 
+///////////////////////////////////////
+////////////// Section Assign
+typedef struct {
+  variable target;
+  expr *value;
+} assign;
+
+///////////////////////////////////////
+////////////// Section Concat
+#define CONCAT_MAX 32
+
+/**
+ * A left nested chain of + over nparts operands: ((a + b) + c) + ...
+ * - The tree walker joins runs of strings with a single allocation. The
+ *   compiled tiers translate chain, the binary nodes it replaces
+ * - ops[k - 1] adds parts[k], so feedback lands where it always did
+ */
+typedef struct {
+  expr *chain;
+  expr **parts;
+  binary **ops;
+  int nparts;
+} concat;
+
+///////////////////////////////////////
+////////////// Section Property
+// obj.name, and obj.name = value. Calls of a get invoke methods through
+// its cache without binding them
+typedef struct {
+  expr *obj;
+  char *name;
+  prop_cache *cache;
+} get;
+
+typedef struct {
+  expr *obj;
+  char *name;
+  expr *value;
+  prop_cache *cache;
+} set;
+
+///////////////////////////////////////
+////////////// Section Arrays
+// [a, b, ...], obj[index] and obj[index] = value
+typedef struct {
+  expr **elems;
+  int nelems;
+} array_lit;
+
+typedef struct {
+  expr *obj;
+  expr *index;
+} index_get;
+
+typedef struct {
+  expr *obj;
+  expr *index;
+  expr *value;
+} index_set;
+
 ///////////////////////////////////////
 ////////////// Section Expression
 typedef enum {
@@ -92,6 +197,14 @@ typedef enum {
   ET_BINARY,
   ET_GROUPING,
   ET_VARIABLE,
+  ET_CALL,
+  ET_ASSIGN,
+  ET_GET,
+  ET_SET,
+  ET_CONCAT,
+  ET_ARRAY,
+  ET_INDEX,
+  ET_INDEX_SET,
 } expr_t;
 
 struct expr_s {
@@ -100,7 +213,15 @@ struct expr_s {
     unary u;
     binary b;
     expr *g;
-    char *v;
+    variable v;
+    call c;
+    assign a;
+    get get;
+    set set;
+    concat cat;
+    array_lit arr;
+    index_get idx;
+    index_set iset;
   };
   expr_t type;
 };
@@ -122,7 +243,47 @@ static inline expr expr_grouping(expr *e) {
 }
 
 static inline expr expr_variable(char *ident) {
-  return (expr){.type = ET_VARIABLE, .v = ident};
+  return (expr){.type = ET_VARIABLE, .v = {.name = ident, .kind = VAR_GLOBAL}};
+}
+
+static inline expr expr_call(call c) {
+  return (expr){.type = ET_CALL, .c = c};
+}
+
+static inline expr expr_assign(char *ident, expr *value) {
+  return (expr){
+      .type = ET_ASSIGN,
+      .a = {.target = {.name = ident, .kind = VAR_GLOBAL}, .value = value},
+  };
+}
+
+static inline expr expr_get(expr *obj, char *name, prop_cache *cache) {
+  return (expr){
+      .type = ET_GET,
+      .get = {.obj = obj, .name = name, .cache = cache},
+  };
+}
+
+static inline expr expr_set(get g, expr *value) {
+  return (expr){
+      .type = ET_SET,
+      .set = {.obj = g.obj, .name = g.name, .value = value, .cache = g.cache},
+  };
+}
+
+static inline expr expr_array(expr **elems, int nelems) {
+  return (expr){.type = ET_ARRAY, .arr = {.elems = elems, .nelems = nelems}};
+}
+
+static inline expr expr_index(expr *obj, expr *index) {
+  return (expr){.type = ET_INDEX, .idx = {.obj = obj, .index = index}};
+}
+
+static inline expr expr_index_set(index_get g, expr *value) {
+  return (expr){
+      .type = ET_INDEX_SET,
+      .iset = {.obj = g.obj, .index = g.index, .value = value},
+  };
 }
 
 int fprintln_expr(FILE *ofp, expr *e);
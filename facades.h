@@ -16,7 +16,7 @@ static inline void *malloc_or_abort(size_t len) {
 }
 static inline void *realloc_or_abort(void *ptr, size_t newlen) {
   void *ret = realloc(ptr, newlen);
-  abort_if(ptr == NULL, "realloc");
+  abort_if(ret == NULL, "realloc");
   return ret;
 }
 static inline void fseek_or_abort(FILE *fp, long int offset, int whence) {
@@ -0,0 +1,849 @@
+#include "gc.h"
+#include "array.h"
+#include "facades.h"
+#include "heap_profile.h"
+#include "map.h"
+#include "object.h"
+#include "slab.h"
+#include "statements.h"
+#include "vector.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define INITIAL_ROOTS 256
+#define INITIAL_WORK 256
+#define INITIAL_SEEN 256
+
+#define gc_root_stack_ASSERT(s)                                                \
+  ASSERT(s);                                                                   \
+  ASSERT((s)->len <= (s)->cap)
+#define gc_work_stack_ASSERT(s)                                                \
+  ASSERT(s);                                                                   \
+  ASSERT((s)->len <= (s)->cap)
+#define gc_buffer_ASSERT(b)                                                    \
+  ASSERT(b);                                                                   \
+  ASSERT((b)->len <= (b)->cap)
+
+VECTOR_FUNCTIONS(gc_root_stack, gc_root, at, vector_grow_double);
+VECTOR_FUNCTIONS(gc_work_stack, gc_work, at, vector_grow_double);
+VECTOR_FUNCTIONS(gc_buffer, gc_object *, at, vector_grow_double);
+
+// Values traced in a stress mode slice
+#define STRESS_SLICE 4
+
+// Elements of an array or map traced before looking at the clock again
+#define TRACE_CHUNK 1024
+
+static int stress = 0;
+static int incremental = 0;
+static size_t quota_limit = 0;
+int gc_refcounting = 0;
+
+void gc_set_stress(int on) { stress = on; }
+
+void gc_set_refcounting(int on) { gc_refcounting = on; }
+
+void gc_set_quota(size_t limit) { quota_limit = limit; }
+
+void gc_set_incremental(int on) {
+  incremental = on;
+#ifdef __GLIBC__
+  // A free() that leaves enough at the top of the heap hands it back to the
+  // system right there, tens of milliseconds for a big heap. Sweeping frees
+  // what the next allocations would take again anyway
+  if (on)
+    mallopt(M_TRIM_THRESHOLD, INT32_MAX);
+#endif
+}
+
+gc_heap *gc_create() {
+  gc_heap *ret = malloc_or_abort(sizeof *ret);
+  *ret = (gc_heap){
+      .threshold = GC_MIN_THRESHOLD,
+      .seen = malloc_or_abort(INITIAL_SEEN * sizeof(void *)),
+      .seen_cap = INITIAL_SEEN,
+      .cycles_due = GC_MIN_CANDIDATES,
+      .quota = {.limit = quota_limit},
+  };
+  memset(ret->seen, 0, INITIAL_SEEN * sizeof(void *));
+  gc_root_stack_reserve(&ret->roots, INITIAL_ROOTS);
+  gc_work_stack_reserve(&ret->work, INITIAL_WORK);
+  return ret;
+}
+
+static void destroy(gc_heap *h, gc_object *o);
+
+void gc_free(gc_heap *h) {
+  while (h->objects != NULL)
+    destroy(h, h->objects);
+  free(h->roots.at);
+  free(h->work.at);
+  free(h->seen);
+  gc_buffer *buffers[] = {&h->zct,        &h->rooted, &h->rooting,
+                          &h->candidates, &h->stack,  &h->dead};
+  for (size_t b = 0; b < sizeof buffers / sizeof *buffers; ++b)
+    free(buffers[b]->at);
+  free(h);
+}
+
+void gc_roots_grow(gc_heap *h) {
+  gc_root_stack_make_available(&h->roots, h->roots.len + 1);
+}
+
+///////////////////////////////////////
+////////////// Section Marking
+
+static inline gc_object *header(void *obj) { return (gc_object *)obj - 1; }
+
+static inline void *object(gc_object *o) { return o + 1; }
+
+// Unlinks o and frees it, with whatever it malloced
+static void destroy(gc_heap *h, gc_object *o) {
+  if (o->prev != NULL)
+    o->prev->next = o->next;
+  else
+    h->objects = o->next;
+  if (o->next != NULL)
+    o->next->prev = o->prev;
+
+  // An instance's size counts its fields, which it may have outgrown
+  size_t size = o->size;
+  if (o->type == V_INSTANCE) {
+    instance *in = object(o);
+    slab_free(in->fields, in->cap * sizeof(value));
+    size = sizeof *in;
+  }
+  h->resident -= o->size;
+  h->quota.heap -= o->size;
+  if (heap_profiling)
+    heap_profile_arena("gc heap", -(long)o->size);
+  slab_free(o, sizeof *o + size);
+}
+
+static int first_visit(gc_heap *h, void *p);
+
+// 1 the first time obj is reached in a cycle. on is the heap it's on, NULL
+// for one in a linmem
+static int reach(gc_heap *h, void *obj, gc_heap *on) {
+  if (on == NULL)
+    return first_visit(h, obj);
+  if (header(obj)->epoch == h->epoch)
+    return 0;
+  header(obj)->epoch = h->epoch;
+  return 1;
+}
+
+// 1 the first time p is asked about in a cycle
+static int first_visit(gc_heap *h, void *p) {
+  size_t mask = h->seen_cap - 1;
+  size_t i = ((uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ull & mask;
+  for (; h->seen[i] != NULL; i = (i + 1) & mask)
+    if (h->seen[i] == p)
+      return 0;
+  h->seen[i] = p;
+
+  // Keep it at most half full
+  if (2 * ++h->nseen > h->seen_cap) {
+    void **old = h->seen;
+    size_t old_cap = h->seen_cap;
+    h->seen_cap *= 2;
+    h->seen = malloc_or_abort(h->seen_cap * sizeof *h->seen);
+    memset(h->seen, 0, h->seen_cap * sizeof *h->seen);
+    h->nseen = 0;
+    for (size_t k = 0; k < old_cap; ++k)
+      if (old[k] != NULL)
+        first_visit(h, old[k]);
+    free(old);
+  }
+  return 1;
+}
+
+static void work_push(gc_heap *h, value *v, size_t from) {
+  gc_work_stack_make_available(&h->work, h->work.len + 1);
+  h->work.at[h->work.len++] = (gc_work){.v = *v, .from = from};
+}
+
+static inline void mark_string(gc_heap *h, lox_string *s) {
+  if (s->gc)
+    header(s)->epoch = h->epoch;
+}
+
+// Strings are marked right away, anything holding values is traced later
+static void mark_value(gc_heap *h, value *v) {
+  switch (v->type) {
+  case V_STRING:
+    mark_string(h, v->str);
+    return;
+  case V_ROPE:
+    if (reach(h, v->rp, v->rp->heap))
+      work_push(h, v, 0);
+    return;
+  case V_INSTANCE:
+    if (reach(h, v->in, v->in->heap))
+      work_push(h, v, 0);
+    return;
+  case V_CLOSURE:
+  case V_BOX:
+  case V_CLASS:
+  case V_BOUND:
+  case V_ARRAY:
+  case V_MAP:
+    // Every pointer in the union shares fn's storage
+    if (first_visit(h, v->fn))
+      work_push(h, v, 0);
+    return;
+  default:
+    return;
+  }
+}
+
+void gc_shade(gc_heap *h, value *v) { mark_value(h, v); }
+
+static void mark_values(gc_heap *h, value *v, size_t n) {
+  for (size_t k = 0; k < n; ++k)
+    mark_value(h, &v[k]);
+}
+
+// Arrays and maps TRACE_CHUNK elements at a time, the rest is pushed back
+static void trace(gc_heap *h, gc_work *w) {
+  value *v = &w->v;
+  switch (v->type) {
+  case V_ROPE:
+    if (v->rp->flat != NULL)
+      mark_string(h, v->rp->flat);
+    mark_value(h, &v->rp->left);
+    mark_value(h, &v->rp->right);
+    return;
+  case V_CLOSURE:
+    mark_values(h, v->cl->captures, v->cl->fn->ncaptures);
+    return;
+  case V_BOX:
+    mark_value(h, &v->bx->v);
+    return;
+  case V_CLASS:
+    for (int k = 0; k < v->k->nmethods; ++k)
+      mark_value(h, &v->k->methods[k].fn);
+    return;
+  case V_INSTANCE: {
+    value k = {.type = V_CLASS, .k = v->in->k};
+    mark_value(h, &k);
+    mark_values(h, v->in->fields, v->in->shape->nfields);
+    return;
+  }
+  case V_BOUND:
+    mark_value(h, &v->bd->receiver);
+    mark_value(h, &v->bd->method);
+    return;
+  case V_ARRAY: {
+    array *a = v->arr;
+    if (a->vals == NULL)
+      return;
+    size_t end = a->len - w->from > TRACE_CHUNK ? w->from + TRACE_CHUNK
+                                                : a->len;
+    mark_values(h, &a->vals[w->from], end - w->from);
+    if (end < a->len)
+      work_push(h, v, end);
+    return;
+  }
+  case V_MAP: {
+    // From the back: closing holes only moves entries to the front, where
+    // they're still to be traced. from is how many are left, 0 at first
+    map *m = v->mp;
+    size_t end = w->from == 0 || w->from > m->entries.len ? m->entries.len
+                                                          : w->from;
+    size_t k = end > TRACE_CHUNK ? end - TRACE_CHUNK : 0;
+    for (size_t e = k; e < end; ++e) {
+      if (m->entries.at[e].key.type == V_UNDEF)
+        continue;
+      mark_value(h, &m->entries.at[e].key);
+      mark_value(h, &m->entries.at[e].val);
+    }
+    if (k > 0)
+      work_push(h, v, k);
+    return;
+  }
+  default:
+    unreachable();
+  }
+}
+
+typedef void (*root_visitor)(gc_heap *h, value *v, size_t n);
+
+// Every frame on the stack, including any a call is still filling in
+static void scan_stack(gc_heap *h, stackmem *st, root_visitor visit) {
+  if (st->len == 0)
+    return;
+  size_t top = stackmem_top(st);
+  size_t end = st->len;
+  do {
+    visit(h, stackmem_at(st, top), (end - top) / sizeof(value));
+  } while (stackmem_prev(st, &top, &end));
+}
+
+static void scan_roots(gc_heap *h, value *live, size_t nlive,
+                       root_visitor visit) {
+  var_env *env = h->env;
+  visit(h, env->slots, env->len);
+  scan_stack(h, &env->stack, visit);
+  for (size_t f = 0; f < env->nframes; ++f) {
+    call_frame *cf = &env->frames[f];
+    visit(h, &cf->ret, 1);
+    if (cf->cl != NULL) {
+      value cl = {.type = V_CLOSURE, .cl = cf->cl};
+      visit(h, &cl, 1);
+    }
+  }
+  for (size_t r = 0; r < h->roots.len; ++r)
+    visit(h, h->roots.at[r].v, h->roots.at[r].n);
+  visit(h, live, nlive);
+}
+
+///////////////////////////////////////
+////////////// Section Reference counts
+
+static void buffer_push(gc_buffer *b, gc_object *o) {
+  gc_buffer_make_available(b, b->len + 1);
+  b->at[b->len++] = o;
+}
+
+// The object v points to, if it's on a heap
+static gc_object *counted(value *v) {
+  switch (v->type) {
+  case V_STRING:
+    return v->str->gc ? header(v->str) : NULL;
+  case V_ROPE:
+    return v->rp->heap != NULL ? header(v->rp) : NULL;
+  case V_INSTANCE:
+    return v->in->heap != NULL ? header(v->in) : NULL;
+  default:
+    return NULL;
+  }
+}
+
+// The instance v points to, if it's on a heap: what cycles are made of
+static inline gc_object *cyclic(value *v) {
+  return v->type == V_INSTANCE && v->in->heap != NULL ? header(v->in) : NULL;
+}
+
+static inline value *fields(gc_object *o, size_t *n) {
+  instance *in = object(o);
+  *n = in->shape->nfields;
+  return in->fields;
+}
+
+// An instance whose count dropped to something other than zero
+static void suspect(gc_heap *h, gc_object *o) {
+  if (o->type != V_INSTANCE || o->color == GC_PURPLE)
+    return;
+  o->color = GC_PURPLE;
+  if (!o->buffered) {
+    o->buffered = 1;
+    buffer_push(&h->candidates, o);
+  }
+}
+
+void gc_count_up(gc_heap *h, value *v) {
+  gc_object *o = counted(v);
+  if (o == NULL)
+    return;
+  if (h == NULL) {
+    __atomic_fetch_add(&o->rc, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  o->rc++;
+  o->color = GC_BLACK;
+}
+
+// Nothing is freed here: a value with no counted references left may still
+// be on a root
+void gc_count_down(gc_heap *h, value *v) {
+  gc_object *o = counted(v);
+  if (o == NULL || h == NULL)
+    return;
+  ASSERT(o->rc > 0);
+  if (--o->rc > 0) {
+    suspect(h, o);
+  } else if (!o->zct) {
+    o->zct = 1;
+    buffer_push(&h->zct, o);
+  }
+}
+
+// Within a reconciliation, where a count of zero means garbage. An object
+// still in a buffer is left for it to free
+static void unref(gc_heap *h, value *v) {
+  gc_object *o = counted(v);
+  if (o == NULL)
+    return;
+  ASSERT(o->rc > 0);
+  if (--o->rc > 0)
+    suspect(h, o);
+  else if (o->zct || o->buffered)
+    o->color = GC_BLACK;
+  else
+    buffer_push(&h->stack, o);
+}
+
+// What o holds, instances only if cycles_too
+static void unref_held(gc_heap *h, gc_object *o, int cycles_too) {
+  if (o->type == V_ROPE) {
+    rope *r = object(o);
+    unref(h, &r->left);
+    unref(h, &r->right);
+    if (r->flat != NULL) {
+      value flat = {.type = V_STRING, .str = r->flat};
+      unref(h, &flat);
+    }
+  } else if (o->type == V_INSTANCE) {
+    size_t n;
+    value *v = fields(o, &n);
+    for (size_t k = 0; k < n; ++k)
+      if (cycles_too || cyclic(&v[k]) == NULL)
+        unref(h, &v[k]);
+  }
+}
+
+// Frees the objects on the stack, and whatever only they held
+static void drain(gc_heap *h) {
+  while (h->stack.len > 0) {
+    gc_object *o = h->stack.at[--h->stack.len];
+    unref_held(h, o, 1);
+    destroy(h, o);
+    h->nfreed_counted++;
+  }
+}
+
+static void release(gc_heap *h, gc_object *o) {
+  if (o->zct || o->buffered) {
+    o->color = GC_BLACK;
+    return;
+  }
+  buffer_push(&h->stack, o);
+  drain(h);
+}
+
+// Counted once per reconciliation, however many roots hold it
+static void count_roots(gc_heap *h, value *v, size_t n) {
+  for (size_t k = 0; k < n; ++k) {
+    gc_object *o = counted(&v[k]);
+    if (o == NULL || o->epoch == h->epoch)
+      continue;
+    o->epoch = h->epoch;
+    o->rc++;
+    o->color = GC_BLACK;
+    buffer_push(&h->rooting, o);
+  }
+}
+
+///////////////////////////////////////
+////////////// Section Trial deletion
+
+// Takes away the counts of references inside the graph s reaches. How many
+// objects it went through
+static size_t mark_gray(gc_heap *h, gc_object *s) {
+  if (s->color == GC_GRAY)
+    return 0;
+  size_t ret = 0;
+  s->color = GC_GRAY;
+  buffer_push(&h->stack, s);
+  while (h->stack.len > 0) {
+    gc_object *o = h->stack.at[--h->stack.len];
+    ret++;
+    size_t n;
+    value *v = fields(o, &n);
+    for (size_t k = 0; k < n; ++k) {
+      gc_object *t = cyclic(&v[k]);
+      if (t == NULL)
+        continue;
+      t->rc--;
+      if (t->color != GC_GRAY) {
+        t->color = GC_GRAY;
+        buffer_push(&h->stack, t);
+      }
+    }
+  }
+  return ret;
+}
+
+// s is referenced from outside: it and everything it reaches get their
+// counts back
+static void scan_black(gc_heap *h, gc_object *s) {
+  size_t base = h->stack.len;
+  s->color = GC_BLACK;
+  buffer_push(&h->stack, s);
+  while (h->stack.len > base) {
+    gc_object *o = h->stack.at[--h->stack.len];
+    size_t n;
+    value *v = fields(o, &n);
+    for (size_t k = 0; k < n; ++k) {
+      gc_object *t = cyclic(&v[k]);
+      if (t == NULL)
+        continue;
+      t->rc++;
+      if (t->color != GC_BLACK) {
+        t->color = GC_BLACK;
+        buffer_push(&h->stack, t);
+      }
+    }
+  }
+}
+
+// Gray objects left at zero are white, garbage unless something black
+// reaches them
+static void scan(gc_heap *h, gc_object *s) {
+  buffer_push(&h->stack, s);
+  while (h->stack.len > 0) {
+    gc_object *o = h->stack.at[--h->stack.len];
+    if (o->color != GC_GRAY)
+      continue;
+    if (o->rc > 0) {
+      scan_black(h, o);
+      continue;
+    }
+    o->color = GC_WHITE;
+    size_t n;
+    value *v = fields(o, &n);
+    for (size_t k = 0; k < n; ++k) {
+      gc_object *t = cyclic(&v[k]);
+      if (t != NULL)
+        buffer_push(&h->stack, t);
+    }
+  }
+}
+
+// The references between white objects went with mark_gray, what else they
+// hold is dropped as they're freed
+static void collect_white(gc_heap *h, gc_object *s) {
+  buffer_push(&h->stack, s);
+  while (h->stack.len > 0) {
+    gc_object *o = h->stack.at[--h->stack.len];
+    if (o->color != GC_WHITE || o->buffered)
+      continue;
+    o->color = GC_BLACK;
+    buffer_push(&h->dead, o);
+    size_t n;
+    value *v = fields(o, &n);
+    for (size_t k = 0; k < n; ++k) {
+      gc_object *t = cyclic(&v[k]);
+      if (t != NULL)
+        buffer_push(&h->stack, t);
+    }
+  }
+
+  for (size_t k = 0; k < h->dead.len; ++k)
+    unref_held(h, h->dead.at[k], 0);
+  for (size_t k = 0; k < h->dead.len; ++k)
+    destroy(h, h->dead.at[k]);
+  h->nfreed_cycles += h->dead.len;
+  h->dead.len = 0;
+  drain(h);
+}
+
+static void collect_cycles(gc_heap *h) {
+  gc_buffer *c = &h->candidates;
+
+  // Freeing a candidate may add more, they're seen before the loop ends
+  size_t kept = 0;
+  size_t traversed = 0;
+  for (size_t k = 0; k < c->len; ++k) {
+    gc_object *o = c->at[k];
+    if (o->color == GC_PURPLE) {
+      c->at[kept++] = o;
+      traversed += mark_gray(h, o);
+      continue;
+    }
+    o->buffered = 0;
+    if (o->color == GC_BLACK && o->rc == 0)
+      release(h, o);
+  }
+  c->len = kept;
+
+  for (size_t k = 0; k < c->len; ++k)
+    scan(h, c->at[k]);
+  for (size_t k = 0; k < c->len; ++k) {
+    c->at[k]->buffered = 0;
+    collect_white(h, c->at[k]);
+  }
+  c->len = 0;
+
+  // So the work of trial deletion stays proportional to the mutator's
+  h->cycles_due = traversed > GC_MIN_CANDIDATES ? traversed : GC_MIN_CANDIDATES;
+}
+
+// Roots are counted before what they held at the last one is let go, so
+// an object still on one never drops to zero
+static void reconcile(gc_heap *h, value *live, size_t nlive, int cycles) {
+  ASSERT(h->env != NULL);
+  h->epoch++;
+  h->bytes = 0;
+
+  h->rooting.len = 0;
+  scan_roots(h, live, nlive, count_roots);
+  for (size_t k = 0; k < h->rooted.len; ++k) {
+    gc_object *o = h->rooted.at[k];
+    if (--o->rc == 0)
+      release(h, o);
+    else if (o->epoch != h->epoch)
+      suspect(h, o);
+  }
+  gc_buffer rooted = h->rooted;
+  h->rooted = h->rooting;
+  h->rooting = rooted;
+
+  // Whatever got a count without ever being on a root may be in a cycle
+  for (size_t k = 0; k < h->zct.len; ++k) {
+    gc_object *o = h->zct.at[k];
+    o->zct = 0;
+    if (o->rc == 0)
+      release(h, o);
+    else if (o->epoch != h->epoch)
+      suspect(h, o);
+  }
+  h->zct.len = 0;
+
+  if (cycles || h->candidates.len >= h->cycles_due)
+    collect_cycles(h);
+
+  h->live = h->resident;
+  h->ncollections++;
+}
+
+///////////////////////////////////////
+////////////// Section Cycles
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_pause(gc_heap *h, double seconds) {
+  int b = 0;
+  for (double us = seconds * 1e6; us >= 1 && b < GC_PAUSE_BUCKETS - 1;
+       us /= 2)
+    b++;
+  h->pauses[b]++;
+  if (seconds > h->max_pause)
+    h->max_pause = seconds;
+}
+
+// Everything allocated from here on is already marked
+static void begin_cycle(gc_heap *h, value *live, size_t nlive) {
+  ASSERT(h->env != NULL);
+  h->epoch++;
+  h->bytes = 0;
+  h->next_step = GC_STEP_BYTES;
+  h->phase = GC_MARKING;
+  scan_roots(h, live, nlive, mark_values);
+}
+
+static void end_cycle(gc_heap *h) {
+  memset(h->seen, 0, h->seen_cap * sizeof *h->seen);
+  h->nseen = 0;
+  h->live = h->swept_live;
+  h->threshold =
+      2 * h->live > GC_MIN_THRESHOLD ? 2 * h->live : GC_MIN_THRESHOLD;
+  h->phase = GC_IDLE;
+  h->ncollections++;
+}
+
+// Until the work runs out, units of it are done, or the clock passes
+// deadline (0: never). 1 once the phase is over
+static int mark_some(gc_heap *h, size_t units, double deadline) {
+  for (size_t done = 0; h->work.len > 0; ++done) {
+    // A unit is up to TRACE_CHUNK values, worth a look at the clock
+    if (done == units || (deadline > 0 && done > 0 && now() > deadline))
+      return 0;
+    gc_work w = h->work.at[--h->work.len];
+    trace(h, &w);
+  }
+  h->phase = GC_SWEEPING;
+  h->sweep = &h->objects;
+  h->swept_live = 0;
+  return 1;
+}
+
+// Objects allocated since the cycle began are in front of where the sweep
+// started, or carry its epoch: either way they stay
+static int sweep_some(gc_heap *h, size_t units, double deadline) {
+  for (size_t done = 0; *h->sweep != NULL; ++done) {
+    if (done == units ||
+        (deadline > 0 && done % 256 == 255 && now() > deadline))
+      return 0;
+    gc_object *o = *h->sweep;
+    if (o->epoch == h->epoch) {
+      h->swept_live += o->size;
+      h->sweep = &o->next;
+    } else {
+      destroy(h, o);
+    }
+  }
+  end_cycle(h);
+  return 1;
+}
+
+static void finish_marking(gc_heap *h) {
+  if (h->phase == GC_MARKING)
+    mark_some(h, SIZE_MAX, 0);
+}
+
+void gc_collect(gc_heap *h, value *live, size_t nlive) {
+  ASSERT(h->paused == 0 && h->threads == 0);
+  double start = now();
+
+  if (gc_refcounting) {
+    reconcile(h, live, nlive, 1);
+    record_pause(h, now() - start);
+    return;
+  }
+  if (h->phase == GC_IDLE)
+    begin_cycle(h, live, nlive);
+  finish_marking(h);
+  sweep_some(h, SIZE_MAX, 0);
+
+  record_pause(h, now() - start);
+}
+
+// A cycle is started when one is due, then carried on every GC_STEP_BYTES
+static void gc_step(gc_heap *h, value *live, size_t nlive) {
+  double start = now();
+  size_t units = stress ? STRESS_SLICE : SIZE_MAX;
+  double deadline = stress ? 0 : start + GC_SLICE_NS / 1e9;
+
+  if (h->phase == GC_IDLE)
+    begin_cycle(h, live, nlive);
+  else
+    h->next_step = h->bytes + GC_STEP_BYTES;
+
+  if (h->phase == GC_MARKING)
+    mark_some(h, units, deadline);
+  else
+    sweep_some(h, units, deadline);
+
+  record_pause(h, now() - start);
+}
+
+static int step_due(gc_heap *h) {
+  if (stress)
+    return 1;
+  if (gc_refcounting)
+    return h->bytes >= GC_RC_BYTES || h->zct.len >= GC_ZCT_MAX;
+  if (h->phase == GC_IDLE)
+    return h->bytes >= h->threshold;
+  return h->bytes >= h->next_step;
+}
+
+// Whatever step_due found due
+static void collect_due(gc_heap *h, value *live, size_t nlive) {
+  if (gc_refcounting) {
+    double start = now();
+    reconcile(h, live, nlive, 0);
+    record_pause(h, now() - start);
+  } else if (incremental) {
+    gc_step(h, live, nlive);
+  } else {
+    gc_collect(h, live, nlive);
+  }
+}
+
+///////////////////////////////////////
+////////////// Section Allocation
+
+static void grown(gc_heap *h, size_t size) {
+  h->bytes += size;
+  h->resident += size;
+  h->quota.heap += size;
+  if (h->resident > h->peak)
+    h->peak = h->resident;
+  if (heap_profiling)
+    heap_profile_arena("gc heap", (long)size);
+}
+
+static void *heap_alloc(gc_heap *h, value_t type, size_t size) {
+  gc_object *o = slab_malloc(sizeof *o + size);
+  *o = (gc_object){
+      .next = h->objects, .size = size, .epoch = h->epoch, .type = type};
+  if (h->objects != NULL)
+    h->objects->prev = o;
+  h->objects = o;
+  grown(h, size);
+  h->nallocs++;
+  if (gc_refcounting) {
+    o->zct = 1;
+    buffer_push(&h->zct, o);
+  }
+  return object(o);
+}
+
+void *gc_alloc_now_at(gc_heap *h, value_t type, size_t size, const char *file,
+                      const char *func) {
+  heap_profile_note(file, func, size);
+  return heap_alloc(h, type, size);
+}
+
+void *gc_alloc_at(linmem *mem, value_t type, size_t size, value *live,
+                  size_t nlive, const char *file, const char *func) {
+  gc_heap *h = mem->gc;
+  // Either way it's charged, but only what the slab holds is small enough
+  // not to ask first
+  if (size > SLAB_MAX && mem_quota_check(mem->quota, size))
+    return NULL;
+  if (h == NULL)
+    return linmem_malloc_at(mem, size, file, func);
+  if (h->paused == 0 && step_due(h))
+    collect_due(h, live, nlive);
+  heap_profile_note(file, func, size);
+  return heap_alloc(h, type, size);
+}
+
+void gc_grow(gc_heap *h, void *obj, size_t extra) {
+  header(obj)->size += extra;
+  grown(h, extra);
+}
+
+void gc_safepoint(linmem *mem) {
+  gc_heap *h = mem->gc;
+  if (h == NULL || h->paused > 0 || stress || !step_due(h))
+    return;
+  collect_due(h, NULL, 0);
+}
+
+gc_heap *gc_detach(linmem *mem) {
+  gc_heap *h = mem->gc;
+  if (h != NULL) {
+    if (h->phase == GC_MARKING) {
+      double start = now();
+      finish_marking(h);
+      record_pause(h, now() - start);
+    }
+    h->threads++;
+  }
+  mem->gc = NULL;
+  return h;
+}
+
+void gc_attach(linmem *mem, gc_heap *h) {
+  if (h != NULL)
+    h->threads--;
+  mem->gc = h;
+}
+
+void gc_print_stats(FILE *ofp, gc_heap *h) {
+  fprintf(ofp,
+          "gc: %zu collections, %zu allocations, %zu bytes live, %zu at "
+          "most\n",
+          h->ncollections, h->nallocs, h->live, h->peak);
+  if (gc_refcounting)
+    fprintf(ofp, "gc: %zu freed by their count, %zu in cycles\n",
+            h->nfreed_counted, h->nfreed_cycles);
+  fprintf(ofp, "gc: longest pause %.3f ms\n", h->max_pause * 1e3);
+  for (int b = 0; b < GC_PAUSE_BUCKETS; ++b)
+    if (h->pauses[b] > 0)
+      fprintf(ofp, "gc: pauses < %8.0f us  %zu\n", (double)(1u << b),
+              h->pauses[b]);
+}
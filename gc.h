@@ -0,0 +1,334 @@
+#pragma once
+
+#include "memory.h"
+#include "value.h"
+#include "var_env.h"
+
+/**
+ * Garbage collection
+ * - The strings, ropes and instances a program makes while it runs are
+ *   allocated on a heap of their own, each after a gc_object header, and
+ *   freed once nothing reaches them. They, and an instance's fields, come
+ *   from the size class pools (slab.h), so freed ones are reused. String
+ *   literals stay in the linmem with everything else: arrays, maps and
+ *   closures are never freed, only traced through for what they hold
+ * - Precise mark and sweep. The roots are the globals, every frame on the
+ *   stack (those still being filled with arguments too), the call frames,
+ *   and the root stack: values the evaluator holds in C locals while it
+ *   evaluates something else
+ * - An allocation collects once more than threshold bytes were allocated
+ *   since the last collection: twice what survived it, and at least
+ *   GC_MIN_THRESHOLD. In stress mode every allocation collects
+ * - Compiled code pushes its slots as a root when it can collect. Nothing
+ *   is collected while gc_pause'd. While other threads run the heap is
+ *   detached from the caller's linmem: everything they allocate stays in
+ *   linmems
+ *
+ * Incremental mode
+ * - A cycle marks the roots, then marks and sweeps in slices of at most
+ *   GC_SLICE_NS, one every GC_STEP_BYTES allocated, so no pause grows with
+ *   the heap
+ * - Snapshot at the beginning: whatever was reachable when the roots were
+ *   marked stays alive. Stores that overwrite a value shade the old one
+ *   first (gc_barrier), so one moved around behind the marker is still
+ *   found, and objects allocated during a cycle are already marked
+ * - A mark is the number of the cycle that made it, so starting a cycle
+ *   unmarks everything at once
+ *
+ * Reference counting mode
+ * - Deferred: only references from objects are counted, the slots of
+ *   instances, arrays, maps, boxes, closures, bound methods and ropes.
+ *   Every store into one goes through gc_store. Variables and temporaries
+ *   aren't counted, so reading and passing values costs nothing
+ * - New objects, and those whose count drops to zero, go in the zero count
+ *   table. A reconciliation, every GC_RC_BYTES allocated or GC_ZCT_MAX
+ *   entries, counts what the roots hold and frees whatever in the table is
+ *   still at zero, and then whatever only that held. What the roots held is
+ *   counted until the next one, which lets go of it
+ * - An instance whose count drops, but not to zero, may be what kept a
+ *   garbage cycle alive. Such candidates are checked by trial deletion
+ *   (Bacon and Rajan): counts from inside the graph they reach are taken
+ *   away, whatever is left at zero is garbage. Only instances take part:
+ *   strings and ropes can't reach back to anything that holds them. It
+ *   runs once there are as many candidates as the last one looked at
+ * - Arrays, maps and closures are never freed, so neither is anything they
+ *   held when they became garbage. Stores on other threads only add to
+ *   counts: what they overwrite keeps its count, and leaks
+ */
+typedef struct gc_object_s {
+  struct gc_object_s *next;
+  struct gc_object_s *prev;
+  size_t size;
+  // Of the last cycle that reached it. Counting: of the last
+  // reconciliation that found it on a root
+  unsigned epoch;
+  uint32_t rc;      // Counted references to it
+  uint8_t type;     // V_STRING, V_ROPE or V_INSTANCE
+  uint8_t color;    // A gc_color, for trial deletion
+  uint8_t buffered; // Among the candidates
+  uint8_t zct;      // In the zero count table
+} gc_object;
+
+typedef enum { GC_BLACK, GC_GRAY, GC_WHITE, GC_PURPLE } gc_color;
+
+typedef struct {
+  gc_object **at;
+  size_t len;
+  size_t cap;
+} gc_buffer;
+
+// n values at v
+typedef struct {
+  value *v;
+  size_t n;
+} gc_root;
+
+typedef struct {
+  gc_root *at;
+  size_t len;
+  size_t cap;
+} gc_root_stack;
+
+// A value left to trace, from its element from on
+typedef struct {
+  value v;
+  size_t from;
+} gc_work;
+
+typedef struct {
+  gc_work *at;
+  size_t len;
+  size_t cap;
+} gc_work_stack;
+
+typedef enum { GC_IDLE, GC_MARKING, GC_SWEEPING } gc_phase;
+
+// Pauses by their length: bucket b counts those under 2^b microseconds
+#define GC_PAUSE_BUCKETS 24
+
+struct gc_heap_s {
+  gc_object *objects; // Newest first
+  size_t bytes;       // Allocated since the last cycle started
+  size_t live;        // What survived the last collection
+  size_t threshold;
+  int paused;
+  int threads; // Other threads are running, and may read the heap
+
+  gc_phase phase;
+  unsigned epoch;
+  size_t next_step;     // bytes at which the next slice runs
+  gc_object **sweep;    // The link to sweep from next
+  size_t swept_live;    // Survivors of the sweep so far
+
+  gc_root_stack roots;
+  var_env *env;
+
+  // Scratch of a collection: values left to trace, and objects outside
+  // the heap already traced
+  gc_work_stack work;
+  void **seen;
+  size_t nseen;
+  size_t seen_cap; // Power of two
+
+  // Reference counting: what the roots held at the last reconciliation
+  // (counted since), candidates for trial deletion, and scratch
+  gc_buffer zct;
+  gc_buffer rooted;
+  gc_buffer rooting;
+  gc_buffer candidates;
+  gc_buffer stack;
+  gc_buffer dead;
+  size_t cycles_due; // Candidates that make trial deletion due
+
+  size_t resident; // Bytes on the heap
+  size_t peak;
+  mem_quota quota; // Of the interpreter the heap belongs to
+
+  size_t nallocs; // For benchmarks, like linmem's
+  size_t ncollections;
+  size_t nfreed_counted;
+  size_t nfreed_cycles;
+  size_t pauses[GC_PAUSE_BUCKETS];
+  double max_pause; // Seconds
+};
+
+#define GC_MIN_THRESHOLD (1 << 20)
+#define GC_STEP_BYTES (64 << 10)
+#define GC_SLICE_NS 500000
+#define GC_RC_BYTES (256 << 10)
+#define GC_ZCT_MAX 4096
+#define GC_MIN_CANDIDATES 1024
+
+gc_heap *gc_create();
+
+// Frees everything on the heap. Linmems bound to it are charged to its
+// quota: free them first, or bind them to another
+void gc_free(gc_heap *h);
+
+// Every heap collects on every allocation. Incremental, a slice of a few
+// values runs on every allocation instead
+void gc_set_stress(int on);
+
+void gc_set_incremental(int on);
+
+// Reference counting instead of tracing, for heaps made from now on
+void gc_set_refcounting(int on);
+
+// The quota limit of heaps made from now on, 0 for none
+void gc_set_quota(size_t limit);
+
+// Allocations from mem go to env's heap, with env's roots, and are charged
+// to its quota
+static inline void gc_bind(linmem *mem, var_env *env) {
+  mem->gc = env->gc;
+  if (env->gc != NULL) {
+    env->gc->env = env;
+    linmem_set_quota(mem, &env->gc->quota);
+  }
+}
+
+// size bytes for an object of type on mem's heap, or in mem without one.
+// May collect first, keeping the nlive values at live besides the roots.
+// NULL (after an error) if it's bigger than SLAB_MAX and over mem's quota.
+// The caller is the allocation's site in a heap profile
+#define gc_alloc(mem, type, size, live, nlive)                                 \
+  gc_alloc_at(mem, type, size, live, nlive, __FILE__, __func__)
+
+// Like gc_alloc on h, without collecting or checking the quota
+#define gc_alloc_now(h, type, size)                                            \
+  gc_alloc_now_at(h, type, size, __FILE__, __func__)
+
+void *gc_alloc_at(linmem *mem, value_t type, size_t size, value *live,
+                  size_t nlive, const char *file, const char *func);
+void *gc_alloc_now_at(gc_heap *h, value_t type, size_t size, const char *file,
+                      const char *func);
+
+// The object obj on h took extra bytes of its own (an instance's fields)
+void gc_grow(gc_heap *h, void *obj, size_t extra);
+
+// A whole collection, finishing any cycle in progress
+void gc_collect(gc_heap *h, value *live, size_t nlive);
+
+// Collects, or runs a slice, if it's due. Where nothing but the roots holds
+// a value
+void gc_safepoint(linmem *mem);
+
+// Collections, their pauses as a histogram, and the longest. Counting, a
+// reconciliation is a collection
+void gc_print_stats(FILE *ofp, gc_heap *h);
+
+///////////////////////////////////////
+////////////// Section Roots
+
+void gc_roots_grow(gc_heap *h);
+
+static inline void gc_push(linmem *mem, value *v, size_t n) {
+  gc_heap *h = mem->gc;
+  if (h == NULL)
+    return;
+  if (h->roots.len == h->roots.cap)
+    gc_roots_grow(h);
+  h->roots.at[h->roots.len++] = (gc_root){.v = v, .n = n};
+}
+
+static inline void gc_pop(linmem *mem, size_t n) {
+  if (n > 0 && mem->gc != NULL)
+    mem->gc->roots.len -= n;
+}
+
+// Whether v is, or can reach, something on a heap
+static inline int gc_traced(value *v) {
+  return (1u << v->type) &
+         ((1u << V_STRING) | (1u << V_ROPE) | (1u << V_CLOSURE) |
+          (1u << V_BOX) | (1u << V_CLASS) | (1u << V_INSTANCE) |
+          (1u << V_BOUND) | (1u << V_ARRAY) | (1u << V_MAP));
+}
+
+// Pushes v if it needs rooting at all, how many to pop
+static inline size_t gc_push_value(linmem *mem, value *v) {
+  if (!gc_traced(v))
+    return 0;
+  gc_push(mem, v, 1);
+  return 1;
+}
+
+// For paths with many exits: everything pushed after a save goes at once
+static inline size_t gc_roots_save(linmem *mem) {
+  return mem->gc != NULL ? mem->gc->roots.len : 0;
+}
+
+static inline void gc_roots_restore(linmem *mem, size_t saved) {
+  if (mem->gc != NULL)
+    mem->gc->roots.len = saved;
+}
+
+///////////////////////////////////////
+////////////// Section Barrier
+
+// Marks v gray, while a cycle is marking
+void gc_shade(gc_heap *h, value *v);
+
+static inline int gc_marking(linmem *mem) {
+  return mem->gc != NULL && mem->gc->phase == GC_MARKING;
+}
+
+// Before *slot is overwritten
+static inline void gc_barrier(linmem *mem, value *slot) {
+  if (gc_marking(mem))
+    gc_shade(mem->gc, slot);
+}
+
+///////////////////////////////////////
+////////////// Section Reference counts
+
+extern int gc_refcounting; // See gc_set_refcounting
+
+// A counted reference to v from an object on h. NULL while other threads
+// run: then it's added atomically
+void gc_count_up(gc_heap *h, value *v);
+
+// One went away. Ignored with h NULL
+void gc_count_down(gc_heap *h, value *v);
+
+// v was put in an object's slot that held nothing
+static inline void gc_retain(linmem *mem, value *v) {
+  if (gc_refcounting)
+    gc_count_up(mem->gc, v);
+}
+
+// Before an object's slot is dropped, with the object still alive
+static inline void gc_release(linmem *mem, value *slot) {
+  gc_barrier(mem, slot);
+  if (gc_refcounting)
+    gc_count_down(mem->gc, slot);
+}
+
+// *slot = v, for a slot in an object
+static inline void gc_store(linmem *mem, value *slot, value v) {
+  gc_barrier(mem, slot);
+  if (gc_refcounting) {
+    gc_count_up(mem->gc, &v);
+    gc_count_down(mem->gc, slot);
+  }
+  *slot = v;
+}
+
+///////////////////////////////////////
+////////////// Section Pauses
+
+static inline void gc_pause(linmem *mem) {
+  if (mem->gc != NULL)
+    mem->gc->paused++;
+}
+
+static inline void gc_resume(linmem *mem) {
+  if (mem->gc != NULL)
+    mem->gc->paused--;
+}
+
+// Before other threads start: returns the heap, which is kept from
+// collecting and from getting any more objects until gc_attach. Their
+// stores have no barrier, so a cycle that's marking finishes marking first
+gc_heap *gc_detach(linmem *mem);
+
+void gc_attach(linmem *mem, gc_heap *h);
@@ -0,0 +1,105 @@
+#include "gc.h"
+#include "interpreter.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Fills an array with strings, then keeps replacing them: the live heap
+// stays the same size while garbage goes through it
+static const char *program =
+    "var live = array(%d);\n"
+    "var piece = \"%s\";\n"
+    "for (var i = 0; i < len(live); i = i + 1) live[i] = piece + \"!\";\n"
+    "var j = 0;\n"
+    "for (var i = 0; i < %d; i = i + 1) {\n"
+    "  live[j] = piece + \"?\";\n"
+    "  j = j + 1;\n"
+    "  if (j == len(live)) j = 0;\n"
+    "}\n"
+    "var r = len(live);\n";
+
+// Pairs of instances that point at each other, dropped as soon as they're
+// made: garbage only trial deletion finds when counting
+static const char *cycles =
+    "class Node { init(v) { this.v = v; this.next = nil; } }\n"
+    "var keep = Node(0);\n"
+    "for (var i = 0; i < %d; i = i + 1) {\n"
+    "  var a = Node(i);\n"
+    "  var b = Node(i + 1);\n"
+    "  a.next = b;\n"
+    "  b.next = a;\n"
+    "  keep.next = a;\n"
+    "}\n"
+    "var r = keep.next.next.v;\n";
+
+// Flat strings stop short of ROPE_MIN
+#define PIECE_LEN 200
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef enum { TRACING, INCREMENTAL, COUNTING } mode;
+
+static void run(const char *name, mode m, const char *src) {
+  gc_set_incremental(m == INCREMENTAL);
+  gc_set_refcounting(m == COUNTING);
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  var_env env = var_env_create();
+
+  double start = now();
+  int failed = interpret_stmts(&arr.mem, &stmts, &env);
+  double elapsed = now() - start;
+
+  value *r = var_env_find(&env, "r");
+  if (failed || r == NULL || r->type != V_NUMBER) {
+    fprintf(stdout, "%s: failed\n", name);
+    exit(1);
+  }
+  fprintf(stdout, "%s  %.3fs\n", name, elapsed);
+  gc_print_stats(stdout, env.gc);
+  var_env_free(&env);
+}
+
+static void bench(const char *name, mode m, int nstrings) {
+  char piece[PIECE_LEN + 1];
+  for (int k = 0; k < PIECE_LEN; ++k)
+    piece[k] = 'a' + k % 26;
+  piece[PIECE_LEN] = '\0';
+
+  char src[1024];
+  snprintf(src, sizeof src, program, nstrings, piece, 3 * nstrings);
+  run(name, m, src);
+}
+
+static void bench_cycles(const char *name, mode m, int npairs) {
+  char src[1024];
+  snprintf(src, sizeof src, cycles, npairs);
+  run(name, m, src);
+}
+
+int main(int argc, char **argv) {
+  int mb = argc > 1 ? atoi(argv[1]) : 256;
+  int nstrings =
+      (int)((double)mb * (1 << 20) / (sizeof(lox_string) + PIECE_LEN + 2));
+  fprintf(stdout, "%d MB live: %d strings of %d characters\n", mb, nstrings,
+          PIECE_LEN + 1);
+
+  bench("stop the world", TRACING, nstrings);
+  bench("incremental", INCREMENTAL, nstrings);
+  bench("reference counting", COUNTING, nstrings);
+
+  int npairs = 1000000;
+  fprintf(stdout, "\n%d cycles of two instances\n", npairs);
+  bench_cycles("stop the world", TRACING, npairs);
+  bench_cycles("incremental", INCREMENTAL, npairs);
+  bench_cycles("reference counting", COUNTING, npairs);
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include "heap_profile.h"
+#include "facades.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SITES 256 // Power of two
+#define MAX_ARENAS 16
+#define STACK_MAX 256
+
+int heap_profiling = 0;
+_Thread_local int heap_profile_line = 0;
+
+// file and func are string literals: a site is the same pointers
+typedef struct {
+  const char *file;
+  const char *func;
+  int line;
+  size_t bytes;
+  size_t count;
+} site;
+
+typedef struct {
+  const char *name;
+  long bytes;
+  long peak;
+} arena;
+
+// Allocations come from every thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static site *sites = NULL; // Open addressed, file NULL for an empty one
+static size_t nsites = 0;
+static size_t sites_cap = 0;
+static arena arenas[MAX_ARENAS];
+static size_t narenas = 0;
+
+static size_t site_hash(const char *file, const char *func, int line) {
+  uint64_t h = (uintptr_t)file * 0x9e3779b97f4a7c15ull;
+  h ^= (uintptr_t)func + (h << 6) + (h >> 2);
+  h ^= (uint64_t)line * 0xff51afd7ed558ccdull;
+  return (size_t)(h ^ (h >> 29));
+}
+
+static site *site_find(const char *file, const char *func, int line) {
+  size_t mask = sites_cap - 1;
+  size_t i = site_hash(file, func, line) & mask;
+  while (sites[i].file != NULL &&
+         (sites[i].file != file || sites[i].func != func ||
+          sites[i].line != line))
+    i = (i + 1) & mask;
+  return &sites[i];
+}
+
+static void sites_grow() {
+  site *old = sites;
+  size_t old_cap = sites_cap;
+  sites_cap = sites_cap == 0 ? INITIAL_SITES : 2 * sites_cap;
+  sites = malloc_or_abort(sites_cap * sizeof *sites);
+  memset(sites, 0, sites_cap * sizeof *sites);
+  for (size_t k = 0; k < old_cap; ++k)
+    if (old[k].file != NULL)
+      *site_find(old[k].file, old[k].func, old[k].line) = old[k];
+  free(old);
+}
+
+void heap_profile_record(const char *file, const char *func, size_t bytes) {
+  int line = heap_profile_line;
+  pthread_mutex_lock(&lock);
+  if (2 * (nsites + 1) > sites_cap)
+    sites_grow();
+  site *s = site_find(file, func, line);
+  if (s->file == NULL) {
+    *s = (site){.file = file, .func = func, .line = line};
+    nsites++;
+  }
+  s->bytes += bytes;
+  s->count++;
+  pthread_mutex_unlock(&lock);
+}
+
+void heap_profile_arena(const char *name, long delta) {
+  pthread_mutex_lock(&lock);
+  size_t k = 0;
+  while (k < narenas && strcmp(arenas[k].name, name) != 0)
+    k++;
+  if (k == narenas) {
+    abort_if(narenas == MAX_ARENAS, "heap_profile_arena");
+    arenas[narenas++] = (arena){.name = name};
+  }
+  arenas[k].bytes += delta;
+  if (arenas[k].bytes > arenas[k].peak)
+    arenas[k].peak = arenas[k].bytes;
+  pthread_mutex_unlock(&lock);
+}
+
+///////////////////////////////////////
+////////////// Section Output
+
+typedef struct {
+  char stack[STACK_MAX];
+  size_t value;
+} folded;
+
+static int folded_cmp(const void *a, const void *b) {
+  return strcmp(((const folded *)a)->stack, ((const folded *)b)->stack);
+}
+
+static void print_folded(FILE *ofp, const char *title, folded *lines,
+                         size_t n) {
+  qsort(lines, n, sizeof *lines, folded_cmp);
+  fprintf(ofp, "# %s\n", title);
+  for (size_t k = 0; k < n; ++k)
+    fprintf(ofp, "%s %zu\n", lines[k].stack, lines[k].value);
+}
+
+void heap_profile_print(FILE *ofp) {
+  pthread_mutex_lock(&lock);
+  size_t n = nsites > narenas ? nsites : narenas;
+  folded *lines = malloc_or_abort((n + 1) * sizeof *lines);
+
+  // Runtime sites go under the line, so a flame graph splits them by it
+  for (int counts = 0; counts < 2; ++counts) {
+    size_t len = 0;
+    for (size_t k = 0; k < sites_cap; ++k) {
+      site *s = &sites[k];
+      if (s->file == NULL)
+        continue;
+      folded *f = &lines[len++];
+      if (s->line > 0)
+        snprintf(f->stack, STACK_MAX, "%s;%s;line %d", s->file, s->func,
+                 s->line);
+      else
+        snprintf(f->stack, STACK_MAX, "%s;%s", s->file, s->func);
+      f->value = counts ? s->count : s->bytes;
+    }
+    print_folded(ofp, counts ? "allocations" : "bytes", lines, len);
+  }
+
+  for (size_t k = 0; k < narenas; ++k) {
+    snprintf(lines[k].stack, STACK_MAX, "%s", arenas[k].name);
+    lines[k].value = (size_t)arenas[k].peak;
+  }
+  print_folded(ofp, "peak bytes per arena", lines, narenas);
+
+  free(lines);
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * Heap profile
+ * - With heap_profiling on, every allocation is counted against its site:
+ *   the C file and function that asked for it and, while a statement runs,
+ *   that statement's Lox line. linmem_malloc and gc_alloc pass their
+ *   caller's site down themselves, other allocations note it with
+ *   HEAP_PROFILE
+ * - Arenas (linmems by name, the gc heaps, the size class pools) report
+ *   what they hold as it changes, for their peak
+ * - heap_profile_print writes three sections: bytes per site, allocations
+ *   per site and the peak bytes of each arena. Each line is a folded stack,
+ *   "frame;frame value", sorted, so a section diffs against another run's
+ *   and goes straight to flamegraph.pl
+ */
+extern int heap_profiling;
+
+// Of the statement running on this thread, 0 outside of one
+extern _Thread_local int heap_profile_line;
+
+void heap_profile_record(const char *file, const char *func, size_t bytes);
+
+// The arena called name holds delta more bytes. Arenas with the same name
+// add up
+void heap_profile_arena(const char *name, long delta);
+
+void heap_profile_print(FILE *ofp);
+
+static inline void heap_profile_note(const char *file, const char *func,
+                                     size_t bytes) {
+  if (heap_profiling)
+    heap_profile_record(file, func, bytes);
+}
+
+#define HEAP_PROFILE(bytes) heap_profile_note(__FILE__, __func__, bytes)
@@ -1,14 +1,27 @@
 
 #include "interpreter.h"
+#include "array.h"
 #include "errors.h"
 #include "expression.h"
+#include "gc.h"
+#include "heap_profile.h"
+#include "jit.h"
+#include "map.h"
 #include "memory.h"
+#include "natives.h"
+#include "object.h"
 #include "statements.h"
 #include "token.h"
 #include "value.h"
 #include "var_env.h"
+#include <limits.h>
+#include <string.h>
+
+// What a statement returns besides 0 and -1 when a return statement ran
+#define RETURNING 1
 
 static int interpret_expr(linmem *mem, expr *e, value *i, var_env *env);
+static int interpret_body(linmem *mem, stmt_arr *s, var_env *env);
 
 static void interpret_literal(linmem *mem, literal b, value *i) {
   ASSERT(i);
@@ -30,21 +43,18 @@ static void interpret_literal(linmem *mem, literal b, value *i) {
     i->dval = b.dval;
     break;
   case LT_STRING:
-    ASSERT(b.sval);
-    i->type = V_STRING;
-    i->sval = b.sval;
+    ASSERT(b.str);
+    *i = value_from_string(b.str);
     break;
   default:
     unreachable();
   }
 }
 
-static int interpret_unary(linmem *mem, unary b, value *i, var_env *env) {
+int interpret_unary_op(token_t op, value *i) {
   ASSERT(i);
-  if (interpret_expr(mem, b.e, i, env))
-    return -1;
 
-  switch (b.op) {
+  switch (op) {
   case MINUS: {
     if (number_cast(i))
       return -1;
@@ -61,26 +71,48 @@ static int interpret_unary(linmem *mem, unary b, value *i, var_env *env) {
   }
 }
 
-static int interpret_binary(linmem *mem, binary b, value *i, var_env *env) {
-  value left;
-  value right;
+// Ropes that comparing two strings flattens, first where that can fail.
+// Equality only looks at the characters when the lengths match
+static int flatten_operands(linmem *mem, token_t op, value *left,
+                            value *right) {
+  if (!value_is_string(left->type) || !value_is_string(right->type))
+    return 0;
+  switch (op) {
+  case EQUAL_EQUAL:
+  case BANG_EQUAL:
+    if (value_len(left) != value_len(right))
+      return 0;
+    // fallthrough
+  case LESS:
+  case LESS_EQUAL:
+  case GREATER:
+  case GREATER_EQUAL:
+    return value_flatten(mem, left) || value_flatten(mem, right);
+  default:
+    return 0;
+  }
+}
 
-  if (interpret_expr(mem, b.left, &left, env))
-    return -1;
-  if (interpret_expr(mem, b.right, &right, env))
+int interpret_binary_op(linmem *mem, token_t op, value *left, value *right,
+                        value *i) {
+  ASSERT(left);
+  ASSERT(right);
+  ASSERT(i);
+
+  if (flatten_operands(mem, op, left, right))
     return -1;
 
-  switch (b.op) {
+  switch (op) {
   case EQUAL_EQUAL:
-    i->bool_val = equal_equal(&left, &right);
+    i->bool_val = equal_equal(left, right);
     i->type = V_BOOL;
     return 0;
   case BANG_EQUAL:
-    i->bool_val = !equal_equal(&left, &right);
+    i->bool_val = !equal_equal(left, right);
     i->type = V_BOOL;
     return 0;
   case LESS: {
-    int val = less(&left, &right);
+    int val = less(left, right);
     if (val < 0)
       return -1;
     i->type = V_BOOL;
@@ -88,7 +120,7 @@ static int interpret_binary(linmem *mem, binary b, value *i, var_env *env) {
     return 0;
   }
   case LESS_EQUAL: {
-    int val = greater(&left, &right);
+    int val = greater(left, right);
     if (val < 0)
       return -1;
     i->type = V_BOOL;
@@ -96,7 +128,7 @@ static int interpret_binary(linmem *mem, binary b, value *i, var_env *env) {
     return 0;
   }
   case GREATER: {
-    int val = greater(&left, &right);
+    int val = greater(left, right);
     if (val < 0)
       return -1;
     i->type = V_BOOL;
@@ -104,7 +136,7 @@ static int interpret_binary(linmem *mem, binary b, value *i, var_env *env) {
     return 0;
   }
   case GREATER_EQUAL: {
-    int val = less(&left, &right);
+    int val = less(left, right);
     if (val < 0)
       return -1;
     i->type = V_BOOL;
@@ -112,27 +144,27 @@ static int interpret_binary(linmem *mem, binary b, value *i, var_env *env) {
     return 0;
   }
   case PLUS: {
-    if (plus(mem, &left, &right))
+    if (plus(mem, left, right))
       return -1;
-    *i = left;
+    *i = *left;
     return 0;
   }
   case MINUS: {
-    if (minus(&left, &right))
+    if (minus(left, right))
       return -1;
-    *i = left;
+    *i = *left;
     return 0;
   }
   case STAR: {
-    if (star(&left, &right))
+    if (star(left, right))
       return -1;
-    *i = left;
+    *i = *left;
     return 0;
   }
   case SLASH: {
-    if (slash(&left, &right))
+    if (slash(left, right))
       return -1;
-    *i = left;
+    *i = *left;
     return 0;
   }
   default:
@@ -140,11 +172,627 @@ static int interpret_binary(linmem *mem, binary b, value *i, var_env *env) {
   }
 }
 
-static int interpret_variable(linmem *mem, char *name, value *i, var_env *env) {
-  value *ret = var_env_get(env, name);
+static int interpret_unary(linmem *mem, unary b, value *i, var_env *env) {
+  ASSERT(i);
+  if (interpret_expr(mem, b.e, i, env))
+    return -1;
+  return interpret_unary_op(b.op, i);
+}
+
+// Type feedback for the compiled tiers. Views run next to each other and
+// don't leave any
+static inline void record_types(binary *b, value *left, value *right,
+                                var_env *env) {
+  if (env->shared == NULL) {
+    b->seen_left |= 1u << left->type;
+    b->seen_right |= 1u << right->type;
+  }
+}
+
+static int interpret_binary(linmem *mem, binary *b, value *i, var_env *env) {
+  value left;
+  value right;
+
+  if (interpret_expr(mem, b->left, &left, env))
+    return -1;
+  size_t rooted = gc_push_value(mem, &left);
+  int failed = interpret_expr(mem, b->right, &right, env);
+  gc_pop(mem, rooted);
+  if (failed)
+    return -1;
+
+  record_types(b, &left, &right, env);
+  return interpret_binary_op(mem, b->op, &left, &right, i);
+}
+
+// The raw slot of the running function's kth capture: in its closure, or in
+// the frame of the function that declared it
+static value *capture_slot(var_env *env, int k) {
+  call_frame *f = var_env_frame(env);
+  if (f->cl != NULL)
+    return &f->cl->captures[k];
+
+  capture *c = &f->fn->captures[k];
+  ASSERT(c->from_local);
+  return var_env_scope_at(env, f->outer + c->level, c->idx);
+}
+
+// Where v's value lives, NULL (after an error) if it's undefined
+static value *variable_slot(var_env *env, variable *v) {
+  value *ret;
+  switch (v->kind) {
+  case VAR_GLOBAL:
+    return var_env_get_cached(env, &v->cache, v->name);
+  case VAR_LOCAL:
+    return var_env_get_local(env, v->depth, v->idx, v->name);
+  case VAR_CAPTURE:
+    ret = var_env_unbox(capture_slot(env, v->idx));
+    if (ret->type == V_UNDEF) {
+      runtime_error("Undefined variable: %s\n", v->name);
+      return NULL;
+    }
+    return ret;
+  }
+  unreachable();
+}
+
+// Whether v lives in an object, a box or a closure, rather than on the
+// stack or in a global: only references from objects are counted
+static int variable_counted(var_env *env, variable *v) {
+  switch (v->kind) {
+  case VAR_GLOBAL:
+    return 0;
+  case VAR_LOCAL:
+    return var_env_local(env, v->depth, v->idx)->type == V_BOX;
+  case VAR_CAPTURE:
+    return var_env_frame(env)->cl != NULL ||
+           capture_slot(env, v->idx)->type == V_BOX;
+  }
+  unreachable();
+}
+
+int interpret_variable_load(var_env *env, variable *v, value *dest) {
+  value *ret = variable_slot(env, v);
   if (ret == NULL)
     return -1;
-  *i = *ret;
+  *dest = *ret;
+  return 0;
+}
+
+// Strings in parts [from, from + n) of a concat, or the first thing that
+// isn't one
+typedef struct {
+  value s[CONCAT_MAX]; // V_STRING or V_SMALL
+  size_t len[CONCAT_MAX];
+  size_t total;
+  int n;
+} string_run;
+
+static void string_run_push(string_run *r, value *s) {
+  r->s[r->n] = *s;
+  r->len[r->n] = value_flat_len(s);
+  r->total += r->len[r->n++];
+}
+
+// Short results stay in the value, without allocating. -1 (after an error)
+// if a long one is over the quota
+static int string_run_join(linmem *mem, string_run *r, int from,
+                           value *dest) {
+  size_t total = r->total;
+  for (int k = 0; k < from; ++k)
+    total -= r->len[k];
+
+  char small[SMALL_MAX];
+  lox_string *ret = NULL;
+  char *head = small;
+  if (total > SMALL_MAX) {
+    if ((ret = lox_string_alloc(mem, total, r->s, r->n)) == NULL)
+      return -1;
+    head = ret->chars;
+  }
+  for (int k = from; k < r->n; ++k) {
+    memcpy(head, value_flat_chars(&r->s[k]), r->len[k]);
+    head += r->len[k];
+  }
+  if (ret == NULL)
+    *dest = value_small(small, total);
+  else
+    *dest = (value){.type = V_STRING, .str = ret};
+  return 0;
+}
+
+// A long result keeps its first string as is and ropes the rest on, so
+// s = s + a + b in a loop doesn't copy s every time
+static int string_run_finish(linmem *mem, string_run *r, value *dest) {
+  if (r->total > STRING_MAX) {
+    runtime_error("String too long\n");
+    return -1;
+  }
+  if (r->total < ROPE_MIN)
+    return string_run_join(mem, r, 0, dest);
+
+  value rest = r->s[1];
+  if (r->n > 2 && string_run_join(mem, r, 1, &rest))
+    return -1;
+  return plus(mem, dest, &rest);
+}
+
+// Operands are evaluated in order and added in order like the chain would.
+// A run of strings is joined at once instead of one copy per +
+static int concat_parts(linmem *mem, concat *c, value *dest, var_env *env) {
+  int k = 1;
+  while (k < c->nparts) {
+    value right;
+    if (!value_is_flat_string(dest->type)) {
+      if (interpret_expr(mem, c->parts[k], &right, env))
+        return -1;
+      record_types(c->ops[k - 1], dest, &right, env);
+      if (interpret_binary_op(mem, PLUS, dest, &right, dest))
+        return -1;
+      k++;
+      continue;
+    }
+
+    string_run run = {.n = 0};
+    string_run_push(&run, dest);
+    int pending = 0;
+    for (; k < c->nparts && !pending; ++k) {
+      if (interpret_expr(mem, c->parts[k], &right, env))
+        return -1;
+      record_types(c->ops[k - 1], dest, &right, env);
+      if (value_is_flat_string(right.type)) {
+        string_run_push(&run, &right);
+        gc_push(mem, &run.s[run.n - 1], 1);
+      } else {
+        pending = 1;
+      }
+    }
+
+    int ret = run.n > 1 ? string_run_finish(mem, &run, dest) : 0;
+    gc_pop(mem, run.n - 1);
+    if (ret)
+      return -1;
+    if (pending && interpret_binary_op(mem, PLUS, dest, &right, dest))
+      return -1;
+  }
+  return 0;
+}
+
+int interpret_concat(linmem *mem, concat *c, value *dest, var_env *env) {
+  if (interpret_expr(mem, c->parts[0], dest, env))
+    return -1;
+
+  size_t roots = gc_roots_save(mem);
+  gc_push(mem, dest, 1);
+  int ret = concat_parts(mem, c, dest, env);
+  gc_roots_restore(mem, roots);
+  return ret;
+}
+
+static int interpret_variable(linmem *mem, variable *v, value *i,
+                              var_env *env) {
+  return interpret_variable_load(env, v, i);
+}
+
+// Assigning never defines, the variable must already be
+static int interpret_assign(linmem *mem, assign *a, value *i, var_env *env) {
+  if (interpret_expr(mem, a->value, i, env))
+    return -1;
+
+  // A view's globals are a copy, assigning one would be lost
+  if (a->target.kind == VAR_GLOBAL && env->shared != NULL) {
+    runtime_error("Cannot assign global %s in a parallel callback\n",
+                  a->target.name);
+    return -1;
+  }
+
+  value *slot = variable_slot(env, &a->target);
+  if (slot == NULL)
+    return -1;
+  if (gc_refcounting && variable_counted(env, &a->target)) {
+    gc_store(mem, slot, *i);
+    return 0;
+  }
+  gc_barrier(mem, slot);
+  *slot = *i;
+  return 0;
+}
+
+// Runs fn (with its closure cl, if it has one) on c's arguments. A method
+// gets receiver as its local 0
+static int interpret_invoke(linmem *mem, call *c, function *fn, closure *cl,
+                            value *receiver, value *i, var_env *env) {
+  ASSERT(!fn->is_method || receiver != NULL);
+
+  if (c->nargs != fn->arity) {
+    runtime_error("%s expected %d arguments but got %d\n", fn->name,
+                  fn->arity, c->nargs);
+    return -1;
+  }
+
+  if (var_env_call(env, fn, cl, fn->nlocals))
+    return -1;
+
+  // Arguments are evaluated straight into the callee's frame, hidden from
+  // the caller's scopes and call_frame while they are
+  size_t frame = env->scopes[--env->nscopes];
+  call_frame callee_frame = env->frames[--env->nframes];
+  int first = 0;
+  if (fn->is_method)
+    ((value *)stackmem_at(&env->stack, frame))[first++] = *receiver;
+
+  int ret = 0;
+  for (int a = 0; a < c->nargs && ret == 0; ++a) {
+    value *arg = &((value *)stackmem_at(&env->stack, frame))[first + a];
+    ret = interpret_expr(mem, c->args[a], arg, env);
+  }
+  env->frames[env->nframes++] = callee_frame;
+  env->scopes[env->nscopes++] = frame;
+
+  if (ret == 0 && interpret_body(mem, &fn->body, env) < 0)
+    ret = -1;
+
+  *i = var_env_return(env);
+  if (fn->is_init)
+    *i = *receiver;
+  return ret;
+}
+
+// Calling a class makes an instance and runs its initializer on it
+static int interpret_call_value(linmem *mem, call *c, value *callee,
+                                value *receiver, value *i, var_env *env) {
+  switch (callee->type) {
+  case V_FUNCTION:
+    return interpret_invoke(mem, c, callee->fn, NULL, receiver, i, env);
+  case V_CLOSURE:
+    return interpret_invoke(mem, c, callee->cl->fn, callee->cl, receiver, i,
+                            env);
+  case V_BOUND:
+    return interpret_call_value(mem, c, &callee->bd->method,
+                                &callee->bd->receiver, i, env);
+  case V_NATIVE: {
+    native *nt = callee->nt;
+    if (native_check_arity(nt, c->nargs))
+      return -1;
+    // Rooted until call_rooted returns
+    value args[NATIVE_ARGS_MAX];
+    for (int a = 0; a < c->nargs; ++a) {
+      if (interpret_expr(mem, c->args[a], &args[a], env))
+        return -1;
+      gc_push(mem, &args[a], 1);
+    }
+    for (int a = c->nargs; a < nt->arity; ++a)
+      args[a] = (value){.type = V_NIL};
+    return nt->fn(mem, args, i, env);
+  }
+  case V_CLASS: {
+    klass *k = callee->k;
+    value self = {.type = V_INSTANCE,
+                  .in = instance_create(mem, k, NULL, 0)};
+    if (k->init != NULL)
+      return interpret_call_value(mem, c, &k->init->fn, &self, i, env);
+    if (c->nargs != 0) {
+      runtime_error("%s expected 0 arguments but got %d\n", k->name,
+                    c->nargs);
+      return -1;
+    }
+    *i = self;
+    return 0;
+  }
+  default:
+    runtime_error("Can only call functions and classes\n");
+    return -1;
+  }
+}
+
+int interpret_callable(value *callee, int nargs) {
+  function *fn = NULL;
+  switch (callee->type) {
+  case V_FUNCTION:
+    fn = callee->fn;
+    break;
+  case V_CLOSURE:
+    fn = callee->cl->fn;
+    break;
+  case V_BOUND:
+    return interpret_callable(&callee->bd->method, nargs);
+  case V_NATIVE:
+    return native_check_arity(callee->nt, nargs);
+  case V_CLASS:
+    if (callee->k->init != NULL)
+      return interpret_callable(&callee->k->init->fn, nargs);
+    if (nargs != 0) {
+      runtime_error("%s expected 0 arguments but got %d\n", callee->k->name,
+                    nargs);
+      return -1;
+    }
+    return 0;
+  default:
+    runtime_error("Can only call functions and classes\n");
+    return -1;
+  }
+
+  if (nargs != fn->arity) {
+    runtime_error("%s expected %d arguments but got %d\n", fn->name,
+                  fn->arity, nargs);
+    return -1;
+  }
+  return 0;
+}
+
+// Like interpret_invoke, on argument values instead of expressions
+static int interpret_invoke_values(linmem *mem, value *method,
+                                   value *receiver, value *args, int nargs,
+                                   value *i, var_env *env) {
+  closure *cl = method->type == V_CLOSURE ? method->cl : NULL;
+  function *fn = cl != NULL ? cl->fn : method->fn;
+  ASSERT(!fn->is_method || receiver != NULL);
+
+  if (nargs != fn->arity) {
+    runtime_error("%s expected %d arguments but got %d\n", fn->name,
+                  fn->arity, nargs);
+    return -1;
+  }
+  if (var_env_call(env, fn, cl, fn->nlocals))
+    return -1;
+
+  value *frame = var_env_local(env, 0, 0);
+  int first = 0;
+  if (fn->is_method)
+    frame[first++] = *receiver;
+  memcpy(&frame[first], args, nargs * sizeof *args);
+
+  int ret = interpret_body(mem, &fn->body, env) < 0 ? -1 : 0;
+  *i = var_env_return(env);
+  if (fn->is_init)
+    *i = *receiver;
+  return ret;
+}
+
+int interpret_call_values(linmem *mem, value *callee, value *args, int nargs,
+                          value *i, var_env *env) {
+  switch (callee->type) {
+  case V_FUNCTION:
+  case V_CLOSURE:
+    return interpret_invoke_values(mem, callee, NULL, args, nargs, i, env);
+  case V_BOUND:
+    return interpret_invoke_values(mem, &callee->bd->method,
+                                   &callee->bd->receiver, args, nargs, i,
+                                   env);
+  case V_NATIVE: {
+    native *nt = callee->nt;
+    if (native_check_arity(nt, nargs))
+      return -1;
+    if (nargs == nt->arity)
+      return nt->fn(mem, args, i, env);
+    value all[NATIVE_ARGS_MAX];
+    for (int a = 0; a < nt->arity; ++a)
+      all[a] = a < nargs ? args[a] : (value){.type = V_NIL};
+    return nt->fn(mem, all, i, env);
+  }
+  case V_CLASS: {
+    klass *k = callee->k;
+    value self = {.type = V_INSTANCE,
+                  .in = instance_create(mem, k, args, nargs)};
+    if (k->init != NULL)
+      return interpret_invoke_values(mem, &k->init->fn, &self, args, nargs, i,
+                                     env);
+    if (nargs != 0) {
+      runtime_error("%s expected 0 arguments but got %d\n", k->name, nargs);
+      return -1;
+    }
+    *i = self;
+    return 0;
+  }
+  default:
+    runtime_error("Can only call functions and classes\n");
+    return -1;
+  }
+}
+
+// Views run on several threads at once, their property sites don't cache
+static inline prop_cache *site_cache(prop_cache *c, var_env *env) {
+  return env->shared == NULL ? c : NULL;
+}
+
+// The instance obj evaluates to, NULL (after an error) if it isn't one
+static instance *interpret_instance(linmem *mem, expr *obj, value *dest,
+                                    var_env *env, const char *what) {
+  if (interpret_expr(mem, obj, dest, env))
+    return NULL;
+  if (dest->type != V_INSTANCE) {
+    runtime_error("Only instances have %s\n", what);
+    return NULL;
+  }
+  return dest->in;
+}
+
+// interpret_call_value, with callee and receiver (if any) rooted while the
+// arguments are evaluated. So are a native's arguments while it runs
+static int call_rooted(linmem *mem, call *c, value *callee, value *receiver,
+                       value *i, var_env *env) {
+  size_t roots = gc_roots_save(mem);
+  gc_push(mem, callee, 1);
+  if (receiver != NULL)
+    gc_push(mem, receiver, 1);
+  int ret = interpret_call_value(mem, c, callee, receiver, i, env);
+  gc_roots_restore(mem, roots);
+  return ret;
+}
+
+// obj.name(...) goes straight to the method, without binding it
+static int interpret_call(linmem *mem, call *c, value *i, var_env *env) {
+  value callee;
+
+  if (c->callee->type == ET_GET) {
+    get *g = &c->callee->get;
+    value receiver;
+    instance *in = interpret_instance(mem, g->obj, &receiver, env,
+                                      "properties");
+    if (in == NULL)
+      return -1;
+
+    prop_entry scratch;
+    prop_entry *e =
+        object_get(site_cache(g->cache, env), in, g->name, &scratch);
+    if (e == NULL) {
+      runtime_error("Undefined property: %s\n", g->name);
+      return -1;
+    }
+    if (e->slot < 0)
+      return call_rooted(mem, c, &e->m->fn, &receiver, i, env);
+    callee = in->fields[e->slot];
+  } else if (interpret_expr(mem, c->callee, &callee, env)) {
+    return -1;
+  }
+
+  // Plain functions first, they're by far the most common, and hold nothing
+  // to root
+  if (callee.type == V_FUNCTION)
+    return interpret_invoke(mem, c, callee.fn, NULL, NULL, i, env);
+  return call_rooted(mem, c, &callee, NULL, i, env);
+}
+
+static int interpret_get(linmem *mem, get *g, value *i, var_env *env) {
+  value receiver;
+  instance *in = interpret_instance(mem, g->obj, &receiver, env, "properties");
+  if (in == NULL)
+    return -1;
+
+  prop_entry scratch;
+  prop_entry *e =
+      object_get(site_cache(g->cache, env), in, g->name, &scratch);
+  if (e == NULL) {
+    runtime_error("Undefined property: %s\n", g->name);
+    return -1;
+  }
+  if (e->slot >= 0) {
+    *i = in->fields[e->slot];
+    return 0;
+  }
+
+  bound *bd = linmem_malloc(mem, sizeof *bd);
+  *bd = (bound){.receiver = receiver, .method = e->m->fn};
+  gc_retain(mem, &bd->receiver);
+  *i = (value){.type = V_BOUND, .bd = bd};
+  return 0;
+}
+
+static int interpret_set(linmem *mem, set *st, value *i, var_env *env) {
+  value receiver;
+  instance *in = interpret_instance(mem, st->obj, &receiver, env, "fields");
+  if (in == NULL)
+    return -1;
+  gc_push(mem, &receiver, 1);
+  int failed = interpret_expr(mem, st->value, i, env);
+  gc_pop(mem, 1);
+  if (failed)
+    return -1;
+  // Unless the callback made it, the instance may be another thread's too
+  if (env->shared != NULL && !linmem_made_here(mem, in->section)) {
+    runtime_error("Cannot set field %s in a parallel callback\n", st->name);
+    return -1;
+  }
+  object_set(mem, site_cache(st->cache, env), in, st->name, *i);
+  return 0;
+}
+
+static int interpret_array(linmem *mem, array_lit *l, value *i,
+                           var_env *env) {
+  *i = (value){.type = V_ARRAY, .arr = array_create(mem, l->nelems)};
+  gc_push(mem, i, 1);
+  int ret = 0;
+  for (int k = 0; k < l->nelems && ret == 0; ++k) {
+    value v;
+    ret = interpret_expr(mem, l->elems[k], &v, env);
+    if (ret == 0)
+      array_store(mem, i->arr, k, v);
+  }
+  gc_pop(mem, 1);
+  return ret;
+}
+
+// obj and index, -1 (after an error) unless obj is an array or a map
+static int interpret_indexed(linmem *mem, expr *obj, expr *index,
+                             value *dest, value *key, var_env *env) {
+  if (interpret_expr(mem, obj, dest, env))
+    return -1;
+  if (dest->type != V_ARRAY && dest->type != V_MAP) {
+    runtime_error("Only arrays and maps can be indexed\n");
+    return -1;
+  }
+  gc_push(mem, dest, 1);
+  int ret = interpret_expr(mem, index, key, env);
+  gc_pop(mem, 1);
+  // Maps key ropes by their flat
+  if (ret == 0 && dest->type == V_MAP)
+    ret = value_flatten(mem, key);
+  return ret;
+}
+
+// A key that isn't in the map reads as nil
+static int interpret_index(linmem *mem, index_get *g, value *i,
+                           var_env *env) {
+  value obj, index;
+  if (interpret_indexed(mem, g->obj, g->index, &obj, &index, env))
+    return -1;
+  if (obj.type == V_ARRAY)
+    return array_get(obj.arr, &index, i);
+
+  value *v = map_get(obj.mp, &index);
+  *i = v == NULL ? (value){.type = V_NIL} : *v;
+  return 0;
+}
+
+// Callbacks may store numbers into distinct elements of a numeric array.
+// Anything that reshapes an array or a map isn't safe next to other threads,
+// unless the callback made it
+static int parallel_store_ok(linmem *mem, value *obj, value *v) {
+  size_t section = obj->type == V_MAP ? obj->mp->section : obj->arr->section;
+  if (linmem_made_here(mem, section))
+    return 1;
+  if (obj->type == V_MAP) {
+    runtime_error("Cannot change a map in a parallel callback\n");
+    return 0;
+  }
+  if (obj->arr->nums != NULL && v->type != V_NUMBER) {
+    runtime_error("Cannot store a non number into a numeric array in a "
+                  "parallel callback\n");
+    return 0;
+  }
+  return 1;
+}
+
+static int interpret_index_set(linmem *mem, index_set *st, value *i,
+                               var_env *env) {
+  value obj, index;
+  if (interpret_indexed(mem, st->obj, st->index, &obj, &index, env))
+    return -1;
+  gc_push(mem, &obj, 1);
+  gc_push(mem, &index, 1);
+  int failed = interpret_expr(mem, st->value, i, env);
+  gc_pop(mem, 2);
+  if (failed)
+    return -1;
+  if (env->shared != NULL && !parallel_store_ok(mem, &obj, i))
+    return -1;
+  if (obj.type == V_ARRAY)
+    return array_set(mem, obj.arr, &index, *i);
+
+  // The collector needs to see what's overwritten, and what a new entry
+  // holds: the key may be a flattened copy
+  if (!gc_marking(mem) && !gc_refcounting) {
+    map_set(obj.mp, &index, *i);
+    return 0;
+  }
+  value *old = map_get(obj.mp, &index);
+  if (old != NULL) {
+    gc_store(mem, old, *i);
+    return 0;
+  }
+  map_entry *e = map_set(obj.mp, &index, *i);
+  gc_retain(mem, &e->key);
+  gc_retain(mem, &e->val);
   return 0;
 }
 
@@ -158,44 +806,253 @@ static int interpret_expr(linmem *mem, expr *e, value *i, var_env *env) {
   case ET_UNARY:
     return interpret_unary(mem, e->u, i, env);
   case ET_BINARY:
-    return interpret_binary(mem, e->b, i, env);
+    return interpret_binary(mem, &e->b, i, env);
   case ET_GROUPING:
     return interpret_expr(mem, e->g, i, env);
   case ET_VARIABLE:
-    return interpret_variable(mem, e->v, i, env);
+    return interpret_variable(mem, &e->v, i, env);
+  case ET_CALL:
+    return interpret_call(mem, &e->c, i, env);
+  case ET_ASSIGN:
+    return interpret_assign(mem, &e->a, i, env);
+  case ET_CONCAT:
+    return interpret_concat(mem, &e->cat, i, env);
+  case ET_GET:
+    return interpret_get(mem, &e->get, i, env);
+  case ET_SET:
+    return interpret_set(mem, &e->set, i, env);
+  case ET_ARRAY:
+    return interpret_array(mem, &e->arr, i, env);
+  case ET_INDEX:
+    return interpret_index(mem, &e->idx, i, env);
+  case ET_INDEX_SET:
+    return interpret_index_set(mem, &e->iset, i, env);
   default:
     unreachable();
   }
 }
 
+// Evaluates the statement's expression, compiling it once it is hot. Views
+// only ever walk the tree
+static int interpret_stmt_expr(linmem *mem, stmt *s, value *i, var_env *env) {
+  ASSERT(s->e);
+
+  // Compiled code assumes it owns the globals and the caches
+  if (env->shared != NULL)
+    return interpret_expr(mem, s->e, i, env);
+
+  if (s->hits < UINT_MAX)
+    s->hits++;
+
+  if (jit_enabled() && s->jit == NULL && !s->jit_failed &&
+      s->hits >= jit_threshold()) {
+    s->jit = jit_compile(s->e);
+    s->jit_failed = s->jit == NULL;
+  }
+
+  if (s->jit) {
+    gc_safepoint(mem);
+    return s->jit(mem, env, i);
+  }
+  return interpret_expr(mem, s->e, i, env);
+}
+
+int interpret_stmt_value(linmem *mem, stmt *s, value *dest, var_env *env) {
+  ASSERT(s);
+  ASSERT(dest);
+  if (s->type == ST_FUN) {
+    *dest = (value){.type = V_FUNCTION, .fn = s->fn};
+    return 0;
+  }
+  if (s->e == NULL) {
+    dest->type = V_NIL;
+    return 0;
+  }
+  if (interpret_stmt_expr(mem, s, dest, env))
+    return -1;
+  // Whoever prints it can't fail
+  return s->type == ST_PRNT ? value_flatten(mem, dest) : 0;
+}
+
 static inline int interpret_expr_stmt(linmem *mem, stmt *s, var_env *env) {
   ASSERT(s);
   ASSERT(mem);
   value i;
-  return interpret_expr(mem, s->e, &i, env);
+  return interpret_stmt_expr(mem, s, &i, env);
 }
 
 static inline int interpret_print_stmt(linmem *mem, stmt *s, var_env *env) {
   ASSERT(s);
   ASSERT(mem);
   value i;
-  if (interpret_expr(mem, s->e, &i, env))
+  if (interpret_stmt_expr(mem, s, &i, env) || value_flatten(mem, &i))
     return -1;
   value_println(stdout, i);
   return 0;
 }
 
+// Declarations and function declarations both bind a name to a value
+static inline void interpret_bind(linmem *mem, stmt *s, value i,
+                                  var_env *env) {
+  if (s->local_idx >= 0) {
+    value *slot = var_env_local(env, 0, s->local_idx);
+    gc_barrier(mem, slot);
+    *slot = i;
+  } else {
+    size_t slot = var_env_cached_slot(env, &s->ident_cache, s->ident_name);
+    gc_barrier(mem, &env->slots[slot]);
+    env->slots[slot] = i;
+  }
+}
+
 static inline int interpret_decl_stmt(linmem *mem, stmt *s, var_env *env) {
   ASSERT(s);
   ASSERT(mem);
-  value i;
-  if (interpret_expr(mem, s->e, &i, env))
+  value i = {.type = V_NIL};
+  if (s->e != NULL && interpret_stmt_expr(mem, s, &i, env))
+    return -1;
+  interpret_bind(mem, s, i, env);
+  return 0;
+}
+
+static value interpret_function(linmem *mem, function *fn) {
+  if (function_on_stack(fn))
+    return (value){.type = V_FUNCTION, .fn = fn};
+
+  closure *cl = linmem_malloc(mem, sizeof *cl + fn->ncaptures * sizeof(value));
+  cl->fn = fn;
+  return (value){.type = V_CLOSURE, .cl = cl};
+}
+
+// Captures are copied in, unless they're assigned after being captured:
+// then the variable moves into a box its closures share
+static void interpret_capture(linmem *mem, value f, var_env *env) {
+  if (f.type != V_CLOSURE)
+    return;
+
+  closure *cl = f.cl;
+  function *fn = cl->fn;
+  for (int k = 0; k < fn->ncaptures; ++k) {
+    capture *c = &fn->captures[k];
+    value *slot = c->from_local ? var_env_scope_at(env,
+                                                   var_env_base(env) + c->level,
+                                                   c->idx)
+                                : capture_slot(env, c->parent);
+    if (*c->boxed && slot->type != V_BOX) {
+      box *bx = linmem_malloc(mem, sizeof *bx);
+      bx->v = *slot;
+      gc_retain(mem, &bx->v);
+      *slot = (value){.type = V_BOX, .bx = bx};
+    }
+    cl->captures[k] = *slot;
+    gc_retain(mem, &cl->captures[k]);
+  }
+}
+
+// Bound before capturing, so a closure can capture itself
+static inline int interpret_fun_stmt(linmem *mem, stmt *s, var_env *env) {
+  ASSERT(s);
+  ASSERT(s->fn);
+  value f = interpret_function(mem, s->fn);
+  interpret_bind(mem, s, f, env);
+  interpret_capture(mem, f, env);
+  return 0;
+}
+
+// Bound before its methods capture, so they can refer to the class
+static inline int interpret_class_stmt(linmem *mem, stmt *s, var_env *env) {
+  ASSERT(s);
+  klass *k = klass_create(mem, s->ident_name, (int)s->body.len);
+  interpret_bind(mem, s, (value){.type = V_CLASS, .k = k}, env);
+
+  for (size_t m = 0; m < s->body.len; ++m) {
+    function *fn = s->body.stmts[m].fn;
+    k->methods[m] = (method){.name = fn->name,
+                             .fn = interpret_function(mem, fn)};
+    interpret_capture(mem, k->methods[m].fn, env);
+  }
+  k->init = klass_find_method(k, "init");
+  return 0;
+}
+
+static inline int interpret_block_stmt(linmem *mem, stmt *s, var_env *env) {
+  ASSERT(s);
+  if (var_env_enter(env, s->nlocals))
+    return -1;
+  int ret = interpret_body(mem, &s->body, env);
+  var_env_leave(env);
+  return ret;
+}
+
+static inline int interpret_if_stmt(linmem *mem, stmt *s, var_env *env) {
+  ASSERT(s);
+  value cond;
+  if (interpret_stmt_expr(mem, s, &cond, env))
     return -1;
-  var_env_define(env, s->ident_name, i);
+  bool_cast(&cond);
+
+  if (cond.bool_val)
+    return interpret_stmt(mem, s->then_s, env);
+  if (s->else_s != NULL)
+    return interpret_stmt(mem, s->else_s, env);
   return 0;
 }
 
-static inline int interpret_stmt(linmem *mem, stmt *s, var_env *env) {
+// Stops at a runtime error even at the top level, it would only repeat
+static inline int interpret_while_stmt(linmem *mem, stmt *s, var_env *env) {
+  ASSERT(s);
+  for (;;) {
+    value cond;
+    if (interpret_stmt_expr(mem, s, &cond, env))
+      return -1;
+    bool_cast(&cond);
+    if (!cond.bool_val)
+      return 0;
+
+    int ret = interpret_stmt(mem, s->then_s, env);
+    if (ret == 0 && s->else_s != NULL)
+      ret = interpret_stmt(mem, s->else_s, env);
+    if (ret != 0)
+      return ret;
+  }
+}
+
+static inline int interpret_return_stmt(linmem *mem, stmt *s, var_env *env) {
+  ASSERT(s);
+  value i = {.type = V_NIL};
+  if (s->e != NULL && interpret_stmt_expr(mem, s, &i, env))
+    return -1;
+  var_env_frame(env)->ret = i;
+  return RETURNING;
+}
+
+// With the quota spent: fails unless a full collection makes room
+static int interpret_over_quota(linmem *mem) {
+  if (mem->gc != NULL && mem->gc->paused == 0) {
+    gc_collect(mem->gc, NULL, 0);
+    if (mem_quota_fits(mem->quota, 0))
+      return 0;
+  }
+  runtime_error("Out of memory: over the quota of %zu bytes\n",
+                mem->quota->limit);
+  return -1;
+}
+
+// What s allocates goes on its line in a heap profile: runs it again with
+// the line set
+static int interpret_stmt_profiled(linmem *mem, stmt *s, var_env *env) {
+  int outer = heap_profile_line;
+  heap_profile_line = s->pos.line;
+  int ret = interpret_stmt(mem, s, env);
+  heap_profile_line = outer;
+  return ret;
+}
+
+int interpret_stmt(linmem *mem, stmt *s, var_env *env) {
+  if (!mem_quota_fits(mem->quota, 0) && interpret_over_quota(mem))
+    return -1;
+  if (heap_profiling && heap_profile_line != s->pos.line)
+    return interpret_stmt_profiled(mem, s, env);
   switch (s->type) {
   case ST_EXPR:
     return interpret_expr_stmt(mem, s, env);
@@ -203,16 +1060,39 @@ static inline int interpret_stmt(linmem *mem, stmt *s, var_env *env) {
     return interpret_print_stmt(mem, s, env);
   case ST_DECL:
     return interpret_decl_stmt(mem, s, env);
+  case ST_BLOCK:
+    return interpret_block_stmt(mem, s, env);
+  case ST_FUN:
+    return interpret_fun_stmt(mem, s, env);
+  case ST_CLASS:
+    return interpret_class_stmt(mem, s, env);
+  case ST_WHILE:
+    return interpret_while_stmt(mem, s, env);
+  case ST_IF:
+    return interpret_if_stmt(mem, s, env);
+  case ST_RETURN:
+    return interpret_return_stmt(mem, s, env);
   }
+  unreachable();
 }
 
-int interpret_stmts(linmem *mem, stmt_arr *s, var_env *env) {
-  stmt_arr_ASSERT(s);
-  ASSERT(mem);
+// Inside a call a runtime error unwinds the whole call. At the top level the
+// next statement still runs
+static int interpret_body(linmem *mem, stmt_arr *s, var_env *env) {
   int ret = 0;
-  for (int i = 0; i < s->len; ++i) {
-    if (interpret_stmt(mem, &s->stmts[i], env))
+  for (size_t i = 0; i < s->len; ++i) {
+    int r = interpret_stmt(mem, &s->stmts[i], env);
+    if (r == RETURNING || (r < 0 && env->nframes > 0))
+      return r;
+    if (r < 0)
       ret = -1;
   }
   return ret;
 }
+
+int interpret_stmts(linmem *mem, stmt_arr *s, var_env *env) {
+  stmt_arr_ASSERT(s);
+  ASSERT(mem);
+  gc_bind(mem, env);
+  return interpret_body(mem, s, env);
+}
@@ -5,3 +5,29 @@
 #include "var_env.h"
 
 int interpret_stmts(linmem *mem, stmt_arr *s, var_env *env);
+
+int interpret_stmt(linmem *mem, stmt *s, var_env *env);
+
+// Evaluates a statement's expression (nil for a bare declaration) without
+// performing its print / declaration
+int interpret_stmt_value(linmem *mem, stmt *s, value *dest, var_env *env);
+
+// Calls a function, closure, bound method, native or class on nargs values
+int interpret_call_values(linmem *mem, value *callee, value *args, int nargs,
+                          value *i, var_env *env);
+
+// The errors a call reports before its arguments are evaluated: a callee
+// that can't be called, or doesn't take nargs
+int interpret_callable(value *callee, int nargs);
+
+// Reads a local, captured or global variable: -1 if it's undefined
+int interpret_variable_load(var_env *env, variable *v, value *dest);
+
+// Evaluates a fused + chain, for the JIT too
+int interpret_concat(linmem *mem, concat *c, value *dest, var_env *env);
+
+// Operator semantics shared by the tree walker and the compiled tiers
+int interpret_unary_op(token_t op, value *i);
+
+int interpret_binary_op(linmem *mem, token_t op, value *left, value *right,
+                        value *dest);
@@ -0,0 +1,1506 @@
+#include "ir.h"
+#include "errors.h"
+#include "facades.h"
+#include "gc.h"
+#include "interpreter.h"
+#include "value_hashtable.h"
+#include "vector.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define INITIAL_CAP 64
+
+#define NO_OPERAND ((size_t)-1)
+
+static ir_prog ir_prog_create() {
+  ir_prog ret;
+  ret.instrs = malloc_or_abort(INITIAL_CAP * sizeof *ret.instrs);
+  ret.len = 0;
+  ret.cap = INITIAL_CAP;
+  ret.nlocals = 0;
+  return ret;
+}
+
+void ir_free(ir_prog *p) {
+  ir_prog_ASSERT(p);
+  free(p->instrs);
+  p->instrs = NULL;
+  p->len = 0;
+  p->cap = 0;
+}
+
+VECTOR_FUNCTIONS(ir_prog, ir_instr, instrs, vector_grow_double);
+
+static inline int ir_has_a(ir_op op) {
+  switch (op) {
+  case IR_CONST:
+  case IR_LOAD:
+  case IR_LOAD_LOCAL:
+  case IR_CLEAR_LOCAL:
+  case IR_JUMP:
+  case IR_NOP:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+static inline int ir_has_b(ir_op op) {
+  return op == IR_ADD_NUM || op == IR_SUB_NUM || op == IR_MUL_NUM ||
+         op == IR_DIV_NUM || op == IR_BINARY;
+}
+
+static inline int ir_has_target(ir_op op) {
+  return op == IR_BRANCH || op == IR_JUMP || op == IR_EXIT_FAILED;
+}
+
+static inline int ir_is_store(ir_op op) {
+  return op == IR_STORE || op == IR_ASSIGN || op == IR_STORE_LOCAL ||
+         op == IR_ASSIGN_LOCAL || op == IR_CLEAR_LOCAL;
+}
+
+static inline int ir_is_local(ir_op op) {
+  return op == IR_LOAD_LOCAL || op == IR_STORE_LOCAL ||
+         op == IR_ASSIGN_LOCAL || op == IR_CLEAR_LOCAL;
+}
+
+///////////////////////////////////////
+////////////// Section Lowering
+
+// Where an open block's locals start in the program's flat array of them
+typedef struct lower_scope_s {
+  int base;
+  struct lower_scope_s *outer;
+} lower_scope;
+
+typedef struct {
+  ir_prog *p;
+  size_t stmt;   // Top level statement
+  size_t unit;   // Innermost statement
+  size_t nunits; // Statements so far
+  lower_scope *scope;
+  int nlocals; // Of the open blocks
+} lowering;
+
+static size_t ir_push(lowering *l, ir_op op, size_t a, size_t b) {
+  ir_prog *p = l->p;
+  ir_prog_ASSERT(p);
+  ir_prog_make_available(p, p->len + 1);
+  p->instrs[p->len] = (ir_instr){
+      .op = op,
+      .type = IRT_ANY,
+      .a = a,
+      .b = b,
+      .target = NO_OPERAND,
+      .stmt = l->stmt,
+      .unit = l->unit,
+      .end = NO_OPERAND,
+  };
+  return p->len++;
+}
+
+static value literal_value(literal l) {
+  switch (l.type) {
+  case LT_NUMBER:
+    return (value){.type = V_NUMBER, .dval = l.dval};
+  case LT_STRING:
+    return value_from_string(l.str);
+  case LT_TRUE:
+    return (value){.type = V_BOOL, .bool_val = 1};
+  case LT_FALSE:
+    return (value){.type = V_BOOL, .bool_val = 0};
+  case LT_NIL:
+    return (value){.type = V_NIL};
+  default:
+    unreachable();
+  }
+}
+
+static size_t ir_const(lowering *l, value k) {
+  size_t ret = ir_push(l, IR_CONST, NO_OPERAND, NO_OPERAND);
+  l->p->instrs[ret].k = k;
+  return ret;
+}
+
+static size_t ir_named(lowering *l, ir_op op, char *name, size_t a) {
+  size_t ret = ir_push(l, op, a, NO_OPERAND);
+  l->p->instrs[ret].name = name;
+  return ret;
+}
+
+static size_t ir_local(lowering *l, ir_op op, char *name, int local,
+                       size_t a) {
+  size_t ret = ir_named(l, op, name, a);
+  l->p->instrs[ret].local = local;
+  return ret;
+}
+
+static int local_slot(lowering *l, int depth, int idx) {
+  lower_scope *s = l->scope;
+  for (; depth > 0; --depth)
+    s = s->outer;
+  ASSERT(s);
+  return s->base + idx;
+}
+
+static size_t lower_expr(lowering *l, expr *e) {
+  ASSERT(e);
+
+  switch (e->type) {
+  case ET_LITERAL:
+    return ir_const(l, literal_value(e->l));
+  case ET_VARIABLE:
+    if (e->v.kind == VAR_LOCAL)
+      return ir_local(l, IR_LOAD_LOCAL, e->v.name,
+                      local_slot(l, e->v.depth, e->v.idx), NO_OPERAND);
+    if (!variable_is_global(&e->v))
+      return NO_OPERAND;
+    return ir_named(l, IR_LOAD, e->v.name, NO_OPERAND);
+  case ET_ASSIGN: {
+    variable *t = &e->a.target;
+    if (t->kind == VAR_CAPTURE)
+      return NO_OPERAND;
+    size_t v = lower_expr(l, e->a.value);
+    if (v == NO_OPERAND)
+      return NO_OPERAND;
+    if (t->kind == VAR_LOCAL)
+      ir_local(l, IR_ASSIGN_LOCAL, t->name, local_slot(l, t->depth, t->idx),
+               v);
+    else
+      ir_named(l, IR_ASSIGN, t->name, v);
+    return v;
+  }
+  case ET_GROUPING:
+    return lower_expr(l, e->g);
+  case ET_CONCAT:
+    return lower_expr(l, e->cat.chain);
+  case ET_UNARY: {
+    size_t a = lower_expr(l, e->u.e);
+    if (a == NO_OPERAND)
+      return NO_OPERAND;
+    if (e->u.op == MINUS)
+      return ir_push(l, IR_NEG, ir_push(l, IR_GUARD_NUM, a, NO_OPERAND),
+                     NO_OPERAND);
+    return ir_push(l, IR_NOT, ir_push(l, IR_GUARD_BOOL, a, NO_OPERAND),
+                   NO_OPERAND);
+  }
+  case ET_BINARY: {
+    size_t a = lower_expr(l, e->b.left);
+    if (a == NO_OPERAND)
+      return NO_OPERAND;
+    size_t b = lower_expr(l, e->b.right);
+    if (b == NO_OPERAND)
+      return NO_OPERAND;
+
+    ir_op op;
+    switch (e->b.op) {
+    case MINUS:
+      op = IR_SUB_NUM;
+      break;
+    case STAR:
+      op = IR_MUL_NUM;
+      break;
+    case SLASH:
+      op = IR_DIV_NUM;
+      break;
+    default: {
+      size_t ret = ir_push(l, IR_BINARY, a, b);
+      l->p->instrs[ret].bop = e->b.op;
+      return ret;
+    }
+    }
+
+    // Both operands are evaluated before either is cast
+    size_t ga = ir_push(l, IR_GUARD_NUM, a, NO_OPERAND);
+    size_t gb = ir_push(l, IR_GUARD_NUM, b, NO_OPERAND);
+    return ir_push(l, op, ga, gb);
+  }
+  default:
+    return NO_OPERAND;
+  }
+}
+
+// A failure in [from, to) skips to where the program is now
+static void ir_skip_to_here(lowering *l, size_t from, size_t to) {
+  for (size_t i = from; i < to; ++i)
+    l->p->instrs[i].end = l->p->len;
+}
+
+// A condition, cast like the tree walker casts it
+static size_t lower_cond(lowering *l, stmt *st) {
+  size_t v = lower_expr(l, st->e);
+  if (v == NO_OPERAND)
+    return NO_OPERAND;
+  return ir_push(l, IR_BRANCH, ir_push(l, IR_GUARD_BOOL, v, NO_OPERAND),
+                 NO_OPERAND);
+}
+
+static int lower_stmt(lowering *l, stmt *st);
+
+static int lower_block(lowering *l, stmt *st) {
+  lower_scope scope = {.base = l->nlocals, .outer = l->scope};
+  l->scope = &scope;
+  l->nlocals += st->nlocals;
+  if (l->nlocals > l->p->nlocals)
+    l->p->nlocals = l->nlocals;
+
+  int ret = 0;
+  for (size_t i = 0; i < st->body.len && ret == 0; ++i)
+    ret = lower_stmt(l, &st->body.stmts[i]);
+
+  l->scope = scope.outer;
+  l->nlocals = scope.base;
+  return ret;
+}
+
+static int lower_if(lowering *l, stmt *st) {
+  size_t from = l->p->len;
+  size_t branch = lower_cond(l, st);
+  if (branch == NO_OPERAND)
+    return -1;
+  size_t cond_end = l->p->len;
+
+  if (lower_stmt(l, st->then_s))
+    return -1;
+  if (st->else_s != NULL) {
+    size_t jump = ir_push(l, IR_JUMP, NO_OPERAND, NO_OPERAND);
+    l->p->instrs[branch].target = l->p->len;
+    if (lower_stmt(l, st->else_s))
+      return -1;
+    l->p->instrs[jump].target = l->p->len;
+  } else {
+    l->p->instrs[branch].target = l->p->len;
+  }
+
+  ir_skip_to_here(l, from, cond_end);
+  return 0;
+}
+
+// The condition, the body, then the increment of a for loop. A failed
+// condition or increment ends the loop, a failed body skips the increment
+static int lower_while(lowering *l, stmt *st) {
+  size_t from = l->p->len;
+  size_t branch = lower_cond(l, st);
+  if (branch == NO_OPERAND)
+    return -1;
+  size_t cond_end = l->p->len;
+
+  if (lower_stmt(l, st->then_s))
+    return -1;
+
+  size_t exit_failed = ir_push(l, IR_EXIT_FAILED, branch, NO_OPERAND);
+  size_t inc_from = l->p->len;
+  if (st->else_s != NULL && lower_stmt(l, st->else_s))
+    return -1;
+  size_t inc_end = l->p->len;
+
+  size_t back = ir_push(l, IR_JUMP, NO_OPERAND, NO_OPERAND);
+  l->p->instrs[back].target = from;
+  l->p->instrs[branch].target = l->p->len;
+  l->p->instrs[exit_failed].target = l->p->len;
+
+  ir_skip_to_here(l, from, cond_end);
+  ir_skip_to_here(l, inc_from, inc_end);
+  return 0;
+}
+
+static int lower_stmt(lowering *l, stmt *st) {
+  l->unit = l->nunits++;
+
+  switch (st->type) {
+  case ST_BLOCK:
+    return lower_block(l, st);
+  case ST_IF:
+    return lower_if(l, st);
+  case ST_WHILE:
+    return lower_while(l, st);
+  case ST_EXPR:
+  case ST_PRNT:
+  case ST_DECL:
+    break;
+  default:
+    return -1;
+  }
+
+  size_t from = l->p->len;
+  // A local is undefined until its declaration is done, and again if it
+  // fails. Entering the block again, it's declared again
+  int local = st->type == ST_DECL && st->local_idx >= 0;
+  if (local)
+    ir_local(l, IR_CLEAR_LOCAL, st->ident_name,
+             local_slot(l, 0, st->local_idx), NO_OPERAND);
+
+  size_t v = st->e ? lower_expr(l, st->e) : ir_const(l, (value){.type = V_NIL});
+  if (v == NO_OPERAND)
+    return -1;
+
+  if (st->type == ST_PRNT)
+    ir_push(l, IR_PRINT, v, NO_OPERAND);
+  else if (local)
+    ir_local(l, IR_STORE_LOCAL, st->ident_name,
+             local_slot(l, 0, st->local_idx), v);
+  else if (st->type == ST_DECL)
+    ir_named(l, IR_STORE, st->ident_name, v);
+
+  ir_skip_to_here(l, from, l->p->len);
+  return 0;
+}
+
+int ir_lower(ir_prog *dest, stmt_arr *s) {
+  ASSERT(dest);
+  stmt_arr_ASSERT(s);
+
+  ir_prog p = ir_prog_create();
+  lowering l = {.p = &p};
+
+  for (size_t i = 0; i < s->len; ++i) {
+    l.stmt = i;
+    if (lower_stmt(&l, &s->stmts[i])) {
+      ir_free(&p);
+      return -1;
+    }
+  }
+
+  *dest = p;
+  return 0;
+}
+
+///////////////////////////////////////
+////////////// Section Analysis
+
+static ir_type value_ir_type(value v) {
+  switch (v.type) {
+  case V_NUMBER:
+    return IRT_NUMBER;
+  case V_BOOL:
+    return IRT_BOOL;
+  case V_STRING:
+  case V_SMALL:
+    return IRT_STRING;
+  case V_NIL:
+    return IRT_NIL;
+  default:
+    unreachable();
+  }
+}
+
+// number_cast can't fail on these
+static inline int numeric(ir_type t) { return t == IRT_NUMBER || t == IRT_BOOL; }
+
+static inline ir_type type_a(ir_prog *p, ir_instr *in) {
+  return p->instrs[in->a].type;
+}
+
+static inline ir_type type_b(ir_prog *p, ir_instr *in) {
+  return p->instrs[in->b].type;
+}
+
+static int ir_may_fail(ir_prog *p, ir_instr *in) {
+  switch (in->op) {
+  case IR_LOAD:
+    return !in->speculative;
+  case IR_LOAD_LOCAL:
+  case IR_ASSIGN_LOCAL:
+    return !in->defined;
+  case IR_ASSIGN:
+  case IR_CHECK:
+    return 1;
+  case IR_GUARD_NUM:
+    return !numeric(type_a(p, in));
+  case IR_BINARY: {
+    ir_type ta = type_a(p, in);
+    ir_type tb = type_b(p, in);
+    switch (in->bop) {
+    case EQUAL_EQUAL:
+    case BANG_EQUAL:
+      return 0;
+    default:
+      return !(ta == IRT_STRING && tb == IRT_STRING) &&
+             !(numeric(ta) && numeric(tb));
+    }
+  }
+  default:
+    return 0;
+  }
+}
+
+// Anything observable besides failing
+static int ir_has_effect(ir_prog *p, ir_instr *in) {
+  switch (in->op) {
+  case IR_STORE:
+  case IR_ASSIGN:
+  case IR_STORE_LOCAL:
+  case IR_ASSIGN_LOCAL:
+  case IR_CLEAR_LOCAL:
+  case IR_PRINT:
+  case IR_BRANCH:
+  case IR_JUMP:
+  case IR_EXIT_FAILED:
+    return 1;
+  case IR_BINARY: {
+    if (in->bop != EQUAL_EQUAL && in->bop != BANG_EQUAL)
+      return 0;
+    // equal_equal reports a failed number_cast of the right side
+    ir_type ta = type_a(p, in);
+    return (ta == IRT_ANY || ta == IRT_NUMBER) && !numeric(type_b(p, in));
+  }
+  default:
+    return 0;
+  }
+}
+
+static ir_type ir_result_type(ir_prog *p, ir_instr *in) {
+  switch (in->op) {
+  case IR_CONST:
+    return value_ir_type(in->k);
+  case IR_LOAD:
+  case IR_LOAD_LOCAL:
+  case IR_CHECK:
+    return IRT_ANY;
+  case IR_GUARD_NUM:
+  case IR_NEG:
+  case IR_ADD_NUM:
+  case IR_SUB_NUM:
+  case IR_MUL_NUM:
+  case IR_DIV_NUM:
+    return IRT_NUMBER;
+  case IR_GUARD_BOOL:
+  case IR_NOT:
+    return IRT_BOOL;
+  case IR_BINARY: {
+    if (in->bop != PLUS)
+      return IRT_BOOL;
+    ir_type ta = type_a(p, in);
+    ir_type tb = type_b(p, in);
+    if (ta == IRT_STRING && tb == IRT_STRING)
+      return IRT_STRING;
+    if (numeric(ta) && numeric(tb))
+      return IRT_NUMBER;
+    return IRT_ANY;
+  }
+  default:
+    return IRT_NONE;
+  }
+}
+
+///////////////////////////////////////
+////////////// Section Value numbering
+
+static int value_same(value *a, value *b) {
+  if (a->type != b->type)
+    return 0;
+  switch (a->type) {
+  case V_NUMBER: // Bitwise, so 0 and -0 stay apart
+    return memcmp(&a->dval, &b->dval, sizeof a->dval) == 0;
+  case V_STRING:
+    return lox_string_equal(a->str, b->str);
+  case V_SMALL:
+    return a->small_len == b->small_len &&
+           memcmp(value_small_chars(a), value_small_chars(b), a->small_len) == 0;
+  case V_BOOL:
+    return a->bool_val == b->bool_val;
+  case V_NIL:
+    return 1;
+  default:
+    unreachable();
+  }
+}
+
+static int ir_same(ir_instr *x, ir_instr *y) {
+  if (x->op != y->op || x->a != y->a || x->b != y->b)
+    return 0;
+  switch (x->op) {
+  case IR_CONST:
+    return value_same(&x->k, &y->k);
+  case IR_LOAD:
+    return strcmp(x->name, y->name) == 0 && x->speculative == y->speculative;
+  case IR_LOAD_LOCAL:
+    return x->local == y->local;
+  case IR_BINARY:
+    return x->bop == y->bop;
+  default:
+    return 1;
+  }
+}
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+  const uint8_t *d = data;
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ d[i]) * 1099511628211ULL;
+  return h;
+}
+
+static uint64_t ir_hash(ir_instr *in) {
+  uint64_t h = 14695981039346656037ULL;
+  h = hash_bytes(h, &in->op, sizeof in->op);
+  h = hash_bytes(h, &in->a, sizeof in->a);
+  h = hash_bytes(h, &in->b, sizeof in->b);
+
+  switch (in->op) {
+  case IR_CONST:
+    h = hash_bytes(h, &in->k.type, sizeof in->k.type);
+    if (in->k.type == V_STRING) {
+      uint32_t s = lox_string_hash(in->k.str);
+      h = hash_bytes(h, &s, sizeof s);
+    } else if (in->k.type == V_SMALL)
+      h = hash_bytes(h, value_small_chars(&in->k), in->k.small_len);
+    else if (in->k.type == V_NUMBER)
+      h = hash_bytes(h, &in->k.dval, sizeof in->k.dval);
+    else if (in->k.type == V_BOOL)
+      h = hash_bytes(h, &in->k.bool_val, sizeof in->k.bool_val);
+    break;
+  case IR_LOAD:
+    h = hash_bytes(h, in->name, strlen(in->name));
+    break;
+  case IR_LOAD_LOCAL:
+    h = hash_bytes(h, &in->local, sizeof in->local);
+    break;
+  case IR_BINARY:
+    h = hash_bytes(h, &in->bop, sizeof in->bop);
+    break;
+  default:
+    break;
+  }
+  return h;
+}
+
+/**
+ * Open addressed set of instruction indices
+ * - Holds the most recent instruction for every expression
+ */
+typedef struct {
+  size_t *slots;
+  size_t mask;
+} gvn_table;
+
+static gvn_table gvn_create(size_t n) {
+  size_t cap = 16;
+  while (cap < 2 * n)
+    cap *= 2;
+  gvn_table ret = {.slots = malloc_or_abort(cap * sizeof *ret.slots),
+                   .mask = cap - 1};
+  for (size_t i = 0; i < cap; ++i)
+    ret.slots[i] = NO_OPERAND;
+  return ret;
+}
+
+// Returns the slot holding an equal instruction, or the empty slot for it
+static size_t *gvn_find(gvn_table *t, ir_prog *p, ir_instr *in) {
+  size_t i = ir_hash(in) & t->mask;
+  while (t->slots[i] != NO_OPERAND && !ir_same(&p->instrs[t->slots[i]], in))
+    i = (i + 1) & t->mask;
+  return &t->slots[i];
+}
+
+static inline int gvn_candidate(ir_prog *p, ir_instr *in) {
+  return in->op != IR_NOP && !ir_has_effect(p, in);
+}
+
+///////////////////////////////////////
+////////////// Section Simplification
+
+static void make_const(ir_instr *in, value k) {
+  in->op = IR_CONST;
+  in->k = k;
+  in->a = NO_OPERAND;
+  in->b = NO_OPERAND;
+}
+
+// Rewrites in place. Returns an earlier instruction to use instead, or i
+static size_t ir_simplify(ir_prog *p, size_t i) {
+  ir_instr *in = &p->instrs[i];
+  ir_instr *a = ir_has_a(in->op) ? &p->instrs[in->a] : NULL;
+  ir_instr *b = ir_has_b(in->op) ? &p->instrs[in->b] : NULL;
+
+  switch (in->op) {
+  case IR_GUARD_NUM:
+    if (a->type == IRT_NUMBER)
+      return in->a;
+    if (a->op == IR_CONST && a->type == IRT_BOOL) {
+      value k = a->k;
+      number_cast(&k);
+      make_const(in, k);
+    }
+    return i;
+  case IR_GUARD_BOOL:
+    if (a->type == IRT_BOOL)
+      return in->a;
+    if (a->op == IR_CONST) {
+      value k = a->k;
+      bool_cast(&k);
+      make_const(in, k);
+    }
+    return i;
+  case IR_NEG:
+    if (a->op == IR_CONST) {
+      value k = a->k;
+      minus_number(&k);
+      make_const(in, k);
+    }
+    return i;
+  case IR_NOT:
+    if (a->op == IR_CONST) {
+      value k = a->k;
+      bang_bool(&k);
+      make_const(in, k);
+    }
+    return i;
+  case IR_ADD_NUM:
+  case IR_SUB_NUM:
+  case IR_MUL_NUM:
+  case IR_DIV_NUM:
+    if (a->op == IR_CONST && b->op == IR_CONST) {
+      value k = a->k;
+      value r = b->k;
+      if (in->op == IR_ADD_NUM)
+        k.dval += r.dval;
+      else if (in->op == IR_SUB_NUM)
+        minus(&k, &r);
+      else if (in->op == IR_MUL_NUM)
+        star(&k, &r);
+      else
+        slash(&k, &r);
+      make_const(in, k);
+    }
+    return i;
+  case IR_BINARY:
+    if (in->bop == PLUS && a->type == IRT_NUMBER && b->type == IRT_NUMBER) {
+      in->op = IR_ADD_NUM;
+      return ir_simplify(p, i);
+    }
+    // Fold everything that neither allocates nor reports anything
+    if (a->op == IR_CONST && b->op == IR_CONST && !ir_may_fail(p, in) &&
+        !ir_has_effect(p, in) && ir_result_type(p, in) != IRT_STRING) {
+      value l = a->k;
+      value r = b->k;
+      value k;
+      if (interpret_binary_op(NULL, in->bop, &l, &r, &k) == 0)
+        make_const(in, k);
+    }
+    return i;
+  default:
+    return i;
+  }
+}
+
+static void ir_rewrite_operands(ir_instr *in, size_t *alias) {
+  if (ir_has_a(in->op))
+    in->a = alias[in->a];
+  if (ir_has_b(in->op))
+    in->b = alias[in->b];
+}
+
+/**
+ * State of the forward pass
+ * - A region is an if's branch or a loop's body. What the value numbering
+ *   table learned inside one is undone at its end, and the variables stored
+ *   inside are no longer known
+ * - Loads are only numbered within a statement, and not across a store
+ */
+typedef struct {
+  size_t end;
+  size_t undo;   // Length of the undo log when it started
+  size_t stores; // Of the store log
+} fwd_region;
+
+typedef struct {
+  ir_prog *p;
+  gvn_table gvn;
+  size_t *undo_slot;
+  size_t *undo_old;
+  size_t nundo;
+  size_t *stores; // Store instructions so far
+  size_t nstores;
+  fwd_region *regions;
+  size_t nregions;
+  // Global name -> instruction known to hold its current value, or -1
+  value_hashtable known;
+  size_t *known_local; // NO_OPERAND if unknown
+  char *defined_local; // Since its declaration surely ran
+  size_t *clear_at;    // The local's last IR_CLEAR_LOCAL
+} forward;
+
+static forward forward_create(ir_prog *p) {
+  forward ret = {
+      .p = p,
+      .gvn = gvn_create(p->len),
+      .undo_slot = malloc_or_abort(p->len * sizeof(size_t)),
+      .undo_old = malloc_or_abort(p->len * sizeof(size_t)),
+      .stores = malloc_or_abort(p->len * sizeof(size_t)),
+      .regions = malloc_or_abort(p->len * sizeof(fwd_region)),
+      .known = vhtbl_create(),
+      .known_local = malloc_or_abort((p->nlocals + 1) * sizeof(size_t)),
+      .defined_local = calloc(p->nlocals + 1, 1),
+      .clear_at = malloc_or_abort((p->nlocals + 1) * sizeof(size_t)),
+  };
+  abort_if(ret.defined_local == NULL, "calloc");
+  for (int k = 0; k < p->nlocals; ++k) {
+    ret.known_local[k] = NO_OPERAND;
+    ret.clear_at[k] = NO_OPERAND;
+  }
+  return ret;
+}
+
+static void forward_free(forward *f) {
+  vhtbl_free(&f->known);
+  free(f->clear_at);
+  free(f->defined_local);
+  free(f->known_local);
+  free(f->regions);
+  free(f->stores);
+  free(f->undo_old);
+  free(f->undo_slot);
+  free(f->gvn.slots);
+}
+
+static void gvn_set(forward *f, size_t *slot, size_t i) {
+  f->undo_slot[f->nundo] = (size_t)(slot - f->gvn.slots);
+  f->undo_old[f->nundo++] = *slot;
+  *slot = i;
+}
+
+// What the store instruction in wrote to is known to hold src now
+static void known_set(forward *f, ir_instr *in, size_t src) {
+  if (in->op == IR_NOP)
+    return;
+  if (ir_is_local(in->op)) {
+    f->known_local[in->local] = src;
+    return;
+  }
+  double at = src == NO_OPERAND ? -1 : (double)src;
+  vhtbl_insert(&f->known, in->name, (value){.type = V_NUMBER, .dval = at});
+}
+
+static void region_push(forward *f, size_t end) {
+  f->regions[f->nregions++] =
+      (fwd_region){.end = end, .undo = f->nundo, .stores = f->nstores};
+}
+
+static void region_pop(forward *f) {
+  fwd_region *r = &f->regions[--f->nregions];
+  while (f->nundo > r->undo) {
+    f->nundo--;
+    f->gvn.slots[f->undo_slot[f->nundo]] = f->undo_old[f->nundo];
+  }
+  for (size_t k = r->stores; k < f->nstores; ++k)
+    known_set(f, &f->p->instrs[f->stores[k]], NO_OPERAND);
+}
+
+// Where the loop starting at each instruction jumps back, or NO_OPERAND
+static size_t *ir_loop_ends(ir_prog *p) {
+  size_t *ret = malloc_or_abort(p->len * sizeof *ret);
+  for (size_t i = 0; i < p->len; ++i)
+    ret[i] = NO_OPERAND;
+  for (size_t i = 0; i < p->len; ++i)
+    if (p->instrs[i].op == IR_JUMP && p->instrs[i].target <= i)
+      ret[p->instrs[i].target] = i;
+  return ret;
+}
+
+// Forward pass: guard elimination, folding, value numbering, forwarding
+static void ir_forward(ir_prog *p) {
+  size_t *alias = malloc_or_abort(p->len * sizeof *alias);
+  size_t *loop_end = ir_loop_ends(p);
+  forward f = forward_create(p);
+
+  size_t unit = NO_OPERAND;
+  int unit_may_fail = 0;
+  size_t loads_from = 0; // Loads before a store aren't reused
+
+  for (size_t i = 0; i < p->len; ++i) {
+    ir_instr *in = &p->instrs[i];
+    alias[i] = i;
+
+    while (f.nregions > 0 && f.regions[f.nregions - 1].end <= i)
+      region_pop(&f);
+    // Coming back around, a loop's variables hold what it stored last
+    if (loop_end[i] != NO_OPERAND)
+      for (size_t k = i; k <= loop_end[i]; ++k)
+        if (ir_is_store(p->instrs[k].op))
+          known_set(&f, &p->instrs[k], NO_OPERAND);
+
+    if (in->op == IR_NOP)
+      continue;
+
+    if (in->unit != unit) {
+      unit = in->unit;
+      unit_may_fail = 0;
+    }
+
+    ir_rewrite_operands(in, alias);
+
+    size_t repl = ir_simplify(p, i);
+
+    if (repl == i && in->op == IR_LOAD) {
+      value *v = vhtbl_get(&f.known, in->name);
+      if (v != NULL && v->dval >= 0)
+        repl = (size_t)v->dval;
+    }
+    if (repl == i && in->op == IR_LOAD_LOCAL &&
+        f.known_local[in->local] != NO_OPERAND)
+      repl = f.known_local[in->local];
+
+    if (repl == i) {
+      in->type = ir_result_type(p, in);
+    }
+
+    if (repl == i && gvn_candidate(p, in)) {
+      size_t *slot = gvn_find(&f.gvn, p, in);
+      // Only reuse what must have run: same statement or never fails
+      if (*slot != NO_OPERAND &&
+          ((p->instrs[*slot].unit == unit && *slot >= loads_from) ||
+           p->instrs[*slot].safe))
+        repl = *slot;
+      else
+        gvn_set(&f, slot, i);
+    }
+
+    if (repl != i) {
+      alias[i] = repl;
+      in->op = IR_NOP;
+      continue;
+    }
+
+    if (in->op == IR_LOAD_LOCAL || in->op == IR_ASSIGN_LOCAL)
+      in->defined = f.defined_local[in->local];
+
+    int fails = ir_may_fail(p, in);
+    unit_may_fail |= fails;
+    // A local load's value depends on when it runs
+    in->safe =
+        !fails && !ir_has_effect(p, in) && in->op != IR_LOAD_LOCAL;
+    if (ir_has_a(in->op))
+      in->safe &= p->instrs[in->a].safe;
+    if (ir_has_b(in->op))
+      in->safe &= p->instrs[in->b].safe;
+
+    // Forwarded only if the store surely ran
+    if (ir_is_store(in->op)) {
+      f.stores[f.nstores++] = i;
+      loads_from = i + 1;
+      int ran = !unit_may_fail && in->op != IR_CLEAR_LOCAL;
+      known_set(&f, in,
+                ran && p->instrs[in->a].safe ? in->a : NO_OPERAND);
+    }
+
+    // A declaration that can't fail doesn't need its local cleared first
+    if (in->op == IR_CLEAR_LOCAL) {
+      f.defined_local[in->local] = 0;
+      f.clear_at[in->local] = i;
+    }
+    if (in->op == IR_STORE_LOCAL && !unit_may_fail) {
+      f.defined_local[in->local] = 1;
+      size_t clear = f.clear_at[in->local];
+      if (clear != NO_OPERAND && p->instrs[clear].unit == unit)
+        p->instrs[clear].op = IR_NOP;
+    }
+
+    // An if's else branch starts where its then branch ends
+    if (ir_has_target(in->op) && in->target > i) {
+      if (in->op == IR_JUMP)
+        region_pop(&f);
+      region_push(&f, in->target);
+    }
+  }
+
+  forward_free(&f);
+  free(loop_end);
+  free(alias);
+}
+
+///////////////////////////////////////
+////////////// Section Loop invariant code motion
+
+/**
+ * Hoisting
+ * - What a loop computes the same way every time goes right before it, in
+ *   the order it was in. Inner loops go first, so what they hoist can leave
+ *   the loops around them too
+ * - Anything that can't fail or have an effect, and only depends on what
+ *   the loop doesn't change, can go. So can what may fail at the start of
+ *   the condition: it would fail the same way the first time through
+ * - A global the loop doesn't store is loaded once before it, without
+ *   failing, and checked where it was loaded
+ * - Instructions are placed first and reordered at the end: an
+ *   instruction's key is where it goes and whether it was moved there
+ */
+typedef struct {
+  size_t place; // The instruction it goes right before, or its own index
+  int stays;    // 0 if moved, so it goes before what's already at place
+  size_t orig;  // Where it was, or the check of a speculative load
+  size_t idx;
+} licm_key;
+
+static int licm_key_cmp(const void *x, const void *y) {
+  const licm_key *a = x;
+  const licm_key *b = y;
+  if (a->place != b->place)
+    return a->place < b->place ? -1 : 1;
+  if (a->stays != b->stays)
+    return a->stays - b->stays;
+  return a->orig < b->orig ? -1 : a->orig > b->orig;
+}
+
+typedef struct {
+  ir_prog *p;
+  licm_key *keys; // By instruction index, one per instruction
+  size_t len;
+  size_t cap;
+} licm;
+
+#define licm_ASSERT(m)                                                         \
+  ASSERT(m);                                                                   \
+  ASSERT((m)->len <= (m)->cap)
+
+VECTOR_FUNCTIONS(licm, licm_key, keys, vector_grow_double);
+
+// Whether the loop [from, to] writes what the load in reads
+static int loop_stores(ir_prog *p, size_t from, size_t to, ir_instr *in) {
+  for (size_t k = from; k <= to; ++k) {
+    ir_instr *s = &p->instrs[k];
+    if (in->op == IR_LOAD_LOCAL && ir_is_local(s->op) &&
+        ir_is_store(s->op) && s->local == in->local)
+      return 1;
+    if (in->op == IR_LOAD && (s->op == IR_STORE || s->op == IR_ASSIGN) &&
+        strcmp(s->name, in->name) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Already before the loop starting at from, or hoisted out of it
+static inline int licm_outside(licm *m, size_t i, size_t from) {
+  return m->keys[i].place < from ||
+         (m->keys[i].place == from && !m->keys[i].stays);
+}
+
+static int licm_invariant(licm *m, size_t from, size_t to, ir_instr *in) {
+  if (ir_has_a(in->op) && !licm_outside(m, in->a, from))
+    return 0;
+  if (ir_has_b(in->op) && !licm_outside(m, in->b, from))
+    return 0;
+  if (in->op == IR_LOAD || in->op == IR_LOAD_LOCAL)
+    return !loop_stores(m->p, from, to, in);
+  return 1;
+}
+
+static inline void licm_move(licm *m, size_t i, size_t from) {
+  m->keys[i].place = from;
+  m->keys[i].stays = 0;
+}
+
+// The load at i stays as a check of a speculative one before the loop,
+// which the loop's other loads of the name share. Those start at len
+static void licm_speculate(licm *m, size_t i, size_t from, size_t len) {
+  ir_prog *p = m->p;
+  for (size_t k = len; k < p->len; ++k) {
+    if (m->keys[k].place == from &&
+        strcmp(p->instrs[k].name, p->instrs[i].name) == 0) {
+      p->instrs[i].op = IR_CHECK;
+      p->instrs[i].a = k;
+      return;
+    }
+  }
+
+  ir_prog_make_available(p, p->len + 1);
+  licm_make_available(m, m->len + 1);
+
+  size_t spec = p->len++;
+  m->len++;
+  p->instrs[spec] = p->instrs[i];
+  p->instrs[spec].speculative = 1;
+  p->instrs[spec].safe = 0;
+  m->keys[spec] = (licm_key){.place = from, .stays = 0, .orig = i,
+                             .idx = spec};
+
+  ir_instr *in = &p->instrs[i];
+  in->op = IR_CHECK;
+  in->a = spec;
+}
+
+static void licm_loop(licm *m, size_t from, size_t to, size_t len) {
+  ir_prog *p = m->p;
+  size_t branch = from;
+  while (p->instrs[branch].op != IR_BRANCH)
+    branch++;
+
+  // Nothing that may fail or has an effect stays before it
+  int prefix = 1;
+
+  for (size_t i = from; i <= to; ++i) {
+    ir_instr *in = &p->instrs[i];
+    if (in->op == IR_NOP || licm_outside(m, i, from))
+      continue;
+
+    int fails = ir_may_fail(p, in);
+    int effect = ir_has_effect(p, in);
+    int invariant = !effect && licm_invariant(m, from, to, in);
+
+    if (invariant && (!fails || (prefix && i < branch))) {
+      licm_move(m, i, from);
+      continue;
+    }
+    if (invariant && in->op == IR_LOAD)
+      licm_speculate(m, i, from, len);
+    if (fails || effect)
+      prefix = 0;
+  }
+
+  // Speculative loads an inner loop made can leave this one too
+  for (size_t i = len; i < p->len; ++i) {
+    licm_key *k = &m->keys[i];
+    if (k->place > from && k->place <= to &&
+        !loop_stores(p, from, to, &p->instrs[i]))
+      licm_move(m, i, from);
+  }
+}
+
+// Where an instruction that was before old index q is now. A jump back to
+// a loop skips what was hoisted in front of it
+static size_t licm_remap(licm_key *sorted, size_t n, size_t q, int stays) {
+  licm_key bound = {.place = q, .stays = stays, .orig = 0};
+  size_t lo = 0;
+  size_t hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (licm_key_cmp(&sorted[mid], &bound) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void licm_reorder(licm *m, size_t len) {
+  ir_prog *p = m->p;
+  size_t n = p->len;
+
+  licm_key *sorted = malloc_or_abort(n * sizeof *sorted);
+  memcpy(sorted, m->keys, n * sizeof *sorted);
+  qsort(sorted, n, sizeof *sorted, licm_key_cmp);
+
+  size_t *new_of = malloc_or_abort(n * sizeof *new_of);
+  for (size_t k = 0; k < n; ++k)
+    new_of[sorted[k].idx] = k;
+
+  ir_instr *instrs = malloc_or_abort(p->cap * sizeof *instrs);
+  for (size_t k = 0; k < n; ++k) {
+    size_t i = sorted[k].idx;
+    ir_instr in = p->instrs[i];
+    if (ir_has_a(in.op))
+      in.a = new_of[in.a];
+    if (ir_has_b(in.op))
+      in.b = new_of[in.b];
+    if (ir_has_target(in.op))
+      in.target = licm_remap(sorted, n, in.target,
+                             in.op == IR_JUMP && in.target <= i);
+    if (in.end != NO_OPERAND)
+      in.end = in.end < len ? licm_remap(sorted, n, in.end, 0) : n;
+    instrs[k] = in;
+  }
+
+  free(p->instrs);
+  p->instrs = instrs;
+  free(new_of);
+  free(sorted);
+}
+
+static int loop_span_cmp(const void *x, const void *y) {
+  const size_t *a = x;
+  const size_t *b = y;
+  size_t sa = a[1] - a[0];
+  size_t sb = b[1] - b[0];
+  return sa < sb ? -1 : sa > sb;
+}
+
+static void ir_licm(ir_prog *p) {
+  size_t len = p->len;
+  size_t *loops = malloc_or_abort(2 * len * sizeof *loops);
+  size_t nloops = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (p->instrs[i].op == IR_JUMP && p->instrs[i].target <= i) {
+      loops[2 * nloops] = p->instrs[i].target;
+      loops[2 * nloops++ + 1] = i;
+    }
+  }
+  if (nloops == 0) {
+    free(loops);
+    return;
+  }
+
+  licm m = {.p = p};
+  licm_reserve(&m, len);
+  m.len = len;
+  for (size_t i = 0; i < len; ++i)
+    m.keys[i] = (licm_key){.place = i, .stays = 1, .orig = i, .idx = i};
+
+  // Innermost first
+  qsort(loops, nloops, 2 * sizeof *loops, loop_span_cmp);
+  for (size_t l = 0; l < nloops; ++l)
+    licm_loop(&m, loops[2 * l], loops[2 * l + 1], len);
+
+  int moved = p->len > len;
+  for (size_t i = 0; i < len && !moved; ++i)
+    moved = !m.keys[i].stays;
+  if (moved)
+    licm_reorder(&m, len);
+
+  free(m.keys);
+  free(loops);
+}
+
+// Backward pass: drop whatever nothing observable depends on
+static void ir_dce(ir_prog *p) {
+  char *live = calloc(p->len, 1);
+  abort_if(live == NULL, "calloc");
+
+  for (size_t i = p->len; i-- > 0;) {
+    ir_instr *in = &p->instrs[i];
+    if (in->op == IR_NOP)
+      continue;
+
+    if (!live[i] && !ir_may_fail(p, in) && !ir_has_effect(p, in)) {
+      in->op = IR_NOP;
+      continue;
+    }
+
+    if (ir_has_a(in->op))
+      live[in->a] = 1;
+    if (ir_has_b(in->op))
+      live[in->b] = 1;
+  }
+
+  free(live);
+}
+
+void ir_optimize(ir_prog *p) {
+  ir_prog_ASSERT(p);
+  if (p->len == 0)
+    return;
+  ir_forward(p);
+  ir_licm(p);
+  ir_dce(p);
+}
+
+///////////////////////////////////////
+////////////// Section Dump
+
+static const char *ir_op_name(ir_op op) {
+  switch (op) {
+  case IR_CONST:
+    return "const";
+  case IR_LOAD:
+    return "load";
+  case IR_STORE:
+    return "store";
+  case IR_ASSIGN:
+    return "assign";
+  case IR_LOAD_LOCAL:
+    return "load.local";
+  case IR_STORE_LOCAL:
+    return "store.local";
+  case IR_ASSIGN_LOCAL:
+    return "assign.local";
+  case IR_CLEAR_LOCAL:
+    return "clear.local";
+  case IR_CHECK:
+    return "check";
+  case IR_GUARD_NUM:
+    return "guard.num";
+  case IR_GUARD_BOOL:
+    return "guard.bool";
+  case IR_NEG:
+    return "neg";
+  case IR_NOT:
+    return "not";
+  case IR_ADD_NUM:
+    return "add.num";
+  case IR_SUB_NUM:
+    return "sub.num";
+  case IR_MUL_NUM:
+    return "mul.num";
+  case IR_DIV_NUM:
+    return "div.num";
+  case IR_BINARY:
+    return "binary";
+  case IR_PRINT:
+    return "print";
+  case IR_BRANCH:
+    return "branch";
+  case IR_JUMP:
+    return "jump";
+  case IR_EXIT_FAILED:
+    return "exit.failed";
+  case IR_NOP:
+    return "nop";
+  }
+  return NULL;
+}
+
+static const char *ir_type_name(ir_type t) {
+  switch (t) {
+  case IRT_ANY:
+    return "any";
+  case IRT_NUMBER:
+    return "number";
+  case IRT_BOOL:
+    return "bool";
+  case IRT_STRING:
+    return "string";
+  case IRT_NIL:
+    return "nil";
+  case IRT_NONE:
+    return "none";
+  }
+  return NULL;
+}
+
+static void ir_dump_const(FILE *ofp, value k) {
+  switch (k.type) {
+  case V_NUMBER:
+    fprintf(ofp, " %g", k.dval);
+    break;
+  case V_STRING:
+  case V_SMALL: {
+    size_t len;
+    char *chars = value_chars(&k, &len);
+    fprintf(ofp, " \"%.*s\"", (int)len, chars);
+    break;
+  }
+  case V_BOOL:
+    fprintf(ofp, " %s", k.bool_val ? "true" : "false");
+    break;
+  case V_NIL:
+    fprintf(ofp, " nil");
+    break;
+  }
+}
+
+void ir_dump(FILE *ofp, ir_prog *p) {
+  ASSERT(ofp);
+  ir_prog_ASSERT(p);
+
+  size_t stmt = NO_OPERAND;
+
+  for (size_t i = 0; i < p->len; ++i) {
+    ir_instr *in = &p->instrs[i];
+    if (in->op == IR_NOP)
+      continue;
+
+    if (in->stmt != stmt) {
+      stmt = in->stmt;
+      fprintf(ofp, "; stmt %zu\n", stmt);
+    }
+
+    int defines = ir_result_type(p, in) != IRT_NONE;
+    if (defines)
+      fprintf(ofp, "  %%%zu = %s", i, ir_op_name(in->op));
+    else
+      fprintf(ofp, "  %s", ir_op_name(in->op));
+    if (in->op == IR_LOAD && in->speculative)
+      fprintf(ofp, ".spec");
+
+    if (in->op == IR_BINARY)
+      fprintf(ofp, " %s", tttostr(in->bop));
+    if (in->op == IR_CONST)
+      ir_dump_const(ofp, in->k);
+    if (ir_is_local(in->op))
+      fprintf(ofp, " %s#%d", in->name, in->local);
+    else if (in->name)
+      fprintf(ofp, " %s", in->name);
+    if (in->name && ir_is_store(in->op) && ir_has_a(in->op))
+      fprintf(ofp, ",");
+    if (ir_has_a(in->op))
+      fprintf(ofp, " %%%zu", in->a);
+    if (ir_has_b(in->op))
+      fprintf(ofp, ", %%%zu", in->b);
+    if (ir_has_target(in->op))
+      fprintf(ofp, " -> %zu", in->target);
+
+    if (defines)
+      fprintf(ofp, " : %s", ir_type_name(in->type));
+    fprintf(ofp, "\n");
+  }
+}
+
+///////////////////////////////////////
+////////////// Section Execution
+
+// Stores overwrite what a marking collector may not have seen yet
+static void ir_exec_store(linmem *mem, value *slot, value v) {
+  gc_barrier(mem, slot);
+  *slot = v;
+}
+
+// Everything but control flow
+static int ir_exec_instr(linmem *mem, ir_prog *p, value *vals, value *locals,
+                         size_t i, var_env *env) {
+  ir_instr *in = &p->instrs[i];
+  value *dest = &vals[i];
+
+  switch (in->op) {
+  case IR_CONST:
+    *dest = in->k;
+    return 0;
+  case IR_LOAD: {
+    if (in->speculative) {
+      size_t slot = var_env_cached_slot(env, &in->cache, in->name);
+      *dest = env->slots[slot];
+      return 0;
+    }
+    value *v = var_env_get_cached(env, &in->cache, in->name);
+    if (v == NULL)
+      return -1;
+    *dest = *v;
+    return 0;
+  }
+  case IR_STORE: {
+    size_t slot = var_env_cached_slot(env, &in->cache, in->name);
+    ir_exec_store(mem, &env->slots[slot], vals[in->a]);
+    return 0;
+  }
+  case IR_ASSIGN: {
+    value *v = var_env_get_cached(env, &in->cache, in->name);
+    if (v == NULL)
+      return -1;
+    ir_exec_store(mem, v, vals[in->a]);
+    return 0;
+  }
+  case IR_LOAD_LOCAL:
+  case IR_ASSIGN_LOCAL:
+    if (locals[in->local].type == V_UNDEF) {
+      runtime_error("Undefined variable: %s\n", in->name);
+      return -1;
+    }
+    if (in->op == IR_LOAD_LOCAL)
+      *dest = locals[in->local];
+    else
+      ir_exec_store(mem, &locals[in->local], vals[in->a]);
+    return 0;
+  case IR_STORE_LOCAL:
+    ir_exec_store(mem, &locals[in->local], vals[in->a]);
+    return 0;
+  case IR_CLEAR_LOCAL:
+    ir_exec_store(mem, &locals[in->local], (value){.type = V_UNDEF});
+    return 0;
+  case IR_CHECK:
+    if (vals[in->a].type == V_UNDEF) {
+      runtime_error("Undefined variable: %s\n", p->instrs[in->a].name);
+      return -1;
+    }
+    *dest = vals[in->a];
+    return 0;
+  case IR_GUARD_NUM:
+    *dest = vals[in->a];
+    return number_cast(dest);
+  case IR_GUARD_BOOL:
+    *dest = vals[in->a];
+    bool_cast(dest);
+    return 0;
+  case IR_NEG:
+    *dest = vals[in->a];
+    minus_number(dest);
+    return 0;
+  case IR_NOT:
+    *dest = vals[in->a];
+    bang_bool(dest);
+    return 0;
+  case IR_ADD_NUM:
+    *dest = (value){.type = V_NUMBER,
+                    .dval = vals[in->a].dval + vals[in->b].dval};
+    return 0;
+  case IR_SUB_NUM:
+    *dest = (value){.type = V_NUMBER,
+                    .dval = vals[in->a].dval - vals[in->b].dval};
+    return 0;
+  case IR_MUL_NUM:
+    *dest = (value){.type = V_NUMBER,
+                    .dval = vals[in->a].dval * vals[in->b].dval};
+    return 0;
+  case IR_DIV_NUM:
+    *dest = (value){.type = V_NUMBER,
+                    .dval = vals[in->a].dval / vals[in->b].dval};
+    return 0;
+  case IR_BINARY: {
+    // Operators cast their operands in place, SSA values must not change
+    value l = vals[in->a];
+    value r = vals[in->b];
+    return interpret_binary_op(mem, in->bop, &l, &r, dest);
+  }
+  case IR_PRINT:
+    if (value_flatten(mem, &vals[in->a]))
+      return -1;
+    value_println(stdout, vals[in->a]);
+    return 0;
+  case IR_NOP:
+    return 0;
+  default:
+    unreachable();
+  }
+}
+
+int ir_exec(linmem *mem, ir_prog *p, var_env *env) {
+  ASSERT(mem);
+  ir_prog_ASSERT(p);
+
+  // Every SSA value and every local is a root, until the program is done
+  value *vals = malloc_or_abort((p->len ? p->len : 1) * sizeof *vals);
+  for (size_t i = 0; i < p->len; ++i)
+    vals[i] = (value){.type = V_NIL};
+  size_t nlocals = p->nlocals ? p->nlocals : 1;
+  value *locals = malloc_or_abort(nlocals * sizeof *locals);
+  for (size_t i = 0; i < nlocals; ++i)
+    locals[i] = (value){.type = V_UNDEF};
+  gc_bind(mem, env);
+  gc_push(mem, vals, p->len);
+  gc_push(mem, locals, nlocals);
+
+  size_t nfailed = 0;
+  size_t skip_end = 0;
+  int ret = 0;
+
+  for (size_t i = 0; i < p->len;) {
+    ir_instr *in = &p->instrs[i];
+
+    // The rest of a failed statement is skipped, except for safe values
+    // which later statements may have been numbered onto
+    if (i < skip_end && !in->safe) {
+      i++;
+      continue;
+    }
+
+    switch (in->op) {
+    // A branch defines nothing, its value is how many instructions had
+    // failed when it was last taken into its body
+    case IR_BRANCH:
+      if (!vals[in->a].bool_val) {
+        i = in->target;
+        continue;
+      }
+      vals[i] = (value){.type = V_NUMBER, .dval = (double)nfailed};
+      i++;
+      continue;
+    case IR_JUMP:
+      i = in->target;
+      continue;
+    case IR_EXIT_FAILED:
+      i = vals[in->a].dval != (double)nfailed ? in->target : i + 1;
+      continue;
+    default:
+      break;
+    }
+
+    if (ir_exec_instr(mem, p, vals, locals, i, env)) {
+      nfailed++;
+      skip_end = in->end;
+      ret = -1;
+    }
+    i++;
+  }
+
+  gc_pop(mem, 2);
+  free(locals);
+  free(vals);
+  return ret;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "memory.h"
+#include "statements.h"
+#include "token.h"
+#include "value.h"
+#include "var_env.h"
+#include <stdio.h>
+
+/**
+ * Mid level IR
+ * - SSA over a whole program: every instruction defines at most one value
+ *   and operands are indices of earlier instructions. Globals and locals
+ *   are memory, read and written by loads and stores, so there are no phis
+ * - Ifs and loops lower to branches and jumps. A jump back closes a loop,
+ *   which starts with its condition
+ * - Every instruction remembers the statement it was lowered from. A failing
+ *   instruction skips the rest of its statement (all of an if or a loop, for
+ *   its condition), like the tree walker does. A loop stops once anything in
+ *   its body failed
+ */
+typedef enum {
+  IR_CONST,        // k
+  IR_LOAD,         // global name
+  IR_STORE,        // global name = a
+  IR_ASSIGN,       // global name = a, name must be defined
+  IR_LOAD_LOCAL,   // local, must be defined
+  IR_STORE_LOCAL,  // local = a
+  IR_ASSIGN_LOCAL, // local = a, local must be defined
+  IR_CLEAR_LOCAL,  // local = undefined, where it's declared
+  IR_CHECK,        // a, a speculative load of name, must be defined
+  IR_GUARD_NUM,    // number_cast(a)
+  IR_GUARD_BOOL,   // bool_cast(a)
+  IR_NEG,          // -a, a is a number
+  IR_NOT,          // !a, a is a bool
+  IR_ADD_NUM,      // a + b, both numbers
+  IR_SUB_NUM,
+  IR_MUL_NUM,
+  IR_DIV_NUM,
+  IR_BINARY,      // a <bop> b with the generic operator semantics
+  IR_PRINT,       // print a
+  IR_BRANCH,      // to target unless a, a is a bool
+  IR_JUMP,        // to target
+  IR_EXIT_FAILED, // to target if anything failed since branch a was taken
+  IR_NOP,         // Removed by a pass
+} ir_op;
+
+// What an instruction's result is known to be
+typedef enum {
+  IRT_ANY,
+  IRT_NUMBER,
+  IRT_BOOL,
+  IRT_STRING,
+  IRT_NIL,
+  IRT_NONE, // Defines nothing
+} ir_type;
+
+typedef struct {
+  ir_op op;
+  ir_type type;
+  token_t bop;
+  size_t a;
+  size_t b;
+  value k;
+  char *name;
+  slot_cache cache; // Of name
+  int speculative;  // IR_LOAD: undefined instead of failing
+  int local;        // Of the IR_*_LOCAL, name is its name
+  int defined;      // IR_LOAD_LOCAL, IR_ASSIGN_LOCAL: known to be defined
+  size_t target;    // IR_BRANCH, IR_JUMP, IR_EXIT_FAILED
+  size_t stmt;      // Top level statement
+  size_t unit;      // Innermost statement, the one a failure skips
+  size_t end;       // Where that skip ends
+  int safe; // Can't fail, has no effect and only depends on safe values
+} ir_instr;
+
+typedef struct {
+  ir_instr *instrs;
+  size_t len;
+  size_t cap;
+  int nlocals; // Of the most blocks open at once
+} ir_prog;
+
+#define ir_prog_ASSERT(p)                                                      \
+  ASSERT(p);                                                                   \
+  ASSERT((p)->instrs);                                                         \
+  ASSERT((p)->len <= (p)->cap)
+
+// Returns -1 if the program uses something the IR can't express
+int ir_lower(ir_prog *dest, stmt_arr *s);
+
+// Type guard elimination, constant folding, global value numbering with
+// store to load forwarding, loop invariant code motion, then dead code
+// elimination
+void ir_optimize(ir_prog *p);
+
+void ir_dump(FILE *ofp, ir_prog *p);
+
+int ir_exec(linmem *mem, ir_prog *p, var_env *env);
+
+void ir_free(ir_prog *p);
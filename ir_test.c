@@ -0,0 +1,212 @@
+#include "interpreter.h"
+#include "ir.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+///////////////////////////////////////
+////////////// Section Dumps
+
+typedef struct {
+  const char *src;
+  const char *dump;
+} dump_case;
+
+static const dump_case dumps[] = {
+    // Folding plus forwarding of a global stored by an infallible statement
+    {"var a = 1 + 2; print a * a;", "; stmt 0\n"
+                                    "  %2 = const 3 : number\n"
+                                    "  store a, %2\n"
+                                    "; stmt 1\n"
+                                    "  %8 = const 9 : number\n"
+                                    "  print %8\n"},
+    // Value numbering inside a statement, the second guard is redundant
+    {"print x * 2 + x * 2;", "; stmt 0\n"
+                             "  %0 = load x : any\n"
+                             "  %1 = const 2 : number\n"
+                             "  %2 = guard.num %0 : number\n"
+                             "  %4 = mul.num %2, %1 : number\n"
+                             "  %10 = add.num %4, %4 : number\n"
+                             "  print %10\n"},
+    // A store that may not have happened is not forwarded
+    {"var a = x; print a + 1;", "; stmt 0\n"
+                                "  %0 = load x : any\n"
+                                "  store a, %0\n"
+                                "; stmt 1\n"
+                                "  %2 = load a : any\n"
+                                "  %3 = const 1 : number\n"
+                                "  %4 = binary PLUS %2, %3 : any\n"
+                                "  print %4\n"},
+    // Dead code goes, unless it can fail
+    {"1 + 2; x; \"s\" - 1;", "; stmt 1\n"
+                             "  %3 = load x : any\n"
+                             "; stmt 2\n"
+                             "  %4 = const \"s\" : string\n"
+                             "  %6 = guard.num %4 : number\n"},
+    // A global the loop doesn't store is loaded once, checked every time
+    {"var i = 0; while (i < 3) { print n; i = i + 1; }",
+     "; stmt 0\n"
+     "  %0 = const 0 : number\n"
+     "  store i, %0\n"
+     "; stmt 1\n"
+     "  %2 = const 3 : number\n"
+     "  %3 = load.spec n : any\n"
+     "  %4 = const 1 : number\n"
+     "  %5 = load i : any\n"
+     "  %6 = binary LESS %5, %2 : bool\n"
+     "  branch %6 -> 16\n"
+     "  %9 = check n %3 : any\n"
+     "  print %9\n"
+     "  %11 = load i : any\n"
+     "  %12 = binary PLUS %11, %4 : any\n"
+     "  assign i, %12\n"
+     "  exit.failed %8 -> 16\n"
+     "  jump -> 5\n"},
+    // The start of a condition may fail, it would the first time through
+    {"{ var k = 1; if (x) k = 2; for (var i = 0; i < k * 2; i = i + 1) i; }",
+     "; stmt 0\n"
+     "  %1 = const 1 : number\n"
+     "  store.local k#0, %1\n"
+     "  %3 = load x : any\n"
+     "  %4 = guard.bool %3 : bool\n"
+     "  branch %4 -> 8\n"
+     "  %6 = const 2 : number\n"
+     "  assign.local k#0, %6\n"
+     "  %9 = const 0 : number\n"
+     "  store.local i#1, %9\n"
+     "  %11 = load.local k#0 : any\n"
+     "  %12 = const 2 : number\n"
+     "  %13 = guard.num %11 : number\n"
+     "  %14 = mul.num %13, %12 : number\n"
+     "  %15 = load.local i#1 : any\n"
+     "  %17 = binary LESS %15, %14 : bool\n"
+     "  branch %17 -> 27\n"
+     "  exit.failed %19 -> 27\n"
+     "  %22 = load.local i#1 : any\n"
+     "  %24 = binary PLUS %22, %1 : any\n"
+     "  assign.local i#1, %24\n"
+     "  jump -> 15\n"},
+};
+
+static void check_dump(const dump_case *c) {
+  token_arr arr = scanner_parse_tokens(c->src);
+  stmt_arr stmts = parse_tokens(arr);
+
+  ir_prog p;
+  if (ir_lower(&p, &stmts)) {
+    fprintf(stdout, "FAIL: can't lower: %s\n", c->src);
+    failures++;
+    return;
+  }
+  ir_optimize(&p);
+
+  char *got = NULL;
+  size_t len = 0;
+  FILE *ofp = open_memstream(&got, &len);
+  ir_dump(ofp, &p);
+  fclose(ofp);
+
+  if (strcmp(got, c->dump) != 0) {
+    fprintf(stdout, "FAIL: %s\nexpected:\n%sgot:\n%s", c->src, c->dump, got);
+    failures++;
+  }
+
+  free(got);
+  ir_free(&p);
+}
+
+///////////////////////////////////////
+////////////// Section Differential
+
+// Every global listed in vars must end up the same in both tiers
+static const char *programs[] = {
+    "var a = 3; var b = a * 2 - 1; var c = b / a; var d = -c + !a;",
+    "var s = \"foo\"; var t = s + \"bar\"; var u = t < s; var v = s == t;",
+    "var a = true + true; var b = a == 2; var c = nil == a; var d = \"x\";",
+    "var a = 1; var b = missing; var c = b + a; var d = a + 1;",
+    "var a = \"s\" - 1; var b = a; var c = 1 == \"s\"; var d = c;",
+    "var a = 1 < 2; var b = a == true; var c = 5 >= 5; var d = !nil;",
+    "var a = 0; var b = 0; for (var i = 0; i < 5; i = i + 1) { a = a + i; "
+    "if (i > 2) b = b + a; else b = b - 1; } var c = a * b; var d = a < b;",
+    // A failed body ends the loop, after the rest of its block
+    "var a = 0; var b = 0; var c = 0; while (a < 4) { a = a + 1; "
+    "{ var t = a * 2; if (a == 2) t = nope; b = b + t; } c = c + 1; }",
+    "var a = 0; var b = 0; for (var i = 0; i < 3; i = i + 1) { "
+    "for (var j = 0; j < 3; j = j + 1) { if (j == 1) a = a + bad; "
+    "b = b + 1; } a = a + 10; }",
+    // A local whose declaration failed is undefined
+    "var a = 1; var b = 0; { var t = missing; b = t; } var c = b; var d = a;",
+    "var a = 0; var b = 0; while (a < 3) { a = a + 1; b = b + k * a; } "
+    "var c = a; var d = b;",
+    "var a = \"s\"; var b = 0; for (var i = 0; i < 3; i = i + 1) b = b + -a; "
+    "var c = 1; for (c = 0; c < 3; c = c + z) c; var d = c;",
+};
+
+static const char *vars[] = {"a", "b", "c", "d", "s", "t", "u", "v"};
+
+static int value_same(value *a, value *b) {
+  if (a == NULL || b == NULL)
+    return a == b;
+  if (a->type != b->type)
+    return 0;
+
+  switch (a->type) {
+  case V_NUMBER:
+    return a->dval == b->dval;
+  case V_STRING:
+    return lox_string_equal(a->str, b->str);
+  case V_SMALL:
+    return equal_equal(a, b);
+  case V_BOOL:
+    return a->bool_val == b->bool_val;
+  case V_NIL:
+    return 1;
+  }
+  return 0;
+}
+
+static void check_program(const char *src) {
+  var_env walked = var_env_create();
+  var_env optimized = var_env_create();
+
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  interpret_stmts(&arr.mem, &stmts, &walked);
+
+  ir_prog p;
+  if (ir_lower(&p, &stmts)) {
+    fprintf(stdout, "FAIL: can't lower: %s\n", src);
+    failures++;
+    return;
+  }
+  ir_optimize(&p);
+  ir_exec(&arr.mem, &p, &optimized);
+  ir_free(&p);
+
+  for (size_t i = 0; i < sizeof vars / sizeof *vars; ++i) {
+    if (!value_same(var_env_find(&walked, (char *)vars[i]),
+                    var_env_find(&optimized, (char *)vars[i]))) {
+      fprintf(stdout, "FAIL: %s differs in: %s\n", vars[i], src);
+      failures++;
+    }
+  }
+}
+
+int main() {
+  size_t ndumps = sizeof dumps / sizeof *dumps;
+  size_t nprograms = sizeof programs / sizeof *programs;
+
+  for (size_t i = 0; i < ndumps; ++i)
+    check_dump(&dumps[i]);
+  for (size_t i = 0; i < nprograms; ++i)
+    check_program(programs[i]);
+
+  fprintf(stdout, "%zu cases, %d failures\n", ndumps + nprograms, failures);
+  return failures != 0;
+}
@@ -0,0 +1,646 @@
+#include "jit.h"
+#include "errors.h"
+#include "gc.h"
+#include "interpreter.h"
+#include "string.h"
+#include "token.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static int enabled = 0;
+static unsigned int hot_threshold = JIT_HOT_THRESHOLD;
+
+void jit_enable(unsigned int threshold) {
+  enabled = jit_supported();
+  hot_threshold = threshold;
+}
+
+int jit_enabled() { return enabled; }
+
+unsigned int jit_threshold() { return hot_threshold; }
+
+#ifdef JIT_X86_64
+
+int jit_supported() { return 1; }
+
+_Static_assert(sizeof(value) == 16, "jit templates assume 16 byte values");
+_Static_assert(sizeof(((value *)0)->type) == 1, "jit templates compare bytes");
+
+#define TYPE_OFFSET ((int32_t)offsetof(value, type))
+
+// rbx, r12, r13, r14 are saved right below rbp, slots start after them
+#define SAVED_REGS_SIZE 32
+#define SLOT_SIZE 16
+
+// Register numbers as encoded in ModRM
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+typedef struct {
+  string code;
+  int nslots;
+  int rooted; // Calls something that can collect
+} jit_state;
+
+static inline void emit(jit_state *j, const char *bytes, size_t len) {
+  string_append_cstr_len(&j->code, bytes, len);
+}
+
+static inline void emit_u8(jit_state *j, uint8_t b) {
+  string_append_ch(&j->code, (char)b);
+}
+
+static inline void emit_u32(jit_state *j, uint32_t v) {
+  emit(j, (const char *)&v, sizeof v);
+}
+
+static inline void emit_u64(jit_state *j, uint64_t v) {
+  emit(j, (const char *)&v, sizeof v);
+}
+
+static inline size_t jit_here(const jit_state *j) { return j->code.len; }
+
+// Points the rel32 stored at [at] to target
+static inline void jit_patch(jit_state *j, size_t at, size_t target) {
+  int32_t rel = (int32_t)(target - (at + 4));
+  memcpy(&j->code.data[at], &rel, sizeof rel);
+}
+
+// Emits a rel32 jump / jcc and returns the location of its displacement
+static size_t emit_jump(jit_state *j, const char *opcode, size_t len,
+                        size_t target) {
+  emit(j, opcode, len);
+  size_t at = jit_here(j);
+  emit_u32(j, 0);
+  jit_patch(j, at, target);
+  return at;
+}
+
+#define JMP "\xe9", 1
+#define JE "\x0f\x84", 2
+#define JNE "\x0f\x85", 2
+
+static inline int32_t slot_disp(int slot) {
+  return -(SAVED_REGS_SIZE + SLOT_SIZE * (slot + 1));
+}
+
+// ModRM for [rbp + disp32]
+static inline void emit_rbp_mem(jit_state *j, int reg, int32_t disp) {
+  emit_u8(j, 0x80 | (reg << 3) | 5);
+  emit_u32(j, (uint32_t)disp);
+}
+
+// A small string fills all 16 bytes, so the whole value is stored
+static void emit_store_value(jit_state *j, int slot, value v) {
+  uint64_t half[2];
+  memcpy(half, &v, sizeof half);
+  for (int i = 0; i < 2; ++i) {
+    // mov rax, imm64 ; mov [slot + 8 * i], rax
+    emit(j, "\x48\xb8", 2);
+    emit_u64(j, half[i]);
+    emit(j, "\x48\x89", 2);
+    emit_rbp_mem(j, RAX, slot_disp(slot) + 8 * i);
+  }
+}
+
+static void emit_lea(jit_state *j, int reg, int slot) {
+  emit(j, "\x48\x8d", 2);
+  emit_rbp_mem(j, reg, slot_disp(slot));
+}
+
+static void emit_call_raw(jit_state *j, void *fn) {
+  emit(j, "\x48\xb8", 2);
+  emit_u64(j, (uint64_t)(uintptr_t)fn);
+  emit(j, "\xff\xd0", 2); // call rax
+}
+
+// Calls fn and jumps to the shared failure exit when it returns non zero
+static void emit_call(jit_state *j, void *fn, size_t fail) {
+  emit_call_raw(j, fn);
+  emit(j, "\x85\xc0", 2); // test eax, eax
+  emit_jump(j, JNE, fail);
+}
+
+static size_t emit_type_guard(jit_state *j, int slot, value_t type) {
+  // cmp byte [slot + type], imm8 ; jne <patched>
+  emit_u8(j, 0x80);
+  emit_rbp_mem(j, 7, slot_disp(slot) + TYPE_OFFSET);
+  emit_u8(j, (uint8_t)type);
+  return emit_jump(j, JNE, 0);
+}
+
+static int compile_expr(jit_state *j, expr *e, int slot, size_t fail);
+
+static void compile_literal(jit_state *j, literal l, int slot) {
+  switch (l.type) {
+  case LT_NUMBER:
+    emit_store_value(j, slot, (value){.type = V_NUMBER, .dval = l.dval});
+    return;
+  case LT_STRING:
+    emit_store_value(j, slot, value_from_string(l.str));
+    return;
+  case LT_TRUE:
+    emit_store_value(j, slot, (value){.type = V_BOOL, .bool_val = 1});
+    return;
+  case LT_FALSE:
+    emit_store_value(j, slot, (value){.type = V_BOOL, .bool_val = 0});
+    return;
+  case LT_NIL:
+    emit_store_value(j, slot, (value){.type = V_NIL});
+    return;
+  default:
+    unreachable();
+  }
+}
+
+static int compile_unary(jit_state *j, unary u, int slot, size_t fail) {
+  if (compile_expr(j, u.e, slot, fail))
+    return -1;
+
+  size_t slow = 0;
+  size_t done = 0;
+
+  if (u.op == MINUS) {
+    // Fast path: flip the sign bit in place
+    slow = emit_type_guard(j, slot, V_NUMBER);
+    emit(j, "\x48\x8b", 2);
+    emit_rbp_mem(j, RAX, slot_disp(slot));
+    emit(j, "\x48\x0f\xba\xf8\x3f", 5); // btc rax, 63
+    emit(j, "\x48\x89", 2);
+    emit_rbp_mem(j, RAX, slot_disp(slot));
+    done = emit_jump(j, JMP, 0);
+    jit_patch(j, slow, jit_here(j));
+  }
+
+  emit_u8(j, 0xbf); // mov edi, op
+  emit_u32(j, (uint32_t)u.op);
+  emit_lea(j, RSI, slot);
+  emit_call(j, (void *)interpret_unary_op, fail);
+
+  if (u.op == MINUS)
+    jit_patch(j, done, jit_here(j));
+  return 0;
+}
+
+// Feedback that never saw a number makes the inline path dead weight
+static inline int never_number(unsigned int seen) {
+  return seen != 0 && !(seen & (1u << V_NUMBER));
+}
+
+// Both numbers: compares them into a bool in the left slot. ucomisd sets
+// CF and ZF like an unsigned compare, and all three of PF, CF and ZF for
+// NaN, so <= and >= come out as the tree walker's !> and !<
+static void emit_compare(jit_state *j, token_t op, int slot) {
+  // ucomisd xmm0, [other] with xmm0 the side that goes on the left of >
+  int swap = op == LESS || op == GREATER_EQUAL;
+  emit(j, "\xf2\x0f\x10", 3); // movsd xmm0, [first]
+  emit_rbp_mem(j, 0, slot_disp(swap ? slot + 1 : slot));
+  emit(j, "\x66\x0f\x2e", 3); // ucomisd xmm0, [second]
+  emit_rbp_mem(j, 0, slot_disp(swap ? slot : slot + 1));
+
+  switch (op) {
+  case GREATER:
+  case LESS:
+    emit(j, "\x0f\x97\xc0", 3); // seta al
+    break;
+  case GREATER_EQUAL:
+  case LESS_EQUAL:
+    emit(j, "\x0f\x96\xc0", 3); // setbe al
+    break;
+  case EQUAL_EQUAL:
+    // sete al ; setnp cl ; and al, cl
+    emit(j, "\x0f\x94\xc0\x0f\x9b\xc1\x20\xc8", 8);
+    break;
+  case BANG_EQUAL:
+    // setne al ; setp cl ; or al, cl
+    emit(j, "\x0f\x95\xc0\x0f\x9a\xc1\x08\xc8", 8);
+    break;
+  default:
+    unreachable();
+  }
+
+  emit(j, "\x0f\xb6\xc0\x89", 4); // movzx eax, al ; mov [left], eax
+  emit_rbp_mem(j, RAX, slot_disp(slot));
+  emit_u8(j, 0xc6); // mov byte [left + type], V_BOOL
+  emit_rbp_mem(j, 0, slot_disp(slot) + TYPE_OFFSET);
+  emit_u8(j, (uint8_t)V_BOOL);
+}
+
+static int compile_binary(jit_state *j, binary b, int slot, size_t fail) {
+  if (compile_expr(j, b.left, slot, fail))
+    return -1;
+  if (compile_expr(j, b.right, slot + 1, fail))
+    return -1;
+
+  uint8_t sse_op = 0;
+  int compare = 0;
+  switch (b.op) {
+  case PLUS:
+    sse_op = 0x58;
+    break;
+  case MINUS:
+    sse_op = 0x5c;
+    break;
+  case STAR:
+    sse_op = 0x59;
+    break;
+  case SLASH:
+    sse_op = 0x5e;
+    break;
+  case GREATER:
+  case GREATER_EQUAL:
+  case LESS:
+  case LESS_EQUAL:
+  case EQUAL_EQUAL:
+  case BANG_EQUAL:
+    compare = 1;
+    break;
+  default:
+    break;
+  }
+
+  if (never_number(b.seen_left) || never_number(b.seen_right)) {
+    sse_op = 0;
+    compare = 0;
+  }
+
+  size_t slow_left = 0;
+  size_t slow_right = 0;
+  size_t done = 0;
+
+  if (sse_op || compare) {
+    // Fast path: both numbers, the result goes in the left slot
+    slow_left = emit_type_guard(j, slot, V_NUMBER);
+    slow_right = emit_type_guard(j, slot + 1, V_NUMBER);
+    if (compare) {
+      emit_compare(j, b.op, slot);
+    } else {
+      emit(j, "\xf2\x0f\x10", 3); // movsd xmm0, [left]
+      emit_rbp_mem(j, 0, slot_disp(slot));
+      emit(j, "\xf2\x0f", 2); // <op>sd xmm0, [right]
+      emit_u8(j, sse_op);
+      emit_rbp_mem(j, 0, slot_disp(slot + 1));
+      emit(j, "\xf2\x0f\x11", 3); // movsd [left], xmm0
+      emit_rbp_mem(j, 0, slot_disp(slot));
+    }
+    done = emit_jump(j, JMP, 0);
+    jit_patch(j, slow_left, jit_here(j));
+    jit_patch(j, slow_right, jit_here(j));
+  }
+
+  // interpret_binary_op(mem, op, &left, &right, &left). Joining strings
+  // allocates
+  emit(j, "\x48\x89\xdf", 3); // mov rdi, rbx
+  emit_u8(j, 0xbe);           // mov esi, op
+  emit_u32(j, (uint32_t)b.op);
+  emit_lea(j, RDX, slot);
+  emit_lea(j, RCX, slot + 1);
+  emit(j, "\x4c\x8d", 2); // lea r8, [left]
+  emit_rbp_mem(j, 0, slot_disp(slot));
+  emit_call(j, (void *)interpret_binary_op, fail);
+  if (b.op == PLUS)
+    j->rooted = 1;
+
+  if (sse_op || compare)
+    jit_patch(j, done, jit_here(j));
+  return 0;
+}
+
+_Static_assert(offsetof(var_env, slots) == 0, "jit loads env->slots");
+_Static_assert(offsetof(slot_cache, env) == 0, "jit compares cache->env");
+_Static_assert(offsetof(slot_cache, slot) == 8, "jit loads cache->slot");
+
+_Static_assert(offsetof(box, v) == 0, "jit loads a box's value in place");
+
+#define ENV_DISP(field) ((uint32_t)offsetof(var_env, field))
+
+// Copies the value at [rax] to slot
+static void emit_copy_from_rax(jit_state *j, int slot) {
+  emit(j, "\x48\x8b\x10", 3); // mov rdx, [rax] ; mov [slot], rdx
+  emit(j, "\x48\x89", 2);
+  emit_rbp_mem(j, RDX, slot_disp(slot));
+  emit(j, "\x48\x8b\x50\x08", 4); // mov rdx, [rax + 8] ; mov [slot + 8], rdx
+  emit(j, "\x48\x89", 2);
+  emit_rbp_mem(j, RDX, slot_disp(slot) + 8);
+}
+
+static void emit_variable_load(jit_state *j, variable *v, int slot,
+                               size_t fail) {
+  emit(j, "\x4c\x89\xe7", 3); // mov rdi, r12
+  emit(j, "\x48\xbe", 2);     // mov rsi, v
+  emit_u64(j, (uint64_t)(uintptr_t)v);
+  emit_lea(j, RDX, slot);
+  emit_call(j, (void *)interpret_variable_load, fail);
+}
+
+// A local is found like var_env_local does, from the scope offsets, every
+// time: calls move the stack. The helper reports an undefined one
+static void compile_local(jit_state *j, variable *v, int slot, size_t fail) {
+  emit(j, "\x49\x8b\x84\x24", 4); // mov rax, [r12 + nscopes]
+  emit_u32(j, ENV_DISP(nscopes));
+  emit(j, "\x49\x8b\x8c\x24", 4); // mov rcx, [r12 + scopes]
+  emit_u32(j, ENV_DISP(scopes));
+  // mov rax, [rcx + 8 * rax - 8 * (depth + 1)]
+  emit(j, "\x48\x8b\x84\xc1", 4);
+  emit_u32(j, (uint32_t)(int32_t)(-8 * (v->depth + 1)));
+  emit(j, "\x49\x03\x84\x24", 4); // add rax, [r12 + stack.data]
+  emit_u32(j, ENV_DISP(stack) + (uint32_t)offsetof(stackmem, data));
+  emit(j, "\x48\x8d\x80", 3); // lea rax, [rax + idx]
+  emit_u32(j, (uint32_t)(sizeof(value) * v->idx));
+
+  emit(j, "\x80\x78", 2); // cmp byte [rax + type], V_BOX
+  emit_u8(j, (uint8_t)TYPE_OFFSET);
+  emit_u8(j, (uint8_t)V_BOX);
+  emit(j, "\x75\x03\x48\x8b\x00", 5); // jne +3 ; mov rax, [rax]
+  emit(j, "\x80\x78", 2);               // cmp byte [rax + type], V_UNDEF
+  emit_u8(j, (uint8_t)TYPE_OFFSET);
+  emit_u8(j, (uint8_t)V_UNDEF);
+  size_t undef = emit_jump(j, JE, 0);
+
+  emit_copy_from_rax(j, slot);
+  size_t done = emit_jump(j, JMP, 0);
+
+  jit_patch(j, undef, jit_here(j));
+  emit_variable_load(j, v, slot, fail);
+  jit_patch(j, done, jit_here(j));
+}
+
+// Reads the slot straight from the inline cache when it's warm and defined,
+// otherwise the helper fills the cache or reports the undefined variable
+static int compile_variable(jit_state *j, variable *v, int slot, size_t fail) {
+  if (v->kind == VAR_LOCAL) {
+    compile_local(j, v, slot, fail);
+    return 0;
+  }
+  if (!variable_is_global(v)) {
+    emit_variable_load(j, v, slot, fail);
+    return 0;
+  }
+
+  emit(j, "\x48\xb8", 2); // mov rax, &v->cache
+  emit_u64(j, (uint64_t)(uintptr_t)&v->cache);
+  emit(j, "\x4c\x3b\x20", 3); // cmp r12, [rax]
+  size_t miss = emit_jump(j, JNE, 0);
+
+  emit(j, "\x48\x8b\x48\x08", 4); // mov rcx, [rax + 8]
+  emit(j, "\x48\xc1\xe1\x04", 4); // shl rcx, 4
+  emit(j, "\x49\x03\x0c\x24", 4); // add rcx, [r12]
+  emit(j, "\x80\x79", 2);         // cmp byte [rcx + type], V_UNDEF
+  emit_u8(j, (uint8_t)TYPE_OFFSET);
+  emit_u8(j, (uint8_t)V_UNDEF);
+  size_t undef = emit_jump(j, JE, 0);
+
+  emit(j, "\x48\x89\xc8", 3); // mov rax, rcx
+  emit_copy_from_rax(j, slot);
+  size_t done = emit_jump(j, JMP, 0);
+
+  jit_patch(j, miss, jit_here(j));
+  jit_patch(j, undef, jit_here(j));
+  emit_variable_load(j, v, slot, fail);
+
+  jit_patch(j, done, jit_here(j));
+  return 0;
+}
+
+// Seen strings: keep joining them in one allocation through the tree
+// walker. Otherwise the chain compiles like any other arithmetic
+static int compile_concat(jit_state *j, concat *c, int slot, size_t fail) {
+  unsigned int seen = 0;
+  for (int k = 0; k < c->nparts - 1; ++k)
+    seen |= c->ops[k]->seen_left | c->ops[k]->seen_right;
+  if (!(seen & (1u << V_STRING | 1u << V_ROPE | 1u << V_SMALL)))
+    return compile_expr(j, c->chain, slot, fail);
+
+  // interpret_concat(mem, c, &slot, env)
+  emit(j, "\x48\x89\xdf", 3); // mov rdi, rbx
+  emit(j, "\x48\xbe", 2);     // mov rsi, c
+  emit_u64(j, (uint64_t)(uintptr_t)c);
+  emit_lea(j, RDX, slot);
+  emit(j, "\x4c\x89\xe1", 3); // mov rcx, r12
+  emit_call(j, (void *)interpret_concat, fail);
+  j->rooted = 1;
+  return 0;
+}
+
+// Enough for most calls, more go through the tree walker
+#define JIT_CALL_ARGS_MAX 16
+
+// Slots run down the stack, so the arguments below the callee's slot are in
+// reverse. The result replaces the callee
+static int jit_call(linmem *mem, value *callee, int nargs, var_env *env) {
+  value args[JIT_CALL_ARGS_MAX];
+  for (int a = 0; a < nargs; ++a)
+    args[a] = callee[-1 - a];
+  return interpret_call_values(mem, callee, args, nargs, callee, env);
+}
+
+// The callee is checked before the arguments are evaluated, like the tree
+// walker does. Methods (obj.name(...)) go through the property caches,
+// they're left to it
+static int compile_call(jit_state *j, call *c, int slot, size_t fail) {
+  if (c->callee->type == ET_GET || c->nargs > JIT_CALL_ARGS_MAX)
+    return -1;
+  if (compile_expr(j, c->callee, slot, fail))
+    return -1;
+
+  // interpret_callable(&callee, nargs)
+  emit_lea(j, RDI, slot);
+  emit_u8(j, 0xbe); // mov esi, nargs
+  emit_u32(j, (uint32_t)c->nargs);
+  emit_call(j, (void *)interpret_callable, fail);
+
+  for (int a = 0; a < c->nargs; ++a)
+    if (compile_expr(j, c->args[a], slot + 1 + a, fail))
+      return -1;
+
+  // jit_call(mem, &callee, nargs, env)
+  emit(j, "\x48\x89\xdf", 3); // mov rdi, rbx
+  emit_lea(j, RSI, slot);
+  emit_u8(j, 0xba); // mov edx, nargs
+  emit_u32(j, (uint32_t)c->nargs);
+  emit(j, "\x4c\x89\xe1", 3); // mov rcx, r12
+  emit_call(j, (void *)jit_call, fail);
+  j->rooted = 1;
+  return 0;
+}
+
+static int compile_expr(jit_state *j, expr *e, int slot, size_t fail) {
+  ASSERT(e);
+
+  if (slot + 1 > j->nslots)
+    j->nslots = slot + 1;
+
+  switch (e->type) {
+  case ET_LITERAL:
+    compile_literal(j, e->l, slot);
+    return 0;
+  case ET_UNARY:
+    return compile_unary(j, e->u, slot, fail);
+  case ET_BINARY:
+    return compile_binary(j, e->b, slot, fail);
+  case ET_GROUPING:
+    return compile_expr(j, e->g, slot, fail);
+  case ET_CONCAT:
+    return compile_concat(j, &e->cat, slot, fail);
+  case ET_VARIABLE:
+    return compile_variable(j, &e->v, slot, fail);
+  case ET_CALL:
+    return compile_call(j, &e->c, slot, fail);
+  default:
+    return -1;
+  }
+}
+
+// Every mapping starts with its link in the list jit_free_all unmaps.
+// Statement waves compile on the pool's threads too, so the list is locked
+typedef struct jit_code_s {
+  struct jit_code_s *next;
+  size_t len;
+} jit_code;
+
+_Static_assert(sizeof(jit_code) % 16 == 0, "jit code stays aligned");
+
+static jit_code *installed = NULL;
+static pthread_mutex_t installed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copies the finished code into its own executable mapping
+static jit_fn jit_install(jit_state *j) {
+  long page = sysconf(_SC_PAGESIZE);
+  if (page <= 0)
+    return NULL;
+
+  size_t len = (sizeof(jit_code) + j->code.len + page - 1) / page * page;
+  jit_code *code = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    return NULL;
+
+  // The link is read only once the code is executable
+  pthread_mutex_lock(&installed_lock);
+  *code = (jit_code){.next = installed, .len = len};
+  memcpy(code + 1, j->code.data, j->code.len);
+  int failed = mprotect(code, len, PROT_READ | PROT_EXEC);
+  if (failed)
+    munmap(code, len);
+  else
+    installed = code;
+  pthread_mutex_unlock(&installed_lock);
+  return failed ? NULL : (jit_fn)(code + 1);
+}
+
+void jit_free_all() {
+  pthread_mutex_lock(&installed_lock);
+  while (installed != NULL) {
+    jit_code *next = installed->next;
+    munmap(installed, installed->len);
+    installed = next;
+  }
+  pthread_mutex_unlock(&installed_lock);
+}
+
+// Compiled code that can collect pushes its slots as one root, set to nil
+// first. Returns what to restore the roots to
+static size_t jit_root(linmem *mem, value *slots, size_t n) {
+  size_t saved = gc_roots_save(mem);
+  gc_push(mem, slots, n);
+  return saved;
+}
+
+static void jit_unroot(linmem *mem, size_t saved) {
+  gc_roots_restore(mem, saved);
+}
+
+jit_fn jit_compile(expr *e) {
+  ASSERT(e);
+
+  jit_state j = {.code = string_create(), .nslots = 0, .rooted = 0};
+
+  // Prologue: push rbp ; mov rbp, rsp ; push rbx, r12, r13, r14
+  emit(&j, "\x55\x48\x89\xe5\x53\x41\x54\x41\x55\x41\x56", 11);
+  emit(&j, "\x48\x81\xec", 3); // sub rsp, frame
+  size_t frame = jit_here(&j);
+  emit_u32(&j, 0);
+  // rbx = mem, r12 = env, r13 = dest
+  emit(&j, "\x48\x89\xfb\x49\x89\xf4\x49\x89\xd5", 9);
+  size_t init = emit_jump(&j, JMP, 0);
+
+  // Shared exits. r14 is what to restore the roots to, -1 if unrooted
+  size_t fail = jit_here(&j);
+  emit(&j, "\xb8\xff\xff\xff\xff", 5); // mov eax, -1
+  size_t done = jit_here(&j);
+  emit(&j, "\x49\x83\xfe\xff\x74\x18", 6); // cmp r14, -1 ; je out
+  emit(&j, "\x41\x89\xc5", 3);             // mov r13d, eax
+  emit(&j, "\x48\x89\xdf\x4c\x89\xf6", 6); // mov rdi, rbx ; mov rsi, r14
+  emit_call_raw(&j, (void *)jit_unroot);
+  emit(&j, "\x44\x89\xe8", 3);       // mov eax, r13d
+  emit(&j, "\x48\x8d\x65\xe0", 4); // out: lea rsp, [rbp - 32]
+  emit(&j, "\x41\x5e\x41\x5d\x41\x5c\x5b\x5d\xc3", 9);
+
+  size_t body = jit_here(&j);
+  if (compile_expr(&j, e, 0, fail)) {
+    string_free(j.code);
+    return NULL;
+  }
+
+  // *dest = slot 0 ; return 0
+  emit(&j, "\x48\x8b", 2);
+  emit_rbp_mem(&j, RAX, slot_disp(0));
+  emit(&j, "\x49\x89\x45\x00", 4);
+  emit(&j, "\x48\x8b", 2);
+  emit_rbp_mem(&j, RAX, slot_disp(0) + 8);
+  emit(&j, "\x49\x89\x45\x08", 4);
+  emit(&j, "\x31\xc0", 2);
+  emit_jump(&j, JMP, done);
+
+  // Now that the body says whether it can collect
+  jit_patch(&j, init, jit_here(&j));
+  if (j.rooted) {
+    for (int k = 0; k < j.nslots; ++k) {
+      emit_u8(&j, 0xc6); // mov byte [slot + type], V_NIL
+      emit_rbp_mem(&j, 0, slot_disp(k) + TYPE_OFFSET);
+      emit_u8(&j, (uint8_t)V_NIL);
+    }
+    // r14 = jit_root(mem, &slots[nslots - 1], nslots)
+    emit(&j, "\x48\x89\xdf", 3); // mov rdi, rbx
+    emit_lea(&j, RSI, j.nslots - 1);
+    emit_u8(&j, 0xba); // mov edx, nslots
+    emit_u32(&j, (uint32_t)j.nslots);
+    emit_call_raw(&j, (void *)jit_root);
+    emit(&j, "\x49\x89\xc6", 3); // mov r14, rax
+  } else {
+    emit(&j, "\x49\xc7\xc6\xff\xff\xff\xff", 7); // mov r14, -1
+  }
+  emit_jump(&j, JMP, body);
+
+  uint32_t frame_size = SLOT_SIZE * j.nslots;
+  memcpy(&j.code.data[frame], &frame_size, sizeof frame_size);
+
+  jit_fn ret = jit_install(&j);
+  string_free(j.code);
+  return ret;
+}
+
+#else
+
+int jit_supported() { return 0; }
+
+jit_fn jit_compile(expr *e) {
+  ASSERT(e);
+  return NULL;
+}
+
+void jit_free_all() {}
+
+#endif
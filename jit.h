@@ -0,0 +1,33 @@
+#pragma once
+
+#include "expression.h"
+#include "memory.h"
+#include "value.h"
+#include "var_env.h"
+
+/**
+ * Baseline template JIT
+ * - Stitches per-operation x86-64 templates for an expression tree
+ * - Number arithmetic and comparisons, and local variable loads, are
+ *   inlined. Everything else calls the interpreter's helpers, calls too
+ * - Code that can collect (calls, joining strings) roots its slots for as
+ *   long as it runs
+ * - Off by default. Compilation returns NULL when unsupported
+ */
+typedef int (*jit_fn)(linmem *mem, var_env *env, value *dest);
+
+#define JIT_HOT_THRESHOLD 8
+
+void jit_enable(unsigned int threshold);
+
+int jit_enabled();
+
+unsigned int jit_threshold();
+
+// 1 if this build / platform can generate code at all
+int jit_supported();
+
+jit_fn jit_compile(expr *e);
+
+// Unmaps all compiled code, once nothing will run it again
+void jit_free_all();
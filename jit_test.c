@@ -0,0 +1,154 @@
+#include "gc.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Differential test: every case must give the same result in the tree walker
+// and in the JIT. Cases that fail at runtime must fail in both.
+static const char *cases[] = {
+    "1 + 2 * 3",
+    "-(4 - 10) / 3",
+    "1 / 0",
+    "-0",
+    "a * b + a - b / a",
+    "-a",
+    "--b",
+    "\"foo\" + \"bar\"",
+    "s + s + \"baz\"",
+    "true + true",
+    "t * 3 - -t",
+    "1 == true",
+    "nil == nil",
+    "nil == 1",
+    "s == \"foo\"",
+    "!nil",
+    "!!a",
+    "!\"\"",
+    "5 <= 0",
+    "a < b == b > a",
+    "a >= 3",
+    "\"a\" < \"b\"",
+    "\"b\" > \"abc\"",
+    "(((a)))",
+    "\"foo\" + 1",
+    "-\"foo\"",
+    "nil * 2",
+    "missing + 1",
+    "s - a",
+    "s + \"-\" + s + s",
+    "a + b + a + t",
+    "s + s + a + s",
+    "0 / 0 < a",
+    "0 / 0 <= a",
+    "a >= 0 / 0",
+    "0 / 0 == 0 / 0",
+    "0 / 0 != 0 / 0",
+    "a != b",
+    "add(a, b) * 2",
+    "add(add(a, 1), add(b, 2)) <= 10",
+    "(l + s) + add(s, l) == \"longer than a small stringfoofoolonger than "
+    "a small string\"",
+    "boxed(a)",
+    "outer(b)()",
+    "add(a)",
+    "s(1)",
+    "missing(a + 1)",
+    "add(a, missing)",
+};
+
+// Strings joined under stress collection catch slots that aren't rooted
+static const char *prelude =
+    "var a = 3; var b = 4.5; var s = \"foo\"; var t = true;"
+    "var l = \"longer than a small string\";"
+    "fun add(x, y) { return x + y; }"
+    "fun id(x) { return x; }"
+    "fun boxed(x) { fun g() { return x; } return x + g(); }"
+    "fun outer(x) { fun g() { return x; } return g; }"
+    "var r = ";
+
+static int failures = 0;
+
+static int value_same(value *a, value *b) {
+  if (a == NULL || b == NULL)
+    return a == b;
+  if (a->type != b->type)
+    return 0;
+
+  switch (a->type) {
+  case V_NUMBER:
+    return a->dval == b->dval || (isnan(a->dval) && isnan(b->dval));
+  case V_STRING:
+    return lox_string_equal(a->str, b->str);
+  case V_SMALL:
+    return equal_equal(a, b);
+  case V_BOOL:
+    return a->bool_val == b->bool_val;
+  case V_NIL:
+    return 1;
+  }
+  return 0;
+}
+
+static value *run_case(const char *c, var_env *env, int expect_compiled) {
+  char src[512];
+  snprintf(src, sizeof src, "%s%s;", prelude, c);
+
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  interpret_stmts(&arr.mem, &stmts, env);
+
+  stmt *last = &stmts.stmts[stmts.len - 1];
+  if (expect_compiled && last->jit == NULL) {
+    fprintf(stdout, "FAIL: not compiled: %s\n", c);
+    failures++;
+  }
+
+  value *ret = var_env_find(env, "r");
+
+  // Once more, now through the warm inline caches
+  value again;
+  if (expect_compiled && last->jit != NULL && ret != NULL &&
+      (last->jit(&arr.mem, env, &again) || !value_same(ret, &again))) {
+    fprintf(stdout, "FAIL: differs when cached: %s\n", c);
+    failures++;
+  }
+
+  return ret;
+}
+
+int main() {
+  gc_set_stress(1);
+  size_t n = sizeof cases / sizeof *cases;
+  value *expected[sizeof cases / sizeof *cases];
+
+  for (size_t i = 0; i < n; ++i) {
+    var_env env = var_env_create();
+    expected[i] = run_case(cases[i], &env, 0);
+  }
+
+  if (!jit_supported()) {
+    fprintf(stdout, "jit unsupported on this platform, skipping\n");
+    return 0;
+  }
+  jit_enable(0);
+
+  for (size_t i = 0; i < n; ++i) {
+    var_env env = var_env_create();
+    value *got = run_case(cases[i], &env, 1);
+
+    if (!value_same(expected[i], got)) {
+      fprintf(stdout, "FAIL: %s\n", cases[i]);
+      failures++;
+    }
+  }
+
+  fprintf(stdout, "%zu cases, %d failures\n", n, failures);
+  jit_free_all();
+  return failures != 0;
+}
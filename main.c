@@ -1,28 +1,112 @@
+#include "emit_c.h"
+#include "facades.h"
+#include "gc.h"
+#include "heap_profile.h"
 #include "interpreter.h"
+#include "ir.h"
+#include "jit.h"
+#include "parallel.h"
 #include "parser.h"
+#include "profile.h"
 #include "scanner.h"
 #include "string.h"
 #include "token.h"
 #include "utils.h"
 #include "var_env.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+static int use_ir = 0;
+static int dump_ir = 0;
+static const char *profile = NULL;
+static int threads = 0;
+static int gc_stats = 0;
+static const char *heap_profile = NULL; // "" for stderr
+
+// Runs the optimized IR when the program can be lowered
+static int run_ir(linmem *mem, stmt_arr *stmts, var_env *env) {
+  ir_prog p;
+  if (ir_lower(&p, stmts)) {
+    if (dump_ir)
+      fprintf(stderr, "Program can't be lowered to IR\n");
+    return -1;
+  }
+
+  ir_optimize(&p);
+  if (dump_ir)
+    ir_dump(stdout, &p);
+  else
+    ir_exec(mem, &p, env);
+
+  ir_free(&p);
+  return 0;
+}
 
 int run(const char *data, var_env *env) {
   token_arr arr = scanner_parse_tokens(data);
   stmt_arr stmts = parse_tokens(arr);
+  if ((use_ir || dump_ir) && (run_ir(&arr.mem, &stmts, env) == 0 || dump_ir))
+    return 0;
   interpret_stmts(&arr.mem, &stmts, env);
   return 0;
 }
 
+// Like run, warmed up by (and recording into) the profile
+static int run_profiled(const char *data, var_env *env) {
+  token_arr arr = scanner_parse_tokens(data);
+  stmt_arr stmts = parse_tokens(arr);
+  profile_load(profile, data, &stmts);
+  interpret_stmts(&arr.mem, &stmts, env);
+  profile_save(profile, data, &stmts);
+  return 0;
+}
+
+static int run_parallel(const char *data, var_env *env) {
+  token_arr arr = scanner_parse_tokens(data);
+  stmt_arr stmts = parse_tokens(arr);
+  parallel_interpret_stmts(&arr.mem, &stmts, env, threads);
+  return 0;
+}
+
+static void print_heap_profile() {
+  if (heap_profile[0] == '\0') {
+    heap_profile_print(stderr);
+    return;
+  }
+  FILE *ofp = fopen_or_abort(heap_profile, "w");
+  heap_profile_print(ofp);
+  fclose_or_abort(ofp);
+}
+
 int run_file(const char *fname) {
   char *data = fread_malloc(fname);
   var_env env = var_env_create();
-  run(data, &env);
+  if (profile && !use_ir && !dump_ir)
+    run_profiled(data, &env);
+  else if (threads > 0 && !use_ir && !dump_ir)
+    run_parallel(data, &env);
+  else
+    run(data, &env);
+  if (gc_stats)
+    gc_print_stats(stderr, env.gc);
+  if (heap_profile != NULL)
+    print_heap_profile();
+  jit_free_all();
   free(data);
   return 0;
 }
 
+int emit_file(const char *fname) {
+  char *data = fread_malloc(fname);
+  token_arr arr = scanner_parse_tokens(data);
+  stmt_arr stmts = parse_tokens(arr);
+  int ret = emit_c(stdout, &stmts, fname);
+  free(data);
+  return ret;
+}
+
 int run_prompt() {
   string s = string_create();
   char *cstr;
@@ -38,18 +122,101 @@ int run_prompt() {
   } while (s.len > 0);
 
   string_free(s);
+  jit_free_all();
 
   return 0;
 }
 
+// Bytes, with an optional K, M or G suffix. 0 if s isn't that
+static size_t parse_size(const char *s) {
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (end == s)
+    return 0;
+  switch (*end) {
+  case 'K':
+    n <<= 10, end++;
+    break;
+  case 'M':
+    n <<= 20, end++;
+    break;
+  case 'G':
+    n <<= 30, end++;
+    break;
+  }
+  return *end == '\0' ? (size_t)n : 0;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--jit[=threshold]] [--opt] [--profile=path] "
+          "[--parallel[=threads]] [--gc-stress] [--gc-incremental] "
+          "[--gc-refcount] [--gc-stats] [--memory-quota=bytes[K|M|G]] "
+          "[--heap-profile[=path]] [file]\n",
+          prog);
+  fprintf(stderr, "       %s --dump-ir file\n", prog);
+  fprintf(stderr, "       %s --emit-c file > out.c\n", prog);
+  return -1;
+}
+
 int main(int argc, char **argv) {
-  if (argc > 2) {
-    fprintf(stderr, "Usage: %s [file]\n", argv[0]);
-    return -1;
+  const char *fname = NULL;
+  int emit = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--emit-c") == 0) {
+      emit = 1;
+    } else if (strcmp(argv[i], "--opt") == 0) {
+      use_ir = 1;
+    } else if (strcmp(argv[i], "--dump-ir") == 0) {
+      dump_ir = 1;
+    } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile = &argv[i][10];
+    } else if (strcmp(argv[i], "--parallel") == 0) {
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      threads = threads > 0 ? threads : 1;
+    } else if (strncmp(argv[i], "--parallel=", 11) == 0) {
+      threads = atoi(&argv[i][11]);
+      if (threads <= 0)
+        return usage(argv[0]);
+    } else if (strcmp(argv[i], "--gc-stress") == 0) {
+      gc_set_stress(1);
+    } else if (strcmp(argv[i], "--gc-incremental") == 0) {
+      gc_set_incremental(1);
+    } else if (strcmp(argv[i], "--gc-refcount") == 0) {
+      gc_set_refcounting(1);
+    } else if (strncmp(argv[i], "--memory-quota=", 15) == 0) {
+      size_t limit = parse_size(&argv[i][15]);
+      if (limit == 0)
+        return usage(argv[0]);
+      gc_set_quota(limit);
+    } else if (strcmp(argv[i], "--heap-profile") == 0) {
+      heap_profile = "";
+      heap_profiling = 1;
+    } else if (strncmp(argv[i], "--heap-profile=", 15) == 0) {
+      heap_profile = &argv[i][15];
+      heap_profiling = 1;
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      gc_stats = 1;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      jit_enable(JIT_HOT_THRESHOLD);
+    } else if (strncmp(argv[i], "--jit=", 6) == 0) {
+      jit_enable(strtoul(&argv[i][6], NULL, 10));
+    } else if (fname == NULL && argv[i][0] != '-') {
+      fname = argv[i];
+    } else {
+      return usage(argv[0]);
+    }
+  }
+
+  if (emit) {
+    if (fname == NULL)
+      return usage(argv[0]);
+    return emit_file(fname);
   }
 
-  if (argc == 2) {
-    return run_file(argv[1]);
+  if (fname) {
+    return run_file(fname);
   } else {
     return run_prompt();
   }
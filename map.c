@@ -0,0 +1,244 @@
+#include "map.h"
+#include "errors.h"
+#include "facades.h"
+#include "heap_profile.h"
+#include "vector.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAP_MIN_CAP 8
+
+#define map_entry_arr_ASSERT(a)                                                \
+  ASSERT(a);                                                                   \
+  ASSERT((a)->len <= (a)->cap)
+
+VECTOR_FUNCTIONS(map_entry_arr, map_entry, at, vector_grow_double);
+
+///////////////////////////////////////
+////////////// Section Keys
+
+// The finalizer of MurmurHash3, so nearby numbers land far apart
+static uint32_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb3fe1a85ec53ull;
+  h ^= h >> 33;
+  return (uint32_t)h;
+}
+
+static uint32_t key_hash(value *key) {
+  switch (key->type) {
+  case V_STRING:
+    return lox_string_hash(key->str);
+  case V_SMALL:
+    return chars_hash(value_small_chars(key), key->small_len);
+  case V_NUMBER: {
+    // -0 == 0, so they hash the same
+    double d = key->dval == 0 ? 0 : key->dval;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof bits);
+    return mix64(bits);
+  }
+  case V_BOOL:
+    return key->bool_val ? 1 : 2;
+  case V_NIL:
+    return 3;
+  default:
+    // Every pointer in the union shares fn's storage
+    return mix64((uint64_t)(uintptr_t)key->fn);
+  }
+}
+
+static int key_equal(value *a, value *b) {
+  if (a->type != b->type)
+    return 0;
+  switch (a->type) {
+  case V_STRING:
+    return lox_string_equal(a->str, b->str);
+  case V_SMALL:
+    return a->small_len == b->small_len &&
+           memcmp(value_small_chars(a), value_small_chars(b), a->small_len) ==
+               0;
+  case V_NUMBER:
+    return a->dval == b->dval;
+  case V_BOOL:
+    return a->bool_val == b->bool_val;
+  case V_NIL:
+    return 1;
+  default:
+    return a->fn == b->fn;
+  }
+}
+
+// Ropes are flattened into *flat, so every string key is a V_STRING or
+// V_SMALL
+static inline value *key_of(value *key, value *flat) {
+  if (key->type != V_ROPE)
+    return key;
+  *flat = value_from_string(value_string(key));
+  return flat;
+}
+
+///////////////////////////////////////
+////////////// Section Index
+
+static inline size_t probe_distance(map *m, uint32_t hash, size_t slot) {
+  return (slot - (hash & (m->cap - 1))) & (m->cap - 1);
+}
+
+// The slot holding key, m->cap if there's none
+static size_t find_slot(map *m, value *key, uint32_t hash) {
+  size_t mask = m->cap - 1;
+  size_t i = hash & mask;
+  for (size_t d = 0;; ++d, i = (i + 1) & mask) {
+    map_slot *s = &m->slots[i];
+    // Past where key would have taken this slot over
+    if (s->entry == 0 || probe_distance(m, s->hash, i) < d)
+      return m->cap;
+    if (s->hash == hash && key_equal(&m->entries.at[s->entry - 1].key, key))
+      return i;
+  }
+}
+
+// An entry that isn't in the index yet, there's room for it
+static void index_insert(map *m, map_slot cur) {
+  size_t mask = m->cap - 1;
+  size_t i = cur.hash & mask;
+  for (size_t d = 0;; ++d, i = (i + 1) & mask) {
+    map_slot *s = &m->slots[i];
+    if (s->entry == 0) {
+      *s = cur;
+      return;
+    }
+    size_t sd = probe_distance(m, s->hash, i);
+    if (sd < d) {
+      map_slot tmp = *s;
+      *s = cur;
+      cur = tmp;
+      d = sd;
+    }
+  }
+}
+
+// Closes the holes in entries and indexes them again into cap slots
+static void map_rebuild(map *m, size_t cap) {
+  size_t n = 0;
+  for (size_t k = 0; k < m->entries.len; ++k)
+    if (m->entries.at[k].key.type != V_UNDEF)
+      m->entries.at[n++] = m->entries.at[k];
+  ASSERT(n == m->len);
+  m->entries.len = n;
+
+  if (cap != m->cap) {
+    free(m->slots);
+    m->slots = malloc_or_abort(cap * sizeof *m->slots);
+    mem_quota_charge(m->quota, (cap - m->cap) * sizeof *m->slots);
+    HEAP_PROFILE(cap * sizeof *m->slots);
+    m->cap = cap;
+  }
+  memset(m->slots, 0, cap * sizeof *m->slots);
+  for (size_t k = 0; k < n; ++k)
+    index_insert(m, (map_slot){.hash = key_hash(&m->entries.at[k].key),
+                               .entry = k + 1});
+}
+
+///////////////////////////////////////
+////////////// Section Maps
+
+map *map_create(linmem *mem, double max_load) {
+  ASSERT(max_load > 0 && max_load < 1);
+  map *ret = linmem_malloc(mem, sizeof *ret);
+  *ret = (map){
+      .slots = malloc_or_abort(MAP_MIN_CAP * sizeof(map_slot)),
+      .cap = MAP_MIN_CAP,
+      .entries = {.at = malloc_or_abort(MAP_MIN_CAP * sizeof(map_entry)),
+                  .cap = MAP_MIN_CAP},
+      .max_load = max_load,
+      .quota = mem->quota,
+      .section = mem->section,
+  };
+  memset(ret->slots, 0, MAP_MIN_CAP * sizeof(map_slot));
+  mem_quota_charge(ret->quota,
+                   MAP_MIN_CAP * (sizeof(map_slot) + sizeof(map_entry)));
+  HEAP_PROFILE(MAP_MIN_CAP * (sizeof(map_slot) + sizeof(map_entry)));
+  return ret;
+}
+
+void map_free(map *m) {
+  mem_quota_refund(m->quota, m->cap * sizeof *m->slots +
+                                 m->entries.cap * sizeof *m->entries.at);
+  free(m->slots);
+  free(m->entries.at);
+}
+
+map_entry *map_find(map *m, value *key) {
+  value flat;
+  key = key_of(key, &flat);
+  size_t i = find_slot(m, key, key_hash(key));
+  return i == m->cap ? NULL : &m->entries.at[m->slots[i].entry - 1];
+}
+
+map_entry *map_set(map *m, value *key, value val) {
+  value flat;
+  key = key_of(key, &flat);
+  uint32_t hash = key_hash(key);
+  size_t i = find_slot(m, key, hash);
+  if (i < m->cap) {
+    map_entry *e = &m->entries.at[m->slots[i].entry - 1];
+    e->val = val;
+    return e;
+  }
+
+  if (m->len + 1 > m->cap * m->max_load)
+    map_rebuild(m, m->cap * 2);
+  if (m->entries.len == m->entries.cap) {
+    // Mostly holes: closing them makes the room
+    if (m->len <= m->entries.len / 2) {
+      map_rebuild(m, m->cap);
+    } else {
+      size_t cap = m->entries.cap;
+      map_entry_arr_make_available(&m->entries, m->entries.len + 1);
+      mem_quota_charge(m->quota,
+                       (m->entries.cap - cap) * sizeof *m->entries.at);
+      HEAP_PROFILE(m->entries.cap * sizeof *m->entries.at);
+    }
+  }
+
+  m->entries.at[m->entries.len++] = (map_entry){.key = *key, .val = val};
+  m->len++;
+  index_insert(m, (map_slot){.hash = hash, .entry = m->entries.len});
+  return &m->entries.at[m->entries.len - 1];
+}
+
+int map_remove(map *m, value *key) {
+  value flat;
+  key = key_of(key, &flat);
+  size_t i = find_slot(m, key, key_hash(key));
+  if (i == m->cap)
+    return 0;
+
+  map_entry *e = &m->entries.at[m->slots[i].entry - 1];
+  *e = (map_entry){.key.type = V_UNDEF};
+  m->len--;
+
+  // Shift the run after i back a slot, until a key that's already home
+  size_t mask = m->cap - 1;
+  size_t next = (i + 1) & mask;
+  while (m->slots[next].entry != 0 &&
+         probe_distance(m, m->slots[next].hash, next) > 0) {
+    m->slots[i] = m->slots[next];
+    i = next;
+    next = (next + 1) & mask;
+  }
+  m->slots[i] = (map_slot){0};
+  return 1;
+}
+
+map_entry *map_next(map *m, size_t *it) {
+  for (; *it < m->entries.len; ++*it)
+    if (m->entries.at[*it].key.type != V_UNDEF)
+      return &m->entries.at[(*it)++];
+  return NULL;
+}
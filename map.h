@@ -0,0 +1,71 @@
+#pragma once
+
+#include "memory.h"
+#include "value.h"
+#include <stdint.h>
+
+/**
+ * Maps
+ * - Entries are kept in a dense array in insertion order, which is the
+ *   order iteration sees them in. Removing one leaves a hole (key
+ *   V_UNDEF) that the next rebuild closes
+ * - Lookups go through an open addressed index of slots, each holding a
+ *   key's cached hash and its entry. Robin Hood: an insert takes the slot
+ *   of any key closer to its home than the new one is. A lookup stops as
+ *   soon as it has probed further than the key it finds. Removal shifts
+ *   the following slots back, so there are no tombstones
+ * - The index doubles when it gets fuller than max_load
+ * - Keys compare without any casting: 1 and true are different keys.
+ *   Strings compare by contents, functions, classes, instances, arrays and
+ *   maps by identity
+ */
+typedef struct {
+  value key;
+  value val;
+} map_entry;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t entry; // Index into entries plus one, 0 for an empty slot
+} map_slot;
+
+typedef struct {
+  map_entry *at;
+  size_t len; // Holes included
+  size_t cap;
+} map_entry_arr;
+
+struct map_s {
+  map_slot *slots;
+  size_t cap; // Slots, a power of two
+  map_entry_arr entries;
+  size_t len;
+  double max_load;
+  mem_quota *quota; // The linmem's it was made in, charged for the tables
+  size_t section;    // See linmem
+};
+
+#define MAP_DEFAULT_LOAD 0.85
+
+// max_load in (0, 1)
+map *map_create(linmem *mem, double max_load);
+
+void map_free(map *m);
+
+// The entry of key, NULL if there isn't one
+map_entry *map_find(map *m, value *key);
+
+// The value stored under key, NULL if there isn't one
+static inline value *map_get(map *m, value *key) {
+  map_entry *e = map_find(m, key);
+  return e == NULL ? NULL : &e->val;
+}
+
+// The entry val is in now
+map_entry *map_set(map *m, value *key, value val);
+
+// 0 if there was nothing to remove
+int map_remove(map *m, value *key);
+
+// Entry *it onwards that isn't a hole, NULL at the end. Start *it at 0
+map_entry *map_next(map *m, size_t *it);
@@ -0,0 +1,121 @@
+#include "map.h"
+#include "value_hashtable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NMAX 10000000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static value number(double d) { return (value){.type = V_NUMBER, .dval = d}; }
+
+// Keys 0 .. n - 1 in, then each of them and n more that aren't there
+static void bench_round(int n, double max_load, double *insert, double *hit,
+                        double *miss) {
+  linmem mem = linmem_create();
+  map *m = map_create(&mem, max_load);
+
+  double start = now();
+  for (int k = 0; k < n; ++k) {
+    value key = number(k);
+    map_set(m, &key, number(2.0 * k));
+  }
+  *insert += now() - start;
+
+  double acc = 0;
+  start = now();
+  for (int k = 0; k < n; ++k) {
+    value key = number(k);
+    acc += map_get(m, &key)->dval;
+  }
+  *hit += now() - start;
+
+  size_t found = 0;
+  start = now();
+  for (int k = n; k < 2 * n; ++k) {
+    value key = number(k + 0.5);
+    found += map_get(m, &key) != NULL;
+  }
+  *miss += now() - start;
+
+  if (m->len != (size_t)n || found != 0 || acc != (double)n * (n - 1)) {
+    fprintf(stdout, "%d keys: wrong result\n", n);
+    exit(1);
+  }
+  map_free(m);
+  linmem_free(&mem);
+}
+
+// Small maps over and over, so every size does about as many operations
+static void bench_numbers(int n, double max_load) {
+  int rounds = n < NMAX ? NMAX / n : 1;
+  double insert = 0, hit = 0, miss = 0;
+  for (int r = 0; r < rounds; ++r)
+    bench_round(n, max_load, &insert, &hit, &miss);
+
+  double ops = (double)n * rounds;
+  fprintf(stdout, "%8d keys  load %.2f  insert %6.1f  hit %6.1f  miss %6.1f "
+                  "ns/op\n",
+          n, max_load, insert / ops * 1e9, hit / ops * 1e9, miss / ops * 1e9);
+}
+
+// String keys, against value_hashtable, which has a fixed number of chains
+static void bench_strings(int n) {
+  char **keys = malloc(n * sizeof *keys);
+  value *vals = malloc(n * sizeof *vals);
+  linmem mem = linmem_create();
+  for (int k = 0; k < n; ++k) {
+    char buf[32];
+    // Too long to be small strings
+    int len = snprintf(buf, sizeof buf, "a longer string key %d", k);
+    vals[k] = value_from_string(lox_string_create(&mem, buf, len));
+    keys[k] = vals[k].str->chars;
+  }
+
+  map *m = map_create(&mem, MAP_DEFAULT_LOAD);
+  double start = now();
+  for (int k = 0; k < n; ++k)
+    map_set(m, &vals[k], number(k));
+  for (int k = 0; k < n; ++k)
+    ASSERT(map_get(m, &vals[k])->dval == k);
+  double elapsed_map = now() - start;
+
+  value_hashtable h = vhtbl_create();
+  start = now();
+  for (int k = 0; k < n; ++k)
+    vhtbl_insert(&h, keys[k], number(k));
+  for (int k = 0; k < n; ++k)
+    ASSERT(vhtbl_get(&h, keys[k])->dval == k);
+  double elapsed_vhtbl = now() - start;
+
+  fprintf(stdout, "%8d strings  map %6.1f  value_hashtable %8.1f ns/op\n", n,
+          elapsed_map / (2.0 * n) * 1e9, elapsed_vhtbl / (2.0 * n) * 1e9);
+
+  vhtbl_free(&h);
+  map_free(m);
+  linmem_free(&mem);
+  free(keys);
+  free(vals);
+}
+
+int main(int argc, char **argv) {
+  int nmax = argc > 1 ? atoi(argv[1]) : NMAX;
+
+  for (int n = 1000; n <= nmax; n *= 10)
+    bench_numbers(n, MAP_DEFAULT_LOAD);
+
+  int n = nmax < 1000000 ? nmax : 1000000;
+  double loads[] = {0.5, 0.7, 0.95};
+  for (size_t l = 0; l < sizeof loads / sizeof *loads; ++l)
+    bench_numbers(n, loads[l]);
+
+  for (int s = 1000; s <= 100000 && s <= nmax; s *= 10)
+    bench_strings(s);
+  return 0;
+}
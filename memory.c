@@ -1,44 +1,148 @@
 #include "memory.h"
-#include "doubling_array.h"
 #include "facades.h"
+#include "heap_profile.h"
+#include "vector.h"
 #include <stdint.h>
 
 #define INITIAL_CAP 100000
 
-linmem linmem_create() {
+// Every linmem block starts with a pointer to the previous block, and its
+// size. Growing starts a new block, so nothing handed out ever moves
+typedef struct {
+  void *prev;
+  size_t cap;
+} block_header;
+
+#define BLOCK_HEADER sizeof(block_header)
+
+static void *linmem_block(void *prev, size_t cap) {
+  block_header *ret = malloc_or_abort(cap);
+  *ret = (block_header){.prev = prev, .cap = cap};
+  return ret;
+}
+
+// Frees the current block, the previous one becomes current
+static void linmem_pop_block(linmem *m) {
+  block_header *b = m->data;
+  mem_quota_refund(m->quota, b->cap);
+  if (heap_profiling)
+    heap_profile_arena(m->name, -(long)b->cap);
+  m->data = b->prev;
+  free(b);
+}
+
+int mem_quota_check(const mem_quota *q, size_t size) {
+  if (mem_quota_fits(q, size))
+    return 0;
+  runtime_error("Out of memory: %zu bytes are over the quota of %zu bytes\n",
+                size, q->limit);
+  return -1;
+}
+
+linmem linmem_create() { return linmem_create_named("linmem"); }
+
+linmem linmem_create_named(const char *name) {
   linmem ret;
-  ret.data = malloc_or_abort(INITIAL_CAP);
+  ret.data = linmem_block(NULL, INITIAL_CAP);
   ret.cap = INITIAL_CAP;
-  ret.len = 0;
+  ret.len = BLOCK_HEADER;
+  ret.nallocs = 0;
+  ret.gc = NULL;
+  ret.quota = NULL;
+  ret.name = name;
+  ret.section = 0;
+  if (heap_profiling)
+    heap_profile_arena(name, INITIAL_CAP);
   return ret;
 }
 
-DBL_ARR_MAKE_AVAILABLE(linmem, data, cap);
+// A new block with room for at least need bytes after its header
+static void linmem_grow(linmem *m, size_t need) {
+  size_t cap = m->cap < LINMEM_MAX_BLOCK / 2 ? 2 * m->cap : LINMEM_MAX_BLOCK;
+  if (need + BLOCK_HEADER > cap)
+    cap = need + BLOCK_HEADER;
+  m->data = linmem_block(m->data, cap);
+  m->cap = cap;
+  m->len = BLOCK_HEADER;
+  mem_quota_charge(m->quota, cap);
+  if (heap_profiling)
+    heap_profile_arena(m->name, (long)cap);
+}
 
-void *linmem_malloc(linmem *m, size_t len) {
+void *linmem_malloc_at(linmem *m, size_t len, const char *file,
+                       const char *func) {
   linmem_ASSERT(m);
-  linmem_make_available(m, m->len + len);
+  heap_profile_note(file, func, len);
+  len = (len + LINMEM_ALIGN - 1) & ~(LINMEM_ALIGN - 1);
+
+  if (m->len + len > m->cap)
+    linmem_grow(m, len);
+
   void *ret = &((uint8_t *)m->data)[m->len];
   m->len += len;
+  m->nallocs++;
   ASSERT(ret);
   return ret;
 }
 
+void *linmem_malloc_aligned_at(linmem *m, size_t len, size_t align,
+                               const char *file, const char *func) {
+  linmem_ASSERT(m);
+  ASSERT(align > 0 && (align & (align - 1)) == 0);
+  if (align <= LINMEM_ALIGN)
+    return linmem_malloc_at(m, len, file, func);
+
+  len = (len + LINMEM_ALIGN - 1) & ~(LINMEM_ALIGN - 1);
+  size_t pad = -((uintptr_t)m->data + m->len) & (align - 1);
+  if (m->len + pad + len > m->cap) {
+    linmem_grow(m, len + align);
+    pad = -((uintptr_t)m->data + m->len) & (align - 1);
+  }
+
+  // pad is a multiple of LINMEM_ALIGN, the blocks being aligned to it
+  m->len += pad;
+  return linmem_malloc_at(m, len, file, func);
+}
+
+void linmem_reset(linmem *m, linmem_mark mark) {
+  linmem_ASSERT(m);
+  ASSERT(m->data != mark.data || mark.len <= m->len);
+  while (m->data != mark.data) {
+    ASSERT(m->data != NULL);
+    linmem_pop_block(m);
+  }
+  m->cap = mark.cap;
+  m->len = mark.len;
+}
+
 void linmem_free(linmem *m) {
   linmem_ASSERT(m);
-  free(m->data);
+  while (m->data)
+    linmem_pop_block(m);
   m->cap = 0;
   m->len = 0;
 }
 
-DBL_ARR_MAKE_AVAILABLE(stackmem, data, cap);
+void linmem_set_quota(linmem *m, mem_quota *q) {
+  if (m->quota == q)
+    return;
+  for (block_header *b = m->data; b != NULL; b = b->prev) {
+    mem_quota_refund(m->quota, b->cap);
+    mem_quota_charge(q, b->cap);
+  }
+  m->quota = q;
+}
+
+VECTOR_FUNCTIONS(stackmem, char, data, vector_grow_double);
+
+stackmem stackmem_create() { return stackmem_create_cap(INITIAL_CAP); }
 
-stackmem stackmem_create() {
+stackmem stackmem_create_cap(size_t cap) {
   stackmem ret;
-  ret.data = malloc_or_abort(INITIAL_CAP);
-  ret.cap = INITIAL_CAP;
+  ret.data = malloc_or_abort(cap);
+  ret.cap = cap;
   ret.len = 0;
-  ret.top = ret.data;
+  ret.top = 0;
   return ret;
 }
 
@@ -47,34 +151,30 @@ void *stackmem_malloc(stackmem *m, size_t len) {
   size_t bytes = len + sizeof len;
   stackmem_make_available(m, m->len + bytes);
 
-  void *head = &((uint8_t *)m->data)[m->len];
-
-  // Write size in bytes of next elem
-  size_t prev_block = head - m->top;
-  *(size_t *)head = prev_block;
-  head += sizeof len;
-  m->top = head;
+  // Write the distance back to the previous block
+  size_t head = m->len;
+  *(size_t *)stackmem_at(m, head) = head - m->top;
+  m->top = head + sizeof len;
 
   m->len += bytes;
-  ASSERT(head);
-  return head;
+  return stackmem_at(m, m->top);
 }
 
 void stackmem_free_top(stackmem *m) {
   stackmem_ASSERT(m);
   ASSERT(m->len > 0);
+  ASSERT(m->len >= m->top);
 
-  void *head = &((uint8_t *)m->data)[m->len];
-  ASSERT(head >= m->top);
-
-  size_t prev_size = *(size_t *)(m->top - sizeof prev_size);
-  m->len -= ((head - m->top) + sizeof prev_size);
-  m->top = m->top - prev_size - sizeof prev_size;
+  size_t prev_size = *(size_t *)stackmem_at(m, m->top - sizeof prev_size);
+  m->len = m->top - sizeof prev_size;
+  m->top = m->len - prev_size;
 }
 
 void stackmem_freeall(stackmem *m) {
   stackmem_ASSERT(m);
   free(m->data);
+  m->data = NULL;
   m->cap = 0;
   m->len = 0;
+  m->top = 0;
 }
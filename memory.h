@@ -2,17 +2,93 @@
 
 #include "errors.h"
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
+typedef struct gc_heap_s gc_heap;
+
+/**
+ * Memory quota
+ * - What one interpreter may use: the blocks of the linmems it allocates
+ *   from (its own and the workers'), the tables of its maps, and the
+ *   objects on its heap. A limit of 0 is none
+ * - Counted where it's cheap: when a linmem gets a new block or a map a
+ *   bigger table, and by the heap as it allocates and frees
+ * - Checked between statements, and before anything too big for the slab
+ *   (slab.h) is allocated: strings, flattened ropes and array(n) fail
+ *   instead. So a statement goes past the limit by small allocations at
+ *   most, before it fails
+ */
+typedef struct {
+  size_t limit;
+  atomic_size_t blocks; // Added to from any thread
+  size_t heap;          // Only by the heap's thread
+} mem_quota;
+
+static inline size_t mem_quota_used(const mem_quota *q) {
+  return atomic_load_explicit(&q->blocks, memory_order_relaxed) + q->heap;
+}
+
+// Whether more bytes would still fit. Always with no quota
+static inline int mem_quota_fits(const mem_quota *q, size_t more) {
+  return q == NULL || q->limit == 0 || mem_quota_used(q) + more <= q->limit;
+}
+
+static inline void mem_quota_charge(mem_quota *q, size_t bytes) {
+  if (q != NULL)
+    atomic_fetch_add_explicit(&q->blocks, bytes, memory_order_relaxed);
+}
+
+static inline void mem_quota_refund(mem_quota *q, size_t bytes) {
+  if (q != NULL)
+    atomic_fetch_sub_explicit(&q->blocks, bytes, memory_order_relaxed);
+}
+
+// -1 (after an error) unless size more bytes fit
+int mem_quota_check(const mem_quota *q, size_t size);
+
 /**
  * Linear memory
- * - Does not allow free
+ * - Bump allocation from a list of blocks, each twice the size of the one
+ *   before (up to LINMEM_MAX_BLOCK), so nothing handed out ever moves
+ * - Frees only in bulk: linmem_reset frees everything allocated since a
+ *   linmem_save
+ * - Allocations are aligned to LINMEM_ALIGN, or more with
+ *   linmem_malloc_aligned
+ * - gc is where the strings made while running go instead (see gc.h), NULL
+ *   to keep everything here
+ * - Its blocks are charged to quota, if it has one
+ * - name is the arena its blocks count towards in a heap profile
+ * - section tags the arrays, maps and instances made in it while a
+ *   parallel section runs, 0 outside one. A callback may change those,
+ *   since no other thread has seen them
  */
 typedef struct {
+  size_t cap; // Of the current block
+  size_t len; // Used in the current block
+  void *data; // The current block
+  size_t nallocs; // Every linmem_malloc, for benchmarks
+  gc_heap *gc;
+  mem_quota *quota;
+  const char *name;
+  size_t section;
+} linmem;
+
+// An object tagged section was made by the callback that allocates in mem
+static inline int linmem_made_here(linmem *mem, size_t section) {
+  return section != 0 && section == mem->section;
+}
+
+// Where a linmem was at linmem_save
+typedef struct {
+  void *data;
   size_t cap;
   size_t len;
-  void *data;
-} linmem;
+} linmem_mark;
+
+// Strings are allocated between structs, so every allocation is rounded up
+#define LINMEM_ALIGN sizeof(void *)
+#define LINMEM_MAX_BLOCK (64 << 20)
 
 #define linmem_empty(m) ((m)->cap == 0 && (m)->data == NULL && (m)->len == 0)
 #define linmem_not_empty(m) ((m)->cap > 0 && (m)->data != NULL && (m)->len >= 0)
@@ -22,17 +98,42 @@ typedef struct {
   ASSERT(linmem_empty(m) || linmem_not_empty(m))
 
 linmem linmem_create();
-void *linmem_malloc(linmem *m, size_t len);
+linmem linmem_create_named(const char *name);
+
+// The caller is the allocation's site in a heap profile
+#define linmem_malloc(m, len) linmem_malloc_at(m, len, __FILE__, __func__)
+
+// align is a power of two
+#define linmem_malloc_aligned(m, len, align)                                   \
+  linmem_malloc_aligned_at(m, len, align, __FILE__, __func__)
+
+void *linmem_malloc_at(linmem *m, size_t len, const char *file,
+                       const char *func);
+void *linmem_malloc_aligned_at(linmem *m, size_t len, size_t align,
+                               const char *file, const char *func);
+
 void linmem_free(linmem *m);
 
+// Moves the charge for every block from the old quota to q
+void linmem_set_quota(linmem *m, mem_quota *q);
+
+static inline linmem_mark linmem_save(const linmem *m) {
+  return (linmem_mark){.data = m->data, .cap = m->cap, .len = m->len};
+}
+
+// Frees everything allocated since mark was saved. Marks saved after it
+// are no longer valid
+void linmem_reset(linmem *m, linmem_mark mark);
+
 /**
  * Stack memory
  * - Allows free of only the most recently used block
+ * - Growing moves data, so hold on to offsets (stackmem_top), not pointers
  */
 typedef struct {
   size_t cap;
   size_t len;
-  void *top;
+  size_t top; // Offset of the most recent block
   void *data;
 } stackmem;
 
@@ -45,6 +146,29 @@ typedef struct {
   ASSERT(stackmem_empty(m) || stackmem_not_empty(m))
 
 stackmem stackmem_create();
+stackmem stackmem_create_cap(size_t cap);
 void *stackmem_malloc(stackmem *m, size_t len);
 void stackmem_free_top(stackmem *m);
 void stackmem_freeall(stackmem *m);
+
+static inline size_t stackmem_top(const stackmem *m) { return m->top; }
+
+// Whether a block of len bytes fits without growing
+static inline int stackmem_fits(const stackmem *m, size_t len) {
+  return m->len + len + sizeof len <= m->cap;
+}
+
+static inline void *stackmem_at(const stackmem *m, size_t offset) {
+  return &((char *)m->data)[offset];
+}
+
+// Moves [*top, *end) from a block to the one allocated before it, 0 if it
+// was the first. Start at stackmem_top(m) and m->len, when m->len > 0
+static inline int stackmem_prev(const stackmem *m, size_t *top, size_t *end) {
+  size_t head = *top - sizeof(size_t);
+  if (head == 0)
+    return 0;
+  *end = head;
+  *top = head - *(size_t *)stackmem_at(m, head);
+  return 1;
+}
@@ -0,0 +1,259 @@
+#include "natives.h"
+#include "array.h"
+#include "errors.h"
+#include "gc.h"
+#include "map.h"
+#include "parallel.h"
+
+// The numbers of an array argument, NULL after an error
+static double *numeric_arg(linmem *mem, value *arg, const char *fn,
+                           size_t *len) {
+  if (arg->type != V_ARRAY) {
+    runtime_error("%s expects an array\n", fn);
+    return NULL;
+  }
+  double *ret = array_numbers(mem, arg->arr);
+  if (ret == NULL) {
+    runtime_error("%s expects an array of numbers\n", fn);
+    return NULL;
+  }
+  *len = arg->arr->len;
+  return ret;
+}
+
+// x and y of the same length, NULL after an error
+static double *numeric_pair(linmem *mem, value *args, const char *fn,
+                            double **y, size_t *len) {
+  size_t ylen;
+  double *x = numeric_arg(mem, &args[0], fn, len);
+  if (x == NULL || (*y = numeric_arg(mem, &args[1], fn, &ylen)) == NULL)
+    return NULL;
+  if (*len != ylen) {
+    runtime_error("%s expects arrays of the same length, got %zu and %zu\n",
+                  fn, *len, ylen);
+    return NULL;
+  }
+  return x;
+}
+
+static value number(double d) { return (value){.type = V_NUMBER, .dval = d}; }
+
+static value new_array(linmem *mem, size_t len, double **nums) {
+  array *a = array_create(mem, len);
+  *nums = a->nums;
+  return (value){.type = V_ARRAY, .arr = a};
+}
+
+static int native_array(linmem *mem, value *args, value *dest, var_env *env) {
+  double n = args[0].dval;
+  if (args[0].type != V_NUMBER || !(n >= 0) || n != (double)(size_t)n) {
+    runtime_error("array expects a whole number of elements\n");
+    return -1;
+  }
+  if (!mem_quota_fits(mem->quota, (size_t)n * sizeof(double))) {
+    runtime_error("Out of memory: array(%zu) is over the quota of %zu bytes\n",
+                  (size_t)n, mem->quota->limit);
+    return -1;
+  }
+  *dest = (value){.type = V_ARRAY, .arr = array_create(mem, (size_t)n)};
+  return 0;
+}
+
+static int native_len(linmem *mem, value *args, value *dest, var_env *env) {
+  (void)mem;
+  if (args[0].type == V_MAP) {
+    *dest = number(args[0].mp->len);
+    return 0;
+  }
+  if (args[0].type != V_ARRAY) {
+    runtime_error("len expects an array or a map\n");
+    return -1;
+  }
+  *dest = number(args[0].arr->len);
+  return 0;
+}
+
+static int native_sum(linmem *mem, value *args, value *dest, var_env *env) {
+  size_t len;
+  double *x = numeric_arg(mem, &args[0], "sum", &len);
+  if (x == NULL)
+    return -1;
+  *dest = number(kernel_sum(x, len));
+  return 0;
+}
+
+static int native_dot(linmem *mem, value *args, value *dest, var_env *env) {
+  size_t len;
+  double *y;
+  double *x = numeric_pair(mem, args, "dot", &y, &len);
+  if (x == NULL)
+    return -1;
+  *dest = number(kernel_dot(x, y, len));
+  return 0;
+}
+
+static int native_scale(linmem *mem, value *args, value *dest, var_env *env) {
+  size_t len;
+  double *x = numeric_arg(mem, &args[0], "scale", &len);
+  if (x == NULL)
+    return -1;
+  if (args[1].type != V_NUMBER) {
+    runtime_error("scale expects a number to scale by\n");
+    return -1;
+  }
+
+  double *out;
+  *dest = new_array(mem, len, &out);
+  kernel_scale(out, x, args[1].dval, len);
+  return 0;
+}
+
+static int native_add(linmem *mem, value *args, value *dest, var_env *env) {
+  size_t len;
+  double *y;
+  double *x = numeric_pair(mem, args, "add", &y, &len);
+  if (x == NULL)
+    return -1;
+
+  double *out;
+  *dest = new_array(mem, len, &out);
+  kernel_add(out, x, y, len);
+  return 0;
+}
+
+static int native_mul(linmem *mem, value *args, value *dest, var_env *env) {
+  size_t len;
+  double *y;
+  double *x = numeric_pair(mem, args, "mul", &y, &len);
+  if (x == NULL)
+    return -1;
+
+  double *out;
+  *dest = new_array(mem, len, &out);
+  kernel_mul(out, x, y, len);
+  return 0;
+}
+
+static int native_min(linmem *mem, value *args, value *dest, var_env *env) {
+  size_t len;
+  double *x = numeric_arg(mem, &args[0], "min", &len);
+  if (x == NULL)
+    return -1;
+  if (len == 0) {
+    runtime_error("min of an empty array\n");
+    return -1;
+  }
+  *dest = number(kernel_min(x, len));
+  return 0;
+}
+
+static int native_max(linmem *mem, value *args, value *dest, var_env *env) {
+  size_t len;
+  double *x = numeric_arg(mem, &args[0], "max", &len);
+  if (x == NULL)
+    return -1;
+  if (len == 0) {
+    runtime_error("max of an empty array\n");
+    return -1;
+  }
+  *dest = number(kernel_max(x, len));
+  return 0;
+}
+
+static map *map_arg(value *arg, const char *fn) {
+  if (arg->type != V_MAP) {
+    runtime_error("%s expects a map\n", fn);
+    return NULL;
+  }
+  return arg->mp;
+}
+
+static int native_map(linmem *mem, value *args, value *dest, var_env *env) {
+  double load = args[0].type == V_NIL ? MAP_DEFAULT_LOAD : args[0].dval;
+  if (args[0].type != V_NIL &&
+      (args[0].type != V_NUMBER || !(load > 0 && load < 1))) {
+    runtime_error("map expects a load factor between 0 and 1\n");
+    return -1;
+  }
+  *dest = (value){.type = V_MAP, .mp = map_create(mem, load)};
+  return 0;
+}
+
+static int native_has(linmem *mem, value *args, value *dest, var_env *env) {
+  map *m = map_arg(&args[0], "has");
+  if (m == NULL || value_flatten(mem, &args[1]))
+    return -1;
+  *dest = (value){.type = V_BOOL, .bool_val = map_get(m, &args[1]) != NULL};
+  return 0;
+}
+
+static int native_remove(linmem *mem, value *args, value *dest, var_env *env) {
+  map *m = map_arg(&args[0], "remove");
+  if (m == NULL || value_flatten(mem, &args[1]))
+    return -1;
+  if (env->shared != NULL && !linmem_made_here(mem, m->section)) {
+    runtime_error("Cannot change a map in a parallel callback\n");
+    return -1;
+  }
+  map_entry *e =
+      gc_marking(mem) || gc_refcounting ? map_find(m, &args[1]) : NULL;
+  if (e != NULL) {
+    gc_release(mem, &e->key);
+    gc_release(mem, &e->val);
+  }
+  *dest = (value){.type = V_BOOL, .bool_val = map_remove(m, &args[1])};
+  return 0;
+}
+
+// The keys or the values of a map, in insertion order
+static int map_entries(linmem *mem, value *args, value *dest, int keys) {
+  map *m = map_arg(&args[0], keys ? "keys" : "values");
+  if (m == NULL)
+    return -1;
+  array *a = array_create(mem, m->len);
+  size_t it = 0;
+  map_entry *e;
+  for (size_t k = 0; (e = map_next(m, &it)) != NULL; ++k)
+    array_store(mem, a, k, keys ? e->key : e->val);
+  *dest = (value){.type = V_ARRAY, .arr = a};
+  return 0;
+}
+
+static int native_keys(linmem *mem, value *args, value *dest, var_env *env) {
+  return map_entries(mem, args, dest, 1);
+}
+
+static int native_values(linmem *mem, value *args, value *dest, var_env *env) {
+  return map_entries(mem, args, dest, 0);
+}
+
+int native_check_arity(native *nt, int nargs) {
+  if (nargs <= nt->arity && nargs >= nt->arity - nt->optional)
+    return 0;
+  if (nt->optional == 0)
+    runtime_error("%s expected %d arguments but got %d\n", nt->name,
+                  nt->arity, nargs);
+  else
+    runtime_error("%s expected %d to %d arguments but got %d\n", nt->name,
+                  nt->arity - nt->optional, nt->arity, nargs);
+  return -1;
+}
+
+static native natives[] = {
+    {"array", 1, native_array}, {"len", 1, native_len},
+    {"sum", 1, native_sum},     {"dot", 2, native_dot},
+    {"scale", 2, native_scale}, {"add", 2, native_add},
+    {"mul", 2, native_mul},     {"min", 1, native_min},
+    {"max", 1, native_max},     {"map", 1, native_map, 1},
+    {"has", 2, native_has},     {"remove", 2, native_remove},
+    {"keys", 1, native_keys},   {"values", 1, native_values},
+    {"parallel_map", 2, parallel_map},
+    {"parallel_for", 2, parallel_for},
+    {"parallel_reduce", 3, parallel_reduce},
+};
+
+void natives_define(var_env *env) {
+  for (size_t i = 0; i < sizeof natives / sizeof *natives; ++i)
+    var_env_define(env, natives[i].name,
+                   (value){.type = V_NATIVE, .nt = &natives[i]});
+}
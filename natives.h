@@ -0,0 +1,29 @@
+#pragma once
+
+#include "memory.h"
+#include "value.h"
+#include "var_env.h"
+
+/**
+ * Builtin functions
+ * - Globals like any other, defined in every var_env before the program
+ *   runs. A program may redefine them
+ * - fn gets exactly arity arguments and returns -1 after a runtime error.
+ *   env is the caller's, for builtins that call back into the program
+ * - The last optional arguments may be left out. fn gets nil for them
+ */
+typedef int (*native_fn)(linmem *mem, value *args, value *dest, var_env *env);
+
+struct native_s {
+  char *name;
+  int arity;
+  native_fn fn;
+  int optional;
+};
+
+#define NATIVE_ARGS_MAX 3
+
+// -1 after an error unless nt can be called with nargs arguments
+int native_check_arity(native *nt, int nargs);
+
+void natives_define(var_env *env);
@@ -0,0 +1,190 @@
+#include "object.h"
+#include "facades.h"
+#include "gc.h"
+#include "heap_profile.h"
+#include "slab.h"
+#include <pthread.h>
+#include <string.h>
+
+#define INITIAL_CHILDREN 2
+#define INITIAL_FIELDS 4
+
+///////////////////////////////////////
+////////////// Section Shapes
+
+int shape_find(shape *s, char *name) {
+  for (; s->name != NULL; s = s->parent)
+    if (strcmp(s->name, name) == 0)
+      return s->nfields - 1;
+  return -1;
+}
+
+static shape *shape_create(linmem *mem, shape *parent, char *name) {
+  shape *ret = linmem_malloc(mem, sizeof *ret);
+  *ret = (shape){
+      .parent = parent,
+      .name = name,
+      .nfields = parent ? parent->nfields + 1 : 0,
+  };
+  return ret;
+}
+
+shape *shape_transition(linmem *mem, shape *s, char *name) {
+  ASSERT(s);
+  ASSERT(name);
+
+  for (int i = 0; i < s->nchildren; ++i)
+    if (strcmp(s->children[i]->name, name) == 0)
+      return s->children[i];
+
+  // linmem can't grow in place, the old array is left behind
+  if (s->nchildren == s->children_cap) {
+    int cap = s->children_cap ? s->children_cap * 2 : INITIAL_CHILDREN;
+    shape **children = linmem_malloc(mem, cap * sizeof *children);
+    if (s->nchildren > 0)
+      memcpy(children, s->children, s->nchildren * sizeof *children);
+    s->children = children;
+    s->children_cap = cap;
+  }
+
+  shape *ret = shape_create(mem, s, name);
+  s->children[s->nchildren++] = ret;
+  return ret;
+}
+
+///////////////////////////////////////
+////////////// Section Classes
+
+klass *klass_create(linmem *mem, char *name, int nmethods) {
+  ASSERT(name);
+  ASSERT(nmethods >= 0);
+
+  klass *ret = linmem_malloc(mem, sizeof *ret);
+  *ret = (klass){
+      .name = name,
+      .root = shape_create(mem, NULL, NULL),
+      .methods = linmem_malloc(mem, nmethods * sizeof(method)),
+      .nmethods = nmethods,
+      .fields_hint = INITIAL_FIELDS,
+  };
+  return ret;
+}
+
+// A later method of the same name replaces an earlier one
+method *klass_find_method(klass *k, char *name) {
+  for (int i = k->nmethods; i-- > 0;)
+    if (strcmp(k->methods[i].name, name) == 0)
+      return &k->methods[i];
+  return NULL;
+}
+
+instance *instance_create(linmem *mem, klass *k, value *live, size_t nlive) {
+  ASSERT(k);
+
+  instance *ret = gc_alloc(mem, V_INSTANCE, sizeof *ret, live, nlive);
+  size_t size = k->fields_hint * sizeof(value);
+  *ret = (instance){
+      .k = k,
+      .shape = k->root,
+      .fields = mem->gc != NULL ? slab_malloc(size) : linmem_malloc(mem, size),
+      .cap = k->fields_hint,
+      .heap = mem->gc,
+      .section = mem->section,
+  };
+  if (ret->heap != NULL) {
+    HEAP_PROFILE(size);
+    gc_grow(ret->heap, ret, size);
+  }
+  return ret;
+}
+
+static void instance_reserve(linmem *mem, instance *in, int nfields) {
+  if (nfields <= in->cap)
+    return;
+
+  int cap = in->cap * 2 > nfields ? in->cap * 2 : nfields;
+  size_t size = cap * sizeof(value);
+  value *fields =
+      in->heap != NULL ? slab_malloc(size) : linmem_malloc(mem, size);
+  memcpy(fields, in->fields, in->shape->nfields * sizeof *fields);
+  // Other threads may still be reading the old fields
+  if (in->heap != NULL)
+    HEAP_PROFILE(size);
+  if (in->heap != NULL && in->heap->threads == 0) {
+    slab_free(in->fields, in->cap * sizeof(value));
+    gc_grow(in->heap, in, (cap - in->cap) * sizeof(value));
+  }
+  in->fields = fields;
+  in->cap = cap;
+
+  if (in->k->fields_hint < nfields)
+    in->k->fields_hint = nfields;
+}
+
+///////////////////////////////////////
+////////////// Section Inline caches
+
+static prop_entry *prop_cache_add(prop_cache *c, prop_entry *e) {
+  if (c->n == PROP_CACHE_WAYS) {
+    c->megamorphic = 1;
+    return e;
+  }
+  c->entries[c->n] = *e;
+  return &c->entries[c->n++];
+}
+
+prop_entry *object_get(prop_cache *c, instance *in, char *name,
+                       prop_entry *scratch) {
+  ASSERT(in);
+
+  prop_entry *ret = c == NULL ? NULL : prop_cache_find(c, in->shape);
+  if (ret != NULL)
+    return ret;
+
+  // Fields shadow methods
+  *scratch = (prop_entry){
+      .shape = in->shape,
+      .next = in->shape,
+      .slot = shape_find(in->shape, name),
+  };
+  if (scratch->slot < 0 &&
+      (scratch->m = klass_find_method(in->k, name)) == NULL)
+    return NULL;
+  return c == NULL ? scratch : prop_cache_add(c, scratch);
+}
+
+// Shapes and class hints are shared, uncached sets change them under this
+static pthread_mutex_t shapes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void object_set(linmem *mem, prop_cache *c, instance *in, char *name,
+                value v) {
+  ASSERT(in);
+
+  prop_entry scratch;
+  prop_entry *e = c == NULL ? NULL : prop_cache_find(c, in->shape);
+  if (c == NULL)
+    pthread_mutex_lock(&shapes_lock);
+  if (e == NULL) {
+    scratch = (prop_entry){
+        .shape = in->shape,
+        .next = in->shape,
+        .slot = shape_find(in->shape, name),
+    };
+    if (scratch.slot < 0) {
+      scratch.next = shape_transition(mem, in->shape, name);
+      scratch.slot = scratch.next->nfields - 1;
+    }
+    e = c == NULL ? &scratch : prop_cache_add(c, &scratch);
+  }
+
+  instance_reserve(mem, in, e->next->nfields);
+  if (c == NULL)
+    pthread_mutex_unlock(&shapes_lock);
+  if (e->slot < in->shape->nfields) {
+    gc_store(mem, &in->fields[e->slot], v);
+  } else {
+    in->fields[e->slot] = v;
+    gc_retain(mem, &v);
+  }
+  in->shape = e->next;
+}
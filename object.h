@@ -0,0 +1,114 @@
+#pragma once
+
+#include "memory.h"
+#include "value.h"
+
+///////////////////////////////////////
+////////////// Section Shapes
+
+/**
+ * Hidden classes
+ * - An instance's fields are a plain value array. Its shape says which
+ *   field lives in which slot, and is shared by every instance of a class
+ *   that got the same fields in the same order
+ * - Adding a field takes the transition to a child shape, created the
+ *   first time any instance takes it. Every class has its own root
+ */
+struct shape_s {
+  shape *parent;
+  char *name;  // The field this shape adds, NULL at the root
+  int nfields; // So name lives in slot nfields - 1
+
+  shape **children;
+  int nchildren;
+  int children_cap;
+};
+
+// The slot of field name, -1 if s doesn't have one
+int shape_find(shape *s, char *name);
+
+// s with name added
+shape *shape_transition(linmem *mem, shape *s, char *name);
+
+///////////////////////////////////////
+////////////// Section Classes
+
+typedef struct {
+  char *name;
+  value fn; // V_FUNCTION or V_CLOSURE
+} method;
+
+struct klass_s {
+  char *name;
+  shape *root;
+  method *methods;
+  int nmethods;
+  method *init; // NULL without an initializer
+  int fields_hint; // Most fields an instance got, what new ones start with
+};
+
+struct instance_s {
+  klass *k;
+  shape *shape;
+  value *fields;
+  int cap;
+  gc_heap *heap; // It's on it and fields are malloced, NULL in a linmem
+  size_t section; // See linmem
+};
+
+// A method read off an instance without calling it right away
+struct bound_s {
+  value receiver;
+  value method;
+};
+
+// Methods are filled in by the caller
+klass *klass_create(linmem *mem, char *name, int nmethods);
+
+method *klass_find_method(klass *k, char *name);
+
+// On mem's heap if it has one. The nlive values at live are still needed
+instance *instance_create(linmem *mem, klass *k, value *live, size_t nlive);
+
+///////////////////////////////////////
+////////////// Section Inline caches
+
+#define PROP_CACHE_WAYS 4
+
+// Where a property site found its property on one shape
+typedef struct {
+  shape *shape;
+  shape *next; // Sets: the shape after storing, a transition if it's new
+  int slot;    // -1 for a method
+  method *m;
+} prop_entry;
+
+/**
+ * A property site's inline cache
+ * - Monomorphic with one entry, polymorphic up to PROP_CACHE_WAYS. After
+ *   that the site is megamorphic: misses take the slow path and aren't
+ *   cached
+ */
+typedef struct {
+  prop_entry entries[PROP_CACHE_WAYS];
+  int n;
+  int megamorphic;
+} prop_cache;
+
+static inline prop_entry *prop_cache_find(prop_cache *c, shape *s) {
+  for (int i = 0; i < c->n; ++i)
+    if (c->entries[i].shape == s)
+      return &c->entries[i];
+  return NULL;
+}
+
+// c may be NULL, for callers that run on several threads at once: then
+// nothing is cached and new shapes are made under a lock
+
+// Finds field or method name on in. NULL if it has neither
+prop_entry *object_get(prop_cache *c, instance *in, char *name,
+                       prop_entry *scratch);
+
+// Stores field name on in, adding it if it's new
+void object_set(linmem *mem, prop_cache *c, instance *in, char *name,
+                value v);
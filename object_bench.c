@@ -0,0 +1,133 @@
+#include "interpreter.h"
+#include "object.h"
+#include "parser.h"
+#include "scanner.h"
+#include "value_hashtable.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Every call allocates an instance, stores two fields and reads six
+static const char *program =
+    "class Vec {\n"
+    "  init(x, y) { this.x = x; this.y = y; }\n"
+    "  plus(o) { return Vec(this.x + o.x, this.y + o.y); }\n"
+    "  len2() { return this.x * this.x + this.y * this.y; }\n"
+    "}\n"
+    "var one = Vec(1, 0);\n"
+    "fun walk(n, v) {\n"
+    "  if (n < 2) return v.len2();\n"
+    "  return walk(n - 1, v.plus(one)) + walk(n - 2, v);\n"
+    "}\n"
+    "var r = walk(%d, Vec(0, 0));\n";
+
+#define NINSTANCES 256
+#define ROUNDS 20000
+
+static char *fields[] = {"x", "y", "z", "w"};
+#define NFIELDS (sizeof fields / sizeof *fields)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_lox(int n) {
+  char src[1024];
+  snprintf(src, sizeof src, program, n);
+
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  var_env env = var_env_create();
+
+  double start = now();
+  int failed = interpret_stmts(&arr.mem, &stmts, &env);
+  double elapsed = now() - start;
+
+  value *r = var_env_find(&env, "r");
+  if (failed || r == NULL || r->type != V_NUMBER) {
+    fprintf(stdout, "lox: walk(%d) failed\n", n);
+    exit(1);
+  }
+  fprintf(stdout, "%-10s walk(%d) = %.0f  %.3fs\n", "lox", n, r->dval,
+          elapsed);
+  var_env_free(&env);
+}
+
+// Half the instances get their fields in reverse, so every site sees two
+// shapes and stays polymorphic
+static void bench_shapes() {
+  linmem mem = linmem_create();
+  klass *k = klass_create(&mem, "Vec", 0);
+  instance *objs[NINSTANCES];
+  prop_cache sets[NFIELDS] = {0};
+  prop_cache gets[NFIELDS] = {0};
+
+  double start = now();
+  for (int i = 0; i < NINSTANCES; ++i) {
+    objs[i] = instance_create(&mem, k, NULL, 0);
+    for (size_t f = 0; f < NFIELDS; ++f) {
+      size_t fi = i % 2 ? NFIELDS - 1 - f : f;
+      object_set(&mem, &sets[fi], objs[i], fields[fi],
+                 (value){.type = V_NUMBER, .dval = f});
+    }
+  }
+
+  double sum = 0;
+  for (int r = 0; r < ROUNDS; ++r) {
+    for (int i = 0; i < NINSTANCES; ++i) {
+      for (size_t f = 0; f < NFIELDS; ++f) {
+        prop_entry scratch;
+        prop_entry *e = object_get(&gets[f], objs[i], fields[f], &scratch);
+        sum += objs[i]->fields[e->slot].dval;
+      }
+    }
+  }
+  double elapsed = now() - start;
+
+  double accesses = (double)ROUNDS * NINSTANCES * NFIELDS;
+  fprintf(stdout, "%-10s sum = %.0f  %.3fs  %.2fM gets/s\n", "shapes", sum,
+          elapsed, accesses / elapsed / 1e6);
+  linmem_free(&mem);
+}
+
+// The same gets against a value_hashtable per instance
+static void bench_hashtables() {
+  value_hashtable *objs = malloc(NINSTANCES * sizeof *objs);
+
+  double start = now();
+  for (int i = 0; i < NINSTANCES; ++i) {
+    objs[i] = vhtbl_create();
+    for (size_t f = 0; f < NFIELDS; ++f) {
+      size_t fi = i % 2 ? NFIELDS - 1 - f : f;
+      vhtbl_insert(&objs[i], fields[fi], (value){.type = V_NUMBER, .dval = f});
+    }
+  }
+
+  double sum = 0;
+  for (int r = 0; r < ROUNDS; ++r)
+    for (int i = 0; i < NINSTANCES; ++i)
+      for (size_t f = 0; f < NFIELDS; ++f)
+        sum += vhtbl_get(&objs[i], fields[f])->dval;
+  double elapsed = now() - start;
+
+  double accesses = (double)ROUNDS * NINSTANCES * NFIELDS;
+  fprintf(stdout, "%-10s sum = %.0f  %.3fs  %.2fM gets/s\n", "hashtable",
+          sum, elapsed, accesses / elapsed / 1e6);
+
+  for (int i = 0; i < NINSTANCES; ++i)
+    vhtbl_free(&objs[i]);
+  free(objs);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 24;
+
+  bench_lox(n);
+  bench_shapes();
+  bench_hashtables();
+  return 0;
+}
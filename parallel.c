@@ -0,0 +1,458 @@
+#include "parallel.h"
+#include "array.h"
+#include "errors.h"
+#include "facades.h"
+#include "gc.h"
+#include "interpreter.h"
+#include "pool.h"
+#include "value_hashtable.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+
+///////////////////////////////////////
+////////////// Section Workers
+
+/**
+ * One pool for the whole process, made on first use
+ * - Worker 0 is the calling thread and allocates from the caller's linmem.
+ *   Every other worker has an arena of its own, kept for good since the
+ *   values made in it outlive the section that made them
+ * - The caller's gc heap is detached while they run (gc.h), so worker 0
+ *   allocates in the linmem too
+ */
+static int nworkers = 0;
+static thread_pool *pool = NULL;
+static linmem **arenas = NULL;
+
+void parallel_set_threads(int nthreads) {
+  ASSERT(nthreads > 0);
+  if (pool == NULL)
+    nworkers = nthreads;
+}
+
+static thread_pool *parallel_pool() {
+  if (pool != NULL)
+    return pool;
+
+  if (nworkers == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = n > 0 ? (int)n : 1;
+  }
+  pool = pool_create(nworkers);
+  arenas = malloc_or_abort(nworkers * sizeof *arenas);
+  arenas[0] = NULL;
+  for (int i = 1; i < nworkers; ++i) {
+    arenas[i] = malloc_or_abort(sizeof **arenas);
+    *arenas[i] = linmem_create_named("workers");
+  }
+  return pool;
+}
+
+static linmem *worker_arena(linmem *caller, int worker) {
+  return worker == 0 ? caller : arenas[worker];
+}
+
+// Every arena of every section gets a tag of its own
+static size_t sections = 0;
+
+// pool_run, with the blocks the arenas grow meanwhile charged to the
+// caller's quota
+static void run_charged(linmem *caller, pool_fn fn, void *ctx, size_t n) {
+  thread_pool *p = parallel_pool();
+  for (int i = 0; i < nworkers; ++i)
+    worker_arena(caller, i)->section = ++sections;
+  for (int i = 1; i < nworkers; ++i)
+    arenas[i]->quota = caller->quota;
+  pool_run(p, fn, ctx, n);
+  for (int i = 0; i < nworkers; ++i)
+    worker_arena(caller, i)->section = 0;
+  for (int i = 1; i < nworkers; ++i)
+    arenas[i]->quota = NULL;
+}
+
+///////////////////////////////////////
+////////////// Section Statements
+
+typedef struct {
+  stmt *s;
+  value v;
+  int failed;
+
+  // Errors reported while evaluating, replayed on commit
+  char *err;
+  size_t errlen;
+} task;
+
+typedef struct {
+  task *tasks;
+  linmem *mem;  // Worker 0's
+  var_env *env; // Read only while a wave runs
+} wave;
+
+static void run_task(void *ctx, size_t i, int worker) {
+  wave *w = ctx;
+  task *t = &w->tasks[i];
+
+  FILE *errs = open_memstream(&t->err, &t->errlen);
+  abort_if(errs == NULL, "open_memstream");
+
+  // Worker 0 is the caller, whose errors may be going elsewhere
+  FILE *prev = errors_redirect(errs);
+  t->failed =
+      interpret_stmt_value(worker_arena(w->mem, worker), t->s, &t->v, w->env);
+  errors_redirect(prev);
+
+  fclose(errs);
+}
+
+static int commit(task *t, var_env *env) {
+  errors_replay(t->err, t->errlen);
+  free(t->err);
+
+  if (t->failed)
+    return -1;
+
+  switch (t->s->type) {
+  case ST_EXPR:
+    return 0;
+  case ST_PRNT:
+    value_println(stdout, t->v);
+    return 0;
+  case ST_DECL:
+    var_env_define_cached(env, &t->s->ident_cache, t->s->ident_name, t->v);
+    return 0;
+  default:
+    unreachable();
+  }
+}
+
+///////////////////////////////////////
+////////////// Section Dependencies
+
+typedef struct {
+  value_hashtable *writers;
+  var_env *env;
+  size_t dep;
+  int calls;
+} reads;
+
+static void collect_reads(expr *e, reads *r) {
+  if (e == NULL)
+    return;
+
+  switch (e->type) {
+  case ET_LITERAL:
+    return;
+  case ET_VARIABLE: {
+    // Warm the cache here so workers never add slots concurrently
+    var_env_cached_slot(r->env, &e->v.cache, e->v.name);
+    value *w = vhtbl_get(r->writers, e->v.name);
+    if (w != NULL && (size_t)w->dval + 1 > r->dep)
+      r->dep = (size_t)w->dval + 1;
+    return;
+  }
+  case ET_UNARY:
+    collect_reads(e->u.e, r);
+    return;
+  case ET_GROUPING:
+    collect_reads(e->g, r);
+    return;
+  case ET_CONCAT:
+    collect_reads(e->cat.chain, r);
+    return;
+  case ET_BINARY:
+    collect_reads(e->b.left, r);
+    collect_reads(e->b.right, r);
+    return;
+  case ET_ARRAY:
+    for (int i = 0; i < e->arr.nelems; ++i)
+      collect_reads(e->arr.elems[i], r);
+    return;
+  // Elements only change in statements that run alone
+  case ET_INDEX:
+    collect_reads(e->idx.obj, r);
+    collect_reads(e->idx.index, r);
+    return;
+  case ET_CALL:
+  case ET_ASSIGN:
+  case ET_GET:
+  case ET_SET:
+  case ET_INDEX_SET:
+    r->calls = 1;
+    return;
+  default:
+    unreachable();
+  }
+}
+
+// dep[i] - 1 is the last statement before i declaring a global i reads.
+// Anything but a plain expression, print or declaration, and anything that
+// calls, assigns, touches a property or stores into an array, is a barrier:
+// alone[i] runs by itself on the calling thread
+static size_t *statement_deps(stmt_arr *s, var_env *env, char *alone) {
+  size_t *dep = malloc_or_abort((s->len + 1) * sizeof *dep);
+  value_hashtable writers = vhtbl_create();
+
+  for (size_t i = 0; i < s->len; ++i) {
+    stmt_t type = s->stmts[i].type;
+    reads r = {.writers = &writers, .env = env, .dep = 0, .calls = 0};
+    if (type == ST_EXPR || type == ST_PRNT || type == ST_DECL)
+      collect_reads(s->stmts[i].e, &r);
+    dep[i] = r.dep;
+    alone[i] = r.calls || !(type == ST_EXPR || type == ST_PRNT ||
+                            type == ST_DECL);
+
+    if (s->stmts[i].type == ST_DECL)
+      vhtbl_insert(&writers, s->stmts[i].ident_name,
+                   (value){.type = V_NUMBER, .dval = (double)i});
+  }
+
+  vhtbl_free(&writers);
+  return dep;
+}
+
+int parallel_interpret_stmts(linmem *mem, stmt_arr *s, var_env *env,
+                             int nthreads) {
+  stmt_arr_ASSERT(s);
+  ASSERT(mem);
+  ASSERT(nthreads > 0);
+
+  parallel_set_threads(nthreads);
+  gc_bind(mem, env);
+  char *alone = malloc_or_abort(s->len + 1);
+  size_t *dep = statement_deps(s, env, alone);
+  task *tasks = malloc_or_abort((s->len + 1) * sizeof *tasks);
+
+  int ret = 0;
+  size_t start = 0;
+
+  while (start < s->len) {
+    if (alone[start]) {
+      if (interpret_stmt(mem, &s->stmts[start], env))
+        ret = -1;
+      start++;
+      continue;
+    }
+
+    // Grow the wave while every producer is already committed
+    size_t end = start + 1;
+    while (end < s->len && !alone[end] && dep[end] <= start)
+      end++;
+
+    for (size_t i = start; i < end; ++i)
+      tasks[i] = (task){.s = &s->stmts[i]};
+
+    gc_heap *gc = gc_detach(mem);
+    wave w = {.tasks = &tasks[start], .mem = mem, .env = env};
+    run_charged(mem, run_task, &w, end - start);
+
+    for (size_t i = start; i < end; ++i)
+      if (commit(&tasks[i], env))
+        ret = -1;
+    gc_attach(mem, gc);
+
+    start = end;
+  }
+
+  free(tasks);
+  free(alone);
+  free(dep);
+  return ret;
+}
+
+///////////////////////////////////////
+////////////// Section Builtins
+
+/**
+ * parallel_map, parallel_for and parallel_reduce
+ * - Elements are split into at most PARALLEL_CHUNKS chunks, by their count
+ *   alone, and the pool's workers steal chunks off each other
+ * - Each worker calls back on a view of the caller's env (see var_env.h):
+ *   its own stacks and a copy of the globals. Callbacks can't assign
+ *   globals or change maps, and may only store numbers into arrays that
+ *   are numeric. Anything else they touch they should only read
+ * - Chunks stop once an earlier chunk failed. The error reported is the
+ *   first in element order, whichever thread got there first
+ * - A builtin called from a callback runs its chunks on that thread
+ */
+#define PARALLEL_CHUNKS 64
+
+typedef enum { PAR_MAP, PAR_FOR, PAR_REDUCE } par_kind;
+
+typedef struct {
+  value acc; // PAR_REDUCE: the chunk's elements folded left to right
+  char *err;
+  size_t errlen;
+} chunk;
+
+typedef struct {
+  par_kind kind;
+  value *fn;
+  array *in; // NULL for PAR_FOR, which passes indices
+  value *out;
+  size_t len;
+  size_t nchunks;
+  chunk *chunks;
+  atomic_size_t first_failed;
+
+  linmem *mem;     // Worker 0's
+  var_env *views;  // One per worker
+  var_env *nested; // Instead of views, inside a callback
+} job;
+
+static value element(job *j, size_t k) {
+  if (j->in == NULL)
+    return (value){.type = V_NUMBER, .dval = (double)k};
+  return array_at(j->in, k);
+}
+
+static int run_element(job *j, chunk *ch, size_t k, size_t lo, linmem *mem,
+                       var_env *env) {
+  value args[2] = {element(j, k)};
+  switch (j->kind) {
+  case PAR_MAP:
+    return interpret_call_values(mem, j->fn, args, 1, &j->out[k], env);
+  case PAR_FOR: {
+    value ignored;
+    return interpret_call_values(mem, j->fn, args, 1, &ignored, env);
+  }
+  case PAR_REDUCE:
+    if (k == lo) {
+      ch->acc = args[0];
+      return 0;
+    }
+    args[1] = args[0];
+    args[0] = ch->acc;
+    return interpret_call_values(mem, j->fn, args, 2, &ch->acc, env);
+  }
+  unreachable();
+}
+
+static void run_chunk(void *ctx, size_t c, int worker) {
+  job *j = ctx;
+  chunk *ch = &j->chunks[c];
+  linmem *mem = worker_arena(j->mem, worker);
+  var_env *env = j->nested != NULL ? j->nested : &j->views[worker];
+
+  FILE *errs = open_memstream(&ch->err, &ch->errlen);
+  abort_if(errs == NULL, "open_memstream");
+  FILE *prev = errors_redirect(errs);
+
+  size_t lo = j->len * c / j->nchunks;
+  size_t hi = j->len * (c + 1) / j->nchunks;
+  for (size_t k = lo; k < hi && c < atomic_load(&j->first_failed); ++k) {
+    if (run_element(j, ch, k, lo, mem, env)) {
+      size_t first = atomic_load(&j->first_failed);
+      while (c < first &&
+             !atomic_compare_exchange_weak(&j->first_failed, &first, c))
+        ;
+      break;
+    }
+  }
+
+  errors_redirect(prev);
+  fclose(errs);
+}
+
+// Runs every chunk, then reports the first error. -1 if there was one
+static int run_job(job *j, var_env *env) {
+  j->nchunks = j->len < PARALLEL_CHUNKS ? j->len : PARALLEL_CHUNKS;
+  j->chunks = malloc_or_abort((j->nchunks + 1) * sizeof *j->chunks);
+  memset(j->chunks, 0, (j->nchunks + 1) * sizeof *j->chunks);
+  atomic_init(&j->first_failed, j->nchunks);
+
+  if (env->shared != NULL) {
+    j->nested = env;
+    for (size_t c = 0; c < j->nchunks; ++c)
+      run_chunk(j, c, 0);
+  } else {
+    thread_pool *p = parallel_pool();
+    int n = pool_size(p);
+    j->views = malloc_or_abort(n * sizeof *j->views);
+    for (int w = 0; w < n; ++w)
+      j->views[w] = var_env_view(env);
+
+    gc_heap *gc = gc_detach(j->mem);
+    run_charged(j->mem, run_chunk, j, j->nchunks);
+    gc_attach(j->mem, gc);
+
+    for (int w = 0; w < n; ++w)
+      var_env_view_free(&j->views[w]);
+    free(j->views);
+  }
+
+  size_t first = atomic_load(&j->first_failed);
+  for (size_t c = 0; c < j->nchunks; ++c) {
+    if (c == first)
+      errors_replay(j->chunks[c].err, j->chunks[c].errlen);
+    free(j->chunks[c].err);
+  }
+  return first < j->nchunks ? -1 : 0;
+}
+
+static array *array_arg(value *arg, const char *fn) {
+  if (arg->type != V_ARRAY) {
+    runtime_error("%s expects an array\n", fn);
+    return NULL;
+  }
+  return arg->arr;
+}
+
+int parallel_map(linmem *mem, value *args, value *dest, var_env *env) {
+  array *in = array_arg(&args[0], "parallel_map");
+  if (in == NULL)
+    return -1;
+
+  job j = {.kind = PAR_MAP, .fn = &args[1], .in = in, .len = in->len,
+           .mem = mem};
+  j.out = malloc_or_abort((j.len + 1) * sizeof *j.out);
+  int ret = run_job(&j, env);
+
+  // Stored here, since a non number boxes the whole array
+  if (ret == 0) {
+    array *a = array_create(mem, j.len);
+    for (size_t k = 0; k < j.len; ++k)
+      array_store(mem, a, k, j.out[k]);
+    *dest = (value){.type = V_ARRAY, .arr = a};
+  }
+  free(j.out);
+  free(j.chunks);
+  return ret;
+}
+
+int parallel_for(linmem *mem, value *args, value *dest, var_env *env) {
+  double n = args[0].dval;
+  if (args[0].type != V_NUMBER || !(n >= 0) || n != (double)(size_t)n) {
+    runtime_error("parallel_for expects a whole number of iterations\n");
+    return -1;
+  }
+
+  job j = {.kind = PAR_FOR, .fn = &args[1], .len = (size_t)n, .mem = mem};
+  int ret = run_job(&j, env);
+  free(j.chunks);
+  *dest = (value){.type = V_NIL};
+  return ret;
+}
+
+// Chunks are folded on their own, then into init in order. So the result
+// only depends on the array, and matches a serial fold when fn is
+// associative
+int parallel_reduce(linmem *mem, value *args, value *dest, var_env *env) {
+  array *in = array_arg(&args[0], "parallel_reduce");
+  if (in == NULL)
+    return -1;
+
+  job j = {.kind = PAR_REDUCE, .fn = &args[1], .in = in, .len = in->len,
+           .mem = mem};
+  int ret = run_job(&j, env);
+
+  *dest = args[2];
+  for (size_t c = 0; c < j.nchunks && ret == 0; ++c) {
+    value pair[2] = {*dest, j.chunks[c].acc};
+    ret = interpret_call_values(mem, &args[1], pair, 2, dest, env);
+  }
+  free(j.chunks);
+  return ret;
+}
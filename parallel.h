@@ -0,0 +1,32 @@
+#pragma once
+
+#include "memory.h"
+#include "statements.h"
+#include "var_env.h"
+
+/**
+ * Runs top level statements on a thread pool
+ * - Statements are grouped in waves: a wave never contains a statement that
+ *   reads a global declared by an earlier statement of the same wave
+ * - A wave is evaluated concurrently, then committed in program order
+ *   (errors, prints, declarations), so output matches serial execution
+ */
+int parallel_interpret_stmts(linmem *mem, stmt_arr *s, var_env *env,
+                             int nthreads);
+
+// Threads of the pool every parallel section shares, the number of CPUs
+// unless set before the first one
+void parallel_set_threads(int nthreads);
+
+/**
+ * Builtins
+ * - parallel_map(array, fn): the array of fn(element)
+ * - parallel_for(n, fn): fn(i) for every i in [0, n), returns nil
+ * - parallel_reduce(array, fn, init): fn(acc, element) over the array,
+ *   starting from init
+ */
+int parallel_map(linmem *mem, value *args, value *dest, var_env *env);
+
+int parallel_for(linmem *mem, value *args, value *dest, var_env *env);
+
+int parallel_reduce(linmem *mem, value *args, value *dest, var_env *env);
@@ -0,0 +1,114 @@
+#include "errors.h"
+#include "interpreter.h"
+#include "parallel.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Differential test: every script must print the same, report the same
+// errors and fail the same way whether its statements run one after the
+// other or in waves on the pool
+static const char *cases[] = {
+    "var a = 1; var b = 2; var c = 3; print a + b + c;",
+    "var a = 1; var b = a + 1; var c = b + 1; print c; var d = a + c;"
+    "print d;",
+    "print 1; print 2; print 3; print 4; print 5; print 6; print 7;",
+    "var a = 1; var a = a + 1; var b = a * 10; print a; print b;",
+    // Errors in the middle of a wave, then statements that need the
+    // failed declaration
+    "var a = 1; var b = \"x\" - 1; var c = a + 2; print c; print b;",
+    "var a = -\"x\"; var b = nil * 2; var c = true + 1; print 1;",
+    "print missing; var a = 1; print a; print also_missing + a;",
+    "var s = \"a string long enough not to be small\"; var t = s + s;"
+    "var u = t + s; print u; print s < t; print t == s + s;",
+    "var a = [1, 2, 3]; var b = a[1]; var c = a[5]; print b; print c;",
+    "var m = map(); m[\"k\"] = 1; var v = m[\"k\"]; var w = m[\"j\"];"
+    "print v; print w;",
+    // Calls, assignments and loops run alone, between waves
+    "fun f(x) { return x * 2; } var a = f(1); var b = 3; var c = f(b);"
+    "print a + c;",
+    "var a = 1; a = a + 1; var b = a; print b; var c = a + b; print c;",
+    "var s = 0; for (var i = 0; i < 10; i = i + 1) s = s + i; var t = s;"
+    "print t;",
+    "class P { init(v) { this.v = v; } } var p = P(1); var q = p.v + 1;"
+    "print q; p.w = 2; print p.w + q;",
+    "fun sq(x) { return x * x; } var a = [1, 2, 3, 4];"
+    "var b = parallel_map(a, sq); var c = b[3]; print c;",
+    "fun bad(x) { return x - \"y\"; } var a = [1, 2];"
+    "var b = parallel_map(a, bad); print b; var c = 1; print c;",
+    "var a = 1 / 0; var b = 0 / 0; print a; print b == b; print -0;",
+    "var a = 1; { var a = 2; print a; } print a; var b = a + 1; print b;",
+};
+
+static int failures = 0;
+
+// What a run printed and reported, and what it returned
+typedef struct {
+  char *out;
+  char *errors;
+  int ret;
+} outcome;
+
+// The whole file fp was written to
+static char *read_all(FILE *fp) {
+  long len = ftell(fp);
+  char *ret = malloc(len + 1);
+  rewind(fp);
+  ret[fread(ret, 1, len, fp)] = '\0';
+  return ret;
+}
+
+// Serially, or in waves of nthreads
+static outcome run_case(const char *c, int nthreads) {
+  FILE *out = tmpfile();
+  FILE *errs = tmpfile();
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(fileno(out), STDOUT_FILENO);
+  FILE *old = errors_redirect(errs);
+
+  var_env env = var_env_create();
+  token_arr arr = scanner_parse_tokens(c);
+  stmt_arr stmts = parse_tokens(arr);
+  int ret = nthreads == 0
+                ? interpret_stmts(&arr.mem, &stmts, &env)
+                : parallel_interpret_stmts(&arr.mem, &stmts, &env, nthreads);
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  errors_redirect(old);
+
+  outcome o = {.out = read_all(out), .errors = read_all(errs), .ret = ret};
+  fclose(out);
+  fclose(errs);
+  return o;
+}
+
+int main() {
+  size_t n = sizeof cases / sizeof *cases;
+  for (size_t i = 0; i < n; ++i) {
+    outcome serial = run_case(cases[i], 0);
+    outcome waves = run_case(cases[i], 4);
+    if (strcmp(serial.out, waves.out) != 0 ||
+        strcmp(serial.errors, waves.errors) != 0 || serial.ret != waves.ret) {
+      fprintf(stdout,
+              "FAIL: %s\nserially:\n%s%s(%d)\nin waves:\n%s%s(%d)\n",
+              cases[i], serial.out, serial.errors, serial.ret, waves.out,
+              waves.errors, waves.ret);
+      failures++;
+    }
+    free(serial.out);
+    free(serial.errors);
+    free(waves.out);
+    free(waves.errors);
+  }
+
+  fprintf(stdout, "%zu cases, %d failures\n", n, failures);
+  return failures != 0;
+}
@@ -1,25 +1,122 @@
 #include "parser.h"
 #include "errors.h"
 #include "expression.h"
+#include "facades.h"
 #include "memory.h"
 #include "statements.h"
 #include "token.h"
+#include "vector.h"
 
 #include <stdarg.h>
 #include <string.h>
 
+typedef struct {
+  char *name;
+  int ready;    // Its initializer is parsed, so it can be read
+  function *fn; // Declared by a fun declaration
+  int *boxed;   // Shared with its captures, once it has any
+
+  // Loops open at its declaration. Assigned in a loop it didn't start in,
+  // it may be assigned again after a capture that comes later in the text
+  int loops;
+  int written_in_loop;
+} local;
+
+typedef struct {
+  local *at;
+  size_t len;
+  size_t cap;
+} local_arr;
+
+typedef struct {
+  size_t *at;
+  size_t len;
+  size_t cap;
+} scope_arr;
+
+// A capture, and the local it leads back to
+typedef struct {
+  capture c;
+  size_t origin;
+} fn_capture;
+
+typedef struct {
+  fn_capture *at;
+  size_t len;
+  size_t cap;
+} fn_capture_arr;
+
+// A function being parsed
+typedef struct {
+  function *fn;
+  size_t scope; // Its first scope
+  fn_capture_arr captures;
+} fn_ctx;
+
+typedef struct {
+  fn_ctx *at;
+  size_t len;
+  size_t cap;
+} fn_ctx_arr;
+
+typedef struct {
+  expr **at;
+  size_t len;
+  size_t cap;
+} expr_ptr_arr;
+
+// How a variable is used, for escape analysis and boxing
+typedef enum { USE_READ, USE_CALLEE, USE_WRITE } var_use;
+
 typedef struct {
   size_t cur;
   token_arr tokens;
   linmem mem;
+
+  // Resolver: the locals of every open block, innermost last, and where
+  // each block's locals start
+  local_arr locals;
+  scope_arr scopes;
+
+  // Every open function, innermost last
+  fn_ctx_arr fns;
+
+  int loops; // Open loops, across functions
 } parser;
 
 #define parser_ASSERT(p)                                                       \
   ASSERT(p);                                                                   \
   ASSERT((p)->cur <= (p)->tokens.len);
 
+#define ARGS_MAX 255
+
+#define local_arr_ASSERT(a) ASSERT(a)
+#define scope_arr_ASSERT(a) ASSERT(a)
+#define fn_capture_arr_ASSERT(a) ASSERT(a)
+#define fn_ctx_arr_ASSERT(a) ASSERT(a)
+#define expr_ptr_arr_ASSERT(a) ASSERT(a)
+
+VECTOR_FUNCTIONS(local_arr, local, at, vector_grow_double);
+VECTOR_FUNCTIONS(scope_arr, size_t, at, vector_grow_double);
+VECTOR_FUNCTIONS(fn_capture_arr, fn_capture, at, vector_grow_double);
+VECTOR_FUNCTIONS(fn_ctx_arr, fn_ctx, at, vector_grow_double);
+VECTOR_FUNCTIONS(expr_ptr_arr, expr *, at, vector_grow_double);
+
 parser parser_create(token_arr arr) {
-  return (parser){.tokens = arr, .cur = 0, .mem = linmem_create()};
+  return (parser){
+      .tokens = arr,
+      .cur = 0,
+      .mem = linmem_create_named("parser"),
+  };
+}
+
+static void parser_free_scopes(parser *p) {
+  free(p->locals.at);
+  free(p->scopes.at);
+  free(p->fns.at);
+  p->locals = (local_arr){0};
+  p->scopes = (scope_arr){0};
+  p->fns = (fn_ctx_arr){0};
 }
 
 static inline token_t parser_peek_tt(const parser *p) {
@@ -37,6 +134,13 @@ static inline token parser_peek_t(const parser *p) {
   return p->tokens.tokens[p->cur];
 }
 
+static inline token_t parser_peek_next_tt(const parser *p) {
+  parser_ASSERT(p);
+  if (p->cur + 1 >= p->tokens.len)
+    return TT_EOF;
+  return p->tokens.tokens[p->cur + 1].type;
+}
+
 static inline token_t parser_prev_tt(const parser *p) {
   parser_ASSERT(p);
   ASSERT(p->cur > 0);
@@ -84,6 +188,7 @@ static void parser_synchronize(parser *p) {
     if (parser_prev_tt(p) == SEMICOLON)
       return;
     switch (parser_peek_tt(p)) {
+    case RIGHT_BRACE:
     case CLASS:
     case FUN:
     case VAR:
@@ -99,11 +204,153 @@ static void parser_synchronize(parser *p) {
   }
 }
 
+///////////////////////////////////////
+////////////// Section Resolver
+
+static void parser_begin_scope(parser *p) {
+  scope_arr_make_available(&p->scopes, p->scopes.len + 1);
+  p->scopes.at[p->scopes.len++] = p->locals.len;
+}
+
+// Returns the number of locals the scope declared
+static int parser_end_scope(parser *p) {
+  ASSERT(p->scopes.len > 0);
+  size_t start = p->scopes.at[--p->scopes.len];
+  int ret = (int)(p->locals.len - start);
+  p->locals.len = start;
+  return ret;
+}
+
+// Returns the new local's index in the innermost scope
+static int parser_declare_local(parser *p, token t) {
+  ASSERT(p->scopes.len > 0);
+  size_t start = p->scopes.at[p->scopes.len - 1];
+
+  for (size_t i = start; i < p->locals.len; ++i) {
+    if (strcmp(p->locals.at[i].name, t.literal) == 0) {
+      compile_error(t.line, "Already a variable named %s in this scope\n",
+                    t.literal);
+      return -1;
+    }
+  }
+
+  local_arr_make_available(&p->locals, p->locals.len + 1);
+  p->locals.at[p->locals.len++] = (local){.name = t.literal, .loops = p->loops};
+  return (int)(p->locals.len - 1 - start);
+}
+
+// The innermost local named name in scopes [from, to), or -1
+static long parser_find_local(parser *p, const char *name, size_t from,
+                              size_t to, size_t *scope) {
+  for (size_t d = to; d-- > from;) {
+    size_t end = d + 1 < p->scopes.len ? p->scopes.at[d + 1] : p->locals.len;
+    for (size_t i = end; i-- > p->scopes.at[d];) {
+      if (strcmp(p->locals.at[i].name, name) == 0) {
+        *scope = d;
+        return (long)i;
+      }
+    }
+  }
+  return -1;
+}
+
+// Index of origin's capture in f, added if it's new
+static int fn_ctx_capture(fn_ctx *f, capture c, size_t origin) {
+  for (size_t i = 0; i < f->captures.len; ++i)
+    if (f->captures.at[i].origin == origin)
+      return (int)i;
+
+  fn_capture_arr_make_available(&f->captures, f->captures.len + 1);
+  f->captures.at[f->captures.len] = (fn_capture){.c = c, .origin = origin};
+  return (int)f->captures.len++;
+}
+
+static int parser_check_ready(local *l, int line) {
+  if (!l->ready) {
+    compile_error(line, "Can't read local variable %s in its own initializer\n",
+                  l->name);
+    return -1;
+  }
+  return 0;
+}
+
+// Assignments of captured variables go through a box
+static void parser_note_write(parser *p, local *l) {
+  if (p->loops > l->loops)
+    l->written_in_loop = 1;
+  if (l->boxed != NULL)
+    *l->boxed = 1;
+}
+
+// Leaves v global unless an open scope declares it. A local of an enclosing
+// function is captured by every function in between
+static int parser_resolve(parser *p, variable *v, int line, var_use use) {
+  size_t start = p->fns.len > 0 ? p->fns.at[p->fns.len - 1].scope : 0;
+  size_t d;
+  long i = parser_find_local(p, v->name, start, p->scopes.len, &d);
+
+  if (i >= 0) {
+    local *l = &p->locals.at[i];
+    if (parser_check_ready(l, line))
+      return -1;
+    if (use == USE_READ && l->fn != NULL)
+      l->fn->escapes = 1;
+    if (use == USE_WRITE)
+      parser_note_write(p, l);
+
+    v->kind = VAR_LOCAL;
+    v->depth = (int)(p->scopes.len - 1 - d);
+    v->idx = (int)((size_t)i - p->scopes.at[d]);
+    return 0;
+  }
+
+  for (size_t j = p->fns.len; j-- > 0;) {
+    size_t from = j > 0 ? p->fns.at[j - 1].scope : 0;
+    if ((i = parser_find_local(p, v->name, from, p->fns.at[j].scope, &d)) < 0)
+      continue;
+
+    local *l = &p->locals.at[i];
+    if (parser_check_ready(l, line))
+      return -1;
+    if (l->fn != NULL)
+      l->fn->escapes = 1;
+    if (l->boxed == NULL) {
+      l->boxed = linmem_malloc(&p->mem, sizeof *l->boxed);
+      *l->boxed = l->written_in_loop;
+    }
+    if (use == USE_WRITE)
+      parser_note_write(p, l);
+
+    capture c = {
+        .from_local = 1,
+        .level = (int)(d - from),
+        .idx = (int)((size_t)i - p->scopes.at[d]),
+        .boxed = l->boxed,
+    };
+    int k = fn_ctx_capture(&p->fns.at[j], c, (size_t)i);
+    for (size_t m = j + 1; m < p->fns.len; ++m)
+      k = fn_ctx_capture(&p->fns.at[m],
+                         (capture){.parent = k, .boxed = l->boxed}, (size_t)i);
+
+    v->kind = VAR_CAPTURE;
+    v->idx = k;
+    return 0;
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////
+////////////// Section Expressions
+
 expr *parse_expression(parser *p);
 
 /**
  * primary -> NUMBER | STRING | "true" | "false" | "nil" | "(" expression ")"
+ *          | "[" arguments? "]"
  */
+static expr *parse_finish_array(parser *p);
+
 static expr *parse_primary(parser *p) {
   if (parser_match(p, 1, TRUE)) {
     expr *e = linmem_malloc(&p->mem, sizeof *e);
@@ -149,11 +396,34 @@ static expr *parse_primary(parser *p) {
 
     ASSERT(prev.type == IDENTIFIER);
 
+    // Being called right away doesn't let a function escape
+    var_use use = parser_check(p, LEFT_PAREN) ? USE_CALLEE : USE_READ;
+
     expr *e = linmem_malloc(&p->mem, sizeof *e);
     *e = expr_variable(prev.literal);
+    if (parser_resolve(p, &e->v, prev.line, use))
+      return NULL;
+    return e;
+  }
+
+  if (parser_match(p, 1, THIS)) {
+    token prev = parser_prev_t(p);
+
+    // The receiver is local 0 of every method
+    expr *e = linmem_malloc(&p->mem, sizeof *e);
+    *e = expr_variable("this");
+    if (parser_resolve(p, &e->v, prev.line, USE_READ))
+      return NULL;
+    if (variable_is_global(&e->v)) {
+      compile_error(prev.line, "Can't use 'this' outside of a class\n");
+      return NULL;
+    }
     return e;
   }
 
+  if (parser_match(p, 1, LEFT_BRACKET))
+    return parse_finish_array(p);
+
   if (parser_match(p, 1, LEFT_PAREN)) {
     expr *e = parse_expression(p);
 
@@ -181,8 +451,118 @@ static expr *parse_primary(parser *p) {
   return NULL;
 }
 
+// The arguments of a call of callee, after its opening paren
+static expr *parse_finish_call(parser *p, expr *callee) {
+  token paren = parser_prev_t(p);
+  expr *args[ARGS_MAX];
+  int nargs = 0;
+
+  if (!parser_check(p, RIGHT_PAREN)) {
+    do {
+      if (nargs == ARGS_MAX) {
+        compile_error(paren.line, "Can't have more than %d arguments\n",
+                      ARGS_MAX);
+        return NULL;
+      }
+      if ((args[nargs++] = parse_expression(p)) == NULL)
+        return NULL;
+    } while (parser_match(p, 1, COMMA));
+  }
+
+  if (!parser_match(p, 1, RIGHT_PAREN)) {
+    token t = parser_peek_t(p);
+    compile_error(t.line, "Expected ')' after arguments\n");
+    return NULL;
+  }
+
+  expr **argv = linmem_malloc(&p->mem, nargs * sizeof *argv);
+  memcpy(argv, args, nargs * sizeof *argv);
+
+  expr *ret = linmem_malloc(&p->mem, sizeof *ret);
+  *ret = expr_call(call_c(callee, argv, nargs, token_pos(paren)));
+  return ret;
+}
+
+// The elements of an array literal, after its opening bracket. Unlike
+// arguments there can be any number of them
+static expr *parse_finish_array(parser *p) {
+  token bracket = parser_prev_t(p);
+  expr_ptr_arr elems = {0};
+
+  if (!parser_check(p, RIGHT_BRACKET)) {
+    do {
+      expr_ptr_arr_make_available(&elems, elems.len + 1);
+      if ((elems.at[elems.len++] = parse_expression(p)) == NULL) {
+        free(elems.at);
+        return NULL;
+      }
+    } while (parser_match(p, 1, COMMA));
+  }
+
+  if (!parser_match(p, 1, RIGHT_BRACKET)) {
+    compile_error(bracket.line, "Expected ']' after array elements\n");
+    free(elems.at);
+    return NULL;
+  }
+
+  expr **copy = linmem_malloc(&p->mem, elems.len * sizeof *copy);
+  if (elems.len > 0)
+    memcpy(copy, elems.at, elems.len * sizeof *copy);
+  free(elems.at);
+
+  expr *ret = linmem_malloc(&p->mem, sizeof *ret);
+  *ret = expr_array(copy, (int)elems.len);
+  return ret;
+}
+
+/**
+ * call -> primary ( "(" arguments? ")" | "." IDENTIFIER | "[" expression "]" )*
+ * arguments -> expression ( "," expression )*
+ */
+static expr *parse_call(parser *p) {
+  parser_ASSERT(p);
+
+  expr *e = parse_primary(p);
+
+  while (e != NULL) {
+    if (parser_match(p, 1, LEFT_PAREN)) {
+      e = parse_finish_call(p, e);
+    } else if (parser_match(p, 1, DOT)) {
+      if (!parser_match(p, 1, IDENTIFIER)) {
+        compile_error(parser_peek_t(p).line,
+                      "Expected property name after '.'\n");
+        return NULL;
+      }
+
+      // Every property site gets its own inline cache
+      prop_cache *cache = linmem_malloc(&p->mem, sizeof *cache);
+      *cache = (prop_cache){0};
+
+      expr *ret = linmem_malloc(&p->mem, sizeof *ret);
+      *ret = expr_get(e, parser_prev_t(p).literal, cache);
+      e = ret;
+    } else if (parser_match(p, 1, LEFT_BRACKET)) {
+      expr *index = parse_expression(p);
+      if (index == NULL)
+        return NULL;
+      if (!parser_match(p, 1, RIGHT_BRACKET)) {
+        compile_error(parser_peek_t(p).line, "Expected ']' after index\n");
+        return NULL;
+      }
+
+      expr *ret = linmem_malloc(&p->mem, sizeof *ret);
+      *ret = expr_index(e, index);
+      e = ret;
+    } else {
+      break;
+    }
+  }
+
+  return e;
+}
+
 /**
- * unary -> ( "!" | "-" ) unary | primary
+ * unary -> ( "!" | "-" ) unary | call
  */
 static expr *parse_unary(parser *p) {
   parser_ASSERT(p);
@@ -199,7 +579,7 @@ static expr *parse_unary(parser *p) {
     *ret = expr_unary(unary_c(e, prev));
     return ret;
   } else {
-    return parse_primary(p);
+    return parse_call(p);
   }
 }
 
@@ -215,20 +595,48 @@ static expr *parse_factor(parser *p) {
     return NULL;
 
   while (parser_match(p, 2, SLASH, STAR)) {
-    token_t prev = parser_prev_tt(p);
+    token prev = parser_prev_t(p);
     expr *right = parse_unary(p);
 
     if (right == NULL)
       return NULL;
 
     expr *ret = linmem_malloc(&p->mem, sizeof *ret);
-    *ret = expr_binary(binary_c(e, prev, right));
+    *ret = expr_binary(binary_c(e, prev.type, right, token_pos(prev)));
     e = ret;
   }
 
   return e;
 }
 
+// Left nested + chains of three operands or more become one ET_CONCAT.
+// Past CONCAT_MAX the rest of the chain becomes its first part
+static expr *parser_fuse_concat(parser *p, expr *e) {
+  int n = 1;
+  for (expr *l = e; l->type == ET_BINARY && l->b.op == PLUS && n < CONCAT_MAX;
+       l = l->b.left)
+    n++;
+  if (n < 3)
+    return e;
+
+  expr **parts = linmem_malloc(&p->mem, n * sizeof *parts);
+  binary **ops = linmem_malloc(&p->mem, (n - 1) * sizeof *ops);
+  expr *l = e;
+  for (int k = n - 1; k > 0; --k) {
+    parts[k] = l->b.right;
+    ops[k - 1] = &l->b;
+    l = l->b.left;
+  }
+  parts[0] = parser_fuse_concat(p, l);
+
+  expr *ret = linmem_malloc(&p->mem, sizeof *ret);
+  *ret = (expr){
+      .type = ET_CONCAT,
+      .cat = {.chain = e, .parts = parts, .ops = ops, .nparts = n},
+  };
+  return ret;
+}
+
 /**
  * term -> factor ( ( "+" | "-" ) factor )*
  */
@@ -241,18 +649,18 @@ static expr *parse_term(parser *p) {
     return NULL;
 
   while (parser_match(p, 2, PLUS, MINUS)) {
-    token_t prev = parser_prev_tt(p);
+    token prev = parser_prev_t(p);
     expr *right = parse_factor(p);
 
     if (right == NULL)
       return NULL;
 
     expr *ret = linmem_malloc(&p->mem, sizeof *ret);
-    *ret = expr_binary(binary_c(e, prev, right));
+    *ret = expr_binary(binary_c(e, prev.type, right, token_pos(prev)));
     e = ret;
   }
 
-  return e;
+  return parser_fuse_concat(p, e);
 }
 
 /**
@@ -267,14 +675,14 @@ static expr *parse_comparison(parser *p) {
     return NULL;
 
   while (parser_match(p, 4, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL)) {
-    token_t prev = parser_prev_tt(p);
+    token prev = parser_prev_t(p);
     expr *right = parse_term(p);
 
     if (right == NULL)
       return NULL;
 
     expr *ret = linmem_malloc(&p->mem, sizeof *ret);
-    *ret = expr_binary(binary_c(e, prev, right));
+    *ret = expr_binary(binary_c(e, prev.type, right, token_pos(prev)));
     e = ret;
   }
 
@@ -293,21 +701,64 @@ static expr *parse_equality(parser *p) {
     return NULL;
 
   while (parser_match(p, 2, EQUAL_EQUAL, BANG_EQUAL)) {
-    token_t prev = parser_prev_tt(p);
+    token prev = parser_prev_t(p);
     expr *right = parse_comparison(p);
 
     if (right == NULL)
       return NULL;
 
     expr *ret = linmem_malloc(&p->mem, sizeof *ret);
-    *ret = expr_binary(binary_c(e, prev, right));
+    *ret = expr_binary(binary_c(e, prev.type, right, token_pos(prev)));
     e = ret;
   }
 
   return e;
 }
 
-expr *parse_expression(parser *p) { return parse_equality(p); }
+/**
+ * assignment -> ( call "." )? IDENTIFIER "=" assignment
+ *             | call "[" expression "]" "=" assignment | equality
+ */
+static expr *parse_assignment(parser *p) {
+  parser_ASSERT(p);
+
+  if (!parser_check(p, IDENTIFIER) || parser_peek_next_tt(p) != EQUAL) {
+    expr *e = parse_equality(p);
+    if (e == NULL || !parser_match(p, 1, EQUAL))
+      return e;
+
+    token equals = parser_prev_t(p);
+    expr *value = parse_assignment(p);
+    if (value == NULL)
+      return NULL;
+
+    if (e->type == ET_GET) {
+      *e = expr_set(e->get, value);
+    } else if (e->type == ET_INDEX) {
+      *e = expr_index_set(e->idx, value);
+    } else {
+      compile_error(equals.line, "Invalid assignment target\n");
+      return NULL;
+    }
+    return e;
+  }
+
+  token t = parser_peek_t(p);
+  parser_advance(p);
+  parser_advance(p);
+
+  expr *value = parse_assignment(p);
+  if (value == NULL)
+    return NULL;
+
+  expr *ret = linmem_malloc(&p->mem, sizeof *ret);
+  *ret = expr_assign(t.literal, value);
+  if (parser_resolve(p, &ret->a.target, t.line, USE_WRITE))
+    return NULL;
+  return ret;
+}
+
+expr *parse_expression(parser *p) { return parse_assignment(p); }
 
 int parse_print_stmt(stmt *dest, parser *p) {
   parser_ASSERT(p);
@@ -355,6 +806,220 @@ int parse_expr_stmt(stmt *dest, parser *p) {
   }
 }
 
+int parse_decl(stmt *dest, parser *p);
+int parse_stmt(stmt *dest, parser *p);
+int parse_var_decl(stmt *dest, parser *p);
+
+// Declarations up to and including the closing brace, in the open scope
+static int parse_block_body(stmt_arr *dest, parser *p) {
+  *dest = stmt_arr_create();
+
+  while (!parser_check(p, RIGHT_BRACE) && !parser_end(p)) {
+    stmt s = {.pos = token_pos(parser_peek_t(p))};
+    if (parse_decl(&s, p) == 0)
+      stmt_arr_push(dest, s);
+  }
+  stmt_arr_shrink(dest);
+
+  if (!parser_match(p, 1, RIGHT_BRACE)) {
+    token t = parser_peek_t(p);
+    compile_error(t.line, "Expected '}' after block\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * block -> "{" declaration* "}"
+ */
+int parse_block(stmt *dest, parser *p) {
+  parser_ASSERT(p);
+  ASSERT(dest);
+
+  dest->type = ST_BLOCK;
+  parser_begin_scope(p);
+  int ret = parse_block_body(&dest->body, p);
+  dest->nlocals = parser_end_scope(p);
+  return ret;
+}
+
+// A statement of its own, for the branches of an if
+static stmt *parse_branch(parser *p) {
+  stmt *ret = linmem_malloc(&p->mem, sizeof *ret);
+  *ret = (stmt){.pos = token_pos(parser_peek_t(p))};
+  if (parse_stmt(ret, p))
+    return NULL;
+  return ret;
+}
+
+/**
+ * ifStmt -> "if" "(" expression ")" statement ( "else" statement )?
+ */
+int parse_if_stmt(stmt *dest, parser *p) {
+  parser_ASSERT(p);
+  ASSERT(dest);
+
+  if (!parser_match(p, 1, LEFT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected '(' after 'if'\n");
+    return -1;
+  }
+  if ((dest->e = parse_expression(p)) == NULL)
+    return -1;
+  if (!parser_match(p, 1, RIGHT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected ')' after if condition\n");
+    return -1;
+  }
+
+  dest->type = ST_IF;
+  if ((dest->then_s = parse_branch(p)) == NULL)
+    return -1;
+  if (parser_match(p, 1, ELSE) && (dest->else_s = parse_branch(p)) == NULL)
+    return -1;
+  return 0;
+}
+
+// The body of a loop, which may run again after anything in it
+static stmt *parse_loop_body(parser *p) {
+  p->loops++;
+  stmt *ret = parse_branch(p);
+  p->loops--;
+  return ret;
+}
+
+/**
+ * whileStmt -> "while" "(" expression ")" statement
+ */
+int parse_while_stmt(stmt *dest, parser *p) {
+  parser_ASSERT(p);
+  ASSERT(dest);
+
+  if (!parser_match(p, 1, LEFT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected '(' after 'while'\n");
+    return -1;
+  }
+
+  // The condition runs on every iteration too
+  p->loops++;
+  dest->e = parse_expression(p);
+  p->loops--;
+  if (dest->e == NULL)
+    return -1;
+
+  if (!parser_match(p, 1, RIGHT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected ')' after condition\n");
+    return -1;
+  }
+
+  dest->type = ST_WHILE;
+  if ((dest->then_s = parse_loop_body(p)) == NULL)
+    return -1;
+  return 0;
+}
+
+// Everything after "for (": the initializer, then the loop itself
+static int parse_for_rest(stmt_arr *body, parser *p) {
+  stmt init = {.pos = token_pos(parser_peek_t(p))};
+  if (parser_match(p, 1, VAR)) {
+    if (parse_var_decl(&init, p))
+      return -1;
+    stmt_arr_push(body, init);
+  } else if (!parser_match(p, 1, SEMICOLON)) {
+    if (parse_expr_stmt(&init, p))
+      return -1;
+    stmt_arr_push(body, init);
+  }
+
+  stmt loop = {.type = ST_WHILE, .pos = token_pos(parser_peek_t(p))};
+
+  // The condition and increment run on every iteration too
+  p->loops++;
+  if (!parser_check(p, SEMICOLON)) {
+    loop.e = parse_expression(p);
+  } else {
+    loop.e = linmem_malloc(&p->mem, sizeof *loop.e);
+    *loop.e = expr_literal(lt_true());
+  }
+  if (loop.e != NULL && !parser_match(p, 1, SEMICOLON)) {
+    compile_error(parser_peek_t(p).line, "Expected ';' after loop condition\n");
+    loop.e = NULL;
+  }
+
+  if (loop.e != NULL && !parser_check(p, RIGHT_PAREN)) {
+    stmt *incr = linmem_malloc(&p->mem, sizeof *incr);
+    *incr = (stmt){.type = ST_EXPR, .pos = token_pos(parser_peek_t(p))};
+    if ((incr->e = parse_expression(p)) == NULL)
+      loop.e = NULL;
+    loop.else_s = incr;
+  }
+  p->loops--;
+
+  if (loop.e == NULL)
+    return -1;
+  if (!parser_match(p, 1, RIGHT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected ')' after for clauses\n");
+    return -1;
+  }
+
+  if ((loop.then_s = parse_loop_body(p)) == NULL)
+    return -1;
+  stmt_arr_push(body, loop);
+  return 0;
+}
+
+/**
+ * forStmt -> "for" "(" ( varDecl | exprStmt | ";" ) expression? ";"
+ *            expression? ")" statement
+ * - A block holding the initializer and a while loop, which runs the
+ *   increment after the body
+ */
+int parse_for_stmt(stmt *dest, parser *p) {
+  parser_ASSERT(p);
+  ASSERT(dest);
+
+  if (!parser_match(p, 1, LEFT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected '(' after 'for'\n");
+    return -1;
+  }
+
+  dest->type = ST_BLOCK;
+  dest->body = stmt_arr_create();
+  parser_begin_scope(p);
+  int ret = parse_for_rest(&dest->body, p);
+  stmt_arr_shrink(&dest->body);
+  dest->nlocals = parser_end_scope(p);
+  return ret;
+}
+
+/**
+ * returnStmt -> "return" expression? ";"
+ */
+int parse_return_stmt(stmt *dest, parser *p) {
+  parser_ASSERT(p);
+  ASSERT(dest);
+
+  token keyword = parser_prev_t(p);
+  if (p->fns.len == 0) {
+    compile_error(keyword.line, "Can't return from top level code\n");
+    return -1;
+  }
+
+  dest->type = ST_RETURN;
+  if (!parser_check(p, SEMICOLON)) {
+    if (p->fns.at[p->fns.len - 1].fn->is_init) {
+      compile_error(keyword.line, "Can't return a value from an initializer\n");
+      return -1;
+    }
+    if ((dest->e = parse_expression(p)) == NULL)
+      return -1;
+  }
+
+  if (!parser_match(p, 1, SEMICOLON)) {
+    compile_error(parser_peek_t(p).line, "Expected ';' after return value\n");
+    return -1;
+  }
+  return 0;
+}
+
 int parse_stmt(stmt *dest, parser *p) {
   ASSERT(dest);
   parser_ASSERT(p);
@@ -362,6 +1027,21 @@ int parse_stmt(stmt *dest, parser *p) {
   if (parser_match(p, 1, PRINT)) {
     return parse_print_stmt(dest, p);
   }
+  if (parser_match(p, 1, LEFT_BRACE)) {
+    return parse_block(dest, p);
+  }
+  if (parser_match(p, 1, IF)) {
+    return parse_if_stmt(dest, p);
+  }
+  if (parser_match(p, 1, RETURN)) {
+    return parse_return_stmt(dest, p);
+  }
+  if (parser_match(p, 1, WHILE)) {
+    return parse_while_stmt(dest, p);
+  }
+  if (parser_match(p, 1, FOR)) {
+    return parse_for_stmt(dest, p);
+  }
   return parse_expr_stmt(dest, p);
 }
 
@@ -372,11 +1052,19 @@ int parse_var_decl(stmt *dest, parser *p) {
   }
   token t = parser_prev_t(p);
 
+  // Declared before the initializer, which may not read it
+  int idx = -1;
+  if (p->scopes.len > 0 && (idx = parser_declare_local(p, t)) < 0)
+    return -1;
+
   expr *initializer = NULL;
   if (parser_match(p, 1, EQUAL)) {
     initializer = parse_expression(p);
   }
 
+  if (idx >= 0)
+    p->locals.at[p->locals.len - 1].ready = 1;
+
   if (!parser_match(p, 1, SEMICOLON)) {
     runtime_error("Expected ';' after variable declaration\n");
     return -1;
@@ -385,7 +1073,187 @@ int parse_var_decl(stmt *dest, parser *p) {
   dest->type = ST_DECL;
   dest->e = initializer;
   dest->ident_name = t.literal;
+  dest->local_idx = idx;
+
+  return 0;
+}
+
+// Parameters, then the body in the same scope
+static int parse_fun_rest(function *fn, parser *p) {
+  if (!parser_match(p, 1, LEFT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected '(' after function name\n");
+    return -1;
+  }
+
+  if (!parser_check(p, RIGHT_PAREN)) {
+    do {
+      if (fn->arity == ARGS_MAX) {
+        compile_error(parser_peek_t(p).line,
+                      "Can't have more than %d parameters\n", ARGS_MAX);
+        return -1;
+      }
+      if (!parser_match(p, 1, IDENTIFIER)) {
+        compile_error(parser_peek_t(p).line, "Expected parameter name\n");
+        return -1;
+      }
+      if (parser_declare_local(p, parser_prev_t(p)) < 0)
+        return -1;
+      p->locals.at[p->locals.len - 1].ready = 1;
+      fn->arity++;
+    } while (parser_match(p, 1, COMMA));
+  }
+
+  if (!parser_match(p, 1, RIGHT_PAREN)) {
+    compile_error(parser_peek_t(p).line, "Expected ')' after parameters\n");
+    return -1;
+  }
+  if (!parser_match(p, 1, LEFT_BRACE)) {
+    compile_error(parser_peek_t(p).line,
+                  "Expected '{' before function body\n");
+    return -1;
+  }
+  return parse_block_body(&fn->body, p);
+}
+
+// Parses fn's parameters and body in a scope of its own, and settles what
+// it captures
+static int parse_function(function *fn, parser *p) {
+  fn_ctx_arr_make_available(&p->fns, p->fns.len + 1);
+  fn_ctx *f = &p->fns.at[p->fns.len++];
+  *f = (fn_ctx){
+      .fn = fn,
+      .scope = p->scopes.len,
+  };
+  parser_begin_scope(p);
+
+  int ret = 0;
+  if (fn->is_method) {
+    token self = {.type = THIS, .literal = "this", .line = parser_prev_t(p).line};
+    ret = parser_declare_local(p, self) < 0 ? -1 : 0;
+    p->locals.at[p->locals.len - 1].ready = 1;
+  }
+  if (ret == 0)
+    ret = parse_fun_rest(fn, p);
+
+  fn->nlocals = parser_end_scope(p);
+  f = &p->fns.at[--p->fns.len];
+
+  // The captures are final once the body is parsed
+  fn->ncaptures = (int)f->captures.len;
+  fn->captures =
+      linmem_malloc(&p->mem, f->captures.len * sizeof *fn->captures);
+  fn->local_captures_only = 1;
+  for (size_t i = 0; i < f->captures.len; ++i) {
+    fn->captures[i] = f->captures.at[i].c;
+    fn->local_captures_only &= f->captures.at[i].c.from_local;
+  }
+  free(f->captures.at);
+  return ret;
+}
+
+// Declares the name of a function or class: ready right away, so the body
+// can refer to it. Returns its local index, -1 for a global and -2 on error
+static int parser_declare_named(parser *p, token t) {
+  if (p->scopes.len == 0)
+    return -1;
+
+  int idx = parser_declare_local(p, t);
+  if (idx < 0)
+    return -2;
+  p->locals.at[p->locals.len - 1].ready = 1;
+  return idx;
+}
+
+/**
+ * funDecl -> "fun" IDENTIFIER "(" parameters? ")" block
+ */
+int parse_fun_decl(stmt *dest, parser *p) {
+  parser_ASSERT(p);
+  ASSERT(dest);
+
+  if (!parser_match(p, 1, IDENTIFIER)) {
+    compile_error(parser_peek_t(p).line, "Expected function name\n");
+    return -1;
+  }
+  token t = parser_prev_t(p);
+
+  function *fn = linmem_malloc(&p->mem, sizeof *fn);
+  *fn = (function){.name = t.literal};
+
+  int idx = parser_declare_named(p, t);
+  if (idx == -2)
+    return -1;
+  if (idx >= 0)
+    p->locals.at[p->locals.len - 1].fn = fn;
+
+  dest->type = ST_FUN;
+  dest->fn = fn;
+  dest->ident_name = t.literal;
+  dest->local_idx = idx;
+  return parse_function(fn, p);
+}
+
+/**
+ * classDecl -> "class" IDENTIFIER "{" method* "}"
+ * method -> IDENTIFIER "(" parameters? ")" block
+ */
+int parse_class_decl(stmt *dest, parser *p) {
+  parser_ASSERT(p);
+  ASSERT(dest);
+
+  if (!parser_match(p, 1, IDENTIFIER)) {
+    compile_error(parser_peek_t(p).line, "Expected class name\n");
+    return -1;
+  }
+  token t = parser_prev_t(p);
+
+  int idx = parser_declare_named(p, t);
+  if (idx == -2)
+    return -1;
+
+  if (!parser_match(p, 1, LEFT_BRACE)) {
+    compile_error(parser_peek_t(p).line, "Expected '{' before class body\n");
+    return -1;
+  }
+
+  dest->type = ST_CLASS;
+  dest->ident_name = t.literal;
+  dest->local_idx = idx;
+  dest->body = stmt_arr_create();
+
+  while (!parser_check(p, RIGHT_BRACE) && !parser_end(p)) {
+    if (!parser_match(p, 1, IDENTIFIER)) {
+      compile_error(parser_peek_t(p).line, "Expected method name\n");
+      return -1;
+    }
+    token name = parser_prev_t(p);
+
+    // A method lives on in its class, so it always escapes
+    function *fn = linmem_malloc(&p->mem, sizeof *fn);
+    *fn = (function){
+        .name = name.literal,
+        .escapes = 1,
+        .is_method = 1,
+        .is_init = strcmp(name.literal, "init") == 0,
+    };
+    if (parse_function(fn, p))
+      return -1;
 
+    stmt m = {
+        .type = ST_FUN,
+        .pos = token_pos(name),
+        .fn = fn,
+        .ident_name = name.literal,
+        .local_idx = -1,
+    };
+    stmt_arr_push(&dest->body, m);
+  }
+  stmt_arr_shrink(&dest->body);
+
+  if (!parser_match(p, 1, RIGHT_BRACE)) {
+    compile_error(parser_peek_t(p).line, "Expected '}' after class body\n");
+    return -1;
+  }
   return 0;
 }
 
@@ -393,6 +1261,22 @@ int parse_decl(stmt *dest, parser *p) {
   ASSERT(dest);
   parser_ASSERT(p);
 
+  if (parser_match(p, 1, FUN)) {
+    if (parse_fun_decl(dest, p)) {
+      parser_synchronize(p);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (parser_match(p, 1, CLASS)) {
+    if (parse_class_decl(dest, p)) {
+      parser_synchronize(p);
+      return -1;
+    }
+    return 0;
+  }
+
   if (parser_match(p, 1, VAR)) {
     if (parse_var_decl(dest, p)) {
       parser_synchronize(p);
@@ -408,10 +1292,16 @@ stmt_arr parse_tokens(token_arr arr) {
   stmt_arr ret = stmt_arr_create();
 
   while (!parser_end(&p)) {
-    stmt s;
+    linmem_mark mark = linmem_save(&p.mem);
+    stmt s = {.pos = token_pos(parser_peek_t(&p))};
     if (parse_decl(&s, &p) == 0)
       stmt_arr_push(&ret, s);
+    else if (p.locals.len == 0 && p.fns.len == 0)
+      // Dropped, and no resolver state points into what it allocated
+      linmem_reset(&p.mem, mark);
   }
 
+  parser_free_scopes(&p);
+  stmt_arr_shrink(&ret);
   return ret;
 }
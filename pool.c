@@ -0,0 +1,200 @@
+#include "pool.h"
+#include "errors.h"
+#include "facades.h"
+
+#include <pthread.h>
+
+/**
+ * Work stealing
+ * - A job's indices start out split evenly, one contiguous range per worker
+ * - A worker takes indices off the front of its own range. Once that's
+ *   empty it steals the back half of another worker's range and carries on
+ *   with that, so a worker stuck on slow indices hands the rest of them off
+ * - Each range has its own lock, which its owner only shares with thieves
+ */
+typedef struct {
+  _Alignas(64) pthread_mutex_t lock; // A cache line each
+  size_t lo;
+  size_t hi;
+} range;
+
+struct thread_pool {
+  pthread_t *threads;
+  int nthreads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t idle;
+
+  // Current job, replaced every generation
+  pool_fn fn;
+  void *ctx;
+  size_t n;
+  range *ranges; // One per worker
+  size_t done;
+  unsigned long generation;
+  int busy;
+  int stop;
+};
+
+typedef struct {
+  thread_pool *p;
+  int worker;
+} worker_arg;
+
+static int range_pop(range *r, size_t *i) {
+  pthread_mutex_lock(&r->lock);
+  int ret = r->lo < r->hi;
+  if (ret)
+    *i = r->lo++;
+  pthread_mutex_unlock(&r->lock);
+  return ret;
+}
+
+// Moves the back half of some other worker's range into ours, and takes
+// its first index. 0 once every range is empty
+static int pool_steal(thread_pool *p, int worker, size_t *i) {
+  for (int k = 1; k < p->nthreads; ++k) {
+    range *victim = &p->ranges[(worker + k) % p->nthreads];
+    pthread_mutex_lock(&victim->lock);
+    size_t lo = victim->lo + (victim->hi - victim->lo) / 2;
+    size_t hi = victim->hi;
+    victim->hi = lo;
+    pthread_mutex_unlock(&victim->lock);
+    if (lo == hi)
+      continue;
+
+    range *own = &p->ranges[worker];
+    pthread_mutex_lock(&own->lock);
+    own->lo = lo + 1;
+    own->hi = hi;
+    pthread_mutex_unlock(&own->lock);
+    *i = lo;
+    return 1;
+  }
+  return 0;
+}
+
+// Runs indices until there are none left anywhere
+static size_t pool_drain(thread_pool *p, int worker) {
+  size_t ran = 0;
+  size_t i;
+  while (range_pop(&p->ranges[worker], &i) || pool_steal(p, worker, &i)) {
+    p->fn(p->ctx, i, worker);
+    ran++;
+  }
+  return ran;
+}
+
+static void *pool_worker(void *arg) {
+  worker_arg *w = arg;
+  thread_pool *p = w->p;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&p->lock);
+  while (1) {
+    while (!p->stop && p->generation == seen)
+      pthread_cond_wait(&p->work, &p->lock);
+    if (p->stop)
+      break;
+    seen = p->generation;
+    p->busy++;
+    pthread_mutex_unlock(&p->lock);
+
+    size_t ran = pool_drain(p, w->worker);
+
+    pthread_mutex_lock(&p->lock);
+    p->done += ran;
+    p->busy--;
+    pthread_cond_broadcast(&p->idle);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  free(w);
+  return NULL;
+}
+
+thread_pool *pool_create(int nthreads) {
+  ASSERT(nthreads > 0);
+
+  thread_pool *p = malloc_or_abort(sizeof *p);
+  *p = (thread_pool){.nthreads = nthreads};
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->idle, NULL);
+
+  p->ranges = aligned_alloc(_Alignof(range), nthreads * sizeof *p->ranges);
+  abort_if(p->ranges == NULL, "aligned_alloc");
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_mutex_init(&p->ranges[i].lock, NULL);
+    p->ranges[i].lo = p->ranges[i].hi = 0;
+  }
+
+  // The calling thread is worker 0
+  p->threads = malloc_or_abort(nthreads * sizeof *p->threads);
+  for (int i = 1; i < nthreads; ++i) {
+    worker_arg *w = malloc_or_abort(sizeof *w);
+    *w = (worker_arg){.p = p, .worker = i};
+    abort_if(pthread_create(&p->threads[i], NULL, pool_worker, w),
+             "pthread_create");
+  }
+
+  return p;
+}
+
+int pool_size(thread_pool *p) {
+  ASSERT(p);
+  return p->nthreads;
+}
+
+void pool_run(thread_pool *p, pool_fn fn, void *ctx, size_t n) {
+  ASSERT(p);
+  ASSERT(fn);
+
+  pthread_mutex_lock(&p->lock);
+  p->fn = fn;
+  p->ctx = ctx;
+  p->n = n;
+  p->done = 0;
+  // Nobody drains between jobs, the locks just publish the new ranges
+  for (int w = 0; w < p->nthreads; ++w) {
+    range *r = &p->ranges[w];
+    pthread_mutex_lock(&r->lock);
+    r->lo = n * w / p->nthreads;
+    r->hi = n * (w + 1) / p->nthreads;
+    pthread_mutex_unlock(&r->lock);
+  }
+  p->generation++;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  size_t ran = pool_drain(p, 0);
+
+  // Wait for the stragglers, and for every worker to let go of the job
+  pthread_mutex_lock(&p->lock);
+  p->done += ran;
+  while (p->done < n || p->busy > 0)
+    pthread_cond_wait(&p->idle, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void pool_free(thread_pool *p) {
+  ASSERT(p);
+
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int i = 1; i < p->nthreads; ++i)
+    pthread_join(p->threads[i], NULL);
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work);
+  pthread_cond_destroy(&p->idle);
+  for (int i = 0; i < p->nthreads; ++i)
+    pthread_mutex_destroy(&p->ranges[i].lock);
+  free(p->ranges);
+  free(p->threads);
+  free(p);
+}
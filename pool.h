@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Fixed size, work stealing thread pool
+ * - pool_run hands out indices [0, n) to the workers and the calling thread.
+ *   Each starts on its own contiguous share and steals from the others
+ *   once it runs out
+ * - worker is in [0, nthreads) and stable for the duration of a call, so it
+ *   can index per worker state
+ */
+typedef void (*pool_fn)(void *ctx, size_t i, int worker);
+
+typedef struct thread_pool thread_pool;
+
+thread_pool *pool_create(int nthreads);
+
+int pool_size(thread_pool *p);
+
+// Blocks until fn ran for every index
+void pool_run(thread_pool *p, pool_fn fn, void *ctx, size_t n);
+
+void pool_free(thread_pool *p);
@@ -0,0 +1,232 @@
+#include "profile.h"
+#include "errors.h"
+#include "memory.h"
+#include "value_hashtable.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROFILE_MAGIC "clox-profile"
+#define PROFILE_VERSION 1
+
+// Binary feedback is packed into one number: left | right << MASK_BITS
+#define MASK_BITS 16
+
+_Static_assert(V_COUNT <= MASK_BITS, "binary feedback has a bit per type");
+
+// What a profile file holds fits, anything else was made up
+static int profile_count_ok(double d, int bits) {
+  return d >= 0 && d < (double)(1ull << bits);
+}
+
+static uint64_t source_hash(const char *source) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *source; ++source)
+    h = (h ^ (uint8_t)*source) * 1099511628211ULL;
+  return h;
+}
+
+typedef void (*binary_visitor)(binary *b, void *ctx);
+
+static void walk_expr(expr *e, binary_visitor f, void *ctx) {
+  if (e == NULL)
+    return;
+
+  switch (e->type) {
+  case ET_LITERAL:
+  case ET_VARIABLE:
+    return;
+  case ET_UNARY:
+    walk_expr(e->u.e, f, ctx);
+    return;
+  case ET_GROUPING:
+    walk_expr(e->g, f, ctx);
+    return;
+  case ET_CONCAT:
+    walk_expr(e->cat.chain, f, ctx);
+    return;
+  case ET_BINARY:
+    f(&e->b, ctx);
+    walk_expr(e->b.left, f, ctx);
+    walk_expr(e->b.right, f, ctx);
+    return;
+  case ET_CALL:
+    walk_expr(e->c.callee, f, ctx);
+    for (int i = 0; i < e->c.nargs; ++i)
+      walk_expr(e->c.args[i], f, ctx);
+    return;
+  case ET_ASSIGN:
+    walk_expr(e->a.value, f, ctx);
+    return;
+  case ET_GET:
+    walk_expr(e->get.obj, f, ctx);
+    return;
+  case ET_SET:
+    walk_expr(e->set.obj, f, ctx);
+    walk_expr(e->set.value, f, ctx);
+    return;
+  case ET_ARRAY:
+    for (int i = 0; i < e->arr.nelems; ++i)
+      walk_expr(e->arr.elems[i], f, ctx);
+    return;
+  case ET_INDEX:
+    walk_expr(e->idx.obj, f, ctx);
+    walk_expr(e->idx.index, f, ctx);
+    return;
+  case ET_INDEX_SET:
+    walk_expr(e->iset.obj, f, ctx);
+    walk_expr(e->iset.index, f, ctx);
+    walk_expr(e->iset.value, f, ctx);
+    return;
+  default:
+    unreachable();
+  }
+}
+
+typedef void (*stmt_visitor)(stmt *s, void *ctx);
+
+// Every statement, nested ones too: they have positions of their own
+static void walk_stmts(stmt_arr *s, stmt_visitor f, void *ctx);
+
+static void walk_stmt(stmt *s, stmt_visitor f, void *ctx) {
+  if (s == NULL)
+    return;
+
+  f(s, ctx);
+  switch (s->type) {
+  case ST_BLOCK:
+  case ST_CLASS:
+    walk_stmts(&s->body, f, ctx);
+    return;
+  case ST_FUN:
+    walk_stmts(&s->fn->body, f, ctx);
+    return;
+  case ST_IF:
+  case ST_WHILE:
+    walk_stmt(s->then_s, f, ctx);
+    walk_stmt(s->else_s, f, ctx);
+    return;
+  default:
+    return;
+  }
+}
+
+static void walk_stmts(stmt_arr *s, stmt_visitor f, void *ctx) {
+  for (size_t i = 0; i < s->len; ++i)
+    walk_stmt(&s->stmts[i], f, ctx);
+}
+
+///////////////////////////////////////
+////////////// Section Save
+
+static void save_binary(binary *b, void *ctx) {
+  if (b->seen_left || b->seen_right)
+    fprintf(ctx, "binary %d %d %u %u\n", b->pos.line, b->pos.col,
+            b->seen_left, b->seen_right);
+}
+
+static void save_stmt(stmt *s, void *ctx) {
+  if (s->hits)
+    fprintf(ctx, "stmt %d %d %u\n", s->pos.line, s->pos.col, s->hits);
+  walk_expr(s->e, save_binary, ctx);
+}
+
+int profile_save(const char *fname, const char *source, stmt_arr *s) {
+  ASSERT(fname);
+  ASSERT(source);
+  stmt_arr_ASSERT(s);
+
+  FILE *ofp = fopen(fname, "w");
+  if (ofp == NULL) {
+    runtime_error("Can't write profile %s\n", fname);
+    return -1;
+  }
+
+  fprintf(ofp, "%s %d %016" PRIx64 "\n", PROFILE_MAGIC, PROFILE_VERSION,
+          source_hash(source));
+
+  walk_stmts(s, save_stmt, ofp);
+
+  fclose(ofp);
+  return 0;
+}
+
+///////////////////////////////////////
+////////////// Section Load
+
+// Keys live in the table's own memory
+static char *profile_key(value_hashtable *t, char kind, int line, int col) {
+  char buf[64];
+  int len = snprintf(buf, sizeof buf, "%c:%d:%d", kind, line, col);
+  char *ret = linmem_malloc(&t->mem, len + 1);
+  memcpy(ret, buf, len + 1);
+  return ret;
+}
+
+static void load_binary(binary *b, void *ctx) {
+  char key[64];
+  snprintf(key, sizeof key, "b:%d:%d", b->pos.line, b->pos.col);
+  value *v = vhtbl_get(ctx, key);
+  if (v == NULL)
+    return;
+
+  if (!profile_count_ok(v->dval, 2 * MASK_BITS))
+    return;
+  unsigned long packed = (unsigned long)v->dval;
+  b->seen_left |= packed & ((1u << MASK_BITS) - 1);
+  b->seen_right |= packed >> MASK_BITS;
+}
+
+static void load_stmt(stmt *s, void *ctx) {
+  char key[64];
+  snprintf(key, sizeof key, "s:%d:%d", s->pos.line, s->pos.col);
+
+  value *v = vhtbl_get(ctx, key);
+  if (v != NULL && profile_count_ok(v->dval, 32))
+    s->hits = (unsigned int)v->dval;
+  walk_expr(s->e, load_binary, ctx);
+}
+
+int profile_load(const char *fname, const char *source, stmt_arr *s) {
+  ASSERT(fname);
+  ASSERT(source);
+  stmt_arr_ASSERT(s);
+
+  // No profile yet is not an error
+  FILE *ifp = fopen(fname, "r");
+  if (ifp == NULL)
+    return -1;
+
+  int version;
+  uint64_t hash;
+  if (fscanf(ifp, PROFILE_MAGIC " %d %" SCNx64, &version, &hash) != 2 ||
+      version != PROFILE_VERSION || hash != source_hash(source)) {
+    fclose(ifp);
+    return -1;
+  }
+
+  value_hashtable entries = vhtbl_create();
+  char kind[16];
+  int line, col;
+  unsigned int a, b;
+
+  while (fscanf(ifp, "%15s %d %d %u", kind, &line, &col, &a) == 4) {
+    double packed = a;
+    if (strcmp(kind, "binary") == 0) {
+      if (fscanf(ifp, "%u", &b) != 1)
+        break;
+      unsigned long mask = (1ul << MASK_BITS) - 1;
+      packed = (double)((a & mask) | ((b & mask) << MASK_BITS));
+    }
+    char *key = profile_key(&entries, kind[0], line, col);
+    vhtbl_insert(&entries, key, (value){.type = V_NUMBER, .dval = packed});
+  }
+  fclose(ifp);
+
+  walk_stmts(s, load_stmt, &entries);
+
+  vhtbl_free(&entries);
+  return 0;
+}
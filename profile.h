@@ -0,0 +1,13 @@
+#pragma once
+
+#include "statements.h"
+
+/**
+ * Persisted type feedback
+ * - Statement hit counts and binary operand types, keyed by token line /
+ *   column and tagged with a hash of the source they were recorded on
+ * - A profile recorded on different source is ignored
+ */
+int profile_load(const char *fname, const char *source, stmt_arr *s);
+
+int profile_save(const char *fname, const char *source, stmt_arr *s);
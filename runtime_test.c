@@ -0,0 +1,490 @@
+#include "errors.h"
+#include "gc.h"
+#include "heap_profile.h"
+#include "interpreter.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Programs that must fail with a runtime error instead of crashing
+typedef struct {
+  const char *src;
+  const char *error; // What the reported errors must contain
+  size_t quota;      // 0 for none
+} failure_case;
+
+static const failure_case cases[] = {
+    // The length doubles past what a string can hold
+    {"var s = \"a string that is longer than a small one\"; var i = 0;"
+     "while (i < 64) { s = s + s; i = i + 1; }",
+     "String too long"},
+    // Every worker would write the same instance
+    {"class Box {} var b = Box();"
+     "fun put(i) { b.v = i; } parallel_for(4, put);",
+     "Cannot set field v in a parallel callback"},
+    {"var m = map(); m[1] = 1;"
+     "fun drop(i) { remove(m, 1); } parallel_for(4, drop);",
+     "Cannot change a map in a parallel callback"},
+    {"map(1);", "map expects a load factor between 0 and 1"},
+    {"map(0.5, 1);", "map expected 0 to 1 arguments but got 2"},
+    // A for loop's variable is gone after the loop
+    {"for (var i = 0; i < 3; i = i + 1) {} print i;",
+     "Undefined variable: i"},
+    // Each run of strings is joined before the operand that isn't one
+    {"var q = \"?\"; q + \"a\" + true + \"b\";",
+     "Cannot cast a String: \"?a\" to a number"},
+    {"var q = \"?\"; 1 + \"x\" + q;",
+     "Cannot cast a String: \"x\" to a number"},
+    {"var q = \"?\"; var n = 1; n + 2 + q;",
+     "Cannot cast a String: \"?\" to a number"},
+    // The rope is fine, its flat would take 1.3GB
+    {"var s = \"a string that is longer than a small one\"; var i = 0;"
+     "while (i < 25) { s = s + s; i = i + 1; } print s < \"a\";",
+     "Out of memory", 64 << 20},
+};
+
+/**
+ * 3000 pseudo random inserts and removes of keys 0 to 100, checked against
+ * what stamp and val say: the time each live key went in, and its value
+ * - keys() and values() must follow insertion order. A key that's set
+ *   again keeps its place, one that's removed and set again moves last
+ * - r is the number of live keys and then the number of mismatches
+ */
+#define MAP_CHURN(load)                                                        \
+  "var m = map(" load "); var stamp = array(101); var val = array(101);"      \
+  "for (var k = 0; k < 101; k = k + 1) stamp[k] = -1;"                         \
+  "var x = 7; var y = 3;"                                                      \
+  "fun key() { x = x * 7 + 11; while (x >= 101) x = x - 101; return x; }"     \
+  "fun op() { y = y * 5 + 3; while (y >= 97) y = y - 97; return y; }"         \
+  "for (var t = 0; t < 3000; t = t + 1) {"                                    \
+  "  var k = key();"                                                           \
+  "  if (op() < 60) { if (stamp[k] < 0) stamp[k] = t; m[k] = t; val[k] = t; }" \
+  "  else { stamp[k] = -1; remove(m, k); }"                                    \
+  "}"                                                                          \
+  "var n = 0; var bad = 0; var last = -1;"                                     \
+  "for (var k = 0; k < 101; k = k + 1) {"                                     \
+  "  if (stamp[k] >= 0) n = n + 1;"                                            \
+  "  if (stamp[k] < 0) if (has(m, k)) bad = bad + 1;"                          \
+  "}"                                                                          \
+  "var ks = keys(m); var vs = values(m);"                                      \
+  "if (len(ks) != n) bad = bad + 1;"                                           \
+  "for (var j = 0; j < len(ks); j = j + 1) {"                                 \
+  "  var k = ks[j];"                                                           \
+  "  if (stamp[k] <= last) bad = bad + 1;"                                     \
+  "  last = stamp[k];"                                                         \
+  "  if (vs[j] != val[k]) bad = bad + 1;"                                      \
+  "  if (m[k] != val[k]) bad = bad + 1;"                                       \
+  "}"                                                                          \
+  "var r = [n, bad];"
+
+// Six classes with v in a different slot each: more shapes than a
+// property site's cache has ways
+#define SIX_SHAPES                                                             \
+  "class A { init() { this.v = 1; } }"                                         \
+  "class B { init() { this.a = 0; this.v = 2; } }"                             \
+  "class C { init() { this.a = 0; this.b = 0; this.v = 3; } }"                 \
+  "class D { init() { this.b = 0; this.v = 4; this.a = 0; } }"                 \
+  "class E { init() { this.c = 0; this.b = 0; this.a = 0; this.v = 5; } }"     \
+  "class F { init() { this.v = 6; } get() { return this.v * 10; } }"           \
+  "var os = [A(), B(), C(), D(), E(), F()];"                                   \
+  "fun read(o) { return o.v; }"
+
+// Programs that must run, leaving r to print as expected. Each runs under
+// every one of the collector's modes
+typedef struct {
+  const char *src;
+  const char *r;
+} output_case;
+
+typedef struct {
+  const char *name;
+  int stress;
+  int incremental;
+} gc_mode;
+
+static const gc_mode modes[] = {
+    {"mark and sweep", 0, 0},
+    {"--gc-stress", 1, 0},
+    {"--gc-incremental", 0, 1},
+    {"--gc-incremental --gc-stress", 1, 1},
+};
+
+static const output_case outputs[] = {
+    // Callbacks change what they made themselves, but nothing shared
+    {"class P { init(v) { this.v = v; } }"
+     "fun mk(x) { var p = P(x); p.w = p.v * 2; return p; }"
+     "var a = array(64); for (var i = 0; i < 64; i = i + 1) a[i] = i;"
+     "var ps = parallel_map(a, mk); var r = ps[63].w + ps[1].v;",
+     "127.000000"},
+    {"fun f(x) { var m = map(); m[\"k\"] = x; remove(m, \"k\");"
+     "  m[\"j\"] = x + 1; var b = array(2); b[0] = \"s\"; b[1] = m[\"j\"];"
+     "  return b[1]; }"
+     "var a = array(64); for (var i = 0; i < 64; i = i + 1) a[i] = i;"
+     "var r = parallel_map(a, f)[63];",
+     "64.000000"},
+    {MAP_CHURN(""), "[62.000000, 0.000000]"},
+    {MAP_CHURN("0.5"), "[62.000000, 0.000000]"},
+    {MAP_CHURN("0.95"), "[62.000000, 0.000000]"},
+    {"var m = map(0.5); m[\"a\"] = 1; m[\"b\"] = 2; m[\"c\"] = 3;"
+     "remove(m, \"a\"); m[\"a\"] = 4; m[\"b\"] = 5; var r = keys(m);",
+     "[b, c, a]"},
+    {"var m = map(0.5); m[\"a\"] = 1; m[\"b\"] = 2; m[\"c\"] = 3;"
+     "remove(m, \"a\"); m[\"a\"] = 4; m[\"b\"] = 5; var r = values(m);",
+     "[5.000000, 3.000000, 4.000000]"},
+    // What's still reachable survives collections. Garbage of the same
+    // sizes is made after it, to take its place if it's freed
+    {"var q = \"?\"; var m = map();"
+     "m[\"a key that is long\" + q] = \"a value that is long\" + q;"
+     "var keep = array(20); var s = \"a string that grows\";"
+     "for (var i = 0; i < 20; i = i + 1) {"
+     "  s = s + q; keep[i] = s; var junk = \"a key that is long\" + \"*\" + q;"
+     "  var more = \"a value that is long\" + \"*\" + q; }"
+     "var r = [keep[0], keep[19], keys(m)[0], m[\"a key that is long?\"]];",
+     "[a string that grows?, a string that grows????????????????????, "
+     "a key that is long?, a value that is long?]"},
+    {"var q = \"?\";"
+     "fun counter() { var n = 0; fun inc() { n = n + 1; return n; }"
+     "  return inc; }"
+     "fun greeter(who) { var s = \"hello there, \" + who; fun g() { return s; }"
+     "  return g; }"
+     "var cs = array(10); var gs = array(10);"
+     "for (var i = 0; i < 10; i = i + 1) {"
+     "  cs[i] = counter(); gs[i] = greeter(\"everyone\" + q);"
+     "  var junk = \"goodbye there, \" + \"all\" + q; }"
+     "cs[3](); var r = [cs[3](), cs[4](), gs[5]()];",
+     "[2.000000, 1.000000, hello there, everyone?]"},
+    {"var q = \"?\";"
+     "class Pt { init(x, name) { this.x = x; this.name = name + q; } }"
+     "var ps = array(30);"
+     "for (var i = 0; i < 30; i = i + 1) {"
+     "  ps[i] = Pt(i, \"point number one\");"
+     "  var junk = Pt(i, \"garbage number\" + \"s\"); }"
+     "ps[7].next = ps[8]; var r = [ps[29].x, ps[7].next.name, ps[0].name];",
+     "[29.000000, point number one?, point number one?]"},
+    // Incremental: the marker meets the value as it moves from box to box.
+    // Only the barrier on the slot it leaves keeps it alive
+    {"var q = \"?\"; class Box { init() { this.v = nil; } }"
+     "var boxes = array(200);"
+     "for (var i = 0; i < 200; i = i + 1) boxes[i] = Box();"
+     "boxes[0].v = \"a value that moves\" + q;"
+     "for (var k = 0; k < 5; k = k + 1) {"
+     "  for (var j = 0; j < 199; j = j + 1) {"
+     "    boxes[j + 1].v = boxes[j].v; boxes[j].v = nil;"
+     "    var junk = \"a value that moved\" + q; }"
+     "  boxes[0].v = boxes[199].v; boxes[199].v = nil; }"
+     "var r = boxes[0].v;",
+     "a value that moves?"},
+    // Loops: the loop variable shadows an outer one and the body's own
+    // declarations shadow it
+    {"var i = 10; var seen = 0;"
+     "for (var i = 0; i < 3; i = i + 1) seen = seen + i;"
+     "var n = 0; for (var i = 0; i < 2; i = i + 1) { var i = 5; n = n + i; }"
+     "var r = [i, seen, n];",
+     "[10.000000, 3.000000, 10.000000]"},
+    {"fun f() { var n = 0; for (var i = 0; i < 4; i = i + 1) {"
+     "  var j = i; while (j > 0) { n = n + 1; j = j - 1; } } return n; }"
+     "var i = 0; for (; i < 3;) i = i + 1; var r = [f(), i];",
+     "[6.000000, 3.000000]"},
+    // A rope grown, compared and hashed in loops
+    {"var q = \"?\"; var t = \"a string that is longer than a small one\";"
+     "var s = t; for (var i = 0; i < 8; i = i + 1) s = s + q + t;"
+     "var m = map(); m[s] = 1; var n = 0; var u = t;"
+     "while (u < s) { u = u + q + t; n = n + 1; }"
+     "var v = t; for (var i = 0; i < 9; i = i + 1) v = v + q + t;"
+     "var r = [n, u == s, m[u], s < u + q, u + q + t == v];",
+     "[8.000000, TRUE, 1.000000, TRUE, TRUE]"},
+    // Concatenation chains join their strings at once: the result must be
+    // what adding them one at a time gives, as a rope past ROPE_MIN, with
+    // the hash of the same string made any other way
+    {"var q = \"?\"; var h = \"a string on the heap\";"
+     "var l = h + h + h + h + h + h + h + h + h + h + h + h + h;"
+     "var f = h + h + h + h + h + h + h + h + h + h + h + h;"
+     "var a = l + q + h + q; var b = ((l + q) + h) + q; var c = q + l + q + h;"
+     "var m = map(); m[h + q + h] = 1; m[a] = 2;"
+     "var r = [a == b, c == (q + l) + (q + h), f + q + h == (f + q) + h, l < a,"
+     "  m[\"a string on the heap?a string on the heap\"], m[b], has(m, c)];",
+     "[TRUE, TRUE, TRUE, TRUE, 1.000000, 2.000000, FALSE]"},
+    // Results of up to SMALL_MAX characters stay in the value, one more is
+    // on the heap. Either way they are the same strings
+    {"var q = \"?\"; var h = \"a heap string, long\";"
+     "var d = \"0123456\" + q + \"789012\";"
+     "var e = \"0123456\" + q + \"7890123\";"
+     "var r = [d, e, \"ab\" + q + h, h + q + \"ab\", d == \"0123456?789012\","
+     "  e == \"0123456?7890123\", d + \"3\" == e, d < e, q + q + q];",
+     "[0123456?789012, 0123456?7890123, ab?a heap string, long, "
+     "a heap string, long?ab, TRUE, TRUE, TRUE, TRUE, ???]"},
+    // Forty parts, past CONCAT_MAX
+    {"var q = \"?\"; var r = \"a\" + q + \"b\" + q + \"c\" + q + \"d\" + q"
+     "  + \"e\" + q + \"f\" + q + \"g\" + q + \"h\" + q + \"i\" + q + \"j\" + q"
+     "  + \"k\" + q + \"l\" + q + \"m\" + q + \"n\" + q + \"o\" + q + \"p\" + q"
+     "  + \"q\" + q + \"r\" + q + \"s\" + q + \"t\" + q;",
+     "a?b?c?d?e?f?g?h?i?j?k?l?m?n?o?p?q?r?s?t?"},
+    // Closures: one that never escapes reads its captures off the stack,
+    // one that escapes gets boxes that outlive the call
+    {"fun f(x) { fun g() { return x * 2; } return g() + 1; } var r = f(20);",
+     "41.000000"},
+    {"fun counter() { var n = 0; fun inc() { n = n + 1; return n; }"
+     "  return inc; }"
+     "var c1 = counter(); var c2 = counter(); c1(); c1();"
+     "var r = [c1(), c2()];",
+     "[3.000000, 1.000000]"},
+    // A capture sees assignments made after the closure was
+    {"fun late() { var x = 1; fun g() { return x; } x = 2; return g(); }"
+     "fun escaped() { var x = 1; fun g() { return x; } x = 5; return g; }"
+     "var r = [late(), escaped()()];",
+     "[2.000000, 5.000000]"},
+    {"fun f() { var n = 0; fun inc() { n = n + 1; } inc(); inc(); return n; }"
+     "var r = f();",
+     "2.000000"},
+    {"fun a() { var x = 1;"
+     "  fun b() { fun c() { x = x + 10; return x; } return c; }"
+     "  var c = b(); c(); x = x + 100; return c(); }"
+     "var r = a();",
+     "121.000000"},
+    {"fun pair() { var n = 0; fun inc() { n = n + 1; return n; }"
+     "  fun get() { return n; } var p = array(2); p[0] = inc; p[1] = get;"
+     "  return p; }"
+     "var p = pair(); p[0](); p[0](); var r = p[1]();",
+     "2.000000"},
+    // g escapes through h, which only refers to it
+    {"fun outer() { var x = 40; fun g() { return x + 2; }"
+     "  fun h() { return g; } return h; }"
+     "var h = outer(); fun smash(a, b, c) { return a + b + c; } smash(1, 2, 3);"
+     "var r = h()();",
+     "42.000000"},
+    // Sites that see each shape several times, past megamorphic
+    {SIX_SHAPES "var r = 0; for (var k = 0; k < 3; k = k + 1)"
+     "  for (var i = 0; i < 6; i = i + 1) r = r + read(os[i]);",
+     "63.000000"},
+    // Stores that add fields the first time round and overwrite them after
+    {SIX_SHAPES "fun write(o, v) { o.v = v; o.w = v + 1; }"
+     "for (var i = 0; i < 6; i = i + 1) write(os[i], i * 100);"
+     "for (var i = 0; i < 6; i = i + 1) write(os[i], i * 1000);"
+     "var r = 0;"
+     "for (var i = 0; i < 6; i = i + 1) r = r + read(os[i]) + os[i].w;",
+     "30006.000000"},
+    // One class, its fields added in five orders
+    {"class P {} fun xy(o) { return o.x * 10 + o.y; }"
+     "var p1 = P(); p1.x = 1; p1.y = 2; var p2 = P(); p2.y = 4; p2.x = 3;"
+     "var p3 = P(); p3.z = 0; p3.x = 5; p3.y = 6;"
+     "var p4 = P(); p4.y = 8; p4.z = 0; p4.x = 7;"
+     "var p5 = P(); p5.w = 0; p5.z = 0; p5.y = 9; p5.x = 9;"
+     "var r = [xy(p1), xy(p2), xy(p3), xy(p4), xy(p5), xy(p1)];",
+     "[12.000000, 34.000000, 56.000000, 78.000000, 99.000000, 12.000000]"},
+    // Methods of different classes at one site, then a field holding a
+    // function where the others have a method
+    {SIX_SHAPES "class G { get() { return 1; } }"
+     "class H { get() { return 2; } } class I { init() { this.get = nil; } }"
+     "fun call(o) { return o.get(); } fun one() { return 100; }"
+     "var g = G(); var h = H(); var i = I(); i.get = one; os[5].v = 5;"
+     "var r = [call(g), call(h), call(os[5]), call(g), call(i), call(h)];",
+     "[1.000000, 2.000000, 50.000000, 1.000000, 100.000000, 2.000000]"},
+};
+
+/**
+ * Programs run under reference counting, with every allocation
+ * reconciling. After a full collection at the end, at most resident bytes
+ * may be left on the heap
+ * - counted and cycles: at least how many objects were freed as their
+ *   count dropped, and by trial deletion
+ * - peak: at most how many bytes were ever on the heap, 0 for any. Garbage
+ *   without cycles is freed at once, so it never piles up
+ * - r: what the program leaves in r, which shows the live objects survived
+ */
+typedef struct {
+  const char *src;
+  size_t counted;
+  size_t cycles;
+  size_t peak;
+  size_t resident;
+  const char *r;
+} refcount_case;
+
+#define NODE_CLASS "class Node { init(v) { this.v = v; this.next = nil; } }"
+
+static const refcount_case refcounts[] = {
+    // Pairs that point at each other, and one that stays reachable
+    {NODE_CLASS "var keep = Node(1); keep.next = Node(2);"
+     "keep.next.next = keep;"
+     "fun pair(i) { var a = Node(i); a.next = Node(i); a.next.next = a;"
+     "  return a.v; }"
+     "var s = 0; for (var i = 0; i < 2000; i = i + 1) s = s + pair(i);"
+     "var r = keep.next.next.v + s;",
+     0, 4000, 0, 1024, "1999001.000000"},
+    // Rings of three, and instances that hold themselves
+    {NODE_CLASS "fun ring(i) { var a = Node(i); a.next = Node(i);"
+     "  a.next.next = Node(i); a.next.next.next = a; var b = Node(i);"
+     "  b.next = b; return b.v; }"
+     "var s = 0; for (var i = 0; i < 1000; i = i + 1) s = s + ring(i);"
+     "var r = s;",
+     0, 4000, 0, 1024, "499500.000000"},
+    // Links: the second is freed as soon as the first is
+    {NODE_CLASS "fun link(i) { var a = Node(i); a.next = Node(i + 1);"
+     "  return a.next.v; }"
+     "var s = 0; for (var i = 0; i < 2000; i = i + 1) s = s + link(i);"
+     "var r = s;",
+     3990, 0, 1024, 1024, "2001000.000000"},
+};
+
+static int failures = 0;
+
+static void check_failure(const failure_case *c) {
+  char *errors = NULL;
+  size_t len = 0;
+  FILE *efp = open_memstream(&errors, &len);
+  FILE *old = errors_redirect(efp);
+
+  gc_set_quota(c->quota);
+  var_env env = var_env_create();
+  token_arr arr = scanner_parse_tokens(c->src);
+  stmt_arr stmts = parse_tokens(arr);
+  int ret = interpret_stmts(&arr.mem, &stmts, &env);
+
+  errors_redirect(old);
+  fclose(efp);
+
+  if (ret != -1 || strstr(errors, c->error) == NULL) {
+    fprintf(stdout, "FAIL: %s\nexpected: %s\ngot: %s\n", c->src, c->error,
+            errors);
+    failures++;
+  }
+  free(errors);
+}
+
+// How r prints, "" without one
+static char *printed_r(var_env *env) {
+  char *out = NULL;
+  size_t len = 0;
+  FILE *ofp = open_memstream(&out, &len);
+  value *r = var_env_find(env, "r");
+  if (r != NULL)
+    value_println(ofp, *r);
+  fclose(ofp);
+  if (len > 0)
+    out[len - 1] = '\0'; // The newline
+  return out;
+}
+
+static void check_output(const output_case *c, const gc_mode *m) {
+  gc_set_quota(0);
+  gc_set_stress(m->stress);
+  gc_set_incremental(m->incremental);
+  var_env env = var_env_create();
+  token_arr arr = scanner_parse_tokens(c->src);
+  stmt_arr stmts = parse_tokens(arr);
+  int ret = interpret_stmts(&arr.mem, &stmts, &env);
+  gc_set_stress(0);
+  gc_set_incremental(0);
+
+  char *out = printed_r(&env);
+  if (ret != 0 || strcmp(out, c->r) != 0) {
+    fprintf(stdout, "FAIL (%s): %s\nexpected: %s\ngot: %s\n", m->name, c->src,
+            c->r, out);
+    failures++;
+  }
+  free(out);
+}
+
+static void check_refcount(const refcount_case *c) {
+  gc_set_quota(0);
+  gc_set_refcounting(1);
+  gc_set_stress(1);
+  var_env env = var_env_create();
+  token_arr arr = scanner_parse_tokens(c->src);
+  stmt_arr stmts = parse_tokens(arr);
+  int ret = interpret_stmts(&arr.mem, &stmts, &env);
+  char *out = printed_r(&env);
+
+  gc_heap *h = env.gc;
+  gc_collect(h, NULL, 0);
+  gc_set_stress(0);
+  gc_set_refcounting(0);
+
+  if (ret != 0 || strcmp(out, c->r) != 0 || h->nfreed_counted < c->counted ||
+      h->nfreed_cycles < c->cycles || (c->peak != 0 && h->peak > c->peak) ||
+      h->resident > c->resident) {
+    fprintf(stdout,
+            "FAIL: %s\ngot: %s, %zu freed by their count, %zu in cycles, "
+            "%zu bytes at most, %zu left\n",
+            c->src, out, h->nfreed_counted, h->nfreed_cycles, h->peak,
+            h->resident);
+    failures++;
+  }
+  free(out);
+}
+
+// The value of stack under section's header in profile, 0 without one
+static size_t profiled(const char *profile, const char *section,
+                       const char *stack) {
+  char header[64];
+  snprintf(header, sizeof header, "# %s\n", section);
+  const char *at = strstr(profile, header);
+  if (at == NULL)
+    return 0;
+  at += strlen(header);
+  size_t len = strlen(stack);
+  for (; *at != '\0' && *at != '#'; at = strchr(at, '\n') + 1)
+    if (strncmp(at, stack, len) == 0 && at[len] == ' ')
+      return strtoul(at + len + 1, NULL, 10);
+  return 0;
+}
+
+// Sites that allocate while a statement runs are counted under its line
+static void check_heap_profile() {
+  const char *src = "var q = \"?\";\n"
+                    "var s = \"a string on the heap\" + q;\n"
+                    "class P {} var p = P(); p.x = s;\n";
+  heap_profiling = 1;
+  var_env env = var_env_create();
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  int ret = interpret_stmts(&arr.mem, &stmts, &env);
+  heap_profiling = 0;
+
+  char *profile = NULL;
+  size_t len = 0;
+  FILE *ofp = open_memstream(&profile, &len);
+  heap_profile_print(ofp);
+  fclose(ofp);
+
+  // The sections in their order, then the script's own sites
+  const char *bytes = strstr(profile, "# bytes\n");
+  const char *allocations = strstr(profile, "# allocations\n");
+  const char *arenas = strstr(profile, "# peak bytes per arena\n");
+  int ordered = bytes != NULL && allocations != NULL && arenas != NULL &&
+                bytes < allocations && allocations < arenas;
+  const char *concat = "value.c;lox_string_alloc;line 2";
+  const char *instance = "object.c;instance_create;line 3";
+  if (ret != 0 || !ordered || profiled(profile, "bytes", concat) == 0 ||
+      profiled(profile, "allocations", concat) != 1 ||
+      profiled(profile, "bytes", instance) == 0 ||
+      profiled(profile, "peak bytes per arena", "gc heap") == 0) {
+    fprintf(stdout, "FAIL: heap profile of %s\ngot:\n%s", src, profile);
+    failures++;
+  }
+  free(profile);
+}
+
+int main() {
+  size_t n = sizeof cases / sizeof *cases;
+  for (size_t i = 0; i < n; ++i)
+    check_failure(&cases[i]);
+  size_t nout = sizeof outputs / sizeof *outputs;
+  size_t nmodes = sizeof modes / sizeof *modes;
+  for (size_t i = 0; i < nout; ++i)
+    for (size_t m = 0; m < nmodes; ++m)
+      check_output(&outputs[i], &modes[m]);
+  nout *= nmodes;
+  size_t nrc = sizeof refcounts / sizeof *refcounts;
+  for (size_t i = 0; i < nrc; ++i)
+    check_refcount(&refcounts[i]);
+  check_heap_profile();
+  n += nout + nrc + 1;
+
+  fprintf(stdout, "%zu cases, %d failures\n", n, failures);
+  return failures != 0;
+}
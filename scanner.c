@@ -3,12 +3,15 @@
 #include "token.h"
 #include <string.h>
 
+// Lox runs about 2.5 characters a token, this covers all but the densest
+#define CHARS_PER_TOKEN 2
+
 typedef struct {
   const char *data;
-  token_arr tokens;
   size_t start;
   size_t current;
   size_t line;
+  size_t line_start;
   int error;
 } scanner_state;
 
@@ -20,10 +23,10 @@ typedef struct {
 static scanner_state scanner_state_create(const char *data) {
   scanner_state ret;
   ret.data = data;
-  ret.tokens = token_arr_create();
   ret.start = 0;
   ret.current = 0;
   ret.line = 1;
+  ret.line_start = 0;
   ret.error = 0;
   return ret;
 }
@@ -71,8 +74,10 @@ static int ss_match_ch(scanner_state *s, char c) {
 static void ss_parse_string(scanner_state *s) {
   char ch;
   while (!ss_end(s) && ss_peek_ch(s) != '\"') {
-    if (ss_peek_ch(s) == '\n')
+    if (ss_peek_ch(s) == '\n') {
       s->line++;
+      s->line_start = s->current + 1;
+    }
     ss_next_ch(s);
   }
 
@@ -170,6 +175,10 @@ static ssize_t ss_next_tt(scanner_state *s) {
     return LEFT_BRACE;
   case '}':
     return RIGHT_BRACE;
+  case '[':
+    return LEFT_BRACKET;
+  case ']':
+    return RIGHT_BRACKET;
   case ',':
     return COMMA;
   case '.':
@@ -216,6 +225,7 @@ static ssize_t ss_next_tt(scanner_state *s) {
 
   case '\n':
     s->line++;
+    s->line_start = s->current;
     return -1;
 
   case '\"':
@@ -238,26 +248,31 @@ static ssize_t ss_next_tt(scanner_state *s) {
 static void ss_parse(token_arr *t, scanner_state *s) {
   scanner_state_ASSERT(s);
   ssize_t next;
+  int col;
 
   while (!ss_end(s)) {
     s->start = s->current;
+    col = s->start - s->line_start + 1;
     next = ss_next_tt(s);
 
     if (next != -1) {
       token_arr_push(t, &s->data[s->start], s->current - s->start, next,
-                     s->line);
+                     s->line, col);
     }
   }
 
-  token_arr_push(t, &s->data[s->start], s->current - s->start, TT_EOF, s->line);
+  col = s->current - s->line_start + 1;
+  token_arr_push(t, &s->data[s->start], s->current - s->start, TT_EOF, s->line,
+                 col);
 }
 
 token_arr scanner_parse_tokens(const char *data) {
   ASSERT(data);
 
-  token_arr ret = token_arr_create();
+  token_arr ret = token_arr_create_cap(strlen(data) / CHARS_PER_TOKEN + 1);
   scanner_state s = scanner_state_create(data);
   ss_parse(&ret, &s);
+  token_arr_shrink(&ret);
 
   return ret;
 }
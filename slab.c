@@ -0,0 +1,110 @@
+#include "slab.h"
+#include "facades.h"
+#include "heap_profile.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// A free block
+typedef struct slab_block {
+  struct slab_block *next;  // In its batch, or its cache
+  struct slab_block *batch; // The first block of the next batch
+} slab_block;
+
+typedef struct {
+  slab_block *head;
+  size_t n;
+} slab_cache;
+
+// Full batches, shared by every thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_block *batches[SLAB_CLASSES];
+
+static _Thread_local slab_cache caches[SLAB_CLASSES];
+
+static inline size_t slab_class(size_t size) {
+  return size == 0 ? 0 : (size - 1) / SLAB_GRAIN;
+}
+
+// A chunk of class c's blocks, as whole batches on the shared list. Under
+// the lock
+static void slab_carve(size_t c) {
+  size_t size = (c + 1) * SLAB_GRAIN;
+  size_t n = SLAB_CHUNK / size / SLAB_BATCH * SLAB_BATCH;
+  n = n > 0 ? n : SLAB_BATCH;
+  char *chunk = malloc_or_abort(n * size);
+  if (heap_profiling)
+    heap_profile_arena("size class pools", (long)(n * size));
+
+  for (size_t k = n; k > 0; k -= SLAB_BATCH) {
+    slab_block *first = (slab_block *)&chunk[(k - SLAB_BATCH) * size];
+    for (size_t i = k - SLAB_BATCH; i < k; ++i) {
+      slab_block *b = (slab_block *)&chunk[i * size];
+      b->next = i + 1 < k ? (slab_block *)&chunk[(i + 1) * size] : NULL;
+    }
+    first->batch = batches[c];
+    batches[c] = first;
+  }
+}
+
+static void slab_refill(slab_cache *cache, size_t c) {
+  pthread_mutex_lock(&lock);
+  if (batches[c] == NULL)
+    slab_carve(c);
+  slab_block *b = batches[c];
+  batches[c] = b->batch;
+  pthread_mutex_unlock(&lock);
+
+  cache->head = b;
+  cache->n = SLAB_BATCH;
+}
+
+// Gives the first SLAB_BATCH blocks of cache back
+static void slab_spill(slab_cache *cache, size_t c) {
+  slab_block *first = cache->head;
+  slab_block *last = first;
+  for (int k = 1; k < SLAB_BATCH; ++k)
+    last = last->next;
+  cache->head = last->next;
+  cache->n -= SLAB_BATCH;
+  last->next = NULL;
+
+  pthread_mutex_lock(&lock);
+  first->batch = batches[c];
+  batches[c] = first;
+  pthread_mutex_unlock(&lock);
+}
+
+void *slab_malloc(size_t size) {
+  if (size > SLAB_MAX)
+    return malloc_or_abort(size);
+
+  size_t c = slab_class(size);
+  slab_cache *cache = &caches[c];
+  if (cache->head == NULL)
+    slab_refill(cache, c);
+
+  slab_block *ret = cache->head;
+  cache->head = ret->next;
+  cache->n--;
+  return ret;
+}
+
+void slab_free(void *p, size_t size) {
+  if (p == NULL)
+    return;
+  if (size > SLAB_MAX) {
+    free(p);
+    return;
+  }
+
+  size_t c = slab_class(size);
+  slab_cache *cache = &caches[c];
+  if (cache->n == 2 * SLAB_BATCH)
+    slab_spill(cache, c);
+
+  slab_block *b = p;
+  b->next = cache->head;
+  cache->head = b;
+  cache->n++;
+}
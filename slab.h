@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Size class pools
+ * - Blocks of up to SLAB_MAX bytes come from free lists, one per multiple of
+ *   SLAB_GRAIN they round up to. Larger ones are malloced
+ * - Each thread keeps a cache of free blocks per class, and allocates and
+ *   frees from it without locking. A cache that runs dry takes a batch of
+ *   SLAB_BATCH blocks from the shared list, carving a new chunk when that's
+ *   empty too; one that holds two batches gives one back
+ * - Blocks carry no header: slab_free takes the size they were allocated
+ *   with. They can be freed on any thread
+ * - Chunks are never handed back to the system, what a class frees is kept
+ *   for its next allocations. So are the caches of threads that exit
+ */
+#define SLAB_GRAIN 16
+#define SLAB_MAX 512
+#define SLAB_CLASSES (SLAB_MAX / SLAB_GRAIN)
+#define SLAB_BATCH 32
+#define SLAB_CHUNK (64 << 10)
+
+void *slab_malloc(size_t size);
+
+void slab_free(void *p, size_t size);
@@ -0,0 +1,85 @@
+#include "facades.h"
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LIVE 4096
+#define ROUNDS 2000
+#define MAX_THREADS 8
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+  int use_slab;
+  size_t size;
+} churn_arg;
+
+// Keeps LIVE blocks of every size up to size, replacing them in a
+// scattered order, like objects dying at different ages
+static void *churn(void *ctx) {
+  churn_arg *a = ctx;
+  void **live = malloc_or_abort(LIVE * sizeof *live);
+  size_t *sizes = malloc_or_abort(LIVE * sizeof *sizes);
+  unsigned seed = 1;
+  for (int k = 0; k < LIVE; ++k) {
+    sizes[k] = 16 + rand_r(&seed) % (a->size - 15);
+    live[k] = a->use_slab ? slab_malloc(sizes[k]) : malloc_or_abort(sizes[k]);
+  }
+
+  for (int r = 0; r < ROUNDS; ++r) {
+    for (int k = 0; k < LIVE; ++k) {
+      int i = rand_r(&seed) % LIVE;
+      if (a->use_slab) {
+        slab_free(live[i], sizes[i]);
+        live[i] = slab_malloc(sizes[i]);
+      } else {
+        free(live[i]);
+        live[i] = malloc_or_abort(sizes[i]);
+      }
+      *(char *)live[i] = (char)r;
+    }
+  }
+
+  for (int k = 0; k < LIVE; ++k) {
+    if (a->use_slab)
+      slab_free(live[k], sizes[k]);
+    else
+      free(live[k]);
+  }
+  free(live);
+  free(sizes);
+  return NULL;
+}
+
+static double bench(int use_slab, size_t size, int nthreads) {
+  pthread_t threads[MAX_THREADS];
+  churn_arg arg = {.use_slab = use_slab, .size = size};
+
+  double start = now();
+  for (int t = 0; t < nthreads; ++t)
+    abort_if(pthread_create(&threads[t], NULL, churn, &arg), "pthread_create");
+  for (int t = 0; t < nthreads; ++t)
+    pthread_join(threads[t], NULL);
+  double elapsed = now() - start;
+
+  return elapsed / ((double)LIVE * ROUNDS * nthreads) * 1e9;
+}
+
+int main() {
+  size_t sizes[] = {48, 128, SLAB_MAX};
+  for (size_t s = 0; s < sizeof sizes / sizeof *sizes; ++s)
+    for (int nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2)
+      fprintf(stdout,
+              "up to %3zu bytes  %d threads  malloc %5.1f  slab %5.1f "
+              "ns/free+alloc\n",
+              sizes[s], nthreads, bench(0, sizes[s], nthreads),
+              bench(1, sizes[s], nthreads));
+  return 0;
+}
@@ -1,6 +1,6 @@
 #include "statements.h"
-#include "doubling_array.h"
 #include "facades.h"
+#include "vector.h"
 
 #define INITIAL_CAP 10
 
@@ -19,7 +19,9 @@ void stmt_arr_free(stmt_arr *s) {
   s->len = 0;
 }
 
-DBL_ARR_MAKE_AVAILABLE(stmt_arr, stmts, cap);
+VECTOR_FUNCTIONS(stmt_arr, stmt, stmts, vector_grow_double);
+
+void stmt_arr_shrink(stmt_arr *s) { stmt_arr_shrink_to_fit(s); }
 
 void stmt_arr_push(stmt_arr *s, stmt st) {
   stmt_arr_ASSERT(s);
@@ -1,14 +1,21 @@
 #pragma once
 
 #include "expression.h"
+#include "jit.h"
 
-typedef enum { ST_EXPR, ST_PRNT, ST_DECL } stmt_t;
+typedef enum {
+  ST_EXPR,
+  ST_PRNT,
+  ST_DECL,
+  ST_BLOCK,
+  ST_FUN,
+  ST_IF,
+  ST_RETURN,
+  ST_CLASS,
+  ST_WHILE,
+} stmt_t;
 
-typedef struct {
-  stmt_t type;
-  expr *e;
-  char *ident_name;
-} stmt;
+typedef struct stmt_s stmt;
 
 typedef struct {
   stmt *stmts;
@@ -16,6 +23,82 @@ typedef struct {
   size_t cap;
 } stmt_arr;
 
+/**
+ * A variable a function captures from the function that declares it
+ * - Either a local of the declaring function: level counts scopes from
+ *   that function's first scope. Or one of the declaring function's own
+ *   captures
+ * - boxed is shared by every capture of one variable. It's set when the
+ *   variable is assigned after being captured, then closures share a box
+ *   instead of holding copies
+ */
+typedef struct {
+  int from_local;
+  int level;
+  int idx;
+  int parent;
+  int *boxed;
+} capture;
+
+/**
+ * A function declaration
+ * - Parameters are the first arity locals of its frame, the body's
+ *   top level locals follow them in the same frame
+ * - A function that captures gets a flat closure (every captured value
+ *   copied in) when it's declared. Unless it never escapes the function
+ *   declaring it and only captures that function's locals: then it
+ *   reads them straight from that function's frame and allocates nothing
+ */
+typedef struct function_s {
+  char *name;
+  int arity;
+  stmt_arr body;
+  int nlocals;
+
+  capture *captures;
+  int ncaptures;
+  int escapes;             // Used as anything but a callee, or captured
+  int local_captures_only; // Every capture is from_local
+
+  // Methods get their receiver as local 0, `this`, before the parameters.
+  // An initializer always returns it
+  int is_method;
+  int is_init;
+} function;
+
+#define function_on_stack(fn)                                                  \
+  ((fn)->ncaptures == 0 || (!(fn)->escapes && (fn)->local_captures_only))
+
+struct closure_s {
+  function *fn;
+  value captures[];
+};
+
+struct stmt_s {
+  stmt_t type;
+  expr *e; // The value, or the condition of an ST_IF or ST_WHILE
+  char *ident_name; // ST_DECL, ST_FUN and ST_CLASS
+  int local_idx;    // Of a declaration in a block, -1 for a global
+  slot_cache ident_cache;
+  srcpos pos;
+
+  // ST_BLOCK, one frame of nlocals. ST_CLASS: an ST_FUN per method
+  stmt_arr body;
+  int nlocals;
+
+  function *fn;
+
+  // ST_IF, else_s may be NULL. ST_WHILE: the body, and the increment of a
+  // for loop or NULL
+  stmt *then_s;
+  stmt *else_s;
+
+  // Times executed (type feedback), and the baseline JIT state
+  unsigned int hits;
+  jit_fn jit;
+  int jit_failed;
+};
+
 #define stmt_arr_ASSERT(s)                                                     \
   ASSERT(s);                                                                   \
   ASSERT(s->stmts);                                                            \
@@ -26,3 +109,6 @@ stmt_arr stmt_arr_create();
 void stmt_arr_free(stmt_arr *s);
 
 void stmt_arr_push(stmt_arr *s, stmt st);
+
+// Hands back the room no statement is using
+void stmt_arr_shrink(stmt_arr *s);
@@ -1,15 +1,17 @@
 #include "string.h"
-#include "doubling_array.h"
 #include "facades.h"
+#include "vector.h"
 #include <string.h>
 
 #define INITIAL_CAP 10
 
-string string_create() {
+string string_create() { return string_create_cap(INITIAL_CAP); }
+
+string string_create_cap(size_t cap) {
   string ret;
-  ret.data = malloc_or_abort(INITIAL_CAP * sizeof *ret.data);
+  ret.data = malloc_or_abort(cap * sizeof *ret.data);
   ret.len = 0;
-  ret.cap = INITIAL_CAP;
+  ret.cap = cap;
   return ret;
 }
 
@@ -23,7 +25,7 @@ static inline void *string_head(string *s) {
   return s->data + s->len;
 }
 
-DBL_ARR_MAKE_AVAILABLE(string, data, cap);
+VECTOR_FUNCTIONS(string, char, data, vector_grow_double);
 
 void string_append_cstr(string *s, const char *data) {
   string_ASSERT(s);
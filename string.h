@@ -17,6 +17,9 @@ typedef struct {
 
 string string_create();
 
+// cap > 0, the length it is expected to grow to
+string string_create_cap(size_t cap);
+
 void string_free(string s);
 
 void string_append_cstr(string *s, const char *data);
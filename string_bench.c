@@ -0,0 +1,72 @@
+#include "gc.h"
+#include "interpreter.h"
+#include "parser.h"
+#include "scanner.h"
+#include "var_env.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Short keys and labels built, compared and thrown away every iteration
+static const char *short_program =
+    "var hits = 0;\n"
+    "for (var i = 0; i < %d; i = i + 1) {\n"
+    "  var key = \"user\" + \":\" + \"id\";\n"
+    "  var label = \"n\" + \"=\";\n"
+    "  if (key + label == \"user:idn=\") hits = hits + 1;\n"
+    "  if (label < key) hits = hits + 1;\n"
+    "}\n"
+    "var r = hits;\n";
+
+// The same with strings too long to fit in a value
+static const char *long_program =
+    "var hits = 0;\n"
+    "for (var i = 0; i < %d; i = i + 1) {\n"
+    "  var key = \"customer-account\" + \":\" + \"identifier\";\n"
+    "  var label = \"name-of-the-field\" + \"=\";\n"
+    "  if (key + label == \"customer-account:identifiername-of-the-field=\")"
+    " hits = hits + 1;\n"
+    "  if (label < key) hits = hits + 1;\n"
+    "}\n"
+    "var r = hits;\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, const char *program, int n) {
+  char src[1024];
+  snprintf(src, sizeof src, program, n);
+
+  token_arr arr = scanner_parse_tokens(src);
+  stmt_arr stmts = parse_tokens(arr);
+  var_env env = var_env_create();
+
+  // Strings made while running are on the gc heap
+  size_t allocs = arr.mem.nallocs + env.gc->nallocs;
+  double start = now();
+  int failed = interpret_stmts(&arr.mem, &stmts, &env);
+  double elapsed = now() - start;
+  allocs = arr.mem.nallocs + env.gc->nallocs - allocs;
+
+  value *r = var_env_find(&env, "r");
+  if (failed || r == NULL || r->type != V_NUMBER) {
+    fprintf(stdout, "%s: failed\n", name);
+    exit(1);
+  }
+  fprintf(stdout,
+          "%-6s hits = %.0f  %.3fs  %.2f allocs/iteration  %zu collections\n",
+          name, r->dval, elapsed, (double)allocs / n, env.gc->ncollections);
+  var_env_free(&env);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  bench("short", short_program, n);
+  bench("long", long_program, n);
+  return 0;
+}
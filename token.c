@@ -1,8 +1,8 @@
 #include "token.h"
-#include "doubling_array.h"
 #include "facades.h"
 #include "memory.h"
 #include "string.h"
+#include "vector.h"
 #include <string.h>
 
 #define INITIAL_CAP 10
@@ -19,8 +19,8 @@ const char *tttostr(token_t t) {
 }
 
 token token_create(linmem *m, const char *loc, size_t len, token_t type,
-                   int line) {
-  token ret = {.type = type, .line = line};
+                   int line, int col) {
+  token ret = {.type = type, .line = line, .col = col};
 
   ret.literal = linmem_malloc(m, len + 1);
   memcpy(ret.literal, loc, len);
@@ -28,9 +28,7 @@ token token_create(linmem *m, const char *loc, size_t len, token_t type,
 
   if (type == STRING) {
     // str without quotes
-    ret.str_val = linmem_malloc(m, len + 1 - 2);
-    memcpy(ret.str_val, &loc[1], len - 2);
-    ret.str_val[len - 1] = '\0';
+    ret.str_val = lox_string_create(m, &loc[1], len - 2);
   }
   if (type == NUMBER) {
     ret.n_val = atof(ret.literal);
@@ -45,7 +43,7 @@ void token_arr_print(token_arr *arr) {
   for (int i = 0; i < arr->len; ++i) {
     token t = arr->tokens[i];
     if (t.type == STRING) {
-      printf("%s %s %s\n", tttostr(t.type), t.literal, t.str_val);
+      printf("%s %s %s\n", tttostr(t.type), t.literal, t.str_val->chars);
     } else if (t.type == NUMBER) {
       printf("%s %s %f\n", tttostr(t.type), t.literal, t.n_val);
     } else {
@@ -54,12 +52,14 @@ void token_arr_print(token_arr *arr) {
   }
 }
 
-token_arr token_arr_create() {
+token_arr token_arr_create() { return token_arr_create_cap(INITIAL_CAP); }
+
+token_arr token_arr_create_cap(size_t cap) {
   token_arr ret;
-  ret.mem = linmem_create();
-  ret.tokens = malloc_or_abort(INITIAL_CAP * sizeof *ret.tokens);
+  ret.mem = linmem_create_named("program");
+  ret.tokens = malloc_or_abort(cap * sizeof *ret.tokens);
   ret.len = 0;
-  ret.cap = INITIAL_CAP;
+  ret.cap = cap;
   return ret;
 }
 
@@ -71,11 +71,14 @@ void token_arr_free(token_arr *arr) {
   arr->cap = 0;
 }
 
-DBL_ARR_MAKE_AVAILABLE(token_arr, tokens, cap);
+// Behind a size hint: a miss costs a half more, not twice the tokens
+VECTOR_FUNCTIONS(token_arr, token, tokens, vector_grow_half);
+
+void token_arr_shrink(token_arr *t) { token_arr_shrink_to_fit(t); }
 
 void token_arr_push(token_arr *t, const char *loc, size_t len, token_t type,
-                    int line) {
+                    int line, int col) {
   token_arr_ASSERT(t);
   token_arr_make_available(t, t->len + 1);
-  t->tokens[t->len++] = token_create(&t->mem, loc, len, type, line);
+  t->tokens[t->len++] = token_create(&t->mem, loc, len, type, line, col);
 }
@@ -2,6 +2,7 @@
 
 #include "errors.h"
 #include "memory.h"
+#include "value.h"
 #include <stdlib.h>
 
 #define WHITESPACE_C                                                           \
@@ -14,6 +15,8 @@ typedef enum {
   RIGHT_PAREN,
   LEFT_BRACE,
   RIGHT_BRACE,
+  LEFT_BRACKET,
+  RIGHT_BRACKET,
   COMMA,
   DOT,
   MINUS,
@@ -65,6 +68,8 @@ const char *tttostr(token_t);
   func(RIGHT_PAREN);                                                           \
   func(LEFT_BRACE);                                                            \
   func(RIGHT_BRACE);                                                           \
+  func(LEFT_BRACKET);                                                          \
+  func(RIGHT_BRACKET);                                                         \
   func(COMMA);                                                                 \
   func(DOT);                                                                   \
   func(MINUS);                                                                 \
@@ -101,14 +106,20 @@ const char *tttostr(token_t);
   func(WHILE);                                                                 \
   func(TT_EOF)
 
+// Where a token (or the AST node built from it) starts in the source
+typedef struct {
+  int line;
+  int col;
+} srcpos;
+
 typedef struct {
   union {
-    // TODO
-    char *str_val;
+    lox_string *str_val; // Made once here, every literal shares it
     double n_val;
   };
   char *literal;
   int line;
+  int col;
   token_t type;
 } token;
 
@@ -125,11 +136,21 @@ typedef struct {
   ASSERT((t)->tokens);                                                         \
   ASSERT((t)->cap > 0)
 
+static inline srcpos token_pos(token t) {
+  return (srcpos){.line = t.line, .col = t.col};
+}
+
 void token_arr_print(token_arr *t);
 
 token_arr token_arr_create();
 
+// cap > 0, the number of tokens expected
+token_arr token_arr_create_cap(size_t cap);
+
+// Hands back the room no token is using
+void token_arr_shrink(token_arr *t);
+
 void token_arr_free(token_arr *arr);
 
 void token_arr_push(token_arr *t, const char *loc, size_t len, token_t type,
-                    int line);
+                    int line, int col);
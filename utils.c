@@ -6,6 +6,9 @@
 #include <stdio.h>
 #include <string.h>
 
+// A line is read this much at a time, most fit in one
+#define READLN_CHUNK 256
+
 size_t flen(FILE *fp) {
   ASSERT(fp);
 
@@ -48,7 +51,7 @@ void stdin_readln(string *str) {
   string_ASSERT(str);
 
   string_reset(str);
-  char buffer[6];
+  char buffer[READLN_CHUNK];
   while (fgets_or_abort(buffer, sizeof buffer, stdin) != NULL) {
     string_append_cstr(str, buffer);
     if (strchr(buffer, '\n'))
@@ -1,7 +1,236 @@
 #include "value.h"
+#include "array.h"
 #include "errors.h"
+#include "facades.h"
+#include "gc.h"
+#include "map.h"
+#include "natives.h"
+#include "object.h"
+#include "statements.h"
+#include "vector.h"
 #include <string.h>
 
+///////////////////////////////////////
+////////////// Section Strings
+
+static lox_string *lox_string_init(lox_string *s, size_t len, int gc) {
+  s->len = len;
+  s->hashed = 0;
+  s->gc = gc;
+  s->chars[len] = '\0';
+  return s;
+}
+
+lox_string *lox_string_alloc(linmem *mem, size_t len, value *live,
+                             size_t nlive) {
+  size_t size = sizeof(lox_string) + len + 1;
+  void *s = gc_alloc(mem, V_STRING, size, live, nlive);
+  return s == NULL ? NULL : lox_string_init(s, len, mem->gc != NULL);
+}
+
+lox_string *lox_string_create(linmem *mem, const char *chars, size_t len) {
+  lox_string *ret = lox_string_alloc(mem, len, NULL, 0);
+  if (ret != NULL)
+    memcpy(ret->chars, chars, len);
+  return ret;
+}
+
+uint32_t chars_hash(const char *chars, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ (uint8_t)chars[i]) * 16777619u;
+  return h;
+}
+
+// Whether s is hashed yet, and its hash in *h if it is
+static int hash_known(lox_string *s, uint32_t *h) {
+  if (!atomic_load_explicit(&s->hashed, memory_order_acquire))
+    return 0;
+  *h = atomic_load_explicit(&s->hash, memory_order_relaxed);
+  return 1;
+}
+
+uint32_t lox_string_hash(lox_string *s) {
+  uint32_t h;
+  if (hash_known(s, &h))
+    return h;
+  h = chars_hash(s->chars, s->len);
+  atomic_store_explicit(&s->hash, h, memory_order_relaxed);
+  atomic_store_explicit(&s->hashed, 1, memory_order_release);
+  return h;
+}
+
+int lox_string_equal(lox_string *a, lox_string *b) {
+  if (a == b)
+    return 1;
+  if (a->len != b->len)
+    return 0;
+  uint32_t ha, hb;
+  if (hash_known(a, &ha) && hash_known(b, &hb) && ha != hb)
+    return 0;
+  return memcmp(a->chars, b->chars, a->len) == 0;
+}
+
+// < 0, 0 or > 0 like memcmp, a prefix sorts first
+static int chars_compare(const char *a, size_t alen, const char *b,
+                         size_t blen) {
+  int ret = memcmp(a, b, alen < blen ? alen : blen);
+  if (ret != 0)
+    return ret;
+  return (alen > blen) - (alen < blen);
+}
+
+///////////////////////////////////////
+////////////// Section Small strings
+
+value value_small(const char *chars, size_t len) {
+  ASSERT(len <= SMALL_MAX);
+  value ret = {.type = V_SMALL, .small_len = len};
+  memcpy(value_small_chars(&ret), chars, len);
+  return ret;
+}
+
+///////////////////////////////////////
+////////////// Section Ropes
+
+#define INITIAL_PIECES 64
+
+// A part of a rope still to be copied, and where it goes
+typedef struct {
+  value *v;
+  char *dest;
+} rope_piece;
+
+typedef struct {
+  rope_piece *at;
+  size_t len;
+  size_t cap;
+} rope_piece_arr;
+
+#define rope_piece_arr_ASSERT(a)                                               \
+  ASSERT(a);                                                                   \
+  ASSERT((a)->len <= (a)->cap)
+
+VECTOR_FUNCTIONS(rope_piece_arr, rope_piece, at, vector_grow_double);
+
+// Without recursion: ropes grown in a loop are as deep as it ran
+static void rope_copy(char *dest, value *root) {
+  rope_piece_arr todo = {0};
+  rope_piece_arr_reserve(&todo, INITIAL_PIECES);
+  todo.at[todo.len++] = (rope_piece){.v = root, .dest = dest};
+
+  while (todo.len > 0) {
+    rope_piece p = todo.at[--todo.len];
+    while (p.v->type == V_ROPE && p.v->rp->flat == NULL) {
+      rope *r = p.v->rp;
+      rope_piece_arr_make_available(&todo, todo.len + 1);
+      todo.at[todo.len++] = (rope_piece){.v = &r->right,
+                                         .dest = p.dest + value_len(&r->left)};
+      p.v = &r->left;
+    }
+    if (p.v->type == V_ROPE)
+      memcpy(p.dest, p.v->rp->flat->chars, p.v->rp->len);
+    else
+      memcpy(p.dest, value_flat_chars(p.v), value_len(p.v));
+  }
+  free(todo.at);
+}
+
+// Other threads can't add to the heap: while they run, flats stay off it
+static int flat_on_heap(rope *r) {
+  return r->heap != NULL && r->heap->threads == 0;
+}
+
+// The flat of i's rope, made and published unless another thread got
+// there first. A malloced flat is charged to q, and kept for good
+static lox_string *rope_flatten(value *i, mem_quota *q) {
+  rope *r = i->rp;
+  lox_string *ret = atomic_load_explicit(&r->flat, memory_order_acquire);
+  if (ret != NULL)
+    return ret;
+
+  size_t size = sizeof(lox_string) + r->len + 1;
+  int gc = flat_on_heap(r);
+  lox_string *flat = lox_string_init(
+      gc ? gc_alloc_now(r->heap, V_STRING, size) : malloc_or_abort(size),
+      r->len, gc);
+  rope_copy(flat->chars, i);
+  // Only flats off the heap can race: the heap has a single thread
+  if (!atomic_compare_exchange_strong_explicit(&r->flat, &ret, flat,
+                                               memory_order_acq_rel,
+                                               memory_order_acquire)) {
+    free(flat);
+    return ret;
+  }
+  if (!gc)
+    mem_quota_charge(q, size);
+  if (gc && gc_refcounting)
+    gc_count_up(r->heap, &(value){.type = V_STRING, .str = flat});
+  return flat;
+}
+
+lox_string *value_string(value *i) {
+  ASSERT(i->type == V_STRING || i->type == V_ROPE);
+  if (i->type == V_STRING)
+    return i->str;
+  return rope_flatten(i, NULL);
+}
+
+int value_flatten(linmem *mem, value *i) {
+  if (i->type != V_ROPE ||
+      atomic_load_explicit(&i->rp->flat, memory_order_acquire) != NULL)
+    return 0;
+  if (mem_quota_check(mem->quota, sizeof(lox_string) + i->rp->len + 1))
+    return -1;
+  rope_flatten(i, mem->quota);
+  return 0;
+}
+
+char *value_chars(value *i, size_t *len) {
+  ASSERT(value_is_string(i->type));
+  if (i->type == V_SMALL) {
+    *len = i->small_len;
+    return value_small_chars(i);
+  }
+  lox_string *s = value_string(i);
+  *len = s->len;
+  return s->chars;
+}
+
+static int string_compare(value *left, value *right) {
+  size_t llen, rlen;
+  char *l = value_chars(left, &llen);
+  char *r = value_chars(right, &rlen);
+  return chars_compare(l, llen, r, rlen);
+}
+
+///////////////////////////////////////
+////////////// Section Values
+
+// Of a V_FUNCTION, V_CLOSURE, V_BOUND or V_NATIVE
+static char *function_name(value *i) {
+  switch (i->type) {
+  case V_NATIVE:
+    return i->nt->name;
+  case V_FUNCTION:
+    return i->fn->name;
+  case V_CLOSURE:
+    return i->cl->fn->name;
+  case V_BOUND:
+    return function_name(&i->bd->method);
+  default:
+    unreachable();
+  }
+}
+
+// Functions, classes, instances, arrays and maps are only ever equal to
+// themselves
+static int by_identity(value_t t) {
+  return t == V_FUNCTION || t == V_CLOSURE || t == V_CLASS ||
+         t == V_INSTANCE || t == V_BOUND || t == V_ARRAY || t == V_NATIVE ||
+         t == V_MAP;
+}
+
 int number_cast(value *i) {
   ASSERT(i);
 
@@ -15,9 +244,37 @@ int number_cast(value *i) {
   case V_NIL:
     runtime_error("Cannot cast NIL to a number\n");
     return -1;
+  case V_ROPE:
+    // Without flattening it, just to say it isn't a number
+    runtime_error("Cannot cast a String of %zu characters to a number\n",
+                  value_len(i));
+    return -1;
   case V_STRING:
-    ASSERT(i->sval);
-    runtime_error("Cannot cast a String: \"%s\" to a number\n", i->sval);
+  case V_SMALL: {
+    size_t len;
+    char *chars = value_chars(i, &len);
+    runtime_error("Cannot cast a String: \"%.*s\" to a number\n", (int)len,
+                  chars);
+    return -1;
+  }
+  case V_FUNCTION:
+  case V_CLOSURE:
+  case V_BOUND:
+  case V_NATIVE:
+    runtime_error("Cannot cast a function: %s to a number\n",
+                  function_name(i));
+    return -1;
+  case V_ARRAY:
+    runtime_error("Cannot cast an array to a number\n");
+    return -1;
+  case V_MAP:
+    runtime_error("Cannot cast a map to a number\n");
+    return -1;
+  case V_CLASS:
+    runtime_error("Cannot cast a class: %s to a number\n", i->k->name);
+    return -1;
+  case V_INSTANCE:
+    runtime_error("Cannot cast a %s instance to a number\n", i->in->k->name);
     return -1;
   default:
     unreachable();
@@ -37,9 +294,27 @@ void bool_cast(value *i) {
     i->bool_val = 0;
     break;
   case V_STRING:
-    ASSERT(i->sval);
     i->type = V_BOOL;
-    i->bool_val = i->sval[0] != '\0';
+    i->bool_val = i->str->len > 0;
+    break;
+  case V_ROPE:
+    i->type = V_BOOL;
+    i->bool_val = i->rp->len > 0;
+    break;
+  case V_SMALL:
+    i->type = V_BOOL;
+    i->bool_val = i->small_len > 0;
+    break;
+  case V_FUNCTION:
+  case V_CLOSURE:
+  case V_CLASS:
+  case V_INSTANCE:
+  case V_BOUND:
+  case V_ARRAY:
+  case V_NATIVE:
+  case V_MAP:
+    i->type = V_BOOL;
+    i->bool_val = 1;
     break;
   default:
     unreachable();
@@ -70,11 +345,23 @@ int equal_equal(value *left, value *right) {
   if (left->type == V_NIL)
     return 0;
 
-  if (left->type == V_STRING && right->type == V_STRING)
-    return strcmp(left->sval, right->sval) == 0;
-  if (left->type == V_STRING)
+  // Lengths are known without flattening a rope
+  if (value_is_string(left->type) && value_is_string(right->type)) {
+    if (value_len(left) != value_len(right))
+      return 0;
+    // The same length, so both are small or neither is
+    if (left->type == V_SMALL)
+      return memcmp(value_small_chars(left), value_small_chars(right),
+                    left->small_len) == 0;
+    return lox_string_equal(value_string(left), value_string(right));
+  }
+  if (value_is_string(left->type))
     return 0;
 
+  // Every pointer in the union shares fn's storage
+  if (by_identity(left->type) || by_identity(right->type))
+    return left->type == right->type && left->fn == right->fn;
+
   switch (left->type) {
   case V_BOOL:
     bool_cast(right);
@@ -87,19 +374,41 @@ int equal_equal(value *left, value *right) {
   }
 }
 
-static char *str_plus(linmem *mem, const char *left, const char *right) {
-  size_t llen = strlen(left);
-  size_t rlen = strlen(right);
-  char *ret = linmem_malloc(mem, llen + rlen + 1);
-  memcpy(ret, left, llen);
-  memcpy(ret + llen, right, rlen);
-  ret[llen + rlen] = '\0';
-  return ret;
-}
-
 int plus(linmem *mem, value *dest, value *right) {
-  if (dest->type == V_STRING && right->type == V_STRING) {
-    dest->sval = str_plus(mem, dest->sval, right->sval);
+  if (value_is_string(dest->type) && value_is_string(right->type)) {
+    size_t llen = value_len(dest);
+    size_t rlen = value_len(right);
+    if (rlen > STRING_MAX || llen > STRING_MAX - rlen) {
+      runtime_error("String too long\n");
+      return -1;
+    }
+    // Then both are small as well
+    if (llen + rlen <= SMALL_MAX) {
+      memcpy(value_small_chars(dest) + llen, value_small_chars(right), rlen);
+      dest->small_len = llen + rlen;
+      return 0;
+    }
+
+    value live[2] = {*dest, *right};
+    if (value_is_flat_string(dest->type) &&
+        value_is_flat_string(right->type) && llen + rlen < ROPE_MIN) {
+      lox_string *s = lox_string_alloc(mem, llen + rlen, live, 2);
+      if (s == NULL)
+        return -1;
+      memcpy(s->chars, value_flat_chars(dest), llen);
+      memcpy(s->chars + llen, value_flat_chars(right), rlen);
+      *dest = (value){.type = V_STRING, .str = s};
+      return 0;
+    }
+
+    rope *r = gc_alloc(mem, V_ROPE, sizeof *r, live, 2);
+    *r = (rope){.left = *dest,
+                .right = *right,
+                .len = llen + rlen,
+                .heap = mem->gc};
+    gc_retain(mem, &r->left);
+    gc_retain(mem, &r->right);
+    *dest = (value){.type = V_ROPE, .rp = r};
     return 0;
   }
 
@@ -143,36 +452,14 @@ int slash(value *dest, value *right) {
   return 0;
 }
 
-int str_less(const char *left, const char *right) {
-  ASSERT(left);
-  ASSERT(right);
-  int i = 0;
-  for (; left[i] != '\0' && right[i] != '\0'; ++i) {
-    if (left[i] != right[i])
-      return left[i] < right[i];
-  }
-  return left[i] < right[i];
-}
-
-int str_greater(const char *left, const char *right) {
-  ASSERT(left);
-  ASSERT(right);
-  int i = 0;
-  for (; left[i] != '\0' && right[i] != '\0'; ++i) {
-    if (left[i] != right[i])
-      return left[i] > right[i];
-  }
-  return left[i] > right[i];
-}
-
 /**
  * @brief Returns if left is less than right (type agnostic)
  *
  * @return 0 or 1 for result, -1 if runtime error
  */
 int less(value *left, value *right) {
-  if (left->type == V_STRING && right->type == V_STRING)
-    return str_less(left->sval, right->sval);
+  if (value_is_string(left->type) && value_is_string(right->type))
+    return string_compare(left, right) < 0;
 
   if (number_cast(left))
     return -1;
@@ -183,8 +470,8 @@ int less(value *left, value *right) {
 }
 
 int greater(value *left, value *right) {
-  if (left->type == V_STRING && right->type == V_STRING)
-    return str_greater(left->sval, right->sval);
+  if (value_is_string(left->type) && value_is_string(right->type))
+    return string_compare(left, right) > 0;
 
   if (number_cast(left))
     return -1;
@@ -194,19 +481,85 @@ int greater(value *left, value *right) {
   return left->dval > right->dval;
 }
 
-void value_println(FILE *ofp, value i) {
-  switch (i.type) {
+// Arrays and maps can hold themselves, nesting deeper than this prints as
+// [...] or {...}
+#define PRINT_DEPTH_MAX 8
+
+static void value_print(FILE *ofp, value *i, int depth) {
+  switch (i->type) {
   case V_STRING:
-    fprintf(ofp, "%s\n", i.sval);
+  case V_ROPE:
+  case V_SMALL: {
+    size_t len;
+    char *chars = value_chars(i, &len);
+    fwrite(chars, 1, len, ofp);
     break;
+  }
   case V_NUMBER:
-    fprintf(ofp, "%f\n", i.dval);
+    fprintf(ofp, "%f", i->dval);
     break;
   case V_BOOL:
-    fprintf(ofp, "%s\n", i.bool_val ? "TRUE" : "FALSE");
+    fprintf(ofp, "%s", i->bool_val ? "TRUE" : "FALSE");
     break;
   case V_NIL:
-    fprintf(ofp, "NIL\n");
+    fprintf(ofp, "NIL");
+    break;
+  case V_FUNCTION:
+  case V_CLOSURE:
+  case V_BOUND:
+    fprintf(ofp, "<fn %s>", function_name(i));
+    break;
+  case V_NATIVE:
+    fprintf(ofp, "<native fn %s>", function_name(i));
+    break;
+  case V_CLASS:
+    fprintf(ofp, "%s", i->k->name);
+    break;
+  case V_INSTANCE:
+    fprintf(ofp, "%s instance", i->in->k->name);
+    break;
+  case V_ARRAY: {
+    array *a = i->arr;
+    if (depth == PRINT_DEPTH_MAX) {
+      fprintf(ofp, "[...]");
+      break;
+    }
+    fputc('[', ofp);
+    for (size_t k = 0; k < a->len; ++k) {
+      if (k > 0)
+        fprintf(ofp, ", ");
+      if (a->nums != NULL)
+        fprintf(ofp, "%f", a->nums[k]);
+      else
+        value_print(ofp, &a->vals[k], depth + 1);
+    }
+    fputc(']', ofp);
+    break;
+  }
+  case V_MAP: {
+    if (depth == PRINT_DEPTH_MAX) {
+      fprintf(ofp, "{...}");
+      break;
+    }
+    fputc('{', ofp);
+    size_t it = 0;
+    map_entry *e;
+    for (int first = 1; (e = map_next(i->mp, &it)) != NULL; first = 0) {
+      if (!first)
+        fprintf(ofp, ", ");
+      value_print(ofp, &e->key, depth + 1);
+      fprintf(ofp, ": ");
+      value_print(ofp, &e->val, depth + 1);
+    }
+    fputc('}', ofp);
     break;
   }
+  default:
+    unreachable();
+  }
+}
+
+void value_println(FILE *ofp, value i) {
+  value_print(ofp, &i, 0);
+  fputc('\n', ofp);
 }
@@ -1,24 +1,182 @@
 #pragma once
 
 #include "memory.h"
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 typedef enum {
   V_STRING,
   V_NUMBER,
   V_NIL,
   V_BOOL,
+  V_FUNCTION, // Also closures that never leave the stack
+  V_CLOSURE,
+  V_UNDEF, // Only ever in unset variables
+  V_BOX,   // Only ever in variable slots and closures, never a result
+  V_CLASS,
+  V_INSTANCE,
+  V_BOUND, // A method with its receiver
+  V_ROPE,  // A string, concatenated but not copied yet
+  V_SMALL, // A string short enough to live in the value itself
+  V_ARRAY,
+  V_NATIVE, // A builtin function
+  V_MAP,
+  V_COUNT, // How many there are, not a type
 } value_t;
 
+#define value_is_string(t) ((t) == V_STRING || (t) == V_ROPE || (t) == V_SMALL)
+
+// Strings that are one piece of memory, not a rope
+#define value_is_flat_string(t) ((t) == V_STRING || (t) == V_SMALL)
+
+typedef struct function_s function;
+typedef struct closure_s closure;
+typedef struct box_s box;
+typedef struct shape_s shape;
+typedef struct klass_s klass;
+typedef struct instance_s instance;
+typedef struct bound_s bound;
+typedef struct rope_s rope;
+typedef struct lox_string_s lox_string;
+typedef struct array_s array;
+typedef struct native_s native;
+typedef struct map_s map;
+
 typedef struct {
   union {
-    char *sval;
+    lox_string *str;
     double dval;
     int bool_val;
+    function *fn;
+    closure *cl;
+    box *bx;
+    klass *k;
+    instance *in;
+    bound *bd;
+    rope *rp;
+    array *arr;
+    native *nt;
+    map *mp;
   };
-  value_t type;
+  char small_tail[6]; // V_SMALL characters past the first 8
+  uint8_t small_len;  // V_SMALL
+  uint8_t type;       // A value_t, last so small strings get the rest
 } value;
 
+// A captured variable shared by every closure that captured it
+struct box_s {
+  value v;
+};
+
+/**
+ * Small strings
+ * - A string of SMALL_MAX characters or fewer is always a V_SMALL, never
+ *   a V_STRING: its characters start at the value's first byte and run
+ *   into small_tail. They aren't NUL terminated
+ * - Concatenating, comparing and printing them allocates nothing
+ */
+#define SMALL_MAX 14
+
+static inline char *value_small_chars(value *i) { return (char *)i; }
+
+value value_small(const char *chars, size_t len);
+
+/**
+ * String objects
+ * - Length prefixed, so nothing needs to look for the terminating NUL.
+ *   chars has one anyway, for printf and friends
+ * - The hash is computed the first time it's asked for. Threads sharing a
+ *   string may both compute it, and store the same hash
+ * - Made on mem's gc heap when it has one, and collected (gc.h)
+ */
+struct lox_string_s {
+  size_t len;
+  _Atomic uint32_t hash;
+  _Atomic uint8_t hashed; // Set after hash, with release
+  uint8_t gc;             // On a gc heap
+  char chars[];
+};
+
+// Adding up to a longer string fails. Lengths are printed as ints
+#define STRING_MAX ((size_t)INT32_MAX)
+
+// len characters, filled in by the caller. The nlive values at live are
+// still needed: an allocation may collect. NULL (after an error) if a long
+// one is over mem's quota
+lox_string *lox_string_alloc(linmem *mem, size_t len, value *live,
+                             size_t nlive);
+
+// NULL like lox_string_alloc
+lox_string *lox_string_create(linmem *mem, const char *chars, size_t len);
+
+// FNV-1a, what lox_string_hash computes
+uint32_t chars_hash(const char *chars, size_t len);
+
+uint32_t lox_string_hash(lox_string *s);
+
+// Different lengths or different known hashes don't look at the characters
+int lox_string_equal(lox_string *a, lox_string *b);
+
+// A V_SMALL when s is short enough, otherwise a V_STRING pointing at s
+static inline value value_from_string(lox_string *s) {
+  if (s->len > SMALL_MAX)
+    return (value){.type = V_STRING, .str = s};
+  value ret = {.type = V_SMALL, .small_len = s->len};
+  memcpy(value_small_chars(&ret), s->chars, s->len);
+  return ret;
+}
+
+// Of a V_STRING or V_SMALL
+static inline char *value_flat_chars(value *i) {
+  return i->type == V_SMALL ? value_small_chars(i) : i->str->chars;
+}
+
+static inline size_t value_flat_len(value *i) {
+  return i->type == V_SMALL ? i->small_len : i->str->len;
+}
+
+/**
+ * Ropes
+ * - Adding strings of ROPE_MIN characters or more, or a rope, makes a
+ *   node instead of a copy. So s = s + piece in a loop is linear overall
+ * - Printing or comparing flattens a rope once, into flat. The interpreter
+ *   does it with value_flatten first, which can fail
+ * - Threads sharing a rope may flatten it at once: the first flat published
+ *   is kept, the others are freed
+ */
+#define ROPE_MIN 256
+
+struct rope_s {
+  value left; // Any string, so is right
+  value right;
+  size_t len;
+  lox_string *_Atomic flat;
+  gc_heap *heap; // The rope and its flat are on it, NULL if they aren't
+};
+
+// Of any string, without flattening a rope
+static inline size_t value_len(value *i) {
+  switch (i->type) {
+  case V_ROPE:
+    return i->rp->len;
+  case V_SMALL:
+    return i->small_len;
+  default:
+    return i->str->len;
+  }
+}
+
+// The string of a V_STRING or V_ROPE
+lox_string *value_string(value *i);
+
+// Flattens a V_ROPE unless it's over mem's quota: -1 after an error then.
+// Anything else is left as is
+int value_flatten(linmem *mem, value *i);
+
+// The characters of any string, *len of them. Points into i for a V_SMALL
+char *value_chars(value *i, size_t *len);
+
 int number_cast(value *i);
 
 void bool_cast(value *i);
@@ -1,5 +1,7 @@
 #include "value_hashtable.h"
+#include "heap_profile.h"
 #include "memory.h"
+#include "slab.h"
 #include <string.h>
 
 #define TABLE_SIZE 1000
@@ -14,14 +16,22 @@ unsigned int hash(char *str) {
 
 value_hashtable vhtbl_create() {
   value_hashtable vhtbl;
-  vhtbl.mem = linmem_create();
+  vhtbl.mem = linmem_create_named("hashtables");
   vhtbl.table = linmem_malloc(&vhtbl.mem, TABLE_SIZE * sizeof(entry *));
   memset(vhtbl.table, 0, TABLE_SIZE * sizeof(entry *));
   return vhtbl;
 }
 
 void vhtbl_free(value_hashtable *v) {
-  free(v->table);
+  for (int k = 0; k < TABLE_SIZE; ++k) {
+    entry *cur = v->table[k];
+    while (cur != NULL) {
+      entry *next = cur->next;
+      slab_free(cur, sizeof *cur);
+      cur = next;
+    }
+  }
+  // table lives in mem
   v->table = NULL;
   linmem_free(&v->mem);
 }
@@ -33,11 +43,13 @@ void vhtbl_insert(value_hashtable *vhtbl, char *key, value val) {
   while (cur != NULL) {
     if (strcmp(cur->ident, key) == 0) {
       cur->v = val;
+      return;
     }
     cur = cur->next;
   }
 
-  entry *next = linmem_malloc(&vhtbl->mem, sizeof *next);
+  entry *next = slab_malloc(sizeof *next);
+  HEAP_PROFILE(sizeof *next);
 
   next->ident = key;
   next->v = val;
@@ -9,9 +9,11 @@ typedef struct entry {
   struct entry *next;
 } entry;
 
+// Entries come from the size class pools (slab.h), and go back on
+// vhtbl_free
 typedef struct {
   entry **table;
-  linmem mem;
+  linmem mem; // The table, and keys callers want freed with it
 } value_hashtable;
 
 value_hashtable vhtbl_create();
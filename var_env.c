@@ -0,0 +1,232 @@
+#include "var_env.h"
+#include "facades.h"
+#include "gc.h"
+#include "natives.h"
+#include "vector.h"
+
+#include <string.h>
+
+#define INITIAL_CAP 64
+
+#define var_env_ASSERT(e)                                                      \
+  ASSERT(e);                                                                   \
+  ASSERT((e)->slots);                                                          \
+  ASSERT((e)->len <= (e)->cap);                                                \
+  ASSERT((e)->names_len < (e)->names_cap);                                     \
+  ASSERT((e)->scopes);                                                         \
+  ASSERT((e)->nscopes <= SCOPES_MAX);                                          \
+  ASSERT((e)->nframes <= FRAMES_MAX)
+
+VECTOR_FUNCTIONS(var_env, value, slots, vector_grow_double);
+
+static uint32_t name_hash(const char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s; ++s)
+    h = (h ^ (uint8_t)*s) * 16777619u;
+  return h;
+}
+
+static var_name *names_alloc(size_t cap) {
+  var_name *ret = malloc_or_abort(cap * sizeof *ret);
+  memset(ret, 0, cap * sizeof *ret);
+  return ret;
+}
+
+var_env var_env_create() {
+  var_env ret;
+  ret.slots = malloc_or_abort(INITIAL_CAP * sizeof *ret.slots);
+  ret.len = 0;
+  ret.cap = INITIAL_CAP;
+  ret.names = names_alloc(INITIAL_CAP);
+  ret.names_len = 0;
+  ret.names_cap = INITIAL_CAP;
+  ret.stack = stackmem_create_cap(STACK_MAX);
+  ret.scopes = malloc_or_abort(SCOPES_MAX * sizeof *ret.scopes);
+  ret.nscopes = 0;
+  ret.frames = malloc_or_abort(FRAMES_MAX * sizeof *ret.frames);
+  ret.nframes = 0;
+  ret.shared = NULL;
+  ret.gc = gc_create();
+  natives_define(&ret);
+  return ret;
+}
+
+void var_env_free(var_env *env) {
+  var_env_ASSERT(env);
+  free(env->slots);
+  free(env->names);
+  free(env->scopes);
+  free(env->frames);
+  stackmem_freeall(&env->stack);
+  gc_free(env->gc);
+  env->gc = NULL;
+  env->slots = NULL;
+  env->names = NULL;
+  env->scopes = NULL;
+  env->frames = NULL;
+  env->nscopes = env->nframes = 0;
+  env->len = env->cap = 0;
+  env->names_len = env->names_cap = 0;
+}
+
+// The entry holding ident, or the empty entry where it belongs
+static var_name *names_find(var_name *names, size_t cap, const char *ident,
+                            uint32_t hash) {
+  size_t i = hash & (cap - 1);
+  while (names[i].ident != NULL &&
+         (names[i].hash != hash || strcmp(names[i].ident, ident) != 0))
+    i = (i + 1) & (cap - 1);
+  return &names[i];
+}
+
+static void names_grow(var_env *env) {
+  size_t cap = env->names_cap * 2;
+  var_name *names = names_alloc(cap);
+
+  for (size_t i = 0; i < env->names_cap; ++i) {
+    var_name *n = &env->names[i];
+    if (n->ident != NULL)
+      *names_find(names, cap, n->ident, n->hash) = *n;
+  }
+
+  free(env->names);
+  env->names = names;
+  env->names_cap = cap;
+}
+
+size_t var_env_slot(var_env *env, char *ident) {
+  var_env_ASSERT(env);
+  ASSERT(ident);
+  ASSERT(env->shared == NULL);
+
+  uint32_t hash = name_hash(ident);
+  var_name *n = names_find(env->names, env->names_cap, ident, hash);
+  if (n->ident != NULL)
+    return n->slot;
+
+  var_env_make_available(env, env->len + 1);
+  env->slots[env->len] = (value){.type = V_UNDEF};
+  *n = (var_name){.ident = ident, .hash = hash, .slot = env->len};
+  env->names_len++;
+
+  // Keep the table at most half full
+  if (2 * env->names_len > env->names_cap)
+    names_grow(env);
+
+  return env->len++;
+}
+
+value *var_env_find(var_env *env, char *ident) {
+  var_env_ASSERT(env);
+  ASSERT(ident);
+
+  var_name *n =
+      names_find(env->names, env->names_cap, ident, name_hash(ident));
+  if (n->ident == NULL || env->slots[n->slot].type == V_UNDEF)
+    return NULL;
+  return &env->slots[n->slot];
+}
+
+///////////////////////////////////////
+////////////// Section Views
+
+// Slot len past the copied globals is undefined, for names the view lacks
+var_env var_env_view(var_env *env) {
+  var_env_ASSERT(env);
+  ASSERT(env->shared == NULL);
+
+  var_env ret = *env;
+  ret.slots = malloc_or_abort((env->len + 1) * sizeof *ret.slots);
+  memcpy(ret.slots, env->slots, env->len * sizeof *ret.slots);
+  ret.slots[env->len] = (value){.type = V_UNDEF};
+  ret.cap = env->len + 1;
+  ret.stack = stackmem_create_cap(STACK_MAX);
+  ret.scopes = malloc_or_abort(SCOPES_MAX * sizeof *ret.scopes);
+  ret.nscopes = 0;
+  ret.frames = malloc_or_abort(FRAMES_MAX * sizeof *ret.frames);
+  ret.nframes = 0;
+  ret.shared = env;
+  ret.gc = NULL;
+  return ret;
+}
+
+void var_env_view_free(var_env *view) {
+  ASSERT(view->shared != NULL);
+  free(view->slots);
+  free(view->scopes);
+  free(view->frames);
+  stackmem_freeall(&view->stack);
+}
+
+// A cache warmed on the original holds the same slot here
+size_t var_env_view_slot(var_env *view, slot_cache *c, char *ident) {
+  if (c->env == view->shared)
+    return c->slot;
+  var_name *n =
+      names_find(view->names, view->names_cap, ident, name_hash(ident));
+  return n->ident != NULL && n->slot < view->len ? n->slot : view->len;
+}
+
+///////////////////////////////////////
+////////////// Section Scopes
+
+int var_env_enter(var_env *env, size_t nlocals) {
+  var_env_ASSERT(env);
+
+  // Everything is preallocated, running out is the program's fault
+  if (env->nscopes == SCOPES_MAX ||
+      !stackmem_fits(&env->stack, nlocals * sizeof(value))) {
+    runtime_error("Stack overflow\n");
+    return -1;
+  }
+
+  value *frame = stackmem_malloc(&env->stack, nlocals * sizeof *frame);
+  for (size_t i = 0; i < nlocals; ++i)
+    frame[i].type = V_UNDEF;
+
+  env->scopes[env->nscopes++] = stackmem_top(&env->stack);
+  return 0;
+}
+
+void var_env_leave(var_env *env) {
+  var_env_ASSERT(env);
+  ASSERT(env->nscopes > 0);
+  stackmem_free_top(&env->stack);
+  env->nscopes--;
+}
+
+///////////////////////////////////////
+////////////// Section Calls
+
+int var_env_call(var_env *env, function *fn, closure *cl, int nlocals) {
+  var_env_ASSERT(env);
+
+  if (env->nframes == FRAMES_MAX) {
+    runtime_error("Stack overflow\n");
+    return -1;
+  }
+
+  call_frame *f = &env->frames[env->nframes];
+  *f = (call_frame){
+      .fn = fn,
+      .cl = cl,
+      .nscopes = env->nscopes,
+      .outer = var_env_base(env),
+      .ret = {.type = V_NIL},
+  };
+
+  if (var_env_enter(env, nlocals))
+    return -1;
+  env->nframes++;
+  return 0;
+}
+
+value var_env_return(var_env *env) {
+  var_env_ASSERT(env);
+  ASSERT(env->nframes > 0);
+
+  call_frame *f = &env->frames[--env->nframes];
+  while (env->nscopes > f->nscopes)
+    var_env_leave(env);
+  return f->ret;
+}
@@ -1,27 +1,181 @@
 #pragma once
 
 #include "errors.h"
-#include "value_hashtable.h"
+#include "memory.h"
+#include "value.h"
+#include <stdint.h>
 
 typedef struct {
-  value_hashtable values;
+  char *ident;
+  uint32_t hash;
+  size_t slot;
+} var_name;
+
+/**
+ * Global variables
+ * - Values live in a dense, growable slot vector. A name keeps its slot
+ *   forever, unset slots hold V_UNDEF
+ * - Names map to slots through an open addressed table, which is only
+ *   consulted when a slot_cache misses
+ *
+ * Views
+ * - A view is another thread's var_env for the same program: its own
+ *   stacks, and a copy of the globals taken when it's made. It shares the
+ *   names and never adds one, so the original must not change while a view
+ *   is in use. A name the view doesn't know reads as undefined
+ *
+ * Locals
+ * - Every open block scope is one contiguous frame of values on a stackmem
+ * - scopes holds the stack offset of each open frame, innermost last, so a
+ *   resolved local (depth, idx) is two loads away
+ * - Calls push a fixed size call_frame. Neither a call nor a block
+ *   allocates: all three stacks are preallocated and overflowing one is a
+ *   runtime error
+ */
+// A call in progress. Its arguments and locals are its first scope
+typedef struct {
+  function *fn;
+  closure *cl;    // NULL unless fn got a flat closure
+  size_t nscopes; // Open scopes of the caller, so the index of our first
+  size_t outer;   // First scope of the caller, for closures on the stack
+  value ret;
+} call_frame;
+
+// Fixed limits of the preallocated stacks
+#define STACK_MAX (1 << 20) // Bytes of locals
+#define SCOPES_MAX 8192
+#define FRAMES_MAX 1024
+
+typedef struct var_env_s {
+  value *slots;
+  size_t len;
+  size_t cap;
+
+  var_name *names;
+  size_t names_len;
+  size_t names_cap; // Power of two
+
+  stackmem stack;
+  size_t *scopes;
+  size_t nscopes;
+  call_frame *frames;
+  size_t nframes;
+
+  struct var_env_s *shared; // What this is a view of, NULL if it isn't one
+  gc_heap *gc;              // NULL in a view
 } var_env;
 
-static inline var_env var_env_create() {
-  var_env ret;
-  ret.values = vhtbl_create();
+// Inline cache of a global's slot, valid for one var_env
+typedef struct {
+  var_env *env;
+  size_t slot;
+} slot_cache;
+
+var_env var_env_create();
+
+void var_env_free(var_env *env);
+
+// Finds or reserves (undefined) the slot of ident. Never moves a slot
+size_t var_env_slot(var_env *env, char *ident);
+
+// The slot of ident in a view, without reserving or caching anything
+size_t var_env_view_slot(var_env *view, slot_cache *c, char *ident);
+
+static inline size_t var_env_cached_slot(var_env *env, slot_cache *c,
+                                         char *ident) {
+  if (c->env != env) {
+    if (env->shared != NULL)
+      return var_env_view_slot(env, c, ident);
+    c->slot = var_env_slot(env, ident);
+    c->env = env;
+  }
+  return c->slot;
+}
+
+static inline void var_env_define_cached(var_env *env, slot_cache *c,
+                                         char *ident, value v) {
+  size_t slot = var_env_cached_slot(env, c, ident); // May grow env->slots
+  env->slots[slot] = v;
+}
+
+static inline value *var_env_get_cached(var_env *env, slot_cache *c,
+                                        char *ident) {
+  size_t slot = var_env_cached_slot(env, c, ident);
+  value *ret = &env->slots[slot];
+  if (ret->type == V_UNDEF) {
+    runtime_error("Undefined variable: %s\n", ident);
+    return NULL;
+  }
   return ret;
 }
 
 static inline void var_env_define(var_env *env, char *ident, value v) {
-  vhtbl_insert(&env->values, ident, v);
+  size_t slot = var_env_slot(env, ident);
+  env->slots[slot] = v;
 }
 
 static inline value *var_env_get(var_env *env, char *ident) {
-  value *ret = vhtbl_get(&env->values, ident);
-  if (ret == NULL) {
+  slot_cache c = {0};
+  return var_env_get_cached(env, &c, ident);
+}
+
+// Like var_env_get, without reporting. Doesn't reserve a slot either
+value *var_env_find(var_env *env, char *ident);
+
+var_env var_env_view(var_env *env);
+
+void var_env_view_free(var_env *view);
+
+///////////////////////////////////////
+////////////// Section Scopes
+
+// Pushes a frame of nlocals undefined locals. -1 on stack overflow
+int var_env_enter(var_env *env, size_t nlocals);
+
+void var_env_leave(var_env *env);
+
+// The raw slot, which may hold a V_BOX
+static inline value *var_env_scope_at(var_env *env, size_t scope, int idx) {
+  ASSERT(scope < env->nscopes);
+  return &((value *)stackmem_at(&env->stack, env->scopes[scope]))[idx];
+}
+
+static inline value *var_env_local(var_env *env, int depth, int idx) {
+  ASSERT(depth >= 0 && (size_t)depth < env->nscopes);
+  return var_env_scope_at(env, env->nscopes - 1 - depth, idx);
+}
+
+// Where a variable's value lives, through its box if it has one
+static inline value *var_env_unbox(value *slot) {
+  return slot->type == V_BOX ? &slot->bx->v : slot;
+}
+
+// A local whose declaration failed is still undefined
+static inline value *var_env_get_local(var_env *env, int depth, int idx,
+                                       char *ident) {
+  value *ret = var_env_unbox(var_env_local(env, depth, idx));
+  if (ret->type == V_UNDEF) {
     runtime_error("Undefined variable: %s\n", ident);
     return NULL;
   }
   return ret;
 }
+
+///////////////////////////////////////
+////////////// Section Calls
+
+// Pushes a call_frame and the callee's first scope. -1 on stack overflow
+int var_env_call(var_env *env, function *fn, closure *cl, int nlocals);
+
+// Pops the innermost call_frame, and any scope it left open
+value var_env_return(var_env *env);
+
+static inline call_frame *var_env_frame(var_env *env) {
+  ASSERT(env->nframes > 0);
+  return &env->frames[env->nframes - 1];
+}
+
+// First scope of the running function, 0 at the top level
+static inline size_t var_env_base(var_env *env) {
+  return env->nframes > 0 ? env->frames[env->nframes - 1].nscopes : 0;
+}
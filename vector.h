@@ -0,0 +1,68 @@
+#pragma once
+
+#include "facades.h"
+#include <stddef.h>
+
+/**
+ * Growable arrays
+ * - VECTOR_FUNCTIONS(type, elem, data, grow) makes the helpers of a struct
+ *   with an elem *data array and len and cap fields: type_reserve,
+ *   type_make_available, type_shrink_to_fit and type_move_out
+ * - make_available steps cap through the grow policy until newlen fits and
+ *   reallocates once, so a large append costs one copy, not one per step
+ * - reserve takes a size hint, like a token count guessed from the source's
+ *   length. What it overshoots, shrink_to_fit hands back once the array is
+ *   done growing
+ * - move_out gives the elements to the caller to free, and leaves the array
+ *   with nothing: it's made again before it's used again
+ */
+#define VECTOR_MIN_CAP 8
+
+static inline size_t vector_grow_double(size_t cap) {
+  return cap < VECTOR_MIN_CAP ? VECTOR_MIN_CAP : 2 * cap;
+}
+
+// Wastes less than doubling after a size hint falls short
+static inline size_t vector_grow_half(size_t cap) {
+  return cap < VECTOR_MIN_CAP ? VECTOR_MIN_CAP : cap + cap / 2;
+}
+
+#define VECTOR_FUNCTIONS(type, elem, data, grow)                               \
+  static inline void type##_reserve(type *t, size_t cap) {                     \
+    type##_ASSERT(t);                                                          \
+    if (cap <= t->cap)                                                         \
+      return;                                                                  \
+    t->data = realloc_or_abort(t->data, sizeof(elem) * cap);                   \
+    t->cap = cap;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline void type##_make_available(type *t, size_t newlen) {           \
+    type##_ASSERT(t);                                                          \
+    if (newlen <= t->cap)                                                      \
+      return;                                                                  \
+    size_t cap = t->cap;                                                       \
+    while (newlen > cap)                                                       \
+      cap = grow(cap);                                                         \
+    type##_reserve(t, cap);                                                    \
+  }                                                                            \
+                                                                               \
+  /* Keeps room for one, so the array stays valid */                           \
+  static inline void type##_shrink_to_fit(type *t) {                           \
+    type##_ASSERT(t);                                                          \
+    size_t cap = t->len > 0 ? t->len : 1;                                      \
+    if (cap >= t->cap)                                                         \
+      return;                                                                  \
+    t->data = realloc_or_abort(t->data, sizeof(elem) * cap);                   \
+    t->cap = cap;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline elem *type##_move_out(type *t, size_t *len) {                  \
+    type##_ASSERT(t);                                                          \
+    type##_shrink_to_fit(t);                                                   \
+    elem *ret = t->data;                                                       \
+    *len = t->len;                                                             \
+    t->data = NULL;                                                            \
+    t->len = 0;                                                                \
+    t->cap = 0;                                                                \
+    return ret;                                                                \
+  }
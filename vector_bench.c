@@ -0,0 +1,179 @@
+#include "facades.h"
+#include "parser.h"
+#include "scanner.h"
+#include "string.h"
+#include "vector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// One unit of the generated source, %d keeps the names apart
+static const char *unit =
+    "class Point%d {\n"
+    "  init(x, y) { this.x = x; this.y = y; }\n"
+    "  norm() { return this.x * this.x + this.y * this.y; }\n"
+    "}\n"
+    "fun walk%d(n) {\n"
+    "  var total = 0;\n"
+    "  for (var i = 0; i < n; i = i + 1) {\n"
+    "    var p = Point%d(i, n - i);\n"
+    "    if (p.norm() > 100) total = total + p.norm();\n"
+    "    else total = total - 1.5;\n"
+    "  }\n"
+    "  print \"walked\" + \" far\";\n"
+    "  return total;\n"
+    "}\n";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *generate(size_t bytes) {
+  string src = string_create_cap(bytes + 1024);
+  char buf[1024];
+  for (int k = 0; src.len < bytes; ++k) {
+    snprintf(buf, sizeof buf, unit, k, k, k);
+    string_append_cstr(&src, buf);
+  }
+  return string_to_cstr(&src);
+}
+
+// Scanning sizes the tokens from the source's length, parsing shrinks each
+// block to what it holds
+static void bench_source(size_t mb) {
+  char *src = generate(mb << 20);
+  size_t len = strlen(src);
+
+  double start = now();
+  token_arr arr = scanner_parse_tokens(src);
+  double scanned = now();
+  stmt_arr stmts = parse_tokens(arr);
+  double parsed = now();
+
+  fprintf(stdout,
+          "%3zu MB source  %8zu tokens (%.2f chars each)  scan %6.1f MB/s  "
+          "parse %6.1f MB/s\n",
+          mb, arr.len, (double)len / arr.len,
+          (double)len / (1 << 20) / (scanned - start),
+          (double)len / (1 << 20) / (parsed - scanned));
+
+  stmt_arr_free(&stmts);
+  token_arr_free(&arr);
+  free(src);
+}
+
+// The same tokens pushed one at a time, from the default capacity or from
+// the scanner's hint
+static void bench_tokens(size_t ntokens, int hinted) {
+  token_arr arr =
+      hinted ? token_arr_create_cap(ntokens) : token_arr_create();
+  size_t reallocs = 0;
+
+  double start = now();
+  for (size_t k = 0; k < ntokens; ++k) {
+    size_t cap = arr.cap;
+    token_arr_push(&arr, "x", 1, IDENTIFIER, 1, (int)k);
+    reallocs += arr.cap != cap;
+  }
+  double elapsed = now() - start;
+
+  fprintf(stdout, "%8zu tokens  %-8s %6.1f ns/push  %2zu reallocs\n",
+          ntokens, hinted ? "hinted" : "growing", elapsed / ntokens * 1e9,
+          reallocs);
+  token_arr_free(&arr);
+}
+
+///////////////////////////////////////
+////////////// Section Growth policies
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} bytes;
+
+// The same bytes, growing by half
+typedef bytes bytes_half;
+
+#define bytes_ASSERT(b) ASSERT(b)
+#define bytes_half_ASSERT(b) ASSERT(b)
+
+VECTOR_FUNCTIONS(bytes, char, data, vector_grow_double);
+VECTOR_FUNCTIONS(bytes_half, char, data, vector_grow_half);
+
+// What doubling_array.h did: a realloc per doubling. Returns how many
+static size_t bytes_make_available_stepwise(bytes *b, size_t newlen) {
+  size_t reallocs = 0;
+  while (newlen > b->cap) {
+    b->cap = vector_grow_double(b->cap);
+    b->data = realloc_or_abort(b->data, b->cap);
+    reallocs++;
+  }
+  return reallocs;
+}
+
+typedef enum { STEPWISE, DOUBLE, HALF } policy;
+
+// Appends of every size up to max, like a file read in pieces of whatever
+// came in, then the buffer handed over
+static void bench_appends(const char *name, policy pol, size_t total,
+                          size_t max) {
+  char *piece = malloc_or_abort(max);
+  memset(piece, 'x', max);
+  bytes b = {0};
+  size_t reallocs = 0;
+  unsigned seed = 1;
+
+  double start = now();
+  while (b.len < total) {
+    size_t n = 1 + rand_r(&seed) % max;
+    size_t cap = b.cap;
+    if (pol == STEPWISE)
+      reallocs += bytes_make_available_stepwise(&b, b.len + n);
+    else if (pol == DOUBLE)
+      bytes_make_available(&b, b.len + n);
+    else
+      bytes_half_make_available(&b, b.len + n);
+    reallocs += pol != STEPWISE && b.cap != cap;
+    memcpy(&b.data[b.len], piece, n);
+    b.len += n;
+  }
+  size_t slack = b.cap - b.len;
+  size_t len;
+  char *out = bytes_move_out(&b, &len);
+  double elapsed = now() - start;
+
+  fprintf(stdout,
+          "%-8s %4zu MB in pieces up to %8zu  %7.1f ms  %3zu reallocs  "
+          "%5.1f MB slack\n",
+          name, len >> 20, max, elapsed * 1e3, reallocs,
+          (double)slack / (1 << 20));
+  free(out);
+  free(piece);
+}
+
+int main(int argc, char **argv) {
+  size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 16;
+
+  for (size_t m = 1; m <= mb; m *= 4)
+    bench_source(m);
+
+  fprintf(stdout, "\n");
+  for (size_t n = 1000; n <= 10000000; n *= 100) {
+    bench_tokens(n, 0);
+    bench_tokens(n, 1);
+  }
+
+  fprintf(stdout, "\n");
+  size_t maxes[] = {4096, 1 << 20, 16 << 20};
+  for (size_t k = 0; k < sizeof maxes / sizeof *maxes; ++k) {
+    bench_appends("stepwise", STEPWISE, mb << 22, maxes[k]);
+    bench_appends("doubling", DOUBLE, mb << 22, maxes[k]);
+    bench_appends("half", HALF, mb << 22, maxes[k]);
+  }
+  return 0;
+}